@@ -0,0 +1,848 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * The result cache skips runs of a program whose results are already
+ * known. A run is identified by a key, the hash of the program image,
+ * the zero page (command tail and default FCBs), and the drive
+ * configuration. Since the files a program reads are only known after
+ * it has run, the cache directory holds a manifest for each key listing
+ * the input sets seen so far, i.e. the paths and content hashes of the
+ * files read (or found missing) by the program, each with the hash of
+ * the result file holding the console output, the contents of the
+ * files written, and the names of the files deleted by that run. If the
+ * files of an input set are unchanged, the result is restored without
+ * running the program; otherwise, the run is recorded and stored as a
+ * new input set when it succeeds. Runs which depend on anything else
+ * (console input, the clock, directory searches, etc.) are not stored.
+ */
+#define HASH_SIZE 32
+#define HEX_SIZE (2 * HASH_SIZE + 1)
+
+
+/*
+ * state of the result cache
+ */
+static enum cch_state {
+	CS_OFF /* no result cache configured */,
+	CS_RECORDING /* not found in the cache, the run is recorded */,
+	CS_HIT /* found in the cache, the run is replayed */,
+	CS_UNCACHEABLE /* the run cannot be cached */
+} state = CS_OFF;
+
+
+/*
+ * input file: path and content hash (or missing file)
+ */
+struct cch_input {
+	char *path;
+	int absent;
+	unsigned char hash[HASH_SIZE];
+};
+
+
+static unsigned char key[HASH_SIZE];
+static struct cch_input *inputs = NULL;
+static int input_count = 0;
+static unsigned char *transcript = NULL;
+static size_t transcript_length = 0, transcript_size = 0;
+
+
+/*
+ * SHA-256 (FIPS 180-4)
+ */
+struct sha256 {
+	uint32_t h[8];
+	unsigned char block[64];
+	size_t fill;
+	uint64_t length;
+};
+
+
+static const uint32_t sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+	0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+	0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+	0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+	0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+	0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+	0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+	0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+	0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void
+sha_init(struct sha256 *sp) {
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(sp->h, h0, sizeof h0);
+	sp->fill = 0;
+	sp->length = 0;
+}
+
+
+static void
+sha_block(struct sha256 *sp) {
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	const unsigned char *p = sp->block;
+	int i;
+	for (i = 0; i < 16; i++, p += 4) {
+		w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+		    ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+	}
+	for (i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+		    (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^
+		    (w[i - 15] >> 3)) +
+		    (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^
+		    (w[i - 2] >> 10));
+	}
+	a = sp->h[0]; b = sp->h[1]; c = sp->h[2]; d = sp->h[3];
+	e = sp->h[4]; f = sp->h[5]; g = sp->h[6]; h = sp->h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+		    ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+		    ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	sp->h[0] += a; sp->h[1] += b; sp->h[2] += c; sp->h[3] += d;
+	sp->h[4] += e; sp->h[5] += f; sp->h[6] += g; sp->h[7] += h;
+}
+
+
+static void
+sha_update(struct sha256 *sp, const void *data, size_t n) {
+	const unsigned char *p = data;
+	size_t t;
+	sp->length += n;
+	while (n) {
+		t = 64 - sp->fill;
+		if (t > n) t = n;
+		memcpy(sp->block + sp->fill, p, t);
+		sp->fill += t;
+		p += t;
+		n -= t;
+		if (sp->fill == 64) {
+			sha_block(sp);
+			sp->fill = 0;
+		}
+	}
+}
+
+
+static void
+sha_final(struct sha256 *sp, unsigned char *digest) {
+	uint64_t bits = sp->length * 8;
+	int i;
+	sp->block[sp->fill++] = 0x80;
+	if (sp->fill > 56) {
+		memset(sp->block + sp->fill, 0, 64 - sp->fill);
+		sha_block(sp);
+		sp->fill = 0;
+	}
+	memset(sp->block + sp->fill, 0, 56 - sp->fill);
+	for (i = 0; i < 8; i++) {
+		sp->block[56 + i] = (unsigned char) (bits >> (56 - 8 * i));
+	}
+	sha_block(sp);
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = (unsigned char) (sp->h[i] >> 24);
+		digest[4 * i + 1] = (unsigned char) (sp->h[i] >> 16);
+		digest[4 * i + 2] = (unsigned char) (sp->h[i] >> 8);
+		digest[4 * i + 3] = (unsigned char) sp->h[i];
+	}
+}
+
+
+/*
+ * add a string (including its terminator) to a hash
+ */
+static void
+sha_string(struct sha256 *sp, const char *s) {
+	sha_update(sp, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+
+/*
+ * add an integer to a hash
+ */
+static void
+sha_int(struct sha256 *sp, long long n) {
+	char buffer[24];
+	sprintf(buffer, "%lld", n);
+	sha_string(sp, buffer);
+}
+
+
+/*
+ * convert a hash to hexadecimal
+ */
+static void
+to_hex(const unsigned char *hash, char *hex) {
+	int i;
+	for (i = 0; i < HASH_SIZE; i++) sprintf(hex + 2 * i, "%02x", hash[i]);
+}
+
+
+/*
+ * get the path of a file in the cache directory (allocated)
+ */
+static char *
+cache_path(const char *name, const char *suffix) {
+	char *path = alloc(strlen(conf_cache_dir) + strlen(name) +
+	    strlen(suffix) + 2);
+	sprintf(path, "%s/%s%s", conf_cache_dir, name, suffix);
+	return path;
+}
+
+
+/*
+ * read a whole file into allocated memory; returns (-1) on errors
+ * (errno is set)
+ */
+static int
+read_file(const char *path, unsigned char **data_p, size_t *size_p) {
+	int fd, rc = 0, e;
+	unsigned char *data = NULL;
+	size_t size = 0, n = 0;
+	ssize_t t;
+	*data_p = NULL;
+	*size_p = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == (-1)) return (-1);
+	for (;;) {
+		if (n == size) {
+			size = size ? 2 * size : 16384;
+			data = resize(data, size);
+		}
+		t = read(fd, data + n, size - n);
+		if (t == (-1) && errno == EINTR) continue;
+		if (t == (-1)) {
+			e = errno;
+			rc = (-1);
+			break;
+		}
+		if (! t) break;
+		n += t;
+	}
+	close(fd);
+	if (rc) {
+		free(data);
+		errno = e;
+	} else {
+		*data_p = data;
+		*size_p = n;
+	}
+	return rc;
+}
+
+
+/*
+ * write a whole file, replacing it atomically; returns (-1) on errors
+ * (errno is set)
+ */
+static int
+write_file(const char *path, const unsigned char *data, size_t size) {
+	int fd, rc = (-1), e;
+	size_t n = 0;
+	ssize_t t;
+	char *temp = alloc(strlen(path) + 32);
+	sprintf(temp, "%s.%ld.tmp", path, (long) getpid());
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0666);
+	if (fd == (-1)) goto premature_exit;
+	while (n < size) {
+		t = write(fd, data + n, size - n);
+		if (t == (-1) && errno == EINTR) continue;
+		if (t == (-1)) break;
+		n += t;
+	}
+	if (n == size && ! close(fd)) {
+		fd = (-1);
+		if (! rename(temp, path)) rc = 0;
+	}
+premature_exit:
+	e = errno;
+	if (fd != (-1)) close(fd);
+	if (rc) unlink(temp);
+	free(temp);
+	errno = e;
+	return rc;
+}
+
+
+/*
+ * hash the contents of a file; a missing file is reported by setting
+ * *absent_p. Returns (-1) on other errors.
+ */
+static int
+hash_file(const char *path, unsigned char *hash, int *absent_p) {
+	unsigned char *data;
+	size_t size;
+	struct sha256 sha;
+	*absent_p = 0;
+	memset(hash, 0, HASH_SIZE);
+	if (read_file(path, &data, &size) == (-1)) {
+		if (errno != ENOENT) return (-1);
+		*absent_p = 1;
+		return 0;
+	}
+	sha_init(&sha);
+	sha_update(&sha, data, size);
+	sha_final(&sha, hash);
+	free(data);
+	return 0;
+}
+
+
+/*
+ * count a hit or a miss in the statistics file of the cache directory
+ * (which is locked while it is updated), and log the totals
+ */
+static void
+update_stats(int hit) {
+	int fd;
+	unsigned long hits = 0, misses = 0;
+	char buffer[64];
+	ssize_t t;
+	struct flock fl;
+	char *path = cache_path("stats", "");
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == (-1)) goto premature_exit;
+	memset(&fl, 0, sizeof fl);
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(fd, F_SETLKW, &fl) == (-1)) goto premature_exit;
+	t = read(fd, buffer, sizeof buffer - 1);
+	if (t > 0) {
+		buffer[t] = '\0';
+		if (sscanf(buffer, "%lu hits %lu misses", &hits,
+		    &misses) != 2) hits = misses = 0;
+	}
+	if (hit) hits++; else misses++;
+	sprintf(buffer, "%lu hits %lu misses\n", hits, misses);
+	if (ftruncate(fd, 0) == (-1) ||
+	    pwrite(fd, buffer, strlen(buffer), 0) == (-1)) goto premature_exit;
+	plog("result cache %s (%lu hits, %lu misses in total)",
+	    hit ? "hit" : "miss", hits, misses);
+	free(path);
+	close(fd);
+	return;
+premature_exit:
+	plog("cannot update %s: %s", path, strerror(errno));
+	plog("result cache %s", hit ? "hit" : "miss");
+	if (fd != (-1)) close(fd);
+	free(path);
+}
+
+
+/*
+ * helper function for cch_init(): get the current hash of an input
+ * file, using the list of files already hashed
+ */
+static struct cch_input *
+check_input(struct cch_input **list_p, int *count_p, const char *path) {
+	int i;
+	struct cch_input *ip;
+	for (i = 0; i < *count_p; i++) {
+		if (! strcmp((*list_p)[i].path, path)) return *list_p + i;
+	}
+	*list_p = resize(*list_p, (*count_p + 1) * sizeof (struct cch_input));
+	ip = *list_p + (*count_p)++;
+	ip->path = alloc(strlen(path) + 1);
+	strcpy(ip->path, path);
+	if (hash_file(path, ip->hash, &ip->absent) == (-1)) {
+		/*
+		 * an unreadable file never matches
+		 */
+		ip->absent = (-1);
+	}
+	return ip;
+}
+
+
+/*
+ * helper function for cch_init(): find an input set of the manifest
+ * whose files are unchanged; returns the name of its result (allocated)
+ * or NULL
+ */
+static char *
+find_result(FILE *fp) {
+	char *line = NULL, *result = NULL, *cp;
+	size_t size = 0;
+	ssize_t l;
+	int match = 0, absent;
+	char hex[HEX_SIZE];
+	struct cch_input *list = NULL, *ip;
+	int count = 0, i;
+	while ((l = getline(&line, &size, fp)) != (-1)) {
+		if (l && line[l - 1] == '\n') line[--l] = '\0';
+		if (! strncmp(line, "result ", 7)) {
+			free(result);
+			result = alloc(strlen(line + 7) + 1);
+			strcpy(result, line + 7);
+			match = 1;
+		} else if (! result) {
+			continue;
+		} else if (! strncmp(line, "input ", 6) &&
+		    (cp = strchr(line + 6, ' '))) {
+			*cp++ = '\0';
+			if (! match) continue;
+			ip = check_input(&list, &count, cp);
+			absent = ! strcmp(line + 6, "-");
+			if (ip->absent != absent) {
+				match = 0;
+			} else if (! absent) {
+				to_hex(ip->hash, hex);
+				if (strcmp(hex, line + 6)) match = 0;
+			}
+		} else if (! strcmp(line, "end")) {
+			if (match) break;
+			free(result);
+			result = NULL;
+		} else {
+			match = 0;
+		}
+	}
+	/*
+	 * a truncated last entry doesn't count
+	 */
+	if (l == (-1)) {
+		free(result);
+		result = NULL;
+	}
+	for (i = 0; i < count; i++) free(list[i].path);
+	free(list);
+	free(line);
+	return result;
+}
+
+
+/*
+ * file operation of a result
+ */
+struct cch_op {
+	enum dep_kind kind; /* DK_READ, DK_WRITTEN, or DK_DELETED */
+	char *path;
+	unsigned char *data;
+	size_t size;
+};
+
+
+/*
+ * helper function for cch_init(): read a result file and apply it,
+ * i.e. restore the files written, delete the files deleted, and keep
+ * the console output for cch_replay(); the accesses are entered into
+ * the dependency list. Returns (-1) on errors.
+ */
+static int
+restore_result(const char *name) {
+	int rc = (-1), i, count = 0, complete = 0;
+	struct cch_op *ops = NULL, *op;
+	char *path = cache_path(name, ".result"), *line = NULL, *cp;
+	size_t size = 0, n;
+	ssize_t l;
+	FILE *fp;
+	fp = fopen(path, "rb");
+	if (! fp) {
+		plog("cannot open %s: %s", path, strerror(errno));
+		goto premature_exit;
+	}
+	/*
+	 * read the result completely before changing anything
+	 */
+	while ((l = getline(&line, &size, fp)) != (-1)) {
+		if (l && line[l - 1] == '\n') line[--l] = '\0';
+		if (! strcmp(line, "end")) {
+			complete = 1;
+			break;
+		}
+		if (sscanf(line, "console %zu", &n) == 1) {
+			transcript = resize(transcript, n ? n : 1);
+			transcript_length = n;
+			if (fread(transcript, 1, n, fp) != n) break;
+			continue;
+		}
+		ops = resize(ops, (count + 1) * sizeof (struct cch_op));
+		op = ops + count++;
+		memset(op, 0, sizeof (struct cch_op));
+		if (sscanf(line, "output %zu", &n) == 1 &&
+		    (cp = strchr(line + 7, ' '))) {
+			op->kind = DK_WRITTEN;
+			op->data = alloc(n ? n : 1);
+			op->size = n;
+			if (fread(op->data, 1, n, fp) != n) break;
+		} else if (! strncmp(line, "deleted ", 8)) {
+			op->kind = DK_DELETED;
+			cp = line + 7;
+		} else if (! strncmp(line, "input ", 6)) {
+			op->kind = DK_READ;
+			cp = line + 5;
+		} else {
+			break;
+		}
+		op->path = alloc(strlen(cp + 1) + 1);
+		strcpy(op->path, cp + 1);
+	}
+	if (! complete) {
+		plog("%s is corrupt", path);
+		goto premature_exit;
+	}
+	/*
+	 * apply it
+	 */
+	for (i = 0; i < count; i++) {
+		op = ops + i;
+		if (op->kind == DK_WRITTEN &&
+		    write_file(op->path, op->data, op->size) == (-1)) {
+			plog("cannot restore %s: %s", op->path,
+			    strerror(errno));
+			goto premature_exit;
+		}
+		if (op->kind == DK_DELETED && unlink(op->path) == (-1) &&
+		    errno != ENOENT) {
+			plog("cannot delete %s: %s", op->path,
+			    strerror(errno));
+			goto premature_exit;
+		}
+		dep_record(op->kind, op->path, NULL);
+	}
+	rc = 0;
+premature_exit:
+	if (fp) fclose(fp);
+	for (i = 0; i < count; i++) {
+		free(ops[i].path);
+		free(ops[i].data);
+	}
+	free(ops);
+	free(line);
+	free(path);
+	return rc;
+}
+
+
+/*
+ * look a run up in the result cache (called after the program has been
+ * loaded and the zero page has been set up); returns 1 if the result
+ * has been restored and the program must not be run, 0 if the program
+ * is to be run, or (-1) if a result could not be restored
+ */
+int
+cch_init(size_t image_size, int drive) {
+	int rc = 0, i;
+	char **cpp;
+	struct sha256 sha;
+	char hex[HEX_SIZE], *path = NULL, *result = NULL;
+	FILE *fp;
+	if (! conf_cache_dir) goto premature_exit;
+	/*
+	 * the memory saved on exit is not part of a result
+	 */
+	if (conf_save_file) {
+		state = CS_RECORDING;
+		cch_uncacheable("memory is saved on exit");
+		goto premature_exit;
+	}
+	/*
+	 * compute the key of the run
+	 */
+	sha_init(&sha);
+	sha_string(&sha, "tnylpo result cache 1");
+	sha_int(&sha, (long long) image_size);
+	sha_update(&sha, memory + 0x0100, image_size);
+	sha_update(&sha, memory, 0x0100);
+	sha_int(&sha, drive);
+	sha_int(&sha, conf_epoch);
+	for (i = 0; i < 16; i++) {
+		sha_int(&sha, conf_drive_type[i]);
+		sha_string(&sha, conf_drives[i]);
+		sha_int(&sha, conf_readonly[i]);
+		sha_string(&sha, conf_persist_dir[i]);
+		sha_string(&sha, conf_persist_files[i]);
+		for (cpp = conf_layers[i]; cpp && *cpp; cpp++) {
+			sha_string(&sha, *cpp);
+		}
+		sha_int(&sha, conf_disk_format[i].spt);
+		sha_int(&sha, conf_disk_format[i].bls);
+		sha_int(&sha, conf_disk_format[i].dsm);
+		sha_int(&sha, conf_disk_format[i].drm);
+		sha_int(&sha, conf_disk_format[i].off);
+		sha_int(&sha, conf_disk_format[i].skew);
+	}
+	sha_final(&sha, key);
+	to_hex(key, hex);
+	/*
+	 * look for an input set whose files are unchanged
+	 */
+	path = cache_path(hex, ".manifest");
+	fp = fopen(path, "r");
+	if (fp) {
+		result = find_result(fp);
+		fclose(fp);
+	}
+	update_stats(result != NULL);
+	if (result) {
+		state = CS_HIT;
+		plog("restoring result %s", result);
+		if (restore_result(result)) {
+			perr("cannot restore cached result (see log file)");
+			rc = (-1);
+			goto premature_exit;
+		}
+		rc = 1;
+		goto premature_exit;
+	}
+	state = CS_RECORDING;
+premature_exit:
+	free(result);
+	free(path);
+	return rc;
+}
+
+
+/*
+ * mark the recorded run as not cacheable
+ */
+void
+cch_uncacheable(const char *reason) {
+	if (state != CS_RECORDING) return;
+	state = CS_UNCACHEABLE;
+	plog("result will not be cached: %s", reason);
+}
+
+
+/*
+ * record a file read by the program before writing it (or found
+ * missing): its current contents are part of the input set
+ */
+void
+cch_input(const char *path) {
+	struct cch_input *ip;
+	int i;
+	if (state != CS_RECORDING) return;
+	for (i = 0; i < input_count; i++) {
+		if (! strcmp(inputs[i].path, path)) return;
+	}
+	if (strchr(path, '\n')) {
+		cch_uncacheable("file name containing a newline");
+		return;
+	}
+	inputs = resize(inputs, (input_count + 1) * sizeof (struct cch_input));
+	ip = inputs + input_count++;
+	ip->path = alloc(strlen(path) + 1);
+	strcpy(ip->path, path);
+	if (hash_file(path, ip->hash, &ip->absent) == (-1)) {
+		plog("cannot read %s: %s", path, strerror(errno));
+		cch_uncacheable("unreadable input file");
+	}
+}
+
+
+/*
+ * record a character written to the console
+ */
+void
+cch_console(unsigned char c) {
+	if (state != CS_RECORDING) return;
+	if (transcript_length == transcript_size) {
+		transcript_size = transcript_size ? 2 * transcript_size : 4096;
+		transcript = resize(transcript, transcript_size);
+	}
+	transcript[transcript_length++] = c;
+}
+
+
+/*
+ * write the console output of a restored run to the console
+ */
+void
+cch_replay(void) {
+	size_t i;
+	if (state != CS_HIT) return;
+	for (i = 0; i < transcript_length; i++) console_out(transcript[i]);
+}
+
+
+/*
+ * helper function for cch_exit(): store the result of a recorded run
+ * and add its input set to the manifest of the key; returns (-1) on
+ * errors
+ */
+static int
+store_result(void) {
+	int rc = (-1), i, pos, fd = (-1);
+	struct sha256 sha;
+	unsigned char id[HASH_SIZE], *data;
+	char hex[HEX_SIZE], *path = NULL, *temp = NULL, *text = NULL;
+	const char *cp;
+	size_t size, length;
+	FILE *fp = NULL;
+	/*
+	 * the result is named by the hash of the key and the input set
+	 */
+	sha_init(&sha);
+	sha_update(&sha, key, HASH_SIZE);
+	for (i = 0; i < input_count; i++) {
+		sha_string(&sha, inputs[i].path);
+		sha_int(&sha, inputs[i].absent);
+		sha_update(&sha, inputs[i].hash, HASH_SIZE);
+	}
+	sha_final(&sha, id);
+	to_hex(id, hex);
+	/*
+	 * write the result file
+	 */
+	path = cache_path(hex, ".result");
+	temp = alloc(strlen(path) + 32);
+	sprintf(temp, "%s.%ld.tmp", path, (long) getpid());
+	fp = fopen(temp, "wb");
+	if (! fp) {
+		plog("cannot create %s: %s", temp, strerror(errno));
+		goto premature_exit;
+	}
+	fprintf(fp, "console %lu\n", (unsigned long) transcript_length);
+	fwrite(transcript, 1, transcript_length, fp);
+	for (pos = 0; (cp = dep_next(DK_READ, &pos)); ) {
+		fprintf(fp, "input %s\n", cp);
+	}
+	for (pos = 0; (cp = dep_next(DK_DELETED, &pos)); ) {
+		fprintf(fp, "deleted %s\n", cp);
+	}
+	for (pos = 0; (cp = dep_next(DK_WRITTEN, &pos)); ) {
+		if (strchr(cp, '\n')) {
+			plog("file name %s contains a newline", cp);
+			goto premature_exit;
+		}
+		if (read_file(cp, &data, &size) == (-1)) {
+			plog("cannot read %s: %s", cp, strerror(errno));
+			goto premature_exit;
+		}
+		fprintf(fp, "output %lu %s\n", (unsigned long) size,
+		    cp);
+		fwrite(data, 1, size, fp);
+		free(data);
+	}
+	fputs("end\n", fp);
+	i = ferror(fp);
+	if (fclose(fp) || i) {
+		fp = NULL;
+		plog("cannot write %s: %s", temp, strerror(errno));
+		goto premature_exit;
+	}
+	fp = NULL;
+	if (rename(temp, path) == (-1)) {
+		plog("cannot rename %s: %s", temp, strerror(errno));
+		goto premature_exit;
+	}
+	/*
+	 * append the input set to the manifest in a single write
+	 */
+	length = strlen(hex) + 16;
+	for (i = 0; i < input_count; i++) {
+		length += strlen(inputs[i].path) + HEX_SIZE + 8;
+	}
+	text = alloc(length);
+	length = sprintf(text, "result %s\n", hex);
+	for (i = 0; i < input_count; i++) {
+		to_hex(inputs[i].hash, hex);
+		length += sprintf(text + length, "input %s %s\n",
+		    inputs[i].absent ? "-" : hex, inputs[i].path);
+	}
+	length += sprintf(text + length, "end\n");
+	free(path);
+	to_hex(key, hex);
+	path = cache_path(hex, ".manifest");
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == (-1) || write(fd, text, length) != (ssize_t) length) {
+		plog("cannot write %s: %s", path, strerror(errno));
+		goto premature_exit;
+	}
+	rc = 0;
+premature_exit:
+	if (fd != (-1)) close(fd);
+	if (fp) fclose(fp);
+	if (rc && temp) unlink(temp);
+	free(temp);
+	free(text);
+	free(path);
+	return rc;
+}
+
+
+/*
+ * store the result of a recorded run if the program has terminated
+ * successfully, and release the data of the result cache
+ */
+void
+cch_exit(int success) {
+	int i;
+	if (state == CS_RECORDING) {
+		if (! success) {
+			plog("result not cached: unsuccessful run");
+		} else if (! store_result()) {
+			plog("result stored in the cache");
+		}
+	}
+	state = CS_OFF;
+	for (i = 0; i < input_count; i++) free(inputs[i].path);
+	free(inputs);
+	inputs = NULL;
+	input_count = 0;
+	free(transcript);
+	transcript = NULL;
+	transcript_length = transcript_size = 0;
+}
@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 
 #include "tnylpo.h"
@@ -204,6 +205,14 @@ premature_exit:
 void
 console_out(unsigned char c) {
 	wint_t wc;
+	/*
+	 * suppress output beyond the output limit
+	 */
+	if (limit_output(1)) goto premature_exit;
+	/*
+	 * the console output is part of a cached result
+	 */
+	cch_console(c);
 	/*
 	 * the VT52 emulation is handled separately
 	 */
@@ -271,6 +280,7 @@ console_in(void) {
 	unsigned char c;
 	int t;
 	wint_t wc;
+	cch_uncacheable("console input");
 	/*
 	 * the VT52 emulation is handled separately
 	 */
@@ -470,6 +480,7 @@ void \
 DEV##_out(unsigned char c) { \
 	size_t n; \
 	wchar_t wc; \
+	cch_uncacheable(#DEV " output"); \
 	if (! conf_##DEV) goto premature_exit; \
 	if (DEV##_error) goto premature_exit; \
 	if (! DEV##_fp) { \
@@ -478,6 +489,7 @@ DEV##_out(unsigned char c) { \
 			DEV##_error = errno; \
 			goto premature_exit; \
 		} \
+		fcntl(fileno(DEV##_fp), F_SETFD, FD_CLOEXEC); \
 	} \
 	if (conf_##DEV##_raw) { \
 		for (;;) { \
@@ -583,6 +595,7 @@ reader_in(void) {
 	unsigned char c = 0x1a /* SUB */, tc;
 	size_t n;
 	wint_t wc;
+	cch_uncacheable("reader input");
 	int t;
 	/*
 	 * no reader configured or previous reader error?
@@ -597,6 +610,7 @@ reader_in(void) {
 			reader_error = errno;
 			goto premature_exit;
 		}
+		fcntl(fileno(reader_fp), F_SETFD, FD_CLOEXEC);
 	}
 	/*
 	 * raw binary bytes or text file?
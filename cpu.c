@@ -29,6 +29,33 @@
  */
 
 
+/*
+ * This file is compiled twice: once as the production CPU core, and
+ * once with REFERENCE_CORE defined as the reference core of the lockstep
+ * checker. In the second case, all external symbols are prefixed by ref_,
+ * so both cores can be linked into the same executable; the reference
+ * core consists of the instruction emulation only.
+ */
+#ifdef REFERENCE_CORE
+#define memory ref_memory
+#define reg_sp ref_reg_sp
+#define reg_pc ref_reg_pc
+#define reg_a ref_reg_a
+#define reg_b ref_reg_b
+#define reg_c ref_reg_c
+#define reg_d ref_reg_d
+#define reg_e ref_reg_e
+#define reg_h ref_reg_h
+#define reg_l ref_reg_l
+#define terminate ref_terminate
+#define term_reason ref_term_reason
+#define os_call ref_os_call
+#define cpu_step ref_cpu_step
+#define cpu_get_state ref_cpu_get_state
+#define cpu_set_state ref_cpu_set_state
+#endif
+
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -107,10 +134,12 @@ static int alt_flag_c = 0;
 int terminate = 0;
 
 
+#ifndef REFERENCE_CORE
 /*
  * dump flag
  */
 static sig_atomic_t dump = 0;
+#endif
 
 
 /*
@@ -119,6 +148,15 @@ static sig_atomic_t dump = 0;
 enum reason term_reason = OK_NOTRUN;
 
 
+#ifndef REFERENCE_CORE
+/*
+ * number of instructions executed by cpu_run() (maintained in steps of
+ * POLL_INTERVAL while running, exact after cpu_run() returns)
+ */
+unsigned long long instruction_count = 0;
+#endif
+
+
 /*
  * start of current instruction including prefixes
  */
@@ -191,27 +229,146 @@ static inline void
 set_iy(int iy) { reg_iyl = iy & 0xff; reg_iyh = (iy >> 8) & 0xff; }
 
 
+/*
+ * pack flags into an F register value and unpack it again
+ */
+static inline int
+get_f(int s, int z, int y, int h, int x, int p, int n, int c) {
+	return (s ? 0x80 : 0) | (z ? 0x40 : 0) | (y ? 0x20 : 0) |
+	    (h ? 0x10 : 0) | (x ? 0x08 : 0) | (p ? 0x04 : 0) |
+	    (n ? 0x02 : 0) | (c ? 0x01 : 0);
+}
+
+static inline void
+set_f(int f, int *s, int *z, int *y, int *h, int *x, int *p, int *n, int *c) {
+	*s = ((f & 0x80) != 0);
+	*z = ((f & 0x40) != 0);
+	*y = ((f & 0x20) != 0);
+	*h = ((f & 0x10) != 0);
+	*x = ((f & 0x08) != 0);
+	*p = ((f & 0x04) != 0);
+	*n = ((f & 0x02) != 0);
+	*c = ((f & 0x01) != 0);
+}
+
+
+/*
+ * copy the complete CPU state to a state structure
+ */
+void
+cpu_get_state(struct cpu_state *state_p) {
+	state_p->pc = reg_pc;
+	state_p->sp = reg_sp;
+	state_p->a = reg_a;
+	state_p->f = get_f(flag_s, flag_z, flag_y, flag_h, flag_x, flag_p,
+	    flag_n, flag_c);
+	state_p->b = reg_b;
+	state_p->c = reg_c;
+	state_p->d = reg_d;
+	state_p->e = reg_e;
+	state_p->h = reg_h;
+	state_p->l = reg_l;
+	state_p->alt_a = alt_reg_a;
+	state_p->alt_f = get_f(alt_flag_s, alt_flag_z, alt_flag_y,
+	    alt_flag_h, alt_flag_x, alt_flag_p, alt_flag_n, alt_flag_c);
+	state_p->alt_b = alt_reg_b;
+	state_p->alt_c = alt_reg_c;
+	state_p->alt_d = alt_reg_d;
+	state_p->alt_e = alt_reg_e;
+	state_p->alt_h = alt_reg_h;
+	state_p->alt_l = alt_reg_l;
+	state_p->ixh = reg_ixh;
+	state_p->ixl = reg_ixl;
+	state_p->iyh = reg_iyh;
+	state_p->iyl = reg_iyl;
+	state_p->r = reg_r;
+	state_p->i = reg_i;
+	state_p->iff = flag_i;
+}
+
+
+/*
+ * set the complete CPU state from a state structure
+ */
+void
+cpu_set_state(const struct cpu_state *state_p) {
+	reg_pc = state_p->pc;
+	reg_sp = state_p->sp;
+	reg_a = state_p->a;
+	set_f(state_p->f, &flag_s, &flag_z, &flag_y, &flag_h, &flag_x,
+	    &flag_p, &flag_n, &flag_c);
+	reg_b = state_p->b;
+	reg_c = state_p->c;
+	reg_d = state_p->d;
+	reg_e = state_p->e;
+	reg_h = state_p->h;
+	reg_l = state_p->l;
+	alt_reg_a = state_p->alt_a;
+	set_f(state_p->alt_f, &alt_flag_s, &alt_flag_z, &alt_flag_y,
+	    &alt_flag_h, &alt_flag_x, &alt_flag_p, &alt_flag_n, &alt_flag_c);
+	alt_reg_b = state_p->alt_b;
+	alt_reg_c = state_p->alt_c;
+	alt_reg_d = state_p->alt_d;
+	alt_reg_e = state_p->alt_e;
+	alt_reg_h = state_p->alt_h;
+	alt_reg_l = state_p->alt_l;
+	reg_ixh = state_p->ixh;
+	reg_ixl = state_p->ixl;
+	reg_iyh = state_p->iyh;
+	reg_iyl = state_p->iyl;
+	reg_r = state_p->r;
+	reg_i = state_p->i;
+	flag_i = state_p->iff;
+}
+
+
+#ifndef REFERENCE_CORE
+/*
+ * convert a packed F register to its printable form
+ */
+static const char *
+flag_string(int f) {
+	static char buffer[9];
+	static const char names[] = "szyhxpnc";
+	int i;
+	for (i = 0; i < 8; i++) {
+		buffer[i] = (f & (0x80 >> i)) ? names[i] : '-';
+	}
+	buffer[8] = '\0';
+	return buffer;
+}
+
+
+/*
+ * log the registers contained in a CPU state structure
+ */
+static void
+log_state(const struct cpu_state *state_p) {
+	plog("a=%02x f=%s bc=%04x de=%04x hl=%04x", state_p->a,
+	    flag_string(state_p->f), (state_p->b << 8) | state_p->c,
+	    (state_p->d << 8) | state_p->e, (state_p->h << 8) | state_p->l);
+	plog("a\'=%02x f\'=%s bc\'=%04x de\'=%04x hl\'=%04x",
+	    state_p->alt_a, flag_string(state_p->alt_f),
+	    (state_p->alt_b << 8) | state_p->alt_c,
+	    (state_p->alt_d << 8) | state_p->alt_e,
+	    (state_p->alt_h << 8) | state_p->alt_l);
+	plog("ix=%04x iy=%04x sp=%04x pc=%04x, r=%02x i=%02x",
+	    (state_p->ixh << 8) | state_p->ixl,
+	    (state_p->iyh << 8) | state_p->iyl,
+	    state_p->sp, state_p->pc, state_p->r, state_p->i);
+	plog("interrupts %s", state_p->iff ? "enabled" : "disabled");
+}
+
+
 /*
  * dump registers and memory to log file
  */
 static void
 dump_machine(const char *label) {
+	struct cpu_state state;
+	cpu_get_state(&state);
 	plog("start of %s machine dump", label);
-	plog("a=%02x f=%c%c%c%c%c%c%c%c bc=%04x de=%04x hl=%04x",
-	    reg_a, flag_s ? 's' : '-', flag_z ? 'z' : '-',
-	    flag_y ? 'y' : '-', flag_h ? 'h' : '-', flag_x ? 'x' : '-',
-	    flag_p ? 'p' : '-', flag_n ? 'n' : '-', flag_c ? 'c' : '-',
-	    get_bc(), get_de(), get_hl());
-	plog("a\'=%02x f\'=%c%c%c%c%c%c%c%c bc\'=%04x de\'=%04x hl\'=%04x",
-	    alt_reg_a, alt_flag_s ? 's' : '-',
-	    alt_flag_z ? 'z' : '-', alt_flag_y ? 'y' : '-',
-	    alt_flag_h ? 'h' : '-', alt_flag_x ? 'x' : '-',
-	    alt_flag_p ? 'p' : '-', alt_flag_n ? 'n' : '-',
-	    alt_flag_c ? 'c' : '-', (alt_reg_b << 8) | alt_reg_c,
-	    (alt_reg_d << 8) | alt_reg_e, (alt_reg_h << 8) | alt_reg_l);
-	plog("ix=%04x iy=%04x sp=%04x pc=%04x, r=%02x i=%02x",
-	    get_ix(), get_iy(), reg_sp, reg_pc, reg_r, reg_i);
-	plog("interrupts %s", flag_i ? "enabled" : "disabled");
+	log_state(&state);
 	plog_dump(0, MEMORY_SIZE);
 	plog("end of %s machine dump", label);
 }
@@ -234,10 +391,15 @@ cpu_init(void) {
 	 * use R for generating random numbers
 	 *
 	 * No, this random number is not suitable for
-	 * cryptographical purposes.
+	 * cryptographical purposes. In deterministic mode, it is
+	 * derived from the configured epoch.
 	 */
-	gettimeofday(&tv, NULL);
-	srand((unsigned) tv.tv_usec);
+	if (conf_epoch >= 0) {
+		srand((unsigned) conf_epoch);
+	} else {
+		gettimeofday(&tv, NULL);
+		srand((unsigned) tv.tv_usec);
+	}
 	reg_r = (rand() & 0x7f);
 	/*
 	 * initialize OS emulation
@@ -252,6 +414,7 @@ premature_exit:
 	if (rc) free(memory);
 	return rc;
 }
+#endif
 
 
 /*
@@ -2683,17 +2846,109 @@ static unsigned long fd_cb_counters[256];
 
 
 /*
- * longjmp on reception of SIGINT, SIGTERM, or SIGQUIT
+ * execute a single instruction
+ */
+static inline void
+step(void) {
+	const struct instruction *inst_p;
+	/*
+	 * mark start of new instruction
+	 */
+	current_instruction = reg_pc;
+	/*
+	 * fetch next opcode, handle instruction prefixes
+	 */
+	prefix = 0x00;
+	for (;;) {
+		opcode = fetch_m1();
+		if (opcode != 0xdd && opcode != 0xfd) break;
+		prefix = opcode;
+	}
+	inst_p = base_plane + opcode;
+	/*
+	 * get optional displacement
+	 */
+	if (prefix && (inst_p->flags & OP_INDEXED)) disp = fetch();
+	/*
+	 * instructions starting in 0xed are handled in
+	 * a slightly different way (contrary to those starting in
+	 * 0xcb they are not influenced by prefixes and have
+	 * non-uniform arguments)
+	 */
+	if (opcode == 0xcb) {
+		opcode2 = prefix ? fetch_m1() : fetch();
+		if (log_level >= LL_COUNTERS) {
+			switch (prefix) {
+			case 0xdd: dd_cb_counters[opcode2]++; break;
+			case 0xfd: fd_cb_counters[opcode2]++; break;
+			default: cb_counters[opcode2]++; break;
+			}
+		}
+	} else if (opcode == 0xed) {
+		opcode2 = fetch_m1();
+		inst_p = ed_plane + opcode2;
+		if (log_level >= LL_COUNTERS) {
+			ed_counters[opcode2]++;
+		}
+	} else {
+		if (log_level >= LL_COUNTERS) {
+			switch (prefix) {
+			case 0xdd: dd_counters[opcode]++; break;
+			case 0xfd: fd_counters[opcode]++; break;
+			default: counters[opcode]++; break;
+			}
+		}
+	}
+	/*
+	 * get optional 8-bit argument
+	 */
+	if (inst_p->flags & OP_ARG8) op_low = fetch();
+	/*
+	 * get optional 16-bit argument
+	 */
+	if (inst_p->flags & OP_ARG16) {
+		op_low = fetch();
+		op_high = fetch();
+	}
+	/*
+	 * execute instruction
+	 */
+	(*inst_p->handler_p)();
+}
+
+
+/*
+ * external entry point for executing a single instruction
+ * (used by the lockstep checker)
+ */
+void
+cpu_step(void) {
+	step();
+}
+
+
+#ifndef REFERENCE_CORE
+/*
+ * longjmp on reception of SIGINT, SIGTERM, SIGQUIT, or SIGALRM
  */
 static jmp_buf signal_jmp;
 
 
+/*
+ * set if the wall-clock time limit has been exceeded
+ */
+static volatile sig_atomic_t time_limit_exceeded = 0;
+
+
 /*
  * signal handler just jumps to the top of the main loop
  */
 static void handler(int s) {
 	struct sigaction sa;
 	switch (s) {
+	case SIGALRM:
+		time_limit_exceeded = 1;
+		/* FALLTHROUGH */
 	case SIGTERM:
 	case SIGQUIT:
 	case SIGINT:
@@ -2707,6 +2962,7 @@ static void handler(int s) {
 		sigaction(SIGTERM, &sa, NULL);
 		sigaction(SIGQUIT, &sa, NULL);
 		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGALRM, &sa, NULL);
 		longjmp(signal_jmp, 1);
 		break;
 	case SIGUSR1:
@@ -2722,13 +2978,234 @@ static void handler(int s) {
 #define POLL_INTERVAL (128 * 1024)
 
 
+/*
+ * number of instructions until the next console poll: POLL_INTERVAL or
+ * the number of instructions left before reaching the instruction limit,
+ * whichever is smaller
+ */
+static int
+next_poll_limit(void) {
+	long long left;
+	if (conf_limit_instructions > 0) {
+		left = conf_limit_instructions - (long long) instruction_count;
+		if (left < POLL_INTERVAL) return (left > 0) ? (int) left : 1;
+	}
+	return POLL_INTERVAL;
+}
+
+
+/*
+ * maximal number of differing memory locations logged by the
+ * lockstep checker
+ */
+#define LOCKSTEP_MAX_DIFFS 32
+
+
+/*
+ * number of instructions executed by the lockstep checker since the
+ * last memory comparison
+ */
+static int lockstep_counter = 0;
+
+
+/*
+ * 8-bit registers compared by the lockstep checker
+ */
+static const struct {
+	const char *name;
+	size_t offset;
+} lockstep_regs[] = {
+	{ "a", offsetof(struct cpu_state, a) },
+	{ "f", offsetof(struct cpu_state, f) },
+	{ "b", offsetof(struct cpu_state, b) },
+	{ "c", offsetof(struct cpu_state, c) },
+	{ "d", offsetof(struct cpu_state, d) },
+	{ "e", offsetof(struct cpu_state, e) },
+	{ "h", offsetof(struct cpu_state, h) },
+	{ "l", offsetof(struct cpu_state, l) },
+	{ "a\'", offsetof(struct cpu_state, alt_a) },
+	{ "f\'", offsetof(struct cpu_state, alt_f) },
+	{ "b\'", offsetof(struct cpu_state, alt_b) },
+	{ "c\'", offsetof(struct cpu_state, alt_c) },
+	{ "d\'", offsetof(struct cpu_state, alt_d) },
+	{ "e\'", offsetof(struct cpu_state, alt_e) },
+	{ "h\'", offsetof(struct cpu_state, alt_h) },
+	{ "l\'", offsetof(struct cpu_state, alt_l) },
+	{ "ixh", offsetof(struct cpu_state, ixh) },
+	{ "ixl", offsetof(struct cpu_state, ixl) },
+	{ "iyh", offsetof(struct cpu_state, iyh) },
+	{ "iyl", offsetof(struct cpu_state, iyl) },
+	{ "r", offsetof(struct cpu_state, r) },
+	{ "i", offsetof(struct cpu_state, i) },
+	{ "iff", offsetof(struct cpu_state, iff) }
+};
+
+
+/*
+ * compare the states of the primary and the reference core; if verbose
+ * is set, the differences are logged
+ */
+static int
+lockstep_compare(const struct cpu_state *primary_p,
+    const struct cpu_state *reference_p, int verbose) {
+	int rc = 0, n, p, r;
+	if (primary_p->pc != reference_p->pc) {
+		if (verbose) plog("pc: primary=%04x reference=%04x",
+		    primary_p->pc, reference_p->pc);
+		rc = 1;
+	}
+	if (primary_p->sp != reference_p->sp) {
+		if (verbose) plog("sp: primary=%04x reference=%04x",
+		    primary_p->sp, reference_p->sp);
+		rc = 1;
+	}
+	for (n = 0; n < sizeof lockstep_regs / sizeof lockstep_regs[0];
+	    n++) {
+		p = ((const unsigned char *) primary_p)
+		    [lockstep_regs[n].offset];
+		r = ((const unsigned char *) reference_p)
+		    [lockstep_regs[n].offset];
+		if (p != r) {
+			if (verbose) plog("%s: primary=%02x reference=%02x",
+			    lockstep_regs[n].name, p, r);
+			rc = 1;
+		}
+	}
+	return rc;
+}
+
+
+/*
+ * log the divergence of the two cores and terminate the emulation
+ */
+static void
+lockstep_diverged(int address, const unsigned char *code,
+    const struct cpu_state *before_p, const struct cpu_state *primary_p,
+    const struct cpu_state *reference_p, int checked) {
+	int n, diffs = 0;
+	plog("start of lockstep divergence dump");
+	if (checked > 1) {
+		plog("cores diverged in one of the last %d instructions, "
+		    "the last one at 0x%04x: %02x %02x %02x %02x", checked,
+		    address, code[0], code[1], code[2], code[3]);
+	} else {
+		plog("cores diverged in instruction at 0x%04x: "
+		    "%02x %02x %02x %02x", address, code[0], code[1], code[2],
+		    code[3]);
+	}
+	plog("state before instruction:");
+	log_state(before_p);
+	plog("state of primary core:");
+	log_state(primary_p);
+	plog("state of reference core:");
+	log_state(reference_p);
+	if (terminate != ref_terminate) {
+		plog("terminate: primary=%d reference=%d", terminate,
+		    ref_terminate);
+	}
+	lockstep_compare(primary_p, reference_p, 1);
+	for (n = 0; n < MEMORY_SIZE; n++) {
+		if (memory[n] == ref_memory[n]) continue;
+		if (diffs < LOCKSTEP_MAX_DIFFS) {
+			plog("memory 0x%04x: primary=%02x reference=%02x",
+			    n, memory[n], ref_memory[n]);
+		}
+		diffs++;
+	}
+	if (diffs > LOCKSTEP_MAX_DIFFS) {
+		plog("%d more differing memory locations",
+		    diffs - LOCKSTEP_MAX_DIFFS);
+	}
+	plog("end of lockstep divergence dump");
+	terminate = 1;
+	term_reason = ERR_LOCKSTEP;
+}
+
+
+/*
+ * the reference core never executes the RET instructions at the magic
+ * addresses; after an OS call, it is resynchronized with the primary
+ * core instead
+ */
+void
+ref_os_call(int magic) {
+	plog("reference core called OS function %d", magic);
+	ref_terminate = 1;
+	ref_term_reason = ERR_LOGIC;
+}
+
+
+/*
+ * start the reference core with a copy of the primary core's state
+ */
+static void
+lockstep_init(void) {
+	struct cpu_state state;
+	if (! ref_memory) ref_memory = alloc(MEMORY_SIZE);
+	memcpy(ref_memory, memory, MEMORY_SIZE);
+	cpu_get_state(&state);
+	ref_cpu_set_state(&state);
+	ref_terminate = 0;
+	lockstep_counter = 0;
+	plog("lockstep checker enabled, memory compared every %d "
+	    "instructions", conf_lockstep);
+}
+
+
+/*
+ * execute one instruction in both cores and compare the results:
+ * registers and flags are compared after every instruction, memory
+ * every conf_lockstep instructions and always before an OS call or
+ * at the end of the emulation
+ */
+static void
+lockstep(void) {
+	struct cpu_state before, primary, reference;
+	unsigned char code[4];
+	int address = reg_pc, n;
+	/*
+	 * remember the instruction executed
+	 */
+	for (n = 0; n < 4; n++) code[n] = memory[(address + n) & 0xffff];
+	cpu_get_state(&before);
+	step();
+	cpu_get_state(&primary);
+	if (address >= MAGIC_ADDRESS) {
+		/*
+		 * OS calls are not part of the CPU emulation proper:
+		 * resynchronize the reference core
+		 */
+		memcpy(ref_memory, memory, MEMORY_SIZE);
+		ref_cpu_set_state(&primary);
+		lockstep_counter = 0;
+		return;
+	}
+	ref_cpu_step();
+	ref_cpu_get_state(&reference);
+	lockstep_counter++;
+	if (terminate != ref_terminate ||
+	    lockstep_compare(&primary, &reference, 0)) {
+		lockstep_diverged(address, code, &before, &primary,
+		    &reference, 1);
+		return;
+	}
+	if (lockstep_counter >= conf_lockstep || terminate ||
+	    reg_pc >= MAGIC_ADDRESS) {
+		if (memcmp(memory, ref_memory, MEMORY_SIZE)) {
+			lockstep_diverged(address, code, &before, &primary,
+			    &reference, lockstep_counter);
+		}
+		lockstep_counter = 0;
+	}
+}
+
+
 /*
  * start emulation proper
  */
 void
 cpu_run(void) {
-	int poll_counter = 0, delay_counter = 0;
-	const struct instruction *inst_p;
+	int poll_counter = 0, poll_limit, delay_counter = 0;
 	struct sigaction sa;
 	struct timespec delay;
 	/*
@@ -2745,23 +3222,34 @@ cpu_run(void) {
 	if (setjmp(signal_jmp)) {
 		if (! terminate) {
 			terminate = 1;
-			term_reason = ERR_SIGNAL;
+			term_reason = time_limit_exceeded ?
+			    ERR_TIMELIMIT : ERR_SIGNAL;
 		}
 	} else {
 		/*
 		 * signals causing the emulation to terminate with
-		 * status ERR_SIGNAL; the handlers block the occurrence
-		 * of the other signals to avoid calling logjmp() twice.
+		 * status ERR_SIGNAL (or ERR_TIMELIMIT for SIGALRM);
+		 * the handlers block the occurrence of the other
+		 * signals to avoid calling logjmp() twice.
 		 */
 		sa.sa_handler = handler;
 		sigemptyset(&sa.sa_mask);
 		sigaddset(&sa.sa_mask, SIGTERM);
 		sigaddset(&sa.sa_mask, SIGQUIT);
 		sigaddset(&sa.sa_mask, SIGINT);
+		sigaddset(&sa.sa_mask, SIGALRM);
 		sa.sa_flags = 0;
 		sigaction(SIGTERM, &sa, NULL);
 		sigaction(SIGQUIT, &sa, NULL);
 		sigaction(SIGINT, &sa, NULL);
+		/*
+		 * the wall-clock time limit is enforced by an alarm,
+		 * which also interrupts a program waiting for input
+		 */
+		if (conf_limit_time > 0) {
+			sigaction(SIGALRM, &sa, NULL);
+			alarm(conf_limit_time);
+		}
 	}
 	/*
 	 * install signal handler if dump signals are requested
@@ -2772,6 +3260,15 @@ cpu_run(void) {
 		sa.sa_flags = 0;
 		sigaction(SIGUSR1, &sa, NULL);
 	}
+	/*
+	 * start the reference core if the lockstep checker is enabled
+	 */
+	if (conf_lockstep > 0 && ! terminate) lockstep_init();
+	/*
+	 * the console is polled (and the instruction limit is checked)
+	 * every poll_limit instructions
+	 */
+	poll_limit = next_poll_limit();
 	while (! terminate) {
 		/*
 		 * dump machine state
@@ -2781,77 +3278,35 @@ cpu_run(void) {
 			dump_machine("signal");
 		}
 		/*
-		 * mark start of new instruction
+		 * execute next instruction, either alone or in lockstep
+		 * with the reference core
 		 */
-		current_instruction = reg_pc;
-		/*
-		 * fetch next opcode, handle instruction prefixes
-		 */
-		prefix = 0x00;
-		for (;;) {
-			opcode = fetch_m1();
-			if (opcode != 0xdd && opcode != 0xfd) break;
-			prefix = opcode;
-		}
-		inst_p = base_plane + opcode;
-		/*
-		 * get optional displacement
-		 */
-		if (prefix && (inst_p->flags & OP_INDEXED)) disp = fetch();
-		/*
-		 * instructions starting in 0xed are handled in
-		 * a slightly different way (contrary to those starting in
-		 * 0xcb they are not influenced by prefixes and have
-		 * non-uniform arguments)
-		 */
-		if (opcode == 0xcb) {
-			opcode2 = prefix ? fetch_m1() : fetch();
-			if (log_level >= LL_COUNTERS) {
-				switch (prefix) {
-				case 0xdd: dd_cb_counters[opcode2]++; break;
-				case 0xfd: fd_cb_counters[opcode2]++; break;
-				default: cb_counters[opcode2]++; break;
-				}
-			}
-		} else if (opcode == 0xed) {
-			opcode2 = fetch_m1();
-			inst_p = ed_plane + opcode2;
-			if (log_level >= LL_COUNTERS) {
-				ed_counters[opcode2]++;
-			}
+		if (conf_lockstep > 0) {
+			lockstep();
 		} else {
-			if (log_level >= LL_COUNTERS) {
-				switch (prefix) {
-				case 0xdd: dd_counters[opcode]++; break;
-				case 0xfd: fd_counters[opcode]++; break;
-				default: counters[opcode]++; break;
-				}
-			}
-		}
-		/*
-		 * get optional 8-bit argument
-		 */
-		if (inst_p->flags & OP_ARG8) op_low = fetch();
-		/*
-		 * get optional 16-bit argument
-		 */
-		if (inst_p->flags & OP_ARG16) {
-			op_low = fetch();
-			op_high = fetch();
+			step();
 		}
-		/*
-		 * execute instruction
-		 */
-		(*inst_p->handler_p)();
 		/*
 		 * Poll the console in regular intervals; this is a rather
 		 * clumsy solution to keep the VT52 emulation happy even
 		 * if a program doesn't care about console input for a
-		 * prolonged period.
+		 * prolonged period. The instruction limit is checked at
+		 * the same time; the polling interval is shortened to
+		 * stop exactly at the limit.
 		 */
 		poll_counter++;
-		if (poll_counter == POLL_INTERVAL) {
+		if (poll_counter == poll_limit) {
+			instruction_count += poll_counter;
 			poll_counter = 0;
+			if (conf_limit_instructions > 0 &&
+			    instruction_count >= conf_limit_instructions) {
+				if (! terminate) {
+					terminate = 1;
+					term_reason = ERR_INSTRLIMIT;
+				}
+				break;
+			}
+			poll_limit = next_poll_limit();
 			console_poll();
 		}
 		if (delay_count > 0) {
@@ -2866,6 +3321,11 @@ cpu_run(void) {
 			}
 		}
 	}
+	instruction_count += poll_counter;
+	/*
+	 * cancel a pending alarm
+	 */
+	if (conf_limit_time > 0) alarm(0);
 }
 
 
@@ -3075,6 +3535,21 @@ cpu_exit(void) {
 	case ERR_HALT:
 		perr("HALT instruction executed");
 		break;
+	case ERR_LOCKSTEP:
+		perr("CPU cores diverged in lockstep mode (see log file)");
+		break;
+	case ERR_INSTRLIMIT:
+		perr("instruction limit exceeded");
+		break;
+	case ERR_TIMELIMIT:
+		perr("time limit exceeded");
+		break;
+	case ERR_OUTPUTLIMIT:
+		perr("output limit exceeded");
+		break;
+	case ERR_FILELIMIT:
+		perr("open file limit exceeded");
+		break;
 	}
 	if (term_reason <= OK_CTRLC) {
 		if (conf_save_file) {
@@ -3095,6 +3570,8 @@ cpu_exit(void) {
 	 * deallocate memory
 	 */
 	free(memory);
+	free(ref_memory);
+	ref_memory = NULL;
 	/*
 	 * dump instruction counters
 	 */
@@ -3109,3 +3586,4 @@ cpu_exit(void) {
 	}
 	return rc;
 }
+#endif
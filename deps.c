@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * The dependency list records the host files a program has read,
+ * written, renamed, or deleted through the BDOS, so that a build system
+ * can tell which inputs a job depends on and which outputs it produces.
+ * A file only counts as an input if it was read before the program
+ * wrote it; a file created and deleted again by the program (e.g. a
+ * work file) is neither an input nor an output. On exit, the list is
+ * written as a make rule or as a JSON object. The result cache gets the
+ * input files from here as they are read, and the outputs on exit.
+ */
+#define DEP_READ 0x1 /* read before being written by the program */
+#define DEP_WRITTEN 0x2 /* created or written, and still there */
+#define DEP_DELETED 0x4 /* deleted, and not created again */
+#define DEP_NEW 0x8 /* first seen when the program created it */
+#define DEP_EXAMINED 0x10 /* looked for, but neither read nor written */
+
+
+/*
+ * host file touched by the program
+ */
+static struct dep_entry {
+	char *path;
+	int flags;
+} *entries = NULL;
+static int entry_count = 0;
+
+
+/*
+ * rename operation (recorded for the JSON manifest only)
+ */
+static struct dep_rename {
+	char *from;
+	char *to;
+} *renames = NULL;
+static int rename_count = 0;
+
+
+/*
+ * helper function: copy a string to allocated memory
+ */
+static char *
+copy_string(const char *s) {
+	char *cp = alloc(strlen(s) + 1);
+	strcpy(cp, s);
+	return cp;
+}
+
+
+/*
+ * helper function: get the entry of a path, creating it if necessary;
+ * *new_p is set if the entry did not exist yet
+ */
+static struct dep_entry *
+get_entry(const char *path, int *new_p) {
+	int i;
+	struct dep_entry *ep;
+	for (i = 0; i < entry_count; i++) {
+		if (! strcmp(entries[i].path, path)) {
+			*new_p = 0;
+			return entries + i;
+		}
+	}
+	entries = resize(entries, (entry_count + 1) *
+	    sizeof (struct dep_entry));
+	ep = entries + entry_count++;
+	ep->path = copy_string(path);
+	ep->flags = 0;
+	*new_p = 1;
+	return ep;
+}
+
+
+/*
+ * record an access to a host file (new_path is the new name of a
+ * renamed file and NULL otherwise)
+ */
+void
+dep_record(enum dep_kind kind, const char *path, const char *new_path) {
+	int is_new;
+	struct dep_entry *ep = get_entry(path, &is_new);
+	struct dep_rename *rp;
+	int was_new;
+	switch (kind) {
+	case DK_READ:
+		if (! (ep->flags & (DEP_READ | DEP_WRITTEN | DEP_NEW))) {
+			ep->flags |= DEP_READ;
+			cch_input(path);
+		}
+		break;
+	case DK_EXAMINED:
+		if (is_new) {
+			ep->flags |= DEP_EXAMINED;
+			cch_input(path);
+		}
+		break;
+	case DK_CREATED:
+		if (is_new || ep->flags == DEP_EXAMINED) ep->flags |= DEP_NEW;
+		/* FALLTHROUGH */
+	case DK_WRITTEN:
+		ep->flags |= DEP_WRITTEN;
+		ep->flags &= ~DEP_DELETED;
+		break;
+	case DK_DELETED:
+		ep->flags &= ~DEP_WRITTEN;
+		if (! (ep->flags & DEP_NEW)) ep->flags |= DEP_DELETED;
+		break;
+	case DK_RENAMED:
+		renames = resize(renames, (rename_count + 1) *
+		    sizeof (struct dep_rename));
+		rp = renames + rename_count++;
+		rp->from = copy_string(path);
+		rp->to = copy_string(new_path);
+		/*
+		 * the old name is gone, the new one has been created
+		 * (a file created under the old name stays a new file)
+		 */
+		was_new = ep->flags & DEP_NEW;
+		ep->flags &= ~DEP_WRITTEN;
+		if (! was_new) ep->flags |= DEP_DELETED;
+		ep = get_entry(new_path, &is_new);
+		if (was_new && (is_new || ep->flags == DEP_EXAMINED)) {
+			ep->flags |= DEP_NEW;
+		}
+		ep->flags |= DEP_WRITTEN;
+		ep->flags &= ~DEP_DELETED;
+		break;
+	}
+}
+
+
+/*
+ * get the paths of the inputs (DK_READ), outputs (DK_WRITTEN), or
+ * deleted files (DK_DELETED) one by one; *pos_p must be 0 on the first
+ * call. Returns NULL after the last path.
+ */
+const char *
+dep_next(enum dep_kind kind, int *pos_p) {
+	int flag = kind == DK_READ ? DEP_READ :
+	    (kind == DK_WRITTEN ? DEP_WRITTEN : DEP_DELETED);
+	while (*pos_p < entry_count) {
+		if (entries[(*pos_p)++].flags & flag) {
+			return entries[*pos_p - 1].path;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * helper function for write_make(): write a path, escaping the
+ * characters special to make
+ */
+static void
+put_make_path(FILE *fp, const char *path) {
+	const char *cp;
+	for (cp = path; *cp; cp++) {
+		if (*cp == '$') {
+			fputc('$', fp);
+		} else if (*cp == ' ' || *cp == '\t' || *cp == '#' ||
+		    *cp == ':' || *cp == '\\') {
+			fputc('\\', fp);
+		}
+		fputc(*cp, fp);
+	}
+}
+
+
+/*
+ * helper function for dep_exit(): write the list as a make rule with
+ * the outputs as targets and the inputs as prerequisites (files both
+ * read and written are targets only, to avoid circular dependencies);
+ * like the output of gcc -MP, every input gets an empty rule of its
+ * own, so that make does not fail if an input disappears. Deleted files
+ * are listed in a comment.
+ */
+static void
+write_make(FILE *fp) {
+	int i, n = 0;
+	for (i = 0; i < entry_count; i++) {
+		if (! (entries[i].flags & DEP_WRITTEN)) continue;
+		if (n++) fputs(" \\\n ", fp);
+		put_make_path(fp, entries[i].path);
+	}
+	if (! n) fputs(".PHONY", fp);
+	fputc(':', fp);
+	for (i = 0; i < entry_count; i++) {
+		if (! (entries[i].flags & DEP_READ) ||
+		    (entries[i].flags & DEP_WRITTEN)) continue;
+		fputs(" \\\n ", fp);
+		put_make_path(fp, entries[i].path);
+	}
+	fputc('\n', fp);
+	for (i = 0; i < entry_count; i++) {
+		if (! (entries[i].flags & DEP_READ) ||
+		    (entries[i].flags & DEP_WRITTEN)) continue;
+		fputc('\n', fp);
+		put_make_path(fp, entries[i].path);
+		fputs(":\n", fp);
+	}
+	for (i = n = 0; i < entry_count; i++) {
+		if (! (entries[i].flags & DEP_DELETED)) continue;
+		if (! n++) fputc('\n', fp);
+		fprintf(fp, "# deleted: %s\n", entries[i].path);
+	}
+}
+
+
+/*
+ * helper function for write_json(): write a path as a JSON string
+ */
+static void
+put_json_string(FILE *fp, const char *s) {
+	const unsigned char *cp;
+	fputc('"', fp);
+	for (cp = (const unsigned char *) s; *cp; cp++) {
+		if (*cp == '"' || *cp == '\\') {
+			fprintf(fp, "\\%c", *cp);
+		} else if (*cp < 0x20) {
+			fprintf(fp, "\\u%04x", *cp);
+		} else {
+			fputc(*cp, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+
+/*
+ * helper function for write_json(): write the paths of all entries
+ * with the flag set (and none of the excluded flags) as a JSON array
+ */
+static void
+put_json_list(FILE *fp, const char *key, int flag, int exclude) {
+	int i, n = 0;
+	fprintf(fp, "  \"%s\": [", key);
+	for (i = 0; i < entry_count; i++) {
+		if (! (entries[i].flags & flag) ||
+		    (entries[i].flags & exclude)) continue;
+		fputs(n++ ? ",\n    " : "\n    ", fp);
+		put_json_string(fp, entries[i].path);
+	}
+	fputs(n ? "\n  ]" : "]", fp);
+}
+
+
+/*
+ * helper function for dep_exit(): write the list as a JSON object with
+ * the arrays "inputs", "outputs", "deleted", and "renamed" (the latter
+ * containing objects with the members "from" and "to")
+ */
+static void
+write_json(FILE *fp) {
+	int i;
+	fputs("{\n", fp);
+	put_json_list(fp, "inputs", DEP_READ, 0);
+	fputs(",\n", fp);
+	put_json_list(fp, "outputs", DEP_WRITTEN, 0);
+	fputs(",\n", fp);
+	put_json_list(fp, "deleted", DEP_DELETED, 0);
+	fputs(",\n  \"renamed\": [", fp);
+	for (i = 0; i < rename_count; i++) {
+		fputs(i ? ",\n    { \"from\": " : "\n    { \"from\": ", fp);
+		put_json_string(fp, renames[i].from);
+		fputs(", \"to\": ", fp);
+		put_json_string(fp, renames[i].to);
+		fputs(" }", fp);
+	}
+	fputs(rename_count ? "\n  ]\n}\n" : "]\n}\n", fp);
+}
+
+
+/*
+ * write the dependency file (if one is configured) and release the
+ * list; returns (-1) if the file could not be written
+ */
+int
+dep_exit(void) {
+	int rc = 0, i;
+	FILE *fp;
+	if (conf_dep_file) {
+		fp = fopen(conf_dep_file, "w");
+		if (! fp) {
+			plog("cannot create dependency file %s: %s",
+			    conf_dep_file, strerror(errno));
+			rc = (-1);
+		} else {
+			if (conf_dep_format == DF_JSON) {
+				write_json(fp);
+			} else {
+				write_make(fp);
+			}
+			if (ferror(fp) | fclose(fp)) {
+				plog("cannot write dependency file %s: %s",
+				    conf_dep_file, strerror(errno));
+				rc = (-1);
+			}
+		}
+	}
+	for (i = 0; i < entry_count; i++) free(entries[i].path);
+	free(entries);
+	entries = NULL;
+	entry_count = 0;
+	for (i = 0; i < rename_count; i++) {
+		free(renames[i].from);
+		free(renames[i].to);
+	}
+	free(renames);
+	renames = NULL;
+	rename_count = 0;
+	return rc;
+}
@@ -0,0 +1,1010 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * Disk image drives access the files in a raw image of a CP/M 2.2 disk,
+ * described by a disk parameter block. The image holds the 128 byte
+ * sectors of the disk track by track, with the sectors of each track in
+ * physical order (logical sectors are translated by the skew factor).
+ * The directory is read once, when the drive is set up: the entries of
+ * user 0 are merged into files (which, like the files of RAM drives,
+ * are separate from their names), all other entries are kept unchanged.
+ * Data blocks are read and written through a block cache; the directory
+ * is rebuilt from the files and written back to the image whenever it
+ * has changed and a file is closed, deleted, or created.
+ */
+#define SECTOR_SIZE 128
+#define ENTRY_SIZE 32
+#define UNUSED_ENTRY 0xe5
+/*
+ * the allocation vector must fit into the emulated memory
+ */
+#define DSK_MAX_BLOCKS 512
+#define DSK_CACHE_BLOCKS 32
+
+
+/*
+ * a file: its blocks (0 for blocks not allocated) and its size in records
+ */
+struct dsk_file {
+	unsigned *blocks;
+	int block_count;
+	long records;
+	int links;
+	int opens;
+};
+
+
+/*
+ * name of a file in the directory of a disk image; fcb_name is the name
+ * in directory format (with the attribute bits)
+ */
+struct dsk_name {
+	struct dsk_name *next_p; /* next name in the same hash chain */
+	struct dsk_file *file_p;
+	int slot; /* position in the name array of the image */
+	unsigned char fcb_name[11];
+	char name[13];
+};
+
+
+/*
+ * cached data block
+ */
+struct dsk_block {
+	int block; /* (-1) if the cache slot is unused */
+	int dirty;
+	unsigned long used; /* for LRU replacement */
+	unsigned char *data;
+};
+
+
+/*
+ * state of a disk image drive
+ */
+#define DSK_HASH_SIZE 256
+static struct dsk_image {
+	int drive;
+	int fd;
+	int readonly;
+	time_t modify;
+	struct disk_format fmt;
+	int *xlat; /* sector translation table */
+	int records_per_block;
+	int pointers; /* block pointers per directory entry (8 or 16) */
+	int exm;
+	int dir_blocks;
+	unsigned char *dir; /* directory as read from the image */
+	unsigned char *kept; /* flags of directory entries kept unchanged */
+	int free_entries; /* entries available for the files of user 0 */
+	int entries; /* entries needed for the files of user 0 */
+	int dir_dirty;
+	unsigned char alv[DSK_MAX_BLOCKS / 8];
+	struct dsk_name *table[DSK_HASH_SIZE];
+	struct dsk_name **names;
+	int count;
+	int size;
+	struct dsk_block cache[DSK_CACHE_BLOCKS];
+	unsigned long clock;
+} *images[16];
+
+
+/*
+ * open files
+ */
+struct dsk_handle {
+	struct dsk_image *ip;
+	struct dsk_file *file_p;
+	int written;
+};
+static struct handle_table handles = HANDLE_TABLE_INITIALIZER;
+static struct pool handle_pool = POOL_INITIALIZER(struct dsk_handle);
+
+
+/*
+ * find the entry of a file name; returns the address of the pointer
+ * to the entry (which is NULL if there is no such file)
+ */
+static struct dsk_name **
+find_name(struct dsk_image *ip, const char *name) {
+	struct dsk_name **npp = ip->table + hash_name(name, DSK_HASH_SIZE);
+	while (*npp && strcmp((*npp)->name, name)) npp = &(*npp)->next_p;
+	return npp;
+}
+
+
+/*
+ * convert a name in directory format to a Unix file name (lower case,
+ * without blanks, and without the dot if there is no extension)
+ */
+static void
+unix_name(const unsigned char *fcb_name, char *name) {
+	int i;
+	char *cp = name;
+	for (i = 0; i < 8 && (fcb_name[i] & 0x7f) != ' '; i++) {
+		*cp++ = tolower(fcb_name[i] & 0x7f);
+	}
+	if ((fcb_name[8] & 0x7f) != ' ') {
+		*cp++ = '.';
+		for (i = 8; i < 11 && (fcb_name[i] & 0x7f) != ' '; i++) {
+			*cp++ = tolower(fcb_name[i] & 0x7f);
+		}
+	}
+	*cp = '\0';
+}
+
+
+/*
+ * convert a Unix file name to directory format
+ */
+static void
+fcb_name(const char *name, unsigned char *fcb_name) {
+	int i;
+	memset(fcb_name, ' ', 11);
+	for (i = 0; i < 8 && *name && *name != '.'; i++) {
+		fcb_name[i] = toupper((unsigned char) *name++);
+	}
+	while (*name && *name != '.') name++;
+	if (*name == '.') name++;
+	for (i = 8; i < 11 && *name; i++) {
+		fcb_name[i] = toupper((unsigned char) *name++);
+	}
+}
+
+
+/*
+ * number of directory entries a file needs: one for each group of
+ * blocks with at least one allocated block, and always one for the end
+ * of the file
+ */
+static int
+file_entries(const struct dsk_image *ip, const struct dsk_file *fp) {
+	long records_per_entry = (long) ip->pointers * ip->records_per_block;
+	int last, i, j, n = 0;
+	last = fp->records ? (int) ((fp->records - 1) / records_per_entry) : 0;
+	for (i = 0; i < last; i++) {
+		for (j = 0; j < ip->pointers; j++) {
+			if (i * ip->pointers + j < fp->block_count &&
+			    fp->blocks[i * ip->pointers + j]) {
+				n++;
+				break;
+			}
+		}
+	}
+	return n + 1;
+}
+
+
+/*
+ * add a name to the directory of an image
+ */
+static struct dsk_name *
+add_name(struct dsk_image *ip, struct dsk_name **npp,
+    const unsigned char *fcb_name_p, struct dsk_file *fp) {
+	struct dsk_name *np = alloc(sizeof (struct dsk_name));
+	memcpy(np->fcb_name, fcb_name_p, 11);
+	unix_name(fcb_name_p, np->name);
+	np->file_p = fp;
+	np->next_p = *npp;
+	*npp = np;
+	fp->links++;
+	if (ip->count == ip->size) {
+		ip->size = ip->size ? ip->size * 2 : 64;
+		ip->names = resize(ip->names,
+		    ip->size * sizeof (struct dsk_name *));
+	}
+	np->slot = ip->count;
+	ip->names[ip->count++] = np;
+	return np;
+}
+
+
+/*
+ * mark a block as used or free in the allocation vector
+ */
+static void
+set_block(struct dsk_image *ip, unsigned block, int used) {
+	unsigned char mask = 0x80 >> (block % 8);
+	if (used) {
+		ip->alv[block / 8] |= mask;
+	} else {
+		ip->alv[block / 8] &= ~mask;
+	}
+}
+
+
+/*
+ * release a file if it has neither names nor open handles, freeing its
+ * blocks
+ */
+static void
+release_file(struct dsk_image *ip, struct dsk_file *fp) {
+	int i;
+	if (fp->links || fp->opens) return;
+	for (i = 0; i < fp->block_count; i++) {
+		if (fp->blocks[i]) set_block(ip, fp->blocks[i], 0);
+	}
+	free(fp->blocks);
+	free(fp);
+}
+
+
+/*
+ * remove a name from the directory of an image
+ */
+static void
+remove_name(struct dsk_image *ip, struct dsk_name **npp) {
+	struct dsk_name *np = *npp;
+	struct dsk_file *fp = np->file_p;
+	*npp = np->next_p;
+	ip->names[np->slot] = ip->names[--ip->count];
+	ip->names[np->slot]->slot = np->slot;
+	free(np);
+	fp->links--;
+	release_file(ip, fp);
+}
+
+
+/*
+ * offset of a record of the data area in the image file
+ */
+static off_t
+record_offset(const struct dsk_image *ip, long record) {
+	long track = record / ip->fmt.spt + ip->fmt.off;
+	int sector = ip->xlat[record % ip->fmt.spt];
+	return ((off_t) track * ip->fmt.spt + sector) * SECTOR_SIZE;
+}
+
+
+/*
+ * read a data block from the image (missing sectors at the end of the
+ * image read as 0xe5, as on a freshly formatted disk)
+ */
+static int
+read_block(struct dsk_image *ip, int block, unsigned char *data) {
+	int i;
+	ssize_t n;
+	for (i = 0; i < ip->records_per_block; i++) {
+		n = HOST_CALL(pread(ip->fd, data + i * SECTOR_SIZE,
+		    SECTOR_SIZE, record_offset(ip,
+		    (long) block * ip->records_per_block + i)));
+		if (n == (-1)) return (-1);
+		memset(data + i * SECTOR_SIZE + n, UNUSED_ENTRY,
+		    SECTOR_SIZE - n);
+	}
+	return 0;
+}
+
+
+/*
+ * write a data block to the image
+ */
+static int
+write_block(struct dsk_image *ip, int block, const unsigned char *data) {
+	int i;
+	ssize_t n;
+	for (i = 0; i < ip->records_per_block; i++) {
+		n = HOST_CALL(pwrite(ip->fd, data + i * SECTOR_SIZE,
+		    SECTOR_SIZE, record_offset(ip,
+		    (long) block * ip->records_per_block + i)));
+		if (n == (-1)) return (-1);
+		if (n != SECTOR_SIZE) {
+			errno = EIO;
+			return (-1);
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * get a data block through the cache, replacing the least recently
+ * used block if it is not cached; a fresh block (just allocated) is
+ * not read from the image, but filled with zeros
+ */
+static unsigned char *
+get_block(struct dsk_image *ip, int block, int fresh) {
+	struct dsk_block *bp, *lru_p = ip->cache;
+	int i;
+	for (i = 0; i < DSK_CACHE_BLOCKS; i++) {
+		bp = ip->cache + i;
+		if (bp->block == block) goto found;
+		if (bp->used < lru_p->used) lru_p = bp;
+	}
+	bp = lru_p;
+	if (bp->block != (-1) && bp->dirty) {
+		if (write_block(ip, bp->block, bp->data)) return NULL;
+	}
+	bp->block = (-1);
+	bp->dirty = 0;
+	if (! fresh && read_block(ip, block, bp->data)) return NULL;
+	bp->block = block;
+found:
+	if (fresh) memset(bp->data, 0, ip->fmt.bls);
+	bp->used = ++ip->clock;
+	return bp->data;
+}
+
+
+/*
+ * mark a cached block as changed
+ */
+static void
+dirty_block(struct dsk_image *ip, int block) {
+	int i;
+	for (i = 0; i < DSK_CACHE_BLOCKS; i++) {
+		if (ip->cache[i].block == block) ip->cache[i].dirty = 1;
+	}
+}
+
+
+/*
+ * rebuild the directory from the files of user 0 and write it and all
+ * changed data blocks to the image
+ */
+static int
+sync_image(struct dsk_image *ip) {
+	long records_per_entry = (long) ip->pointers * ip->records_per_block;
+	int i, j, k, e = 0, last, used, x, drm = ip->fmt.drm;
+	long r;
+	unsigned b;
+	unsigned char *ep;
+	struct dsk_name *np;
+	struct dsk_file *fp;
+	struct dsk_block *bp;
+	for (i = 0; i < DSK_CACHE_BLOCKS; i++) {
+		bp = ip->cache + i;
+		if (bp->block == (-1) || ! bp->dirty) continue;
+		if (write_block(ip, bp->block, bp->data)) return (-1);
+		bp->dirty = 0;
+	}
+	if (! ip->dir_dirty) return 0;
+	ip->dir_dirty = 0;
+	for (i = 0; i <= drm; i++) {
+		if (! ip->kept[i]) {
+			memset(ip->dir + i * ENTRY_SIZE, UNUSED_ENTRY,
+			    ENTRY_SIZE);
+		}
+	}
+	for (k = 0; k < ip->count; k++) {
+		np = ip->names[k];
+		fp = np->file_p;
+		last = fp->records ?
+		    (int) ((fp->records - 1) / records_per_entry) : 0;
+		for (i = 0; i <= last; i++) {
+			/*
+			 * skip entries without blocks (except the last)
+			 */
+			for (j = used = 0; j < ip->pointers; j++) {
+				if (i * ip->pointers + j < fp->block_count &&
+				    fp->blocks[i * ip->pointers + j]) used = 1;
+			}
+			if (! used && i < last) continue;
+			while (e <= drm && ip->kept[e]) e++;
+			if (e > drm) {
+				plog("directory of %s is full",
+				    conf_drives[ip->drive]);
+				errno = ENOSPC;
+				return (-1);
+			}
+			ep = ip->dir + e++ * ENTRY_SIZE;
+			memset(ep, 0, ENTRY_SIZE);
+			memcpy(ep + 1, np->fcb_name, 11);
+			r = fp->records - i * records_per_entry;
+			if (r > records_per_entry) r = records_per_entry;
+			if (r > 0) {
+				x = (int) ((r - 1) / SECTOR_SIZE);
+				r -= x * SECTOR_SIZE;
+			} else {
+				x = 0;
+				r = 0;
+			}
+			x += i * (ip->exm + 1);
+			ep[12] = x & 0x1f;
+			ep[14] = (x >> 5) & 0x3f;
+			ep[15] = (unsigned char) r;
+			for (j = 0; j < ip->pointers; j++) {
+				b = (i * ip->pointers + j < fp->block_count) ?
+				    fp->blocks[i * ip->pointers + j] : 0;
+				if (ip->pointers == 16) {
+					ep[16 + j] = b;
+				} else {
+					ep[16 + j * 2] = b & 0xff;
+					ep[17 + j * 2] = (b >> 8) & 0xff;
+				}
+			}
+		}
+	}
+	for (i = 0; i < ip->dir_blocks; i++) {
+		if (write_block(ip, i, ip->dir + i * ip->fmt.bls)) return (-1);
+	}
+	return 0;
+}
+
+
+/*
+ * merge a directory entry of user 0 into the files; returns (-1) if the
+ * entry must be kept unchanged (because its name clashes with a name
+ * differing only in case)
+ */
+static int
+merge_entry(struct dsk_image *ip, const unsigned char *ep) {
+	struct dsk_name **npp, *np;
+	struct dsk_file *fp;
+	unsigned char name[11];
+	char temp[13];
+	int i, x, first;
+	long records;
+	unsigned b;
+	for (i = 0; i < 11; i++) name[i] = ep[1 + i];
+	unix_name(name, temp);
+	npp = find_name(ip, temp);
+	np = *npp;
+	if (np) {
+		for (i = 0; i < 11; i++) {
+			if ((np->fcb_name[i] & 0x7f) != (name[i] & 0x7f)) {
+				return (-1);
+			}
+		}
+		fp = np->file_p;
+	} else {
+		fp = alloc(sizeof (struct dsk_file));
+		memset(fp, 0, sizeof (struct dsk_file));
+		np = add_name(ip, npp, name, fp);
+	}
+	/*
+	 * position of the entry in the file, from the extent number
+	 */
+	x = (ep[14] & 0x3f) * 32 + (ep[12] & 0x1f);
+	first = x / (ip->exm + 1) * ip->pointers;
+	if (first + ip->pointers > fp->block_count) {
+		fp->blocks = resize(fp->blocks,
+		    (first + ip->pointers) * sizeof (unsigned));
+		memset(fp->blocks + fp->block_count, 0,
+		    (first + ip->pointers - fp->block_count) *
+		    sizeof (unsigned));
+		fp->block_count = first + ip->pointers;
+	}
+	for (i = 0; i < ip->pointers; i++) {
+		if (ip->pointers == 16) {
+			b = ep[16 + i];
+		} else {
+			b = ep[16 + i * 2] | (ep[17 + i * 2] << 8);
+		}
+		if (b < (unsigned) ip->dir_blocks ||
+		    b > (unsigned) ip->fmt.dsm) b = 0;
+		fp->blocks[first + i] = b;
+		if (b) set_block(ip, b, 1);
+	}
+	records = (long) x * SECTOR_SIZE +
+	    (ep[15] > SECTOR_SIZE ? SECTOR_SIZE : ep[15]);
+	if (records > fp->records) fp->records = records;
+	return 0;
+}
+
+
+/*
+ * set up a disk image drive: open the image, read its directory, and
+ * build the files and the allocation vector
+ */
+int
+dsk_init(int drive) {
+	struct dsk_image *ip;
+	const struct disk_format *dfp = conf_disk_format + drive;
+	struct stat s;
+	unsigned char *ep;
+	unsigned b;
+	int i, j, *used = NULL, rc = (-1);
+	ip = images[drive] = alloc(sizeof (struct dsk_image));
+	memset(ip, 0, sizeof (struct dsk_image));
+	ip->drive = drive;
+	ip->fd = (-1);
+	ip->fmt = *dfp;
+	for (i = 0; i < DSK_CACHE_BLOCKS; i++) ip->cache[i].block = (-1);
+	/*
+	 * check the disk parameters and derive the rest of the disk
+	 * parameter block
+	 */
+	ip->records_per_block = dfp->bls / SECTOR_SIZE;
+	ip->pointers = dfp->dsm < 256 ? 16 : 8;
+	ip->exm = dfp->bls * ip->pointers / 16384 - 1;
+	ip->dir_blocks = ((dfp->drm + 1) * ENTRY_SIZE + dfp->bls - 1) /
+	    dfp->bls;
+	if (dfp->spt < 1 || dfp->skew < 0 || dfp->skew >= dfp->spt ||
+	    dfp->off < 0 || ip->exm < 0 || dfp->dsm >= DSK_MAX_BLOCKS ||
+	    ip->dir_blocks > 16 || dfp->dsm < ip->dir_blocks ||
+	    (dfp->bls & (dfp->bls - 1))) {
+		perr("invalid disk parameters for drive %c", 'A' + drive);
+		goto premature_exit;
+	}
+	ip->xlat = alloc(dfp->spt * sizeof (int));
+	used = alloc(dfp->spt * sizeof (int));
+	memset(used, 0, dfp->spt * sizeof (int));
+	for (i = j = 0; i < dfp->spt; i++) {
+		while (used[j]) j = (j + 1) % dfp->spt;
+		ip->xlat[i] = j;
+		used[j] = 1;
+		j = (j + (dfp->skew ? dfp->skew : 1)) % dfp->spt;
+	}
+	/*
+	 * open the image (an image which cannot be written makes the
+	 * drive read only)
+	 */
+	ip->readonly = conf_readonly[drive];
+	if (! ip->readonly) {
+		ip->fd = open(conf_drives[drive], O_RDWR | O_CLOEXEC);
+	}
+	if (ip->readonly || (ip->fd == (-1) &&
+	    (errno == EACCES || errno == EROFS))) {
+		ip->readonly = conf_readonly[drive] = 1;
+		ip->fd = open(conf_drives[drive], O_RDONLY | O_CLOEXEC);
+	}
+	if (ip->fd == (-1) || fstat(ip->fd, &s) == (-1)) {
+		perr("cannot open image %s of drive %c: %s",
+		    conf_drives[drive], 'A' + drive, strerror(errno));
+		goto premature_exit;
+	}
+	ip->modify = s.st_mtime;
+	for (i = 0; i < DSK_CACHE_BLOCKS; i++) {
+		ip->cache[i].data = alloc(dfp->bls);
+	}
+	/*
+	 * read the directory
+	 */
+	ip->dir = alloc(ip->dir_blocks * dfp->bls);
+	for (i = 0; i < ip->dir_blocks; i++) {
+		if (read_block(ip, i, ip->dir + i * dfp->bls)) {
+			perr("cannot read image %s of drive %c: %s",
+			    conf_drives[drive], 'A' + drive,
+			    strerror(errno));
+			goto premature_exit;
+		}
+		set_block(ip, i, 1);
+	}
+	ip->kept = alloc(dfp->drm + 1);
+	memset(ip->kept, 0, dfp->drm + 1);
+	ip->free_entries = dfp->drm + 1;
+	for (i = 0; i <= dfp->drm; i++) {
+		ep = ip->dir + i * ENTRY_SIZE;
+		if (ep[0] == UNUSED_ENTRY) continue;
+		if (ep[0] == 0 && merge_entry(ip, ep) == 0) continue;
+		/*
+		 * entries of other users (and labels etc.) are kept; the
+		 * blocks of files are marked as used
+		 */
+		ip->kept[i] = 1;
+		ip->free_entries--;
+		if (ep[0] > 15) continue;
+		for (j = 0; j < ip->pointers; j++) {
+			if (ip->pointers == 16) {
+				b = ep[16 + j];
+			} else {
+				b = ep[16 + j * 2] | (ep[17 + j * 2] << 8);
+			}
+			if (b && b <= (unsigned) dfp->dsm) set_block(ip, b, 1);
+		}
+	}
+	for (i = 0; i < ip->count; i++) {
+		ip->entries += file_entries(ip, ip->names[i]->file_p);
+	}
+	rc = 0;
+premature_exit:
+	free(used);
+	return rc;
+}
+
+
+/*
+ * open a file of a disk image drive; flags are O_RDONLY or O_RDWR,
+ * optionally combined with O_CREAT and O_EXCL to create a new file.
+ * Returns a handle or (-1) with errno set like open(2).
+ */
+static int
+dsk_open(int drive, const char *name, int flags) {
+	struct dsk_image *ip = images[drive];
+	struct dsk_name **npp = find_name(ip, name);
+	struct dsk_file *fp;
+	unsigned char temp[11];
+	struct dsk_handle *hp;
+	if (*npp) {
+		if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+			errno = EEXIST;
+			return (-1);
+		}
+		fp = (*npp)->file_p;
+	} else {
+		if (! (flags & O_CREAT)) {
+			errno = ENOENT;
+			return (-1);
+		}
+		if (ip->readonly) {
+			errno = EROFS;
+			return (-1);
+		}
+		if (ip->entries >= ip->free_entries) {
+			errno = ENOSPC;
+			return (-1);
+		}
+		fp = alloc(sizeof (struct dsk_file));
+		memset(fp, 0, sizeof (struct dsk_file));
+		fcb_name(name, temp);
+		add_name(ip, npp, temp, fp);
+		ip->entries++;
+		ip->dir_dirty = 1;
+		if (sync_image(ip)) return (-1);
+	}
+	if ((flags & O_ACCMODE) != O_RDONLY && ip->readonly) {
+		errno = EACCES;
+		return (-1);
+	}
+	hp = pool_get(&handle_pool);
+	hp->ip = ip;
+	hp->file_p = fp;
+	hp->written = 0;
+	fp->opens++;
+	return handle_add(&handles, hp);
+}
+
+
+/*
+ * close a file handle; the directory and the data of a file which has
+ * been written to are written back to the image
+ */
+static int
+dsk_close(int handle) {
+	struct dsk_handle *hp = handle_get(&handles, handle);
+	struct dsk_image *ip;
+	struct dsk_file *fp;
+	int rc = 0;
+	if (! hp) return (-1);
+	ip = hp->ip;
+	fp = hp->file_p;
+	if (hp->written) rc = sync_image(ip);
+	handle_remove(&handles, handle);
+	pool_put(&handle_pool, hp);
+	fp->opens--;
+	release_file(ip, fp);
+	return rc;
+}
+
+
+/*
+ * read from a handle at an offset (relative to the start of the file);
+ * unallocated blocks read as zeros
+ */
+static ssize_t
+dsk_pread(int handle, void *buffer, size_t n, off_t offset) {
+	struct dsk_handle *hp = handle_get(&handles, handle);
+	struct dsk_image *ip;
+	struct dsk_file *fp;
+	unsigned char *bp = buffer, *data;
+	off_t size;
+	size_t t, k;
+	int index;
+	if (! hp) return (-1);
+	if (offset < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	ip = hp->ip;
+	fp = hp->file_p;
+	size = (off_t) fp->records * SECTOR_SIZE;
+	if (offset >= size) return 0;
+	if ((off_t) n > size - offset) n = (size_t) (size - offset);
+	for (t = 0; t < n; t += k) {
+		index = (int) (offset / ip->fmt.bls);
+		k = ip->fmt.bls - (size_t) (offset % ip->fmt.bls);
+		if (k > n - t) k = n - t;
+		if (index < fp->block_count && fp->blocks[index]) {
+			data = get_block(ip, fp->blocks[index], 0);
+			if (! data) return (-1);
+			memcpy(bp + t, data + offset % ip->fmt.bls, k);
+		} else {
+			memset(bp + t, 0, k);
+		}
+		offset += k;
+	}
+	return n;
+}
+
+
+/*
+ * extend a file for a write: allocate its block at a given index (if
+ * necessary) and raise its size to the given number of records; returns
+ * 1 if a block has been allocated, 0 if not, and (-1) with errno set to
+ * ENOSPC if the disk or its directory is full
+ */
+static int
+grow_file(struct dsk_image *ip, struct dsk_file *fp, int index,
+    long records) {
+	unsigned b = 0;
+	int before, after;
+	long old_records = fp->records;
+	if (index >= fp->block_count) {
+		fp->blocks = resize(fp->blocks,
+		    (index + 1) * sizeof (unsigned));
+		memset(fp->blocks + fp->block_count, 0,
+		    (index + 1 - fp->block_count) * sizeof (unsigned));
+		fp->block_count = index + 1;
+	}
+	if (! fp->blocks[index]) {
+		for (b = ip->dir_blocks; b <= (unsigned) ip->fmt.dsm; b++) {
+			if (! (ip->alv[b / 8] & (0x80 >> (b % 8)))) break;
+		}
+		if (b > (unsigned) ip->fmt.dsm) {
+			errno = ENOSPC;
+			return (-1);
+		}
+	}
+	if (! b && records <= old_records) return 0;
+	/*
+	 * the directory must have room for the grown file
+	 */
+	before = file_entries(ip, fp);
+	if (b) fp->blocks[index] = b;
+	if (records > old_records) fp->records = records;
+	after = file_entries(ip, fp);
+	if (ip->entries + (after - before) * fp->links > ip->free_entries) {
+		if (b) fp->blocks[index] = 0;
+		fp->records = old_records;
+		errno = ENOSPC;
+		return (-1);
+	}
+	ip->entries += (after - before) * fp->links;
+	if (b) set_block(ip, b, 1);
+	ip->dir_dirty = 1;
+	return b != 0;
+}
+
+
+/*
+ * write to a handle at an offset; the file size is rounded up to whole
+ * records
+ */
+static ssize_t
+dsk_pwrite(int handle, const void *buffer, size_t n, off_t offset) {
+	struct dsk_handle *hp = handle_get(&handles, handle);
+	struct dsk_image *ip;
+	struct dsk_file *fp;
+	const unsigned char *bp = buffer;
+	unsigned char *data;
+	size_t t, k;
+	int index, fresh;
+	if (! hp) return (-1);
+	if (offset < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	ip = hp->ip;
+	fp = hp->file_p;
+	for (t = 0; t < n; t += k) {
+		index = (int) (offset / ip->fmt.bls);
+		k = ip->fmt.bls - (size_t) (offset % ip->fmt.bls);
+		if (k > n - t) k = n - t;
+		fresh = grow_file(ip, fp, index, (long) ((offset + k +
+		    SECTOR_SIZE - 1) / SECTOR_SIZE));
+		if (fresh == (-1)) return t ? (ssize_t) t : (-1);
+		data = get_block(ip, fp->blocks[index], fresh);
+		if (! data) return t ? (ssize_t) t : (-1);
+		memcpy(data + offset % ip->fmt.bls, bp + t, k);
+		dirty_block(ip, fp->blocks[index]);
+		offset += k;
+		hp->written = 1;
+	}
+	return n;
+}
+
+
+/*
+ * get the attributes of a file: files are regular files, their time
+ * stamps are the modification time of the image
+ */
+static int
+dsk_stat(int drive, const char *name, struct stat *sp) {
+	struct dsk_image *ip = images[drive];
+	struct dsk_name *np = *find_name(ip, name);
+	if (! np) {
+		errno = ENOENT;
+		return (-1);
+	}
+	memset(sp, 0, sizeof (struct stat));
+	sp->st_mode = S_IFREG | 0666;
+	sp->st_size = (off_t) np->file_p->records * SECTOR_SIZE;
+	sp->st_atime = sp->st_mtime = ip->modify;
+	return 0;
+}
+
+
+/*
+ * delete a name of a file; the blocks of the file are freed when it has
+ * neither names nor open handles
+ */
+static int
+dsk_unlink(int drive, const char *name) {
+	struct dsk_image *ip = images[drive];
+	struct dsk_name **npp = find_name(ip, name);
+	if (! *npp) {
+		errno = ENOENT;
+		return (-1);
+	}
+	if (ip->readonly) {
+		errno = EROFS;
+		return (-1);
+	}
+	ip->entries -= file_entries(ip, (*npp)->file_p);
+	remove_name(ip, npp);
+	ip->dir_dirty = 1;
+	return sync_image(ip);
+}
+
+
+/*
+ * add a new name for a file (the old name is deleted afterwards when a
+ * file is renamed, so the directory is not written here)
+ */
+static int
+dsk_link(int drive, const char *old_name, const char *new_name) {
+	struct dsk_image *ip = images[drive];
+	struct dsk_name *np = *find_name(ip, old_name), **npp;
+	unsigned char temp[11];
+	if (! np) {
+		errno = ENOENT;
+		return (-1);
+	}
+	npp = find_name(ip, new_name);
+	if (*npp) {
+		errno = EEXIST;
+		return (-1);
+	}
+	if (ip->readonly) {
+		errno = EROFS;
+		return (-1);
+	}
+	fcb_name(new_name, temp);
+	add_name(ip, npp, temp, np->file_p);
+	ip->entries += file_entries(ip, np->file_p);
+	ip->dir_dirty = 1;
+	return 0;
+}
+
+
+/*
+ * list the files of a drive
+ */
+static const char *
+dsk_next_name(int drive, int *pos_p) {
+	struct dsk_image *ip = images[drive];
+	if (*pos_p >= ip->count) return NULL;
+	return ip->names[(*pos_p)++]->name;
+}
+
+
+/*
+ * operations on the files of disk image drives
+ */
+const struct drive_ops dsk_ops = {
+	dsk_open, dsk_stat, dsk_unlink, dsk_link, dsk_next_name,
+	dsk_pread, dsk_pwrite, dsk_close
+};
+
+
+/*
+ * get the disk parameter block of a drive in CP/M format (15 bytes)
+ */
+void
+dsk_dpb(int drive, unsigned char *dpb) {
+	const struct dsk_image *ip = images[drive];
+	int bsh, al, cks = (ip->fmt.drm + 1) / 4;
+	for (bsh = 0; (SECTOR_SIZE << bsh) < ip->fmt.bls; bsh++);
+	al = (0xffff << (16 - ip->dir_blocks)) & 0xffff;
+	dpb[0] = ip->fmt.spt & 0xff;
+	dpb[1] = (ip->fmt.spt >> 8) & 0xff;
+	dpb[2] = bsh;
+	dpb[3] = ip->records_per_block - 1;
+	dpb[4] = ip->exm;
+	dpb[5] = ip->fmt.dsm & 0xff;
+	dpb[6] = (ip->fmt.dsm >> 8) & 0xff;
+	dpb[7] = ip->fmt.drm & 0xff;
+	dpb[8] = (ip->fmt.drm >> 8) & 0xff;
+	dpb[9] = (al >> 8) & 0xff;
+	dpb[10] = al & 0xff;
+	dpb[11] = cks & 0xff;
+	dpb[12] = (cks >> 8) & 0xff;
+	dpb[13] = ip->fmt.off & 0xff;
+	dpb[14] = (ip->fmt.off >> 8) & 0xff;
+}
+
+
+/*
+ * get the allocation vector of a drive in CP/M format (one bit per
+ * block, most significant bit first); size is the size of the buffer
+ */
+void
+dsk_alv(int drive, unsigned char *alv, size_t size) {
+	const struct dsk_image *ip = images[drive];
+	size_t n = (size_t) (ip->fmt.dsm + 8) / 8;
+	if (n > size) n = size;
+	memcpy(alv, ip->alv, n);
+	memset(alv + n, 0, size - n);
+}
+
+
+/*
+ * write back and release the disk image drives (open handles must have
+ * been closed before)
+ */
+int
+dsk_exit(void) {
+	int i, j, rc = 0;
+	struct dsk_image *ip;
+	for (i = 0; i < 16; i++) {
+		ip = images[i];
+		if (! ip) continue;
+		if (ip->fd != (-1) && ! ip->readonly && sync_image(ip)) {
+			plog("cannot write image %s: %s", conf_drives[i],
+			    strerror(errno));
+			rc = (-1);
+		}
+		while (ip->count) {
+			remove_name(ip, find_name(ip,
+			    ip->names[ip->count - 1]->name));
+		}
+		if (ip->fd != (-1)) close(ip->fd);
+		for (j = 0; j < DSK_CACHE_BLOCKS; j++) {
+			free(ip->cache[j].data);
+		}
+		free(ip->names);
+		free(ip->xlat);
+		free(ip->dir);
+		free(ip->kept);
+		free(ip);
+		images[i] = NULL;
+	}
+	free_handles(&handles);
+	free_pool(&handle_pool);
+	return rc;
+}
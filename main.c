@@ -42,11 +42,21 @@
 #include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 
 #include "tnylpo.h"
 
 
+/*
+ * exit statuses for programs terminated by exceeding a resource limit
+ */
+#define EXIT_INSTRLIMIT 2
+#define EXIT_TIMELIMIT 3
+#define EXIT_OUTPUTLIMIT 4
+#define EXIT_FILELIMIT 5
+
+
 /*
  * program name for error messages
  */
@@ -182,7 +192,14 @@ usage(void) {
 	perr("    -e [h][b<bytes>|p<pages>|r[<addr>]-<addr>]:<fn>");
 	perr("                     save memory to file <fn> after execution");
 	perr("    -f <fn>          read configuration from file <fn>");
+	perr("    -k <n>           run reference CPU core in lockstep, "
+	    "compare memory");
+	perr("                     every <n> instructions");
 	perr("    -l (<n>|@)       number of full screen mode lines *");
+	perr("    -m {i<n>|t<s>|o<bytes>|f<n>|d<n>}[,...]");
+	perr("                     limit instructions, seconds, output, "
+	    "open files,");
+	perr("                     host file descriptors");
 	perr("    -n               never actually close files");
 	perr("    -o (n|y|[y,]<fg>,<bg>)");
 	perr("                     use colors *");
@@ -191,6 +208,8 @@ usage(void) {
 	perr("    -t (<n>|@)       delay before exiting full screen mode *");
 	perr("    -v <level>       set log level");
 	perr("    -w               use alternate function keys *");
+	perr("    -x <epoch>       deterministic execution, clock starts "
+	    "at <epoch>");
 	perr("    -y (n|<n>,<ns>)  add <ns> nanoseconds delay every <n> "
 	    "instructions");
 	perr("    -z {a|e|i|n|s|x} set dump options");
@@ -270,6 +289,71 @@ parse_delay(int *count_p, int *nanoseconds_p) {
 }
 
 
+/*
+ * parse the argument of the -m option: a comma separated list of
+ * resource limits, each consisting of a letter (i for instructions,
+ * t for seconds of wall-clock time, o for bytes of output, f for open
+ * files, d for host file descriptors) immediately followed by a decimal
+ * number
+ */
+static int
+parse_limits(void) {
+	int rc = 0, c;
+	unsigned long long ull;
+	long long *ll_p = NULL;
+	int *int_p = NULL;
+	const char *cp = optarg;
+	char *rp;
+	for (;;) {
+		c = *cp++;
+		switch (c) {
+		case 'i': ll_p = &conf_limit_instructions; break;
+		case 't': int_p = &conf_limit_time; break;
+		case 'o': ll_p = &conf_limit_output; break;
+		case 'f': int_p = &conf_limit_files; break;
+		case 'd': int_p = &conf_limit_descriptors; break;
+		default:
+			perr("option -m: invalid limit");
+			rc = (-1);
+			goto premature_exit;
+		}
+		if ((ll_p && *ll_p != (-1)) || (int_p && *int_p != (-1))) {
+			perr("option -m: limit %c may be specified only once",
+			    c);
+			rc = (-1);
+			goto premature_exit;
+		}
+		if (! isdigit(*cp)) {
+			perr("option -m: number expected");
+			rc = (-1);
+			goto premature_exit;
+		}
+		ull = strtoull(cp, &rp, 10);
+		cp = rp;
+		if (ull < 1 || ull > (int_p ? INT_MAX : LLONG_MAX)) {
+			perr("option -m: limit %c out of range", c);
+			rc = (-1);
+			goto premature_exit;
+		}
+		if (int_p) {
+			*int_p = (int) ull;
+		} else {
+			*ll_p = (long long) ull;
+		}
+		ll_p = NULL;
+		int_p = NULL;
+		if (! *cp) break;
+		if (*cp++ != ',') {
+			perr("option -m: comma expected");
+			rc = (-1);
+			goto premature_exit;
+		}
+	}
+premature_exit:
+	return rc;
+}
+
+
 /*
  * helper function for parse_save()
  */
@@ -570,14 +654,15 @@ premature_exit:
  */
 static int
 get_config(int argc, char **argv) {
-	int rc = 0, opt, i;
+	int rc = 0, opt, i, limits_set = 0;
 	char *cfn = NULL, *cp;
 	static const char valid_drives[] = "abcdefghijklmnop";
 	size_t l;
 	unsigned long ul;
+	unsigned long long ull;
 	opterr = 0;
 	while ((opt = getopt(argc, argv,
-	    "abc:d:e:f:l:no:rst:v:wy:z:")) != EOF) {
+	    "abc:d:e:f:k:l:m:no:rst:v:wx:y:z:")) != EOF) {
 		switch (opt) {
 		case 'a':
 			/*
@@ -734,6 +819,56 @@ get_config(int argc, char **argv) {
 				}
 			}
 			break;
+		case 'k':
+			/*
+			 * enable the lockstep checker; the parameter is the
+			 * number of instructions between memory comparisons
+			 */
+			if (conf_lockstep != (-1)) {
+				only_once('k');
+				rc = (-1);
+			} else {
+				ul = strtoul(optarg, &cp, 10);
+				if (*cp || ul < 1 || ul > INT_MAX) {
+					perr("invalid lockstep interval");
+					rc = (-1);
+				} else {
+					conf_lockstep = (int) ul;
+				}
+			}
+			break;
+		case 'm':
+			/*
+			 * set resource limits for the program run
+			 */
+			if (limits_set) {
+				only_once('m');
+				rc = (-1);
+			} else {
+				limits_set = 1;
+				if (parse_limits()) rc = (-1);
+			}
+			break;
+		case 'x':
+			/*
+			 * deterministic execution; the parameter is the
+			 * Unix time the emulated clock starts at
+			 */
+			if (conf_epoch != (-1)) {
+				only_once('x');
+				rc = (-1);
+			} else {
+				errno = 0;
+				ull = strtoull(optarg, &cp, 10);
+				if (! isdigit(*optarg) || *cp ||
+				    errno == ERANGE || ull > LLONG_MAX) {
+					perr("invalid deterministic epoch");
+					rc = (-1);
+				} else {
+					conf_epoch = (long long) ull;
+				}
+			}
+			break;
 		case 'y':
 			/*
 			 * set CPU delay
@@ -927,6 +1062,14 @@ get_config(int argc, char **argv) {
 	 * close files by default
 	 */
 	if (dont_close == (-1)) dont_close = 0;
+	/*
+	 * access disk files by system calls by default
+	 */
+	if (conf_map_files == (-1)) conf_map_files = 0;
+	/*
+	 * don't prefetch files by default
+	 */
+	if (conf_prefetch == (-1)) conf_prefetch = 0;
 	/*
 	 * use VT52 cursor keys by default
 	 */
@@ -945,6 +1088,26 @@ get_config(int argc, char **argv) {
 	 * default mode is batch
 	 */
 	if (conf_interactive == (-1)) conf_interactive = 0;
+	/*
+	 * by default, there are no resource limits
+	 */
+	if (conf_limit_instructions == (-1)) conf_limit_instructions = 0;
+	if (conf_limit_time == (-1)) conf_limit_time = 0;
+	if (conf_limit_output == (-1)) conf_limit_output = 0;
+	if (conf_limit_files == (-1)) conf_limit_files = 0;
+	/*
+	 * by default, the descriptor pool size is derived from the
+	 * descriptor limit of the process
+	 */
+	if (conf_limit_descriptors == (-1)) conf_limit_descriptors = 0;
+	/*
+	 * by default, written data is passed to the host on close
+	 */
+	if (conf_durability == DUR_UNSET) conf_durability = DUR_CLOSE;
+	/*
+	 * by default, the directory index is updated by inotify
+	 */
+	if (conf_dircache == DC_UNSET) conf_dircache = DC_INOTIFY;
 premature_exit:
 	return rc;
 }
@@ -995,6 +1158,10 @@ main(int argc, char **argv) {
 			rc = (-1);
 			goto premature_exit;
 		}
+		/*
+		 * commands of streams must not inherit the log file
+		 */
+		fcntl(fileno(log_fp), F_SETFD, FD_CLOEXEC);
 		if (log_level > LL_ERRORS) plog("log opened");
 	}
 	/*
@@ -1010,8 +1177,12 @@ main(int argc, char **argv) {
 		/*
 		 * run program in emulated environment;
 		 * errors are indicated by the return
-		 * code of cpu_exit();
+		 * code of cpu_exit(); if the result of
+		 * the program was found in the result
+		 * cache, only its console output is
+		 * replayed
 		 */
+		cch_replay();
 		cpu_run();
 		/*
 		 * clean up console
@@ -1038,6 +1209,19 @@ premature_exit:
 			rc = (-1);
 		}
 	}
+	/*
+	 * exceeding a resource limit is reported by an exit status of
+	 * its own, allowing batch schedulers to react
+	 */
+	if (rc) {
+		switch (term_reason) {
+		case ERR_INSTRLIMIT: exit(EXIT_INSTRLIMIT);
+		case ERR_TIMELIMIT: exit(EXIT_TIMELIMIT);
+		case ERR_OUTPUTLIMIT: exit(EXIT_OUTPUTLIMIT);
+		case ERR_FILELIMIT: exit(EXIT_FILELIMIT);
+		default: break;
+		}
+	}
 	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
 	return 0;
 }
@@ -46,6 +46,11 @@
 #include <dirent.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "tnylpo.h"
 
@@ -99,12 +104,34 @@ static int current_user = 0;
 static int read_only[16];
 
 
+/*
+ * directory file descriptors of the drives (opened by os_init()); all
+ * files of a drive are accessed relative to them
+ */
+static int drive_fd[16] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+
+/*
+ * maximum length of a Unix file name derived from a CP/M file name
+ */
+#define L_UNIX_NAME (MB_LEN_MAX * 12 + 1)
+
+
 /*
  * current DMA area
  */
 static int current_dma = DEFAULT_DMA;
 
 
+/*
+ * number of records transferred by the read and write functions
+ * (set by the CP/M 3 function Set Multi-Sector Count)
+ */
+static int multi_sector_count = 1;
+
+
 /*
  * OS serial number
  */
@@ -123,6 +150,32 @@ static const unsigned char serial_number[6] = {
 static int program_return_code = 0;
 
 
+/*
+ * deterministic mode: the clock advances by one second every
+ * VIRTUAL_IPS instructions and by the delays requested by the program,
+ * which are not actually performed (virtual_delay is in milliseconds)
+ */
+#define VIRTUAL_IPS 1000000
+static unsigned long long virtual_delay = 0;
+
+
+/*
+ * statistics for tnylpo-bench: number of records transferred by the
+ * file I/O and directory search functions and number of host file
+ * system calls made
+ */
+unsigned long long record_count = 0;
+unsigned long long host_call_count = 0;
+
+
+/*
+ * resource limits: bytes written to disk files and the console so far,
+ * number of files currently open
+ */
+unsigned long long output_count = 0;
+static int open_files = 0;
+
+
 /*
  * helper function: get word from DE
  */
@@ -444,158 +497,279 @@ premature_exit:
 
 
 /*
- * type of a file list
+ * access files of host directory drives by name: if the *at() functions
+ * are available, names are resolved relative to the directory file
+ * descriptor of the drive, otherwise the path of the file is assembled
  */
-struct file_list {
-	/*
-	 * size of file *in CP/M records of 128 bytes*
-	 */
-	off_t size;
-	/*
-	 * file access time
-	 */
-	time_t access;
-	/*
-	 * file modification time
-	 */
-	time_t modify;
-	struct file_list *next_p;
-	char *name;
+#ifndef AT_FDCWD
+static char *
+drive_path(int drive, const char *name) {
+	char *path = alloc(strlen(conf_drives[drive]) + strlen(name) + 2);
+	sprintf(path, "%s/%s", conf_drives[drive], name);
+	return path;
+}
+#endif
+
+
+static int
+dir_open(int drive, const char *name, int flags) {
+#ifdef AT_FDCWD
+	return HOST_CALL(openat(drive_fd[drive], name, flags | O_CLOEXEC,
+	    0666));
+#else
+	int fd, e;
+	char *path = drive_path(drive, name);
+	fd = HOST_CALL(open(path, flags | O_CLOEXEC, 0666));
+	e = errno;
+	free(path);
+	errno = e;
+	return fd;
+#endif
+}
+
+
+static int
+dir_stat(int drive, const char *name, struct stat *sp) {
+#ifdef AT_FDCWD
+	return HOST_CALL(fstatat(drive_fd[drive], name, sp,
+	    AT_SYMLINK_NOFOLLOW));
+#else
+	int rc, e;
+	char *path = drive_path(drive, name);
+	rc = HOST_CALL(lstat(path, sp));
+	e = errno;
+	free(path);
+	errno = e;
+	return rc;
+#endif
+}
+
+
+static int
+dir_unlink(int drive, const char *name) {
+#ifdef AT_FDCWD
+	return HOST_CALL(unlinkat(drive_fd[drive], name, 0));
+#else
+	int rc, e;
+	char *path = drive_path(drive, name);
+	rc = HOST_CALL(unlink(path));
+	e = errno;
+	free(path);
+	errno = e;
+	return rc;
+#endif
+}
+
+
+static int
+dir_link(int drive, const char *old_name, const char *new_name) {
+#ifdef AT_FDCWD
+	return HOST_CALL(linkat(drive_fd[drive], old_name, drive_fd[drive],
+	    new_name, 0));
+#else
+	int rc, e;
+	char *old_path = drive_path(drive, old_name);
+	char *new_path = drive_path(drive, new_name);
+	rc = HOST_CALL(link(old_path, new_path));
+	e = errno;
+	free(old_path);
+	free(new_path);
+	errno = e;
+	return rc;
+#endif
+}
+
+
+/*
+ * positioned reads and writes and closing of host files, counted as
+ * host system calls (the file operations of host directory and overlay
+ * drives)
+ */
+ssize_t
+host_pread(int fd, void *buffer, size_t n, off_t offset) {
+	return HOST_CALL(pread(fd, buffer, n, offset));
+}
+
+
+ssize_t
+host_pwrite(int fd, const void *buffer, size_t n, off_t offset) {
+	return HOST_CALL(pwrite(fd, buffer, n, offset));
+}
+
+
+int
+host_close(int fd) {
+	return HOST_CALL(close(fd));
+}
+
+
+/*
+ * operations on the files of host directory drives (which are listed
+ * by reading the directory)
+ */
+static const struct drive_ops dir_ops = {
+	dir_open, dir_stat, dir_unlink, dir_link, NULL,
+	host_pread, host_pwrite, host_close
 };
 
 
 /*
- * deallocate a file list
+ * operations of the kinds of drives, indexed by enum drive_type
  */
-static void
-free_filelist(struct file_list *flp) {
-	struct file_list *tp;
-	while (flp) {
-		tp = flp;
-		flp = tp->next_p;
-		free(tp->name);
-		free(tp);
-	}
+static const struct drive_ops *const type_ops[] = {
+	&dir_ops /* DT_DIRECTORY */,
+	&ram_ops /* DT_RAM */,
+	&ovl_ops /* DT_OVERLAY */,
+	&tar_ops /* DT_TAR */,
+	&dsk_ops /* DT_IMAGE */
+};
+#define DRIVE_OPS(drive) (type_ops[conf_drive_type[drive]])
+
+
+/*
+ * access files of a drive through the operations of its kind (fd is
+ * a handle returned by open_drive_file)
+ */
+static int
+open_drive_file(int drive, const char *name, int flags) {
+	return DRIVE_OPS(drive)->open(drive, name, flags);
+}
+
+
+static int
+stat_drive_file(int drive, const char *name, struct stat *sp) {
+	return DRIVE_OPS(drive)->stat(drive, name, sp);
+}
+
+
+static int
+unlink_drive_file(int drive, const char *name) {
+	return DRIVE_OPS(drive)->unlink(drive, name);
+}
+
+
+static int
+link_drive_file(int drive, const char *old_name, const char *new_name) {
+	return DRIVE_OPS(drive)->link(drive, old_name, new_name);
+}
+
+
+static ssize_t
+read_drive_file(int drive, int fd, void *buffer, size_t n, off_t offset) {
+	return DRIVE_OPS(drive)->pread(fd, buffer, n, offset);
+}
+
+
+static ssize_t
+write_drive_file(int drive, int fd, const void *buffer, size_t n,
+    off_t offset) {
+	return DRIVE_OPS(drive)->pwrite(fd, buffer, n, offset);
+}
+
+
+static int
+close_drive_file(int drive, int fd) {
+	return DRIVE_OPS(drive)->close(fd);
 }
 
 
 /*
- * helper function for get_filelist(): prepares a CP/M compatible
- * Unix filename for matching by removing the dot between name and
- * extension and padding name and extension with blanks
+ * helper function for record_file(): a file of an overlay drive is read
+ * from the topmost layer containing it, unless a whiteout in the top
+ * layer hides it, so the layers above it and the whiteout are examined
+ * as well (all of them if the file does not exist)
  */
 static void
-prepare_name(const char *unix_name, char pattern[11]) {
-	const char *cp;
-	memset(pattern, ' ', 11);
-	cp = strchr(unix_name, '.');
-	/*
-	 * we already know that unix_name is CP/M compatible,
-	 * i.e. that the name resp. the extension is at most 8 resp. 3
-	 * characters long
-	 */
-	if (cp) {
-		memcpy(pattern, unix_name, cp - unix_name);
-		memcpy(pattern + 8, cp + 1, strlen(cp + 1));
-	} else {
-		memcpy(pattern, unix_name, strlen(unix_name));
+record_layers(enum dep_kind kind, int drive, const char *name) {
+	int layer = ovl_layer(drive, name), i;
+	const char *dir;
+	char *path;
+	for (i = 0; ! i || conf_layers[drive][i - 1]; i++) {
+		dir = i ? conf_layers[drive][i - 1] : conf_drives[drive];
+		path = alloc(strlen(dir) + sizeof OVL_WHITEOUT +
+		    strlen(name) + 1);
+		sprintf(path, "%s/%s", dir, name);
+		dep_record(i == layer ? kind : DK_EXAMINED, path, NULL);
+		if (! i && layer) {
+			sprintf(path, "%s/%s%s", dir, OVL_WHITEOUT, name);
+			dep_record(DK_EXAMINED, path, NULL);
+		}
+		free(path);
+		if (i == layer) break;
 	}
 }
 
 
 /*
- * helper function for get_filelist(): check two arrays prepared
- * by prepare_name() for a match (pattern may contain question marks as
- * wildcards
+ * record an access to a file of a drive in the dependency list (which
+ * also feeds the result cache); files of tar and disk image drives are
+ * represented by the archive resp. the image. Files of RAM drives exist
+ * only while the program runs; the copies saved on exit are recorded by
+ * ram_persist().
  */
-static int
-match_name(const char name[11], const char pattern[11]) {
-	int rc = 1, i;
-	for (i = 0; i < 11; i++) {
-		if (pattern[i] == '?') continue;
-		if (pattern[i] != name[i]) {
-			rc = 0;
-			break;
+static void
+record_file(enum dep_kind kind, int drive, const char *name,
+    const char *new_name) {
+	const char *dir = conf_drives[drive];
+	char *path, *new_path = NULL;
+	if (! conf_dep_file && ! conf_cache_dir) return;
+	switch (conf_drive_type[drive]) {
+	case DT_RAM:
+		return;
+	case DT_TAR:
+	case DT_IMAGE:
+		dep_record(kind == DK_READ || kind == DK_EXAMINED ? kind :
+		    DK_WRITTEN, dir, NULL);
+		return;
+	case DT_OVERLAY:
+		/*
+		 * files are written to the top layer (whiteouts are
+		 * recorded by the overlay drive emulation)
+		 */
+		if (kind == DK_READ || kind == DK_EXAMINED) {
+			record_layers(kind, drive, name);
+			return;
 		}
+		break;
+	default:
+		break;
 	}
-	return rc;
+	path = alloc(strlen(dir) + strlen(name) + 2);
+	sprintf(path, "%s/%s", dir, name);
+	if (new_name) {
+		new_path = alloc(strlen(conf_drives[drive]) +
+		    strlen(new_name) + 2);
+		sprintf(new_path, "%s/%s", conf_drives[drive], new_name);
+	}
+	dep_record(kind, path, new_path);
+	free(path);
+	free(new_path);
 }
 
 
 /*
- * gets a listing of all possible CP/M files in a directory which
- * match a given, possibly ambigous file name (the pattern is expected
- * in Unix format)
+ * open the host directory of a drive for listing
  */
-static struct file_list *
-get_filelist(const char *directory, const char *name, const char *caller) {
-	struct file_list *flp = NULL, *tp;
-	DIR *dp = NULL;
-	struct dirent *dep;
-	int t;
-	struct stat s;
-	char *path = NULL;
-	char pattern[11];
-	char temp_name[11];
-	dp = opendir(directory);
-	if (! dp) {
-		plog("%s: opendir(%s) failed: %s", caller,
-		    directory, strerror(errno));
-		goto premature_exit;
-	}
+static DIR *
+open_drive_dir(int drive) {
+#ifdef AT_FDCWD
+	int fd, e;
+	DIR *dp;
 	/*
-	 * prepare pattern for matching
+	 * open the directory again to get a private directory offset
 	 */
-	prepare_name(name, pattern);
-	while ((dep = readdir(dp))) {
-		/*
-		 * skip CP/M incompatible names
-		 */
-		if (! is_nice_filename(dep->d_name)) continue;
-		/*
-		 * skip names which do not match
-		 */
-		prepare_name(dep->d_name, temp_name);
-		if (! match_name(temp_name, pattern)) continue;
-		/*
-		 * build path for file
-		 */
-		free(path);
-		path = alloc(strlen(directory) + strlen(dep->d_name) + 2);
-		sprintf(path, "%s/%s", directory, dep->d_name);
-		/*
-		 * get information for file, skip if unavailable
-		 */
-		t = lstat(path, &s);
-		if (t == (-1)) {
-			plog("%s: lstat(%s) failed: %s", caller, path,
-			    strerror(errno));
-			continue;
-		}
-		/*
-		 * skip all but regular files
-		 */
-		if (! S_ISREG(s.st_mode)) continue;
-		/*
-		 * skip files greater than 8MB
-		 */
-		if (s.st_size > 8 * 1024 * 1024) continue;
-		/*
-		 * create list entry and append it to list
-		 */
-		tp = alloc(sizeof (struct file_list));
-		tp->next_p = flp;
-		tp->size = (s.st_size + 127) / 128;
-		tp->access = s.st_atime;
-		tp->modify = s.st_mtime;
-		tp->name = alloc(strlen(dep->d_name) + 1);
-		strcpy(tp->name, dep->d_name);
-		flp = tp;
+	fd = HOST_CALL(openat(drive_fd[drive], ".", O_RDONLY | O_CLOEXEC));
+	if (fd == (-1)) return NULL;
+	dp = fdopendir(fd);
+	if (! dp) {
+		e = errno;
+		close(fd);
+		errno = e;
 	}
-premature_exit:
-	free(path);
-	if (dp) closedir(dp);
-	return flp;
+	return dp;
+#else
+	return HOST_CALL(opendir(conf_drives[drive]));
+#endif
 }
 
 
@@ -605,6 +779,33 @@ premature_exit:
 #define FILE_RODISK 0x1 /* opened on a read only disk */
 #define FILE_ROFILE 0x2 /* file was opened read only */
 #define FILE_WRITTEN 0x4 /* file has been written to */
+#define FILE_SHARED 0x8 /* file is open through more than one FCB */
+#define FILE_LOWER 0x10 /* file is in a lower layer of an overlay drive */
+#define FILE_STREAM 0x20 /* stream (fd is the handle of the stream) */
+#define FILE_PARKED 0x40 /* host file closed by the descriptor pool */
+#define FILE_POOLED 0x80 /* file is in the descriptor pool list */
+
+
+/*
+ * size of the read cache window of a file (in bytes, a multiple of
+ * 128); sequential reads fill the whole window, random reads only
+ * CACHE_RANDOM bytes to avoid reading data which is never used
+ */
+#define CACHE_SIZE (32 * 1024)
+#define CACHE_RANDOM 1024
+
+
+/*
+ * size of the write buffer of a file (in bytes, a multiple of 128)
+ */
+#define WRITE_BUFFER_SIZE (32 * 1024)
+
+
+/*
+ * memory mappings of files (if map files is set) are extended in steps
+ * of MAP_CHUNK bytes
+ */
+#define MAP_CHUNK (64 * 1024)
 
 
 /*
@@ -618,39 +819,1254 @@ premature_exit:
  */
 struct file_data {
 	struct file_data *next_p;
-	char *path;
+	struct file_data *prev_p;
+	int drive;
+	char name[L_UNIX_NAME];
 	int id;
 	int flags;
 	int fd;
+	/*
+	 * read cache: a window of cache_valid bytes starting at file
+	 * offset cache_offset; if cache_eof is set, the window ends at
+	 * the end of file. next_record is the record following the
+	 * last one read and is used to detect sequential reads.
+	 */
+	unsigned char *cache;
+	off_t cache_offset;
+	size_t cache_valid;
+	int cache_eof;
+	int next_record;
+	/*
+	 * write buffer: dirty_length bytes of data written by the
+	 * program, to be written to the file at offset dirty_offset
+	 */
+	unsigned char *buffer;
+	off_t dirty_offset;
+	size_t dirty_length;
+	/*
+	 * memory mapping: map_length bytes of the file are mapped at map,
+	 * of which map_size bytes (the file size) may be accessed; mapped
+	 * files use the write buffer only for records extending the file
+	 * and don't use the read cache
+	 */
+	unsigned char *map;
+	size_t map_length;
+	off_t map_size;
+	/*
+	 * host file descriptor pool list, most recently used file first
+	 */
+	struct file_data *lru_next_p;
+	struct file_data *lru_prev_p;
 };
 
 
 /*
- * head of the file list
+ * head of the file list (in no particular order)
  */
 static struct file_data *first_file_p = NULL;
 
 
 /*
- * delete file list element
+ * pool of file data structures
  */
-static void
-free_filedata(struct file_data *fdp) {
-	if (fdp->fd != (-1)) {
-		/*
-		 * warn if a program didn't explicitly close an output file
-		 */
-		if (fdp->flags & FILE_WRITTEN) {
-			plog("output file %s not explicitly closed by program",
-			    fdp->path);
-		}
-		if (close(fdp->fd) == (-1)) {
-			plog("cannot close %s: %s", fdp->path,
-			    strerror(errno));
+static struct pool file_pool = POOL_INITIALIZER(struct file_data);
+
+
+/*
+ * table of the open files, indexed by file ID; file IDs are in the range
+ * 1...65535, and the table grows up to the highest ID in use
+ */
+static struct file_data **file_table = NULL;
+static int file_table_size = 0;
+
+
+/*
+ * file ID generator: file_id is the next ID never used so far; closed
+ * IDs are queued in a FIFO ring and only reused when the unused IDs
+ * are exhausted (oldest first), so that stale FCBs are still
+ * recognized most of the time
+ */
+static int file_id = 1;
+static unsigned short free_ids[65536];
+static int free_id_head = 0, free_id_count = 0;
+
+
+/*
+ * host file descriptor pool: the open files of directory and overlay
+ * drives holding a host file descriptor are kept in a list ordered by
+ * their last access; if a file would need more than fd_limit of these
+ * descriptors, the least recently used file is parked (its descriptor
+ * is closed) and reopened by name when it is accessed again. All other
+ * state of a parked file (file offsets, read cache, write buffer, and
+ * mapping) remains in its file data structure.
+ */
+#define FD_RESERVE 32
+#define FD_MINIMUM 8
+static struct file_data *lru_first_p = NULL, *lru_last_p = NULL;
+static int host_fds = 0, fd_limit = INT_MAX;
+
+
+/*
+ * account for n bytes of output to a disk file or the console; if
+ * this exceeds the output limit, the program is terminated and
+ * true is returned (the output should then be suppressed)
+ */
+int
+limit_output(int n) {
+	output_count += n;
+	if (conf_limit_output > 0 && output_count > conf_limit_output) {
+		if (! terminate) {
+			plog("output limit of %lld bytes exceeded",
+			    conf_limit_output);
+			terminate = 1;
+			term_reason = ERR_OUTPUTLIMIT;
 		}
+		return 1;
 	}
-	free(fdp->path);
-	free(fdp);
+	return 0;
+}
+
+
+/*
+ * check if a file takes part in the host file descriptor pool (files
+ * of RAM, tar, and disk image drives have no host descriptor of their
+ * own, and streams cannot be reopened)
+ */
+static int
+is_pooled(const struct file_data *fdp) {
+	return ! (fdp->flags & FILE_STREAM) &&
+	    (conf_drive_type[fdp->drive] == DT_DIRECTORY ||
+	    conf_drive_type[fdp->drive] == DT_OVERLAY);
+}
+
+
+/*
+ * enter a file at the head of the descriptor pool list
+ */
+static void
+lru_add(struct file_data *fdp) {
+	fdp->lru_prev_p = NULL;
+	fdp->lru_next_p = lru_first_p;
+	if (lru_first_p) {
+		lru_first_p->lru_prev_p = fdp;
+	} else {
+		lru_last_p = fdp;
+	}
+	lru_first_p = fdp;
+	fdp->flags |= FILE_POOLED;
+	host_fds++;
+}
+
+
+/*
+ * remove a file from the descriptor pool list (if it is in the list)
+ */
+static void
+lru_remove(struct file_data *fdp) {
+	if (! (fdp->flags & FILE_POOLED)) return;
+	if (fdp->lru_prev_p) {
+		fdp->lru_prev_p->lru_next_p = fdp->lru_next_p;
+	} else {
+		lru_first_p = fdp->lru_next_p;
+	}
+	if (fdp->lru_next_p) {
+		fdp->lru_next_p->lru_prev_p = fdp->lru_prev_p;
+	} else {
+		lru_last_p = fdp->lru_prev_p;
+	}
+	fdp->lru_next_p = fdp->lru_prev_p = NULL;
+	fdp->flags &= ~FILE_POOLED;
+	host_fds--;
+}
+
+
+/*
+ * park a file of the pool: close its host file, which is reopened on
+ * the next access
+ */
+static void
+park_file(struct file_data *fdp) {
+	lru_remove(fdp);
+	if (close_drive_file(fdp->drive, fdp->fd) == (-1)) {
+		plog("cannot close %s/%s: %s", conf_drives[fdp->drive],
+		    fdp->name, strerror(errno));
+	}
+	fdp->fd = (-1);
+	fdp->flags |= FILE_PARKED;
+	if (log_level >= LL_FDOS) {
+		plog("descriptor pool: parked %s/%s",
+		    conf_drives[fdp->drive], fdp->name);
+	}
+}
+
+
+/*
+ * make room in the descriptor pool for another host file
+ */
+static void
+reserve_fd(void) {
+	while (host_fds >= fd_limit && lru_last_p) park_file(lru_last_p);
+}
+
+
+/*
+ * get the host file descriptor of a file for a system call, reopening
+ * the file if it has been parked; errors terminate the program
+ */
+static int
+host_fd(struct file_data *fdp, const char *caller) {
+	int fd;
+	if (fdp->flags & FILE_PARKED) {
+		reserve_fd();
+		fd = open_drive_file(fdp->drive, fdp->name, (fdp->flags &
+		    (FILE_RODISK | FILE_ROFILE | FILE_LOWER)) ?
+		    O_RDONLY : O_RDWR);
+		if (fd == (-1)) {
+			plog("%s: could not reopen %s/%s: %s", caller,
+			    conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+			terminate = 1;
+			term_reason = ERR_HOST;
+			return (-1);
+		}
+		fdp->fd = fd;
+		fdp->flags &= ~FILE_PARKED;
+		lru_add(fdp);
+	} else if ((fdp->flags & FILE_POOLED) && fdp != lru_first_p) {
+		lru_remove(fdp);
+		lru_add(fdp);
+	}
+	return fdp->fd;
+}
+
+
+/*
+ * write the contents of the write buffer of a file to the host file;
+ * errors terminate the program
+ */
+static int
+flush_file(struct file_data *fdp, const char *caller) {
+	int rc = 0;
+	unsigned char *bp = fdp->buffer;
+	size_t n = fdp->dirty_length;
+	off_t offset = fdp->dirty_offset;
+	ssize_t t;
+	if (! n) goto premature_exit;
+	fdp->dirty_length = 0;
+	if (host_fd(fdp, caller) == (-1)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	while (n) {
+		t = write_drive_file(fdp->drive, fdp->fd, bp, n, offset);
+		if (t == (-1)) {
+			plog("%s: pwrite(%s/%s) failed: %s", caller,
+			    conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+			rc = (-1);
+			goto premature_exit;
+		}
+		bp += t;
+		n -= t;
+		offset += t;
+	}
+premature_exit:
+	if (rc) {
+		terminate = 1;
+		term_reason = ERR_HOST;
+	}
+	return rc;
+}
+
+
+/*
+ * check if two file data structures refer to the same file
+ */
+static int
+same_file(const struct file_data *fdp1, const struct file_data *fdp2) {
+	return fdp1->drive == fdp2->drive && ! strcmp(fdp1->name, fdp2->name);
+}
+
+
+/*
+ * take the files open on a file about to be deleted out of the
+ * descriptor pool, since they cannot be reopened by name afterwards;
+ * parked files are reopened first
+ */
+static int
+pin_files(int drive, const char *name, const char *caller) {
+	struct file_data *tp;
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (tp->drive != drive || strcmp(tp->name, name)) continue;
+		if (host_fd(tp, caller) == (-1)) return (-1);
+		lru_remove(tp);
+	}
+	return 0;
+}
+
+
+/*
+ * flush the write buffers of all other FCBs open on the same file
+ */
+static int
+flush_shared(const struct file_data *fdp, const char *caller) {
+	int rc = 0;
+	struct file_data *tp;
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (tp == fdp || ! tp->dirty_length ||
+		    ! same_file(tp, fdp)) continue;
+		if (flush_file(tp, caller)) rc = (-1);
+	}
+	return rc;
+}
+
+
+/*
+ * flush the write buffers of all files, e. g. before the directory
+ * of a drive is read
+ */
+static int
+flush_all(const char *caller) {
+	int rc = 0;
+	struct file_data *tp;
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (tp->dirty_length && flush_file(tp, caller)) rc = (-1);
+	}
+	return rc;
+}
+
+
+/*
+ * pass the data written to a file to the host system as required by
+ * the durability policy when the file is closed by the program
+ */
+static int
+sync_file(struct file_data *fdp, const char *caller) {
+	int rc = 0;
+	if (flush_file(fdp, caller)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	if (conf_durability != DUR_SYNC || ! (fdp->flags & FILE_WRITTEN) ||
+	    (fdp->flags & FILE_STREAM) ||
+	    conf_drive_type[fdp->drive] == DT_RAM ||
+	    conf_drive_type[fdp->drive] == DT_IMAGE) {
+		goto premature_exit;
+	}
+	if (fdp->map && fdp->map_size) {
+		if (HOST_CALL(msync(fdp->map, (size_t) fdp->map_size,
+		    MS_SYNC)) == (-1)) {
+			plog("%s: cannot sync %s/%s: %s", caller,
+			    conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+			terminate = 1;
+			term_reason = ERR_HOST;
+			rc = (-1);
+			goto premature_exit;
+		}
+	}
+	if (host_fd(fdp, caller) == (-1)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+	if (HOST_CALL(fdatasync(fdp->fd)) == (-1)) {
+#else
+	if (HOST_CALL(fsync(fdp->fd)) == (-1)) {
+#endif
+		plog("%s: cannot sync %s/%s: %s", caller,
+		    conf_drives[fdp->drive], fdp->name, strerror(errno));
+		terminate = 1;
+		term_reason = ERR_HOST;
+		rc = (-1);
+	}
+premature_exit:
+	return rc;
+}
+
+
+/*
+ * check if a record at a given file offset overlaps data in the
+ * write buffer of a file
+ */
+static int
+overlaps_buffer(const struct file_data *fdp, off_t unix_offset) {
+	return fdp->dirty_length && unix_offset + 128 > fdp->dirty_offset &&
+	    unix_offset < fdp->dirty_offset + (off_t) fdp->dirty_length;
+}
+
+
+/*
+ * (re)map a file with a mapping large enough for size bytes; files
+ * which cannot be written get a private read only mapping. If the
+ * mapping fails, the file is accessed by system calls from now on
+ * (data written through the old mapping is already in the file).
+ */
+static void
+map_file(struct file_data *fdp, off_t size, const char *caller) {
+	size_t length;
+	void *p;
+	int ro = fdp->flags & (FILE_RODISK | FILE_ROFILE | FILE_LOWER);
+	if (host_fd(fdp, caller) == (-1)) return;
+	if (fdp->map) {
+		HOST_CALL(munmap(fdp->map, fdp->map_length));
+		fdp->map = NULL;
+	}
+	length = (size_t) ((size + MAP_CHUNK) / MAP_CHUNK * MAP_CHUNK);
+	p = HOST_CALL(mmap(NULL, length,
+	    ro ? PROT_READ : PROT_READ | PROT_WRITE,
+	    ro ? MAP_PRIVATE : MAP_SHARED, fdp->fd, 0));
+	if (p == MAP_FAILED) {
+		if (log_level >= LL_FDOS) {
+			plog("%s: cannot map %s/%s: %s", caller,
+			    conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+		}
+		return;
+	}
+	fdp->map = p;
+	fdp->map_length = length;
+	fdp->map_size = size;
+}
+
+
+/*
+ * update the size of a mapped file (which may have been changed through
+ * another FCB), extending the mapping if necessary; errors terminate
+ * the program
+ */
+static int
+update_map(int fcb, struct file_data *fdp, const char *caller) {
+	int rc = 0;
+	struct stat s;
+	if (host_fd(fdp, caller) == (-1)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	if (HOST_CALL(fstat(fdp->fd, &s)) == (-1)) {
+		plog("%s (FCB 0x%04x): fstat(%s/%s) failed: %s", caller, fcb,
+		    conf_drives[fdp->drive], fdp->name, strerror(errno));
+		terminate = 1;
+		term_reason = ERR_HOST;
+		rc = (-1);
+		goto premature_exit;
+	}
+	if ((size_t) s.st_size > fdp->map_length) {
+		map_file(fdp, s.st_size, caller);
+	} else {
+		fdp->map_size = s.st_size;
+	}
+premature_exit:
+	return rc;
+}
+
+
+/*
+ * type of a file list
+ */
+struct file_list {
+	/*
+	 * size of file *in CP/M records of 128 bytes*
+	 */
+	off_t size;
+	/*
+	 * file access time
+	 */
+	time_t access;
+	/*
+	 * file modification time
+	 */
+	time_t modify;
+	struct file_list *next_p;
+	char *name;
+};
+
+
+/*
+ * helper function for get_filelist(): prepares a CP/M compatible
+ * Unix filename for matching by removing the dot between name and
+ * extension and padding name and extension with blanks
+ */
+static void
+prepare_name(const char *unix_name, char pattern[11]) {
+	const char *cp;
+	memset(pattern, ' ', 11);
+	cp = strchr(unix_name, '.');
+	/*
+	 * we already know that unix_name is CP/M compatible,
+	 * i.e. that the name resp. the extension is at most 8 resp. 3
+	 * characters long
+	 */
+	if (cp) {
+		memcpy(pattern, unix_name, cp - unix_name);
+		memcpy(pattern + 8, cp + 1, strlen(cp + 1));
+	} else {
+		memcpy(pattern, unix_name, strlen(unix_name));
+	}
+}
+
+
+/*
+ * helper function for get_filelist(): check two arrays prepared
+ * by prepare_name() for a match (pattern may contain question marks as
+ * wildcards
+ */
+static int
+match_name(const char name[11], const char pattern[11]) {
+	int rc = 1, i;
+	for (i = 0; i < 11; i++) {
+		if (pattern[i] == '?') continue;
+		if (pattern[i] != name[i]) {
+			rc = 0;
+			break;
+		}
+	}
+	return rc;
+}
+
+
+/*
+ * helper function for get_filelist(): sort a file list by name
+ * (merge sort, to keep directory searches of large directories fast)
+ */
+static struct file_list *
+sort_filelist(struct file_list *flp) {
+	struct file_list *a_p = NULL, *b_p = NULL, *tp, **tpp;
+	/*
+	 * lists of less than two elements are sorted
+	 */
+	if (! flp || ! flp->next_p) return flp;
+	/*
+	 * split the list into two halves, sort them, and merge them
+	 */
+	while (flp) {
+		tp = flp;
+		flp = tp->next_p;
+		tp->next_p = a_p;
+		a_p = tp;
+		if (flp) {
+			tp = flp;
+			flp = tp->next_p;
+			tp->next_p = b_p;
+			b_p = tp;
+		}
+	}
+	a_p = sort_filelist(a_p);
+	b_p = sort_filelist(b_p);
+	tpp = &flp;
+	while (a_p && b_p) {
+		if (strcmp(a_p->name, b_p->name) <= 0) {
+			*tpp = a_p;
+			a_p = a_p->next_p;
+		} else {
+			*tpp = b_p;
+			b_p = b_p->next_p;
+		}
+		tpp = &(*tpp)->next_p;
+	}
+	*tpp = a_p ? a_p : b_p;
+	return flp;
+}
+
+
+/*
+ * check if filename is ambigous (i. e., contains question marks)
+ */
+static int
+is_ambigous(const char *name) {
+	return (strchr(name, '?') != NULL);
+}
+
+
+/*
+ * helper function for get_filelist(): prepend a file to a file list
+ * (list elements and names are allocated from the arena of the list)
+ */
+static struct file_list *
+prepend_filelist(struct file_list *flp, struct arena *ap, const char *name,
+    off_t size, time_t access, time_t modify) {
+	struct file_list *tp;
+	tp = arena_alloc(ap, sizeof (struct file_list));
+	tp->next_p = flp;
+	tp->size = (size + 127) / 128;
+	tp->access = access;
+	tp->modify = modify;
+	tp->name = arena_strdup(ap, name);
+	return tp;
+}
+
+
+/*
+ * helper function for get_filelist(): prepend a file to a file list if
+ * it is a regular file of at most 8MB
+ */
+static struct file_list *
+add_filelist(struct file_list *flp, struct arena *ap, const char *name,
+    const struct stat *sp) {
+	/*
+	 * skip all but regular files
+	 */
+	if (! S_ISREG(sp->st_mode)) return flp;
+	/*
+	 * skip files greater than 8MB
+	 */
+	if (sp->st_size > 8 * 1024 * 1024) return flp;
+	return prepend_filelist(flp, ap, name, sp->st_size, sp->st_atime,
+	    sp->st_mtime);
+}
+
+
+/*
+ * directory index of a drive: the CP/M compatible names in the
+ * directory, hashed by their prepared name, with the file information
+ * of the last lstat() (which must be repeated if the entry is stale)
+ */
+#define DIR_HASH_SIZE 1024
+#define L_NICE_NAME 13
+
+
+struct dir_entry {
+	struct dir_entry *next_p;
+	char key[11];
+	char name[L_NICE_NAME];
+	int stale;
+	int usable; /* regular file of at most 8MB */
+	off_t size;
+	time_t access;
+	time_t modify;
+};
+
+
+struct dir_index {
+	/*
+	 * hash table, NULL if the index has not been built
+	 */
+	struct dir_entry **table;
+	/*
+	 * inotify watch descriptor of the drive directory; if it is
+	 * (-1), the index is revalidated by the directory modification
+	 * time, which must have been older than the index when it was
+	 * built (otherwise, the index is racy and built again)
+	 */
+	int wd;
+	time_t mtime;
+	int racy;
+};
+
+
+static struct dir_index dir_index[16];
+
+
+/*
+ * pool of directory index entries
+ */
+static struct pool dir_pool = POOL_INITIALIZER(struct dir_entry);
+
+
+#ifdef __linux__
+static int inotify_fd = (-1);
+#endif
+
+
+/*
+ * hash function for prepared names
+ */
+static unsigned
+dir_hash(const char key[11]) {
+	unsigned h = 0;
+	int i;
+	for (i = 0; i < 11; i++) h = h * 31 + (unsigned char) key[i];
+	return h % DIR_HASH_SIZE;
+}
+
+
+/*
+ * search an entry in the directory index of a drive; returns a pointer to
+ * a pointer to allow removal of the entry
+ */
+static struct dir_entry **
+find_dir_entry(struct dir_index *ip, const char key[11]) {
+	struct dir_entry **epp;
+	for (epp = ip->table + dir_hash(key);
+	    *epp && memcmp((*epp)->key, key, 11);
+	    epp = &(*epp)->next_p);
+	return epp;
+}
+
+
+/*
+ * root of the search list used by bdos_search_for_first/next(), and
+ * the arena it is allocated from
+ */
+static struct file_list *search_list_p = NULL;
+static struct arena search_arena = ARENA_INITIALIZER;
+
+
+/*
+ * a search which need not be sorted reads the directory index of the
+ * drive incrementally (the cursor being the hash chain and its entry
+ * to be examined next, or NULL for the start of the following chain),
+ * or, without index, the directory stream; both are kept together with
+ * the drive and the prepared pattern of the search
+ */
+static int search_index = 0;
+static int search_bucket;
+static struct dir_entry *search_ep;
+static DIR *search_dp = NULL;
+static int search_drive;
+static char search_pattern[11];
+
+
+/*
+ * get current file information for a directory index entry (without
+ * inotify, changes to files are not noticed, so this is done every time);
+ * returns (-1) if the file cannot be examined
+ */
+static int
+refresh_dir_entry(int drive, struct dir_entry *ep) {
+	struct stat s;
+	if (! ep->stale && dir_index[drive].wd != (-1)) return 0;
+	if (stat_drive_file(drive, ep->name, &s) == (-1)) return (-1);
+	ep->stale = 0;
+	ep->usable = S_ISREG(s.st_mode) && s.st_size <= 8 * 1024 * 1024;
+	ep->size = s.st_size;
+	ep->access = s.st_atime;
+	ep->modify = s.st_mtime;
+	return 0;
+}
+
+
+/*
+ * close the directory stream resp. index cursor of the search, if there
+ * is one
+ */
+static void
+close_search_stream(void) {
+	if (search_dp) {
+		HOST_CALL(closedir(search_dp));
+		search_dp = NULL;
+	}
+	search_index = 0;
+}
+
+
+/*
+ * read the directory stream of the search up to the next matching
+ * regular file of at most 8MB; returns the name of the file (valid
+ * up to the next call), or NULL (closing the stream) at the end of
+ * the directory
+ */
+static const char *
+read_search_stream(const char *caller) {
+	struct dirent *dep;
+	struct stat s;
+	char temp_name[11];
+	const char *name = NULL;
+	while (search_dp) {
+		dep = HOST_CALL(readdir(search_dp));
+		if (! dep) {
+			close_search_stream();
+			break;
+		}
+		/*
+		 * skip CP/M incompatible names and names which do not match
+		 */
+		if (! is_nice_filename(dep->d_name)) continue;
+		prepare_name(dep->d_name, temp_name);
+		if (! match_name(temp_name, search_pattern)) continue;
+		/*
+		 * get information for file, skip if unavailable (the file
+		 * may have been removed since the stream was opened)
+		 */
+		if (stat_drive_file(search_drive, dep->d_name, &s) == (-1)) {
+			if (errno != ENOENT) {
+				plog("%s: lstat(%s/%s) failed: %s", caller,
+				    conf_drives[search_drive], dep->d_name,
+				    strerror(errno));
+			}
+			continue;
+		}
+		if (! S_ISREG(s.st_mode)) continue;
+		if (s.st_size > 8 * 1024 * 1024) continue;
+		name = dep->d_name;
+		break;
+	}
+	return name;
+}
+
+
+/*
+ * advance the index cursor of the search to the next matching regular
+ * file of at most 8MB, examining only this file; returns the name of the
+ * file (valid up to the next change of the index), or NULL (ending the
+ * search) at the end of the index
+ */
+static const char *
+read_search_index(const char *caller) {
+	struct dir_index *ip = dir_index + search_drive;
+	struct dir_entry *ep;
+	while (search_index) {
+		ep = search_ep;
+		if (! ep) {
+			/*
+			 * end of the hash chain: go on with the next one
+			 */
+			if (++search_bucket == DIR_HASH_SIZE) {
+				close_search_stream();
+				break;
+			}
+			search_ep = ip->table[search_bucket];
+			continue;
+		}
+		search_ep = ep->next_p;
+		if (! match_name(ep->key, search_pattern)) continue;
+		/*
+		 * skip the file if it is unavailable (it may have been
+		 * removed, which is noted by the index later)
+		 */
+		if (refresh_dir_entry(search_drive, ep) == (-1)) {
+			if (errno != ENOENT) {
+				plog("%s: lstat(%s/%s) failed: %s", caller,
+				    conf_drives[search_drive], ep->name,
+				    strerror(errno));
+			}
+			continue;
+		}
+		if (ep->usable) return ep->name;
+	}
+	return NULL;
+}
+
+
+/*
+ * called before a file is created, deleted, or renamed on a drive, and
+ * before its directory index is discarded: if a search is still reading
+ * the directory or the index of the drive, the rest of it is read into
+ * the search list, so that the change is not seen by the search (like
+ * with a search list built in advance)
+ */
+static void
+settle_search(int drive, const char *caller) {
+	struct file_list **tpp = &search_list_p;
+	const char *name;
+	if ((! search_dp && ! search_index) || search_drive != drive) return;
+	while (*tpp) tpp = &(*tpp)->next_p;
+	for (;;) {
+		name = search_dp ? read_search_stream(caller) :
+		    read_search_index(caller);
+		if (! name) break;
+		*tpp = prepend_filelist(NULL, &search_arena, name, 0, 0, 0);
+		tpp = &(*tpp)->next_p;
+	}
+}
+
+
+/*
+ * remove an entry from the directory index of a drive, moving the index
+ * cursor of the search past it
+ */
+static void
+unlink_dir_entry(struct dir_entry **epp) {
+	struct dir_entry *ep = *epp;
+	if (search_index && search_ep == ep) search_ep = ep->next_p;
+	*epp = ep->next_p;
+	pool_put(&dir_pool, ep);
+}
+
+
+/*
+ * discard the directory index of a drive
+ */
+static void
+free_dir_index(int drive) {
+	struct dir_index *ip = dir_index + drive;
+	struct dir_entry *ep;
+	int i;
+	if (! ip->table) return;
+	settle_search(drive, "directory index");
+	for (i = 0; i < DIR_HASH_SIZE; i++) {
+		while (ip->table[i]) {
+			ep = ip->table[i];
+			ip->table[i] = ep->next_p;
+			pool_put(&dir_pool, ep);
+		}
+	}
+	free(ip->table);
+	ip->table = NULL;
+}
+
+
+/*
+ * enter a new or changed file into the directory index of a drive (its
+ * file information is fetched when it is needed)
+ */
+static void
+add_dir_entry(int drive, const char *name) {
+	struct dir_index *ip = dir_index + drive;
+	struct dir_entry **epp, *ep;
+	char key[11];
+	if (! ip->table || ! is_nice_filename(name)) return;
+	prepare_name(name, key);
+	epp = find_dir_entry(ip, key);
+	if (! *epp) {
+		ep = pool_get(&dir_pool);
+		ep->next_p = NULL;
+		memcpy(ep->key, key, 11);
+		strcpy(ep->name, name);
+		*epp = ep;
+	}
+	(*epp)->stale = 1;
+}
+
+
+/*
+ * remove a file from the directory index of a drive
+ */
+static void
+remove_dir_entry(int drive, const char *name) {
+	struct dir_index *ip = dir_index + drive;
+	struct dir_entry **epp;
+	char key[11];
+	if (! ip->table || ! is_nice_filename(name)) return;
+	prepare_name(name, key);
+	epp = find_dir_entry(ip, key);
+	if (*epp) unlink_dir_entry(epp);
+}
+
+
+/*
+ * apply pending inotify events to the directory indexes
+ */
+static void
+read_dir_events(void) {
+#ifdef __linux__
+	union {
+		struct inotify_event e;
+		char b[4096];
+	} u;
+	const struct inotify_event *ep;
+	ssize_t n;
+	size_t i;
+	int drive;
+	if (inotify_fd == (-1)) return;
+	for (;;) {
+		n = HOST_CALL(read(inotify_fd, u.b, sizeof u.b));
+		if (n <= 0) break;
+		for (i = 0; i < (size_t) n;
+		    i += sizeof (struct inotify_event) + ep->len) {
+			ep = (const struct inotify_event *) (u.b + i);
+			/*
+			 * events were lost: start over
+			 */
+			if (ep->mask & IN_Q_OVERFLOW) {
+				for (drive = 0; drive < 16; drive++) {
+					free_dir_index(drive);
+				}
+				continue;
+			}
+			/*
+			 * several drives may share a directory (and
+			 * thereby the watch)
+			 */
+			for (drive = 0; drive < 16; drive++) {
+				if (dir_index[drive].wd != ep->wd) continue;
+				if (ep->mask & IN_IGNORED) {
+					/*
+					 * the directory is gone or the
+					 * watch was removed: fall back
+					 * to the modification time
+					 */
+					free_dir_index(drive);
+					dir_index[drive].wd = (-1);
+				} else if (! ep->len) {
+					continue;
+				} else if (ep->mask &
+				    (IN_DELETE | IN_MOVED_FROM)) {
+					remove_dir_entry(drive, ep->name);
+				} else {
+					add_dir_entry(drive, ep->name);
+				}
+			}
+		}
+	}
+#endif
+}
+
+
+/*
+ * record the modification time of a drive directory after tnylpo has
+ * changed it (only needed if there is no inotify watch)
+ */
+static void
+note_dir_change(int drive) {
+	struct dir_index *ip = dir_index + drive;
+	struct stat s;
+	if (! ip->table || ip->wd != (-1)) return;
+	if (stat_drive_file(drive, ".", &s) == (-1)) {
+		free_dir_index(drive);
+		return;
+	}
+	ip->mtime = s.st_mtime;
+}
+
+
+/*
+ * make sure that the directory index of a drive is up to date, building
+ * it if necessary; returns (-1) if there is no index
+ */
+static int
+check_dir_index(int drive, const char *caller) {
+	int rc = 0;
+	struct dir_index *ip = dir_index + drive;
+	DIR *dp = NULL;
+	struct dirent *dep;
+	struct stat s;
+	time_t now;
+	if (ip->wd != (-1)) {
+		/*
+		 * inotify: apply the changes since the last call
+		 */
+		read_dir_events();
+		if (ip->table) goto premature_exit;
+	} else {
+		/*
+		 * no inotify: the index is valid if the directory
+		 * hasn't changed since it was built
+		 */
+		now = time(NULL);
+		if (stat_drive_file(drive, ".", &s) == (-1)) {
+			plog("%s: stat(%s) failed: %s", caller,
+			    conf_drives[drive], strerror(errno));
+			free_dir_index(drive);
+			rc = (-1);
+			goto premature_exit;
+		}
+		if (ip->table && ! ip->racy && s.st_mtime == ip->mtime) {
+			goto premature_exit;
+		}
+		free_dir_index(drive);
+		ip->mtime = s.st_mtime;
+		ip->racy = (s.st_mtime >= now);
+	}
+	/*
+	 * build the index from the directory
+	 */
+	dp = open_drive_dir(drive);
+	if (! dp) {
+		plog("%s: opendir(%s) failed: %s", caller,
+		    conf_drives[drive], strerror(errno));
+		rc = (-1);
+		goto premature_exit;
+	}
+	ip->table = alloc(DIR_HASH_SIZE * sizeof (struct dir_entry *));
+	memset(ip->table, 0, DIR_HASH_SIZE * sizeof (struct dir_entry *));
+	for (;;) {
+		dep = HOST_CALL(readdir(dp));
+		if (! dep) break;
+		add_dir_entry(drive, dep->d_name);
+	}
+premature_exit:
+	if (dp) {
+		HOST_CALL(closedir(dp));
+	}
+	return rc;
+}
+
+
+/*
+ * helper function for get_filelist(): get a listing of the files
+ * matching a pattern from the directory index of a drive
+ */
+static struct file_list *
+search_dir_index(int drive, const char pattern[11], struct arena *ap,
+    const char *caller) {
+	struct file_list *flp = NULL;
+	struct dir_index *ip = dir_index + drive;
+	struct dir_entry **epp, *ep;
+	int i;
+	for (i = 0; i < DIR_HASH_SIZE; i++) {
+		epp = ip->table + i;
+		while (*epp) {
+			ep = *epp;
+			if (! match_name(ep->key, pattern)) {
+				epp = &ep->next_p;
+				continue;
+			}
+			if (refresh_dir_entry(drive, ep) == (-1)) {
+				if (errno != ENOENT) {
+					plog("%s: lstat(%s/%s) failed: %s",
+					    caller, conf_drives[drive],
+					    ep->name, strerror(errno));
+					epp = &ep->next_p;
+					continue;
+				}
+				/*
+				 * the file is gone
+				 */
+				unlink_dir_entry(epp);
+				continue;
+			}
+			if (ep->usable) {
+				flp = prepend_filelist(flp, ap, ep->name,
+				    ep->size, ep->access, ep->modify);
+			}
+			epp = &ep->next_p;
+		}
+	}
+	return flp;
+}
+
+
+/*
+ * gets a listing of all possible CP/M files in a directory which
+ * match a given, possibly ambigous file name (the pattern is expected
+ * in Unix format); in deterministic mode, the list is sorted by name,
+ * otherwise it is in (reverse) directory order. An unambigous name
+ * is looked up directly; ambigous names are searched in the directory
+ * of a RAM drive, the merged directory of an overlay drive, the member
+ * index of a tar drive, the directory of a disk image drive, the
+ * directory index of the drive, or, without index, by scanning the
+ * directory.
+ * The list is allocated from the arena ap and freed by free_arena().
+ */
+static struct file_list *
+get_filelist(int drive, const char *name, struct arena *ap,
+    const char *caller) {
+	struct file_list *flp = NULL;
+	DIR *dp = NULL;
+	struct dirent *dep;
+	int t, pos;
+	struct stat s;
+	const char *cp;
+	char pattern[11];
+	char temp_name[11];
+	/*
+	 * file sizes must include data still in write buffers
+	 */
+	flush_all(caller);
+	/*
+	 * unambigous name: a directory scan could only find the file of
+	 * this very name (and none at all if the name is not CP/M
+	 * compatible)
+	 */
+	if (! is_ambigous(name)) {
+		if (! is_nice_filename(name)) goto premature_exit;
+		t = stat_drive_file(drive, name, &s);
+		if (t == (-1)) {
+			if (errno != ENOENT) {
+				plog("%s: lstat(%s/%s) failed: %s", caller,
+				    conf_drives[drive], name,
+				    strerror(errno));
+			}
+			goto premature_exit;
+		}
+		flp = add_filelist(flp, ap, name, &s);
+		goto premature_exit;
+	}
+	/*
+	 * prepare pattern for matching
+	 */
+	prepare_name(name, pattern);
+	/*
+	 * RAM, overlay, tar, and disk image drives list their files from
+	 * memory
+	 */
+	if (DRIVE_OPS(drive)->next_name) {
+		pos = 0;
+		for (;;) {
+			cp = DRIVE_OPS(drive)->next_name(drive, &pos);
+			if (! cp) break;
+			if (! is_nice_filename(cp)) continue;
+			prepare_name(cp, temp_name);
+			if (! match_name(temp_name, pattern)) continue;
+			if (stat_drive_file(drive, cp, &s) == (-1)) continue;
+			flp = add_filelist(flp, ap, cp, &s);
+		}
+		goto premature_exit;
+	}
+	/*
+	 * use the directory index if there is one
+	 */
+	if (conf_dircache != DC_NONE && check_dir_index(drive, caller) == 0) {
+		flp = search_dir_index(drive, pattern, ap, caller);
+		goto premature_exit;
+	}
+	dp = open_drive_dir(drive);
+	if (! dp) {
+		plog("%s: opendir(%s) failed: %s", caller,
+		    conf_drives[drive], strerror(errno));
+		goto premature_exit;
+	}
+	for (;;) {
+		dep = HOST_CALL(readdir(dp));
+		if (! dep) break;
+		/*
+		 * skip CP/M incompatible names
+		 */
+		if (! is_nice_filename(dep->d_name)) continue;
+		/*
+		 * skip names which do not match
+		 */
+		prepare_name(dep->d_name, temp_name);
+		if (! match_name(temp_name, pattern)) continue;
+		/*
+		 * get information for file, skip if unavailable
+		 */
+		t = stat_drive_file(drive, dep->d_name, &s);
+		if (t == (-1)) {
+			plog("%s: lstat(%s/%s) failed: %s", caller,
+			    conf_drives[drive], dep->d_name, strerror(errno));
+			continue;
+		}
+		flp = add_filelist(flp, ap, dep->d_name, &s);
+	}
+premature_exit:
+	if (dp) {
+		HOST_CALL(closedir(dp));
+	}
+	if (conf_epoch >= 0) flp = sort_filelist(flp);
+	return flp;
+}
+
+
+/*
+ * delete file list element
+ */
+static void
+free_filedata(struct file_data *fdp) {
+	if (fdp->fd != (-1) || (fdp->flags & FILE_PARKED)) {
+		/*
+		 * write buffered data
+		 */
+		flush_file(fdp, "exit");
+		/*
+		 * warn if a program didn't explicitly close an output file
+		 */
+		if (fdp->flags & FILE_WRITTEN) {
+			plog("output file %s/%s not explicitly closed by "
+			    "program", conf_drives[fdp->drive], fdp->name);
+			if (! (fdp->flags & FILE_STREAM)) {
+				record_file(DK_WRITTEN, fdp->drive,
+				    fdp->name, NULL);
+			}
+		}
+		/*
+		 * a parked file is only reopened if data had to be written
+		 */
+		lru_remove(fdp);
+		if (fdp->fd != (-1) && ((fdp->flags & FILE_STREAM) ?
+		    HOST_CALL(stm_close(fdp->fd)) :
+		    close_drive_file(fdp->drive, fdp->fd)) == (-1)) {
+			plog("cannot close %s/%s: %s",
+			    conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+		}
+	}
+	if (fdp->map) munmap(fdp->map, fdp->map_length);
+	free(fdp->cache);
+	free(fdp->buffer);
+	pool_put(&file_pool, fdp);
+	open_files--;
 }
 
 
@@ -659,57 +2075,78 @@ free_filedata(struct file_data *fdp) {
  */
 static struct file_data *
 create_filedata(int fcb, const char *caller) {
+	int id, n;
+	struct file_data *fdp = NULL;
+	/*
+	 * enforce the open file limit
+	 */
+	if (conf_limit_files > 0 && open_files >= conf_limit_files) {
+		plog("%s (FCB 0x%04x): open file limit of %d exceeded",
+		    caller, fcb, conf_limit_files);
+		terminate = 1;
+		term_reason = ERR_FILELIMIT;
+		goto premature_exit;
+	}
 	/*
-	 * current file ID generator; file ID are in the range 1...65535
+	 * take a fresh ID as long as there are any, otherwise the oldest
+	 * closed one
 	 */
-	static int file_id = 1;
-	int start_id, id;
-	struct file_data **fdpp = NULL, *fdp = NULL;
-	/*
-	 * start with the current value of file_id
-       	 */
-	start_id = id = file_id++;
-	file_id &= 0xffff;
-	if (! file_id) file_id++;
-	for (;;) {
-		/*
-		 * search if the ID is already in use
-		 */
-		for (fdpp = &first_file_p;
-		    *fdpp && (*fdpp)->id < id;
-		    fdpp = &(*fdpp)->next_p);
-		/*
-		 * no: use this ID
-		 */
-		if (! *fdpp || (*fdpp)->id > id) break;
-		/*
-		 * get next candidate
-		 */
+	if (file_id <= 0xffff) {
 		id = file_id++;
-		file_id &= 0xffff;
-		if (! file_id) file_id++;
+	} else if (free_id_count) {
+		id = free_ids[free_id_head++];
+		free_id_head &= 0xffff;
+		free_id_count--;
+	} else {
 		/*
 		 * if all possible file IDs are taken, despair
 		 */
-		if (id == start_id) {
-			plog("%s (FCB 0x%04x): more than 65536 open files",
-			    caller, fcb);
-			terminate = 1;
-			term_reason = ERR_LOGIC;
-			goto premature_exit;
-		}
+		plog("%s (FCB 0x%04x): more than 65535 open files",
+		    caller, fcb);
+		terminate = 1;
+		term_reason = ERR_LOGIC;
+		goto premature_exit;
+	}
+	/*
+	 * grow the file table if necessary
+	 */
+	if (id >= file_table_size) {
+		n = file_table_size ? file_table_size * 2 : 64;
+		while (n <= id) n *= 2;
+		file_table = resize(file_table,
+		    n * sizeof (struct file_data *));
+		memset(file_table + file_table_size, 0,
+		    (n - file_table_size) * sizeof (struct file_data *));
+		file_table_size = n;
 	}
 	/*
 	 * allocate and initialize file data structure and enter
 	 * it into the file list
 	 */
-	fdp = alloc(sizeof (struct file_data));
-	fdp->next_p = *fdpp;
-	fdp->path = NULL;
+	fdp = pool_get(&file_pool);
+	fdp->next_p = first_file_p;
+	fdp->prev_p = NULL;
+	fdp->drive = 0;
+	fdp->name[0] = '\0';
 	fdp->id = id;
 	fdp->flags = 0;
 	fdp->fd = (-1);
-	*fdpp = fdp;
+	fdp->cache = NULL;
+	fdp->cache_offset = 0;
+	fdp->cache_valid = 0;
+	fdp->cache_eof = 0;
+	fdp->next_record = (-1);
+	fdp->buffer = NULL;
+	fdp->dirty_offset = 0;
+	fdp->dirty_length = 0;
+	fdp->map = NULL;
+	fdp->map_length = 0;
+	fdp->map_size = 0;
+	fdp->lru_next_p = fdp->lru_prev_p = NULL;
+	if (first_file_p) first_file_p->prev_p = fdp;
+	first_file_p = fdp;
+	file_table[id] = fdp;
+	open_files++;
 	/*
 	 * store file ID and file ID xor FILE_QUUX in the FCB
 	 */
@@ -724,13 +2161,60 @@ premature_exit:
 
 
 /*
- * search existing file data structure; returns a pointer to a pointer
- * to allow removal of the entry
+ * mark the read caches of all other FCBs open on the same file as
+ * invalid after the file has been written to
+ */
+static void
+invalidate_shared(const struct file_data *fdp) {
+	struct file_data *tp;
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (tp == fdp || ! same_file(tp, fdp)) continue;
+		tp->cache_valid = 0;
+		tp->cache_eof = 0;
+	}
+}
+
+
+/*
+ * mark a newly opened file as shared if it is already open through
+ * another FCB; shared files keep their read caches coherent
+ */
+static void
+check_shared(struct file_data *fdp) {
+	struct file_data *tp;
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (tp == fdp || ! same_file(tp, fdp)) continue;
+		tp->flags |= FILE_SHARED;
+		fdp->flags |= FILE_SHARED;
+	}
+}
+
+
+/*
+ * remove a file data structure from the file list and the file table,
+ * and queue its ID for reuse
+ */
+static void
+remove_filedata(struct file_data *fdp) {
+	if (fdp->prev_p) {
+		fdp->prev_p->next_p = fdp->next_p;
+	} else {
+		first_file_p = fdp->next_p;
+	}
+	if (fdp->next_p) fdp->next_p->prev_p = fdp->prev_p;
+	file_table[fdp->id] = NULL;
+	free_ids[(free_id_head + free_id_count) & 0xffff] = fdp->id;
+	free_id_count++;
+}
+
+
+/*
+ * search existing file data structure by the file ID in the FCB
  */
-static struct file_data **
-get_filedata_pp(int fcb, const char *caller) {
+static struct file_data *
+get_filedata(int fcb, const char *caller) {
 	int id, t;
-	struct file_data **fdpp = NULL;
+	struct file_data *fdp = NULL;
 	/*
 	 * get and check file ID from FCB
 	 */
@@ -747,23 +2231,20 @@ get_filedata_pp(int fcb, const char *caller) {
 		goto premature_exit;
 	}
 	/*
-	 * search for file ID in the file list
+	 * look up the file ID in the file table
 	 */
-	for (fdpp = &first_file_p;
-	    *fdpp && (*fdpp)->id < id;
-	    fdpp = &(*fdpp)->next_p);
+	if (id < file_table_size) fdp = file_table[id];
 	/*
 	 * not found: file already closed
 	 */
-	if (! *fdpp || (*fdpp)->id != id) {
+	if (! fdp) {
 		plog("%s (FCB 0x%04x): stale file ID in FCB", caller, fcb);
 		terminate = 1;
 		term_reason = ERR_LOGIC;
-		fdpp = NULL;
 		goto premature_exit;
 	}
 premature_exit:
-	return fdpp;
+	return fdp;
 }
 
 
@@ -789,24 +2270,240 @@ disk_reset(void) {
 }
 
 
+/*
+ * set up the disk parameter block and the allocation vector of a drive;
+ * all drives share the same memory for them, and except for disk image
+ * drives, the values are fake
+ */
+static void
+set_disk_params(int drive) {
+	/*
+	 * disk image drives have the parameters of the image
+	 */
+	if (conf_drives[drive] && conf_drive_type[drive] == DT_IMAGE) {
+		dsk_dpb(drive, memory + DPB);
+		dsk_alv(drive, memory + ALV, ALV_SIZE);
+		return;
+	}
+	/*
+	 * fake DPB for all other drives
+	 */
+	/*
+	 * SPT (sectors / track) 32 (randomly selected)
+	 */
+	memory[DPB] = (32 & 0xff);
+	memory[DPB + 1] = ((32 >> 8) & 0xff);
+	/*
+	 * BSH (block shift) 7 (<-- 16K BLS)
+	 */
+	memory[DPB + 2] = 7;
+	/*
+	 * BLM (block mask) 127 (<-- 16K BLS)
+	 */
+	memory[DPB + 3] = 127;
+	/*
+	 * EXM (extent mask) 7 (<-- 16K BLS, DSM 511, i. e. 8MB drive)
+	 */
+	memory[DPB + 4] = 7;
+	/*
+	 * DSM (# data blocks - 1) 511 (<-- 16K BLS, 8MB drive)
+	 */
+	memory[DPB + 5] = (511 & 0xff);
+	memory[DPB + 6] = ((511 >> 8) & 0xff);
+	/*
+	 * DSM (# directory entries - 1) 2047 (randomly selected)
+	 */
+	memory[DPB + 7] = (2047 & 0xff);
+	memory[DPB + 8] = ((2047 >> 8) & 0xff);
+	/*
+	 * AL0, AL1 (directory block vector) 0xf0 0x00 (<-- 2047 DRM, 16K BLS)
+	 */
+	memory[DPB + 9] = 0xf0;
+	memory[DPB + 10] = 0x00;
+	/*
+	 * CKS (directory check vector) 0 (fixed disk)
+	 */
+	memory[DPB + 11] = 0;
+	memory[DPB + 12] = 0;
+ 	/*
+	 * OFF (reserved tracks) 0 (none)
+	 */
+	memory[DPB + 13] = 0;
+	memory[DPB + 14] = 0;
+	/*
+	 * set up fake ALV (all blocks except the directory are free)
+	 */
+	memcpy(memory + ALV, memory + DPB + 9, 2);
+	memset(memory + ALV + 2, 0, ALV_SIZE - 2);
+}
+
+
+/*
+ * queue the file named in a default FCB for prefetching, together with
+ * the files of the same name and the configured companion extensions;
+ * only unambiguous names of files on directory drives are prefetched
+ */
+static void
+prefetch_fcb(const unsigned char *fcb) {
+	int drive, i;
+	char name[13], *cp, *dot = NULL;
+	const char *ep;
+	char **epp;
+	unsigned char c;
+	drive = fcb[0] ? fcb[0] - 1 : current_drive;
+	if (! conf_drives[drive] || conf_drive_type[drive] != DT_DIRECTORY) {
+		return;
+	}
+	/*
+	 * the file name in lower case (the dot is dropped again if there
+	 * is no extension)
+	 */
+	for (cp = name, i = 1; i < 12; i++) {
+		if (i == 9) {
+			dot = cp;
+			*cp++ = '.';
+		}
+		c = fcb[i] & 0x7f;
+		if (c == 0x20 /* SPC */) continue;
+		if (c >= 0x41 /* A */ && c <= 0x5a /* Z */) c += 0x20;
+		*cp++ = c;
+	}
+	if (cp == dot + 1) cp = dot;
+	*cp = '\0';
+	if (is_nice_filename(name)) pf_add(drive, drive_fd[drive], name);
+	/*
+	 * the companion files (restoring the dot dropped above)
+	 */
+	for (epp = conf_prefetch_ext; epp && *epp; epp++) {
+		*dot = '.';
+		cp = dot + 1;
+		for (ep = *epp; *ep && cp < dot + 4; ep++) {
+			c = *ep;
+			if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+			*cp++ = c;
+		}
+		*cp = '\0';
+		if (is_nice_filename(name)) {
+			pf_add(drive, drive_fd[drive], name);
+		}
+	}
+}
+
+
 /*
  * initialize the OS emulation; check command file name,
  * load command file, and set up the environment
  */
 int
 os_init(void) {
-	int rc = 0, i, t, drive, add_com;
+	int rc = 0, i, t, drive, add_com, handle = (-1);
 	size_t l, tpa_free, bfree, n;
+	ssize_t k = 0;
 	char *command_file = NULL;
 	const char *fn, *cp;
 	static const char valid_drive[] = "abcdefghijklmnop";
 	FILE *fp = NULL;
 	unsigned char *tpa_p;
 	wchar_t buffer[DMA_SIZE], *bp;
+	struct rlimit rl;
+	/*
+	 * open the directories of the drives (the layers of overlay drives,
+	 * the archives of tar drives, and the images of disk image drives
+	 * are opened by their emulations)
+	 */
+	for (i = 0; i < 16; i++) {
+		drive_fd[i] = (-1);
+		if (! conf_drives[i]) continue;
+		if ((conf_drive_type[i] == DT_OVERLAY && ovl_init(i)) ||
+		    (conf_drive_type[i] == DT_TAR && tar_init(i)) ||
+		    (conf_drive_type[i] == DT_IMAGE && dsk_init(i))) {
+			rc = (-1);
+			goto premature_exit;
+		}
+#ifdef AT_FDCWD
+		if (conf_drive_type[i] != DT_DIRECTORY) continue;
+#ifdef O_DIRECTORY
+		drive_fd[i] = open(conf_drives[i],
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#else
+		drive_fd[i] = open(conf_drives[i], O_RDONLY | O_CLOEXEC);
+#endif
+		if (drive_fd[i] == (-1)) {
+			perr("cannot open directory %s of drive %c: %s",
+			    conf_drives[i], 'A' + i, strerror(errno));
+			rc = (-1);
+			goto premature_exit;
+		}
+#endif
+	}
 	/*
-	 * reset disk subsystem
+	 * streams must have valid names on configured drives
+	 */
+	for (i = 0; i < conf_stream_count; i++) {
+		if (! conf_drives[conf_streams[i].drive] ||
+		    ! is_nice_filename(conf_streams[i].name)) {
+			perr("invalid stream %c:%s",
+			    'a' + conf_streams[i].drive,
+			    conf_streams[i].name);
+			rc = (-1);
+			goto premature_exit;
+		}
+	}
+	/*
+	 * size of the host file descriptor pool: configured, or derived
+	 * from the descriptor limit of the process, leaving a reserve for
+	 * drive directories, log files, streams, and the like
+	 */
+	if (conf_limit_descriptors > 0) {
+		fd_limit = conf_limit_descriptors;
+	} else if (! getrlimit(RLIMIT_NOFILE, &rl) &&
+	    rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < INT_MAX) {
+		fd_limit = (int) rl.rlim_cur - FD_RESERVE;
+		if (fd_limit < FD_MINIMUM) fd_limit = FD_MINIMUM;
+	}
+	/*
+	 * reset disk subsystem (after the drives have been set up, since
+	 * disk images which cannot be written make their drives read only)
 	 */
 	disk_reset();
+	/*
+	 * set up the directory indexes (built on first use); with inotify,
+	 * each drive directory is watched for changes
+	 */
+	for (i = 0; i < 16; i++) dir_index[i].wd = (-1);
+#ifdef __linux__
+	if (conf_dircache == DC_INOTIFY) {
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		for (i = 0; i < 16 && inotify_fd != (-1); i++) {
+			if (! conf_drives[i] ||
+			    conf_drive_type[i] != DT_DIRECTORY) continue;
+			dir_index[i].wd = inotify_add_watch(inotify_fd,
+			    conf_drives[i], IN_CREATE | IN_DELETE |
+			    IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+			    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+		}
+	}
+#endif
+	/*
+	 * the multi sector count set by a previous program run in the
+	 * same process (e. g. by tnylpo-bench) doesn't carry over
+	 */
+	multi_sector_count = 1;
+	/*
+	 * deterministic mode: restart the file IDs and the virtual clock,
+	 * and use UTC to make date conversions independent of the host
+	 */
+	if (conf_epoch >= 0) {
+		file_id = 1;
+		free_id_head = free_id_count = 0;
+		virtual_delay = 0;
+		if (setenv("TZ", "UTC0", 1) == (-1)) {
+			perr("cannot set time zone: %s", strerror(errno));
+			rc = (-1);
+			goto premature_exit;
+		}
+		tzset();
+	}
 	/*
 	 * find and load executeable
 	 */
@@ -854,6 +2551,14 @@ os_init(void) {
 			rc = (-1);
 			goto premature_exit;
 		}
+		/*
+		 * RAM drives are empty at startup
+		 */
+		if (conf_drive_type[drive] == DT_RAM) {
+			perr("drive %c: is a RAM drive", valid_drive[drive]);
+			rc = (-1);
+			goto premature_exit;
+		}
 		/*
 		 * check name
 		 */
@@ -862,21 +2567,51 @@ os_init(void) {
 		/*
 		 * create command path
 		 */
-		l = strlen(conf_drives[drive]) + 1 + strlen(fn) +
-		    (add_com ? 4 : 0) + 1;
+		l = strlen(fn) + (add_com ? 4 : 0) + 1;
+		command_file = alloc(l);
+		sprintf(command_file, "%s%s", fn, add_com ? ".com" : "");
+		/*
+		 * the command file of a tar or disk image drive is read
+		 * through the emulation of the drive
+		 */
+		if (conf_drive_type[drive] == DT_TAR ||
+		    conf_drive_type[drive] == DT_IMAGE) {
+			handle = open_drive_file(drive, command_file,
+			    O_RDONLY);
+			if (handle == (-1)) {
+				perr("cannot open command file %s/%s: %s",
+				    conf_drives[drive], command_file,
+				    strerror(errno));
+				rc = (-1);
+				goto premature_exit;
+			}
+		}
+		/*
+		 * the command file of an overlay drive is taken from the
+		 * topmost layer containing it
+		 */
+		if (conf_drive_type[drive] == DT_OVERLAY) {
+			cp = ovl_dir(drive, command_file);
+		} else {
+			cp = conf_drives[drive];
+		}
+		l += strlen(cp) + 1;
+		free(command_file);
 		command_file = alloc(l);
-		sprintf(command_file, "%s/%s%s", conf_drives[drive],
-		    fn, add_com ? ".com" : "");
+		sprintf(command_file, "%s/%s%s", cp, fn,
+		    add_com ? ".com" : "");
 	}
 	/*
 	 * load command file
 	 */
-	fp = fopen(command_file, "rb");
-	if (! fp) {
-		perr("cannot open command file %s: %s", command_file,
-		    strerror(errno));
-		rc = (-1);
-		goto premature_exit;
+	if (handle == (-1)) {
+		fp = fopen(command_file, "rb");
+		if (! fp) {
+			perr("cannot open command file %s: %s", command_file,
+			    strerror(errno));
+			rc = (-1);
+			goto premature_exit;
+		}
 	}
 	tpa_p = memory + TPA_START;
 	/*
@@ -885,9 +2620,15 @@ os_init(void) {
 	 */
 	tpa_free = BDOS_START - TPA_START;
 	while (tpa_free) {
-		l = fread(tpa_p, 1, tpa_free, fp);
+		if (handle != (-1)) {
+			k = read_drive_file(drive, handle, tpa_p, tpa_free,
+			    (off_t) (tpa_p - (memory + TPA_START)));
+			l = (k == (-1)) ? 0 : (size_t) k;
+		} else {
+			l = fread(tpa_p, 1, tpa_free, fp);
+		}
 		if (! l) {
-			if (feof(fp)) break;
+			if (handle != (-1) ? k == 0 : feof(fp)) break;
 			perr("read error on %s: %s", command_file,
 			    strerror(errno));
 			rc = (-1);
@@ -904,6 +2645,13 @@ os_init(void) {
 		rc = (-1);
 		goto premature_exit;
 	}
+	/*
+	 * the command file is an input of the program, too
+	 */
+	if (conf_dep_file || conf_cache_dir) {
+		dep_record(DK_READ, handle == (-1) ? command_file :
+		    conf_drives[drive], NULL);
+	}
 	/*
 	 * set up RET instructions in all magic addresses
 	 */
@@ -944,55 +2692,9 @@ os_init(void) {
 		memory[BIOS_VECTOR + i * 3 + 2] = ((t >> 8) & 0xff);
 	}
 	/*
-	 * set up fake DPB (used for all drives)
-	 */
-	/*
-	 * SPT (sectors / track) 32 (randomly selected)
-	 */
-	memory[DPB] = (32 & 0xff);
-	memory[DPB + 1] = ((32 >> 8) & 0xff);
-	/*
-	 * BSH (block shift) 7 (<-- 16K BLS)
-	 */
-	memory[DPB + 2] = 7;
-	/*
-	 * BLM (block mask) 127 (<-- 16K BLS)
-	 */
-	memory[DPB + 3] = 127;
-	/*
-	 * EXM (extent mask) 7 (<-- 16K BLS, DSM 511, i. e. 8MB drive)
-	 */
-	memory[DPB + 4] = 7;
-	/*
-	 * DSM (# data blocks - 1) 511 (<-- 16K BLS, 8MB drive)
-	 */
-	memory[DPB + 5] = (511 & 0xff);
-	memory[DPB + 6] = ((511 >> 8) & 0xff);
-	/*
-	 * DSM (# directory entries - 1) 2047 (randomly selected)
-	 */
-	memory[DPB + 7] = (2047 & 0xff);
-	memory[DPB + 8] = ((2047 >> 8) & 0xff);
-	/*
-	 * AL0, AL1 (directory block vector) 0xf0 0x00 (<-- 2047 DRM, 16K BLS)
-	 */
-	memory[DPB + 9] = 0xf0;
-	memory[DPB + 10] = 0x00;
-	/*
-	 * CKS (directory check vector) 0 (fixed disk)
-	 */
-	memory[DPB + 11] = 0;
-	memory[DPB + 12] = 0;
- 	/*
-	 * OFF (reserved tracks) 0 (none)
-	 */
-	memory[DPB + 13] = 0;
-	memory[DPB + 14] = 0;
-	/*
-	 * set up fake ALV (used for all drives)
+	 * set up DPB and ALV
 	 */
-	memcpy(memory + ALV, memory + DPB + 9, 2);
-	memset(memory + ALV + 2, 0, ALV_SIZE - 2); 
+	set_disk_params(current_drive);
 	/*
 	 * set up zero page
 	 */
@@ -1065,6 +2767,30 @@ os_init(void) {
 	setup_fcb(
 	    conf_argc > 1 ? conf_argv[1] : "",
 	    memory + DEFAULT_FCB_2);
+	/*
+	 * look the run up in the result cache; if its result has been
+	 * restored, the program is not run at all
+	 */
+	t = cch_init(tpa_p - (memory + TPA_START),
+	    current_drive);
+	if (t == (-1)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	if (t) {
+		terminate = 1;
+		term_reason = OK_TERM;
+		goto premature_exit;
+	}
+	/*
+	 * start reading the files named in the default FCBs, which the
+	 * program will probably open, while the program initializes
+	 */
+	if (conf_prefetch) {
+		prefetch_fcb(memory + DEFAULT_FCB_1);
+		prefetch_fcb(memory + DEFAULT_FCB_2);
+		pf_start(CACHE_SIZE);
+	}
 	/*
 	 * point PC to the start of the TPA
 	 */
@@ -1074,6 +2800,7 @@ os_init(void) {
 	}
 premature_exit:
 	if (fp) fclose(fp);
+	if (handle != (-1)) close_drive_file(drive, handle);
 	free(command_file);
 	return rc;
 }
@@ -1505,6 +3232,7 @@ static void
 bdos_reset_disk_system(void) {
 	static const char func[] = "reset disk system";
 	FDOS_ENTRY(func, 0);
+	flush_all(func);
 	disk_reset();
 	reg_l = reg_a = 0;
 	reg_h = reg_b = 0;
@@ -1550,7 +3278,6 @@ bdos_select_disk(void) {
 }
 
 
-#define L_UNIX_NAME (MB_LEN_MAX * 12 + 1)
 /*
  * extract name from FCB and check for validity (ambiguity is o.k.),
  * and return it as Unix file name
@@ -1645,15 +3372,6 @@ premature_exit:
 }
 
 
-/*
- * check if filename is ambigous (i. e., contains question marks)
- */
-static int
-is_ambigous(const char *name) {
-	return (strchr(name, '?') != NULL);
-}
-
-
 /*
  * get and check FCB address (FCBs can be of different size, depending
  * e.g. on whether they are used for random access functions or not)
@@ -1698,7 +3416,44 @@ get_drive(int fcb, const char *caller) {
 		term_reason = ERR_SELECT;
 		drive = (-1);
 	}
-	return drive;
+	return drive;
+}
+
+
+/*
+ * open a stream for reading or writing through an FCB; returns (-1)
+ * if this fails
+ */
+static int
+open_stream(int fcb, int drive, const char *name, int handle, int output,
+    const char *caller) {
+	int rc = (-1);
+	struct file_data *fdp;
+	cch_uncacheable("stream opened");
+	if (HOST_CALL(stm_open(handle, output)) == (-1)) {
+		plog("%s (FCB 0x%04x): could not open stream %s/%s: %s",
+		    caller, fcb, conf_drives[drive], name, strerror(errno));
+		/*
+		 * a stream already in use is reported to the program
+		 */
+		if (errno != EBUSY) {
+			terminate = 1;
+			term_reason = ERR_HOST;
+		}
+		goto premature_exit;
+	}
+	fdp = create_filedata(fcb, caller);
+	if (! fdp) {
+		stm_close(handle);
+		goto premature_exit;
+	}
+	fdp->drive = drive;
+	strcpy(fdp->name, name);
+	fdp->fd = handle;
+	fdp->flags = FILE_STREAM | (output ? 0 : FILE_ROFILE);
+	rc = 0;
+premature_exit:
+	return rc;
 }
 
 
@@ -1707,14 +3462,19 @@ get_drive(int fcb, const char *caller) {
  */
 static void
 bdos_open_file(void) {
-	int fcb, extent, drive, fd = (-1), ambigous = 0, flags = 0;
+	int fcb, extent, drive, fd = (-1), ambigous = 0, flags = 0,
+	    stream = (-1);
 	unsigned char temp_fcb[12];
 	char unix_name[L_UNIX_NAME];
 	struct file_list *flp = NULL, *tp;
-	char *path = NULL;
+	struct arena arena;
 	struct file_data *fdp;
 	static const char func[] = "open file";
 	FDOS_ENTRY(func, REGS_DE);
+	/*
+	 * the file list is allocated from a local arena
+	 */
+	init_arena(&arena);
 	/*
 	 * assume the operation fails
 	 */
@@ -1747,11 +3507,23 @@ bdos_open_file(void) {
 	 * file name may be ambigous
 	 */
 	ambigous = is_ambigous(unix_name);
+	if (ambigous) cch_uncacheable("ambiguous file name opened");
+	/*
+	 * streams are opened for reading
+	 */
+	if (! ambigous) stream = stm_find(drive, unix_name);
+	if (stream != (-1)) {
+		if (open_stream(fcb, drive, unix_name, stream, 0, func)) {
+			goto premature_exit;
+		}
+		reg_a = 0x00;
+		goto premature_exit;
+	}
 	/*
 	 * get a list of regular files matching the name in the FCB
 	 * (usually, this will be a one-element list)
 	 */
-	flp = get_filelist(conf_drives[drive], unix_name, func);
+	flp = get_filelist(drive, unix_name, &arena, func);
 	for (tp = flp; tp; tp = tp->next_p) {
 		/*
 		 * skip files to small for the given extent
@@ -1764,46 +3536,54 @@ bdos_open_file(void) {
 		break;
 	}
 	/*
-	 * no matching file found?
-	 */
-	if (! tp) goto premature_exit;
-	/*
-	 * allocate and assemble file path
+	 * no matching file found? (the program may depend on this)
 	 */
-	path = alloc(strlen(conf_drives[drive]) + strlen(unix_name) + 2);
-	sprintf(path, "%s/%s", conf_drives[drive], unix_name);
+	if (! tp) {
+		if (! ambigous) {
+			record_file(DK_EXAMINED, drive, unix_name, NULL);
+		}
+		goto premature_exit;
+	}
 	/*
-	 * open existing file
+	 * open existing file (making room in the descriptor pool first)
 	 */
+	if (conf_drive_type[drive] == DT_DIRECTORY ||
+	    conf_drive_type[drive] == DT_OVERLAY) reserve_fd();
 	if (flags) {
 		/*
 		 * disk r/o: file only can be read
 		 */
-		fd = open(path, O_RDONLY);
+		fd = open_drive_file(drive, unix_name, O_RDONLY);
 	} else {
 		/*
 		 * try to open r/w
 		 */
-		fd = open(path, O_RDWR);
+		fd = open_drive_file(drive, unix_name, O_RDWR);
 		if (fd == (-1) && errno == EACCES) {
 			/*
 			 * if there is a problem with file access,
 			 * assume that the file is r/o
 			 */
 			flags |= FILE_ROFILE;
-			fd = open(path, O_RDONLY);
+			fd = open_drive_file(drive, unix_name, O_RDONLY);
 		}
 	}
 	if (fd == (-1)) {
 		/*
 		 * there is a file, but we cannot open it
 		 */
-		plog("%s (FCB 0x%04x): could not open %s: %s", func,
-		    fcb, path, strerror(errno));
+		plog("%s (FCB 0x%04x): could not open %s/%s: %s", func,
+		    fcb, conf_drives[drive], unix_name, strerror(errno));
 		terminate = 1;
 		term_reason = ERR_HOST;
 		goto premature_exit;
 	}
+	/*
+	 * files of the lower layers of an overlay drive are opened read
+	 * only and copied to the top layer when they are first written
+	 */
+	if (conf_drive_type[drive] == DT_OVERLAY &&
+	    ovl_layer(drive, unix_name) > 0) flags |= FILE_LOWER;
 	/*
 	 * if the file name in the FCB was ambigous, update it
 	 */
@@ -1816,11 +3596,39 @@ bdos_open_file(void) {
 	 */
 	fdp = create_filedata(fcb, func);
 	if (! fdp) goto premature_exit;
-	fdp->path = path;
-	path = NULL;
+	fdp->drive = drive;
+	strcpy(fdp->name, unix_name);
 	fdp->fd = fd;
 	fd = (-1);
 	fdp->flags = flags;
+	if (is_pooled(fdp)) lru_add(fdp);
+	check_shared(fdp);
+	record_file(DK_READ, drive, unix_name, NULL);
+	/*
+	 * map the file if requested (the size in the file list is
+	 * rounded up to records, so get the exact size afterwards);
+	 * only host files can be mapped
+	 */
+	if (conf_map_files && (conf_drive_type[drive] == DT_DIRECTORY ||
+	    conf_drive_type[drive] == DT_OVERLAY)) {
+		map_file(fdp, tp->size * 128, func);
+		if (fdp->map && update_map(fcb, fdp, func)) goto premature_exit;
+	}
+	/*
+	 * data prefetched from the file becomes its first read cache
+	 * window
+	 */
+	if (fdp->map) {
+		pf_drop(drive, unix_name);
+	} else {
+		fdp->cache = pf_take(drive, unix_name, fdp->fd,
+		    &fdp->cache_valid, &fdp->cache_eof);
+		if (fdp->cache && log_level >= LL_FDOS) {
+			plog("%s (FCB 0x%04x): %lu prefetched bytes of %s/%s",
+			    func, fcb, (unsigned long) fdp->cache_valid,
+			    conf_drives[drive], unix_name);
+		}
+	}
 	/*
 	 * success: always return directory code 0
 	 */
@@ -1829,9 +3637,8 @@ premature_exit:
 	/*
 	 * clean up
 	 */
-	if (fd != (-1)) close(fd);
-	free_filelist(flp);
-	free(path);
+	if (fd != (-1)) close_drive_file(drive, fd);
+	free_arena(&arena);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -1843,8 +3650,8 @@ premature_exit:
  */
 static void
 bdos_close_file(void) {
-	int fcb;
-	struct file_data **fdpp, *fdp;
+	int fcb, t = 0;
+	struct file_data *fdp;
 	static const char func[] = "close file";
 	FDOS_ENTRY(func, REGS_DE);
 	/*
@@ -1859,9 +3666,14 @@ bdos_close_file(void) {
 	/*
 	 * get and verify FCB data structure
 	 */
-	fdpp = get_filedata_pp(fcb, func);
-	if (! fdpp) goto premature_exit;
-	fdp = *fdpp;
+	fdp = get_filedata(fcb, func);
+	if (! fdp) goto premature_exit;
+	/*
+	 * note modified files in the dependency list
+	 */
+	if ((fdp->flags & (FILE_WRITTEN | FILE_STREAM)) == FILE_WRITTEN) {
+		record_file(DK_WRITTEN, fdp->drive, fdp->name, NULL);
+	}
 	/*
 	 * some programs (e. g. dBase II) continue to use FCBs after
 	 * a call to close; therefore, there is a option to support
@@ -1869,32 +3681,52 @@ bdos_close_file(void) {
 	 */
 	if (dont_close) {
 		/*
-		 * just mark the file as flushed
+		 * just mark the file as flushed (and flush it unless
+		 * the durability policy is none)
 		 */
+		if (conf_durability != DUR_NONE &&
+		    sync_file(fdp, func)) goto premature_exit;
 		fdp->flags &= ~FILE_WRITTEN;
 		reg_a = 0x00;
 		goto premature_exit;
 	}
+	/*
+	 * write buffered data
+	 */
+	if (sync_file(fdp, func)) goto premature_exit;
 	/*
 	 * remove file structure from the list
 	 */
-	*fdpp = fdp->next_p;
+	remove_filedata(fdp);
 	/*
 	 * remove the file reference from the FCB
 	 */
 	memory[fcb + 16] = memory[fcb + 17] =
 	    memory[fcb + 18] = memory[fcb + 19] = 0x00;
 	/*
-	 * close the associated Unix file
+	 * close the associated Unix file (unless it has been parked by
+	 * the descriptor pool)
 	 */
-	if (close(fdp->fd) == (-1)) {
+	lru_remove(fdp);
+	if (fdp->fd != (-1)) {
+		t = (fdp->flags & FILE_STREAM) ? HOST_CALL(stm_close(fdp->fd)) :
+		    close_drive_file(fdp->drive, fdp->fd);
+	}
+	if (t == (-1)) {
 		/*
 		 * close failed: something is clearly amiss
 		 */
-		plog("%s (FCB 0x%04x): close(%s) failed: %s", func, fcb,
-		    fdp->path, strerror(errno));
+		plog("%s (FCB 0x%04x): close(%s/%s) failed: %s", func, fcb,
+		    conf_drives[fdp->drive], fdp->name, strerror(errno));
 		terminate = 1;
 		term_reason = ERR_HOST;
+	} else if (t) {
+		/*
+		 * the command of a stream failed: the output has not been
+		 * consumed, which is reported to the program
+		 */
+		plog("%s (FCB 0x%04x): command of stream %s/%s failed",
+		    func, fcb, conf_drives[fdp->drive], fdp->name);
 	} else {
 		/*
 		 * success: always return directory code 0
@@ -1918,45 +3750,43 @@ premature_exit:
 }
 
 
-/*
- * root of the search list used by bdos_search_for_first/next()
- */
-static struct file_list *search_list_p = NULL;
-
-
 /*
  * common end to bdos_search_for_first() and bdos_search_for_next():
- * return the first entry from the file list if there is one left
+ * return the next entry from the file list resp. the directory stream or
+ * index if there is one left
  */
 static void
-return_direntry(void) {
+return_direntry(const char *caller) {
 	unsigned char temp_fcb[12];
-	struct file_list *flp;
+	const char *name;
 	/*
 	 * default: no more entries in the list
 	 */
 	reg_a = 0xff;
 	/*
-	 * get first entry from the list
+	 * get first entry from the list and remove it, or read the
+	 * next entry from the directory stream or index
 	 */
-	flp = search_list_p;
-	if (! flp) goto premature_exit;
+	if (search_list_p) {
+		name = search_list_p->name;
+		search_list_p = search_list_p->next_p;
+	} else if (search_dp) {
+		name = read_search_stream(caller);
+	} else {
+		name = read_search_index(caller);
+	}
+	if (! name) goto premature_exit;
 	/*
 	 * construct a directory entry in the DMA area from the
-	 * first entry in the list: the file entry is always in the
+	 * entry: the file entry is always in the
 	 * first 32 bytes of the DMA area, and the rest is initialized
 	 * to 0xe5 bytes (which mark unused directory entries)
 	 */
-	setup_fcb(flp->name, temp_fcb);
+	setup_fcb(name, temp_fcb);
 	memset(memory + current_dma, 0, 32);
 	memset(memory + current_dma + 32, 0xe5, 96);
 	memcpy(memory + current_dma + 1, temp_fcb + 1, 11);
-	/*
-	 * remove the first entry from the list
-	 */
-	search_list_p = flp->next_p;
-	free(flp->name);
-	free(flp);
+	record_count++;
 	/*
 	 * always return directory code 0, since the entry is
 	 * always in the first 32 bytes of the DMA area
@@ -1976,6 +3806,7 @@ bdos_search_for_first(void) {
 	char unix_name[L_UNIX_NAME];
 	static const char func[] = "search for first";
 	FDOS_ENTRY(func, REGS_DE);
+	cch_uncacheable("directory searched");
 	/*
 	 * assume the operation fails
 	 */
@@ -2004,17 +3835,46 @@ bdos_search_for_first(void) {
 	 */
 	if (get_unix_name(fcb, unix_name, func) == (-1)) goto premature_exit;
 	/*
-	 * free old file list
-	 */
-	free_filelist(search_list_p);
-	/*
-	 * get a list of all matching file names
+	 * free old file list and directory stream
 	 */
-	search_list_p = get_filelist(conf_drives[drive], unix_name, func);
+	close_search_stream();
+	free_arena(&search_arena);
+	search_list_p = NULL;
+	if (conf_epoch < 0 && conf_drive_type[drive] == DT_DIRECTORY &&
+	    is_ambigous(unix_name)) {
+		/*
+		 * an ambigous name is searched incrementally, entry by
+		 * entry, in the directory index of the drive or, without
+		 * index, in the directory (file sizes must include data
+		 * still in write buffers)
+		 */
+		flush_all(func);
+		if (conf_dircache != DC_NONE &&
+		    check_dir_index(drive, func) == 0) {
+			search_index = 1;
+			search_bucket = (-1);
+			search_ep = NULL;
+		} else {
+			search_dp = open_drive_dir(drive);
+			if (! search_dp) {
+				plog("%s: opendir(%s) failed: %s", func,
+				    conf_drives[drive], strerror(errno));
+				goto premature_exit;
+			}
+		}
+		search_drive = drive;
+		prepare_name(unix_name, search_pattern);
+	} else {
+		/*
+		 * get a list of all matching file names
+		 */
+		search_list_p = get_filelist(drive, unix_name, &search_arena,
+		    func);
+	}
 	/*
-	 * return entry from the file list
+	 * return first entry
 	 */
-	return_direntry();
+	return_direntry(func);
 premature_exit:
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
@@ -2024,7 +3884,7 @@ premature_exit:
 
 
 /*
- * return the next file name from the list established by
+ * return the next file name of the search started by
  * bdos_search_for_first()
  */
 static void
@@ -2032,9 +3892,9 @@ bdos_search_for_next(void) {
 	static const char func[] = "search for next";
 	FDOS_ENTRY(func, 0);
 	/*
-	 * return entry from the file list
+	 * return next entry
 	 */
-	return_direntry();
+	return_direntry(func);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -2050,9 +3910,13 @@ bdos_delete_file(void) {
 	int fcb, drive, t;
 	char unix_name[L_UNIX_NAME];
 	struct file_list *flp = NULL, *tp;
-	char *path = NULL;
+	struct arena arena;
 	static const char func[] = "delete file";
 	FDOS_ENTRY(func, REGS_DE);
+	/*
+	 * the file list is allocated from a local arena
+	 */
+	init_arena(&arena);
 	/*
 	 * assume the operation fails
 	 */
@@ -2071,11 +3935,22 @@ bdos_delete_file(void) {
 	 * extract name from FCB and check it
 	 */
 	if (get_unix_name(fcb, unix_name, func) == (-1)) goto premature_exit;
+	if (is_ambigous(unix_name)) {
+		cch_uncacheable("ambiguous file name deleted");
+	}
 	/*
 	 * get a list of matching files
 	 */
-	flp = get_filelist(conf_drives[drive], unix_name, func);
-	if (! flp) goto premature_exit;
+	flp = get_filelist(drive, unix_name, &arena, func);
+	if (! flp) {
+		/*
+		 * the result depends on the absence of the file
+		 */
+		if (! is_ambigous(unix_name)) {
+			record_file(DK_EXAMINED, drive, unix_name, NULL);
+		}
+		goto premature_exit;
+	}
 	/*
 	 * if the disk is write only, scream and die
 	 */
@@ -2088,29 +3963,30 @@ bdos_delete_file(void) {
 	/*
 	 * traverse file list, deleting files
 	 */
+	settle_search(drive, func);
 	for (tp = flp; tp; tp = tp->next_p) {
-		/*
-		 * build path
-		 */
-		path = alloc(sizeof conf_drives[drive] + strlen(tp->name) + 2);
-		sprintf(path, "%s/%s", conf_drives[drive], tp->name);
 		/*
 		 * delete file
 		 */
-		t = unlink(path);
+		if (pin_files(drive, tp->name, func)) goto premature_exit;
+		record_file(DK_EXAMINED, drive, tp->name, NULL);
+		t = unlink_drive_file(drive, tp->name);
 		if (t == (-1)) {
 			/*
 			 * failed: assume write protected file
 			 */
-			plog("%s (FCB 0x%04x): unlink(%s) failed: %s", func,
-			    fcb, path, strerror(errno));
+			plog("%s (FCB 0x%04x): unlink(%s/%s) failed: %s",
+			    func, fcb, conf_drives[drive], tp->name,
+			    strerror(errno));
 			terminate = 1;
 			term_reason = ERR_ROFILE;
 			goto premature_exit;
 		}
-		free(path);
-		path = NULL;
+		remove_dir_entry(drive, tp->name);
+		pf_drop(drive, tp->name);
+		record_file(DK_DELETED, drive, tp->name, NULL);
 	}
+	note_dir_change(drive);
 	/*
 	 * success: always return directory code 0
 	 */
@@ -2119,8 +3995,7 @@ premature_exit:
 	/*
 	 * clean up
 	 */
-	free_filelist(flp);
-	free(path);
+	free_arena(&arena);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -2133,8 +4008,7 @@ premature_exit:
  */
 static struct file_data *
 file_fcb(int fcb, const char *caller) {
-	struct file_data **fdpp = get_filedata_pp(fcb, caller);
-	return fdpp ? *fdpp : NULL;
+	return get_filedata(fcb, caller);
 }
 
 
@@ -2181,91 +4055,308 @@ set_offset(int fcb, int offset) {
 
 
 /*
- * dump current DMA area
+ * dump a record in the DMA area
  */
 static void
-dump_record(void) {
-	plog("dump of record(0x%04x):", current_dma);
-	plog_dump(current_dma, 128);
+dump_record(int dma) {
+	plog("dump of record(0x%04x):", dma);
+	plog_dump(dma, 128);
+}
+
+
+/*
+ * get the number of records to be transferred by a read or write
+ * function, checking that they fit into memory at the DMA address
+ */
+static int
+get_record_count(const char *caller) {
+	if (MEMORY_SIZE - current_dma < multi_sector_count * 128) {
+		plog("%s: %d records at DMA address 0x%04x exceed memory",
+		    caller, multi_sector_count, current_dma);
+		terminate = 1;
+		term_reason = ERR_BDOSARG;
+		return (-1);
+	}
+	return multi_sector_count;
 }
 
 
 /*
- * read a 128 byte record from a file to the current DMA area;
- * return (-1) on EOF; incomplete records are filled with 0x1a (SUB/^Z)
+ * fill the read cache window of a file, starting at a given offset
  */
 static int
-read_record(int fcb, struct file_data *fdp, const char *caller) {
-	unsigned char *bp = memory + current_dma;
-	size_t n = 128;
+fill_cache(int fcb, struct file_data *fdp, off_t unix_offset, size_t size,
+    const char *caller) {
+	int rc = 0;
+	size_t n = 0;
 	ssize_t t;
-	while (n) {
-		t = read(fdp->fd, bp, n);
-		if (! t) break;
+	if (! fdp->cache) fdp->cache = alloc(CACHE_SIZE);
+	fdp->cache_offset = unix_offset;
+	fdp->cache_valid = 0;
+	fdp->cache_eof = 0;
+	/*
+	 * data still in write buffers must be read from the file
+	 */
+	if (fdp->dirty_length && flush_file(fdp, caller)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	if ((fdp->flags & FILE_SHARED) && flush_shared(fdp, caller)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	if (host_fd(fdp, caller) == (-1)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	while (n < size) {
+		t = read_drive_file(fdp->drive, fdp->fd, fdp->cache + n,
+		    size - n, unix_offset + n);
+		if (! t) {
+			fdp->cache_eof = 1;
+			break;
+		}
 		if (t == (-1)) {
-			plog("%s (FCB 0x%04x): read(%s) failed: %s", caller,
-			    fcb, fdp->path, strerror(errno));
+			plog("%s (FCB 0x%04x): pread(%s/%s) failed: %s",
+			    caller, fcb, conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
 			terminate = 1;
 			term_reason = ERR_HOST;
+			rc = (-1);
 			break;
 		}
-		bp += t;
-		n -=t;
+		n += t;
 	}
-	if (n < 128) memset(bp, 0x1a /* SUB */, n);
-	if (log_level >= LL_RECORDS && n < 128) dump_record();
-	return (n == 128) ? (-1) : 0;
+	fdp->cache_valid = n;
+premature_exit:
+	return rc;
 }
 
 
 /*
- * write a 128 byte record from the current DMA area to a file;
- * return (-1) on error
+ * read a 128 byte record (given by its record number) from a file to
+ * the DMA area at dma; return (-1) on EOF; incomplete records are
+ * filled with 0x1a (SUB/^Z). Records are read through the cache window
+ * of the file, which is refilled if the record is not in the window.
  */
 static int
-write_record(int fcb, struct file_data *fdp, const char *caller) {
-	unsigned char *bp = memory + current_dma;
-	size_t n = 128;
-	ssize_t t;
-	while (n) {
-		t = write(fdp->fd, bp, n);
+read_record(int fcb, struct file_data *fdp, int offset, int dma,
+    const char *caller) {
+	off_t unix_offset = ((off_t) offset) * 128;
+	size_t n;
+	int t;
+	/*
+	 * streams are read sequentially, whatever the record number
+	 */
+	if (fdp->flags & FILE_STREAM) {
+		t = HOST_CALL(stm_read(fdp->fd, memory + dma));
 		if (t == (-1)) {
-			plog("%s (FCB 0x%04x): write(%s) failed: %s", caller,
-			    fcb, fdp->path, strerror(errno));
+			plog("%s (FCB 0x%04x): read(%s/%s) failed: %s",
+			    caller, fcb, conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
 			terminate = 1;
 			term_reason = ERR_HOST;
-			break;
 		}
-		bp += t;
-		n -=t;
+		if (t <= 0) return (-1);
+		record_count++;
+		if (log_level >= LL_RECORDS) dump_record(dma);
+		return 0;
 	}
-	fdp->flags |= FILE_WRITTEN;
-	if (log_level >= LL_RECORDS) dump_record();
-	return n ? (-1) : 0;
+	/*
+	 * mapped file: copy the record directly from the mapping (after
+	 * writing buffered data touching the record or buffered for other
+	 * FCBs on the same file, and checking whether the file has grown
+	 * if the record seems to be beyond the end of file)
+	 */
+	if (fdp->map) {
+		if ((fdp->flags & FILE_SHARED) && flush_shared(fdp, caller)) {
+			return (-1);
+		}
+		if (overlaps_buffer(fdp, unix_offset) &&
+		    flush_file(fdp, caller)) return (-1);
+		if (unix_offset >= fdp->map_size &&
+		    update_map(fcb, fdp, caller)) return (-1);
+	}
+	if (fdp->map) {
+		if (unix_offset >= fdp->map_size) return (-1);
+		n = fdp->map_size - unix_offset;
+		if (n > 128) n = 128;
+		memcpy(memory + dma, fdp->map + unix_offset, n);
+		memset(memory + dma + n, 0x1a /* SUB */, 128 - n);
+		record_count++;
+		if (log_level >= LL_RECORDS) dump_record(dma);
+		return 0;
+	}
+	/*
+	 * refill the cache window if the record is outside of it
+	 * (unless the window already covers the end of file)
+	 */
+	if (unix_offset < fdp->cache_offset ||
+	    unix_offset + 128 > fdp->cache_offset + fdp->cache_valid) {
+		if (! fdp->cache_eof || unix_offset < fdp->cache_offset ||
+		    unix_offset >= fdp->cache_offset + CACHE_SIZE) {
+			if (fill_cache(fcb, fdp, unix_offset,
+			    (offset == fdp->next_record) ?
+			    CACHE_SIZE : CACHE_RANDOM, caller)) return (-1);
+		}
+	}
+	/*
+	 * copy the record (or what is left of it before the end of file)
+	 */
+	fdp->next_record = offset + 1;
+	if (unix_offset >= fdp->cache_offset + fdp->cache_valid) return (-1);
+	n = fdp->cache_offset + fdp->cache_valid - unix_offset;
+	if (n > 128) n = 128;
+	memcpy(memory + dma, fdp->cache + (unix_offset -
+	    fdp->cache_offset), n);
+	memset(memory + dma + n, 0x1a /* SUB */, 128 - n);
+	record_count++;
+	if (log_level >= LL_RECORDS) dump_record(dma);
+	return 0;
 }
 
 
 /*
- * seek to a particular offset in a Unix file (the offset is given in
- * CP/M records of 128 bytes)
+ * write a 128 byte record (given by its record number) from the DMA
+ * area at dma to a file; return (-1) on error. The record is stored in the
+ * write buffer of the file; adjacent records are collected there and
+ * written by a single system call. A cache window containing the
+ * record is updated, otherwise it is invalidated if the write touches it.
  */
 static int
-seek(int fcb, struct file_data *fdp, int offset, const char *caller) {
-	int rc = 0;
-	off_t unix_offset;
+write_record(int fcb, struct file_data *fdp, int offset, int dma,
+    const char *caller) {
+	off_t unix_offset = ((off_t) offset) * 128;
+	if (limit_output(128)) return (-1);
 	/*
-	 * calculate unix file offset and set file position
+	 * streams are written sequentially, whatever the record number
 	 */
-	unix_offset = offset;
-	unix_offset *= 128;
-	if (lseek(fdp->fd, unix_offset, SEEK_SET) == (off_t) (-1)) {
-		plog("%s (FCB 0x%04x): lseek(%s) failed: %s", caller, fcb,
-		    fdp->path, strerror(errno));
-		terminate = 1;
-		term_reason = ERR_HOST;
-		rc = (-1);
+	if (fdp->flags & FILE_STREAM) {
+		if (HOST_CALL(stm_write(fdp->fd, memory + dma)) == (-1)) {
+			plog("%s (FCB 0x%04x): write(%s/%s) failed: %s",
+			    caller, fcb, conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+			terminate = 1;
+			term_reason = ERR_HOST;
+			return (-1);
+		}
+		fdp->flags |= FILE_WRITTEN;
+		record_count++;
+		if (log_level >= LL_RECORDS) dump_record(dma);
+		return 0;
 	}
-	return rc;
+	/*
+	 * writes through other FCBs on the same file are passed to the
+	 * host first to keep their order
+	 */
+	if ((fdp->flags & FILE_SHARED) && flush_shared(fdp, caller)) {
+		return (-1);
+	}
+	/*
+	 * mapped file: copy the record directly to the mapping if it
+	 * lies within the file and not in buffered data; records extending
+	 * the file are collected in the write buffer (the mapping is
+	 * extended when the file is read after the buffer was flushed)
+	 */
+	if (fdp->map && unix_offset + 128 <= fdp->map_size &&
+	    ! overlaps_buffer(fdp, unix_offset)) {
+		memcpy(fdp->map + unix_offset, memory + dma, 128);
+		fdp->flags |= FILE_WRITTEN;
+		if (fdp->flags & FILE_SHARED) invalidate_shared(fdp);
+		record_count++;
+		if (log_level >= LL_RECORDS) dump_record(dma);
+		return 0;
+	}
+	/*
+	 * flush the write buffer if the record neither lies in nor
+	 * continues the buffered data
+	 */
+	if (fdp->dirty_length && (unix_offset < fdp->dirty_offset ||
+	    unix_offset > fdp->dirty_offset + fdp->dirty_length ||
+	    unix_offset + 128 > fdp->dirty_offset + WRITE_BUFFER_SIZE)) {
+		if (flush_file(fdp, caller)) return (-1);
+	}
+	/*
+	 * store the record in the write buffer
+	 */
+	if (! fdp->buffer) fdp->buffer = alloc(WRITE_BUFFER_SIZE);
+	if (! fdp->dirty_length) fdp->dirty_offset = unix_offset;
+	memcpy(fdp->buffer + (unix_offset - fdp->dirty_offset),
+	    memory + dma, 128);
+	if (unix_offset + 128 > fdp->dirty_offset + fdp->dirty_length) {
+		fdp->dirty_length = unix_offset + 128 - fdp->dirty_offset;
+	}
+	fdp->flags |= FILE_WRITTEN;
+	/*
+	 * keep the cache window coherent
+	 */
+	if (unix_offset >= fdp->cache_offset &&
+	    unix_offset + 128 <= fdp->cache_offset + fdp->cache_valid) {
+		memcpy(fdp->cache + (unix_offset - fdp->cache_offset),
+		    memory + dma, 128);
+	} else if (unix_offset + 128 > fdp->cache_offset &&
+	    unix_offset < fdp->cache_offset + CACHE_SIZE) {
+		fdp->cache_valid = 0;
+		fdp->cache_eof = 0;
+	}
+	if (fdp->flags & FILE_SHARED) invalidate_shared(fdp);
+	record_count++;
+	if (log_level >= LL_RECORDS) dump_record(dma);
+	return 0;
+}
+
+
+/*
+ * read count consecutive records (up to the maximal file size) from a
+ * file to consecutive 128 byte blocks starting at the current DMA
+ * address; returns the number of records read. If the records are not
+ * in the cache window of the file, the window is refilled to cover all
+ * of them by a single system call.
+ */
+static int
+read_records(int fcb, struct file_data *fdp, int offset, int count,
+    const char *caller) {
+	off_t unix_offset = ((off_t) offset) * 128;
+	size_t size;
+	int i;
+	if (count > 65536 - offset) count = 65536 - offset;
+	size = ((size_t) count) * 128;
+	if (count > 1 && ! fdp->map && ! (fdp->flags & FILE_STREAM) &&
+	    (unix_offset < fdp->cache_offset ||
+	    unix_offset + size > fdp->cache_offset + fdp->cache_valid)) {
+		if (! fdp->cache_eof || unix_offset < fdp->cache_offset ||
+		    unix_offset + size > fdp->cache_offset + CACHE_SIZE) {
+			if (fill_cache(fcb, fdp, unix_offset,
+			    (offset == fdp->next_record) ? CACHE_SIZE :
+			    (size > CACHE_RANDOM) ? size : CACHE_RANDOM,
+			    caller)) return 0;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (read_record(fcb, fdp, offset + i, current_dma + i * 128,
+		    caller) == (-1)) break;
+	}
+	return i;
+}
+
+
+/*
+ * write count consecutive records (up to the maximal file size) from
+ * consecutive 128 byte blocks starting at the current DMA address to a
+ * file; returns the number of records written. The records are collected
+ * in the write buffer (or copied to the mapping) of the file, so they
+ * reach the host in a single system call.
+ */
+static int
+write_records(int fcb, struct file_data *fdp, int offset, int count,
+    const char *caller) {
+	int i;
+	if (count > 65536 - offset) count = 65536 - offset;
+	for (i = 0; i < count; i++) {
+		if (write_record(fcb, fdp, offset + i, current_dma + i * 128,
+		    caller) == (-1)) break;
+	}
+	return i;
 }
 
 
@@ -2274,7 +4365,7 @@ seek(int fcb, struct file_data *fdp, int offset, const char *caller) {
  */
 static void
 bdos_read_sequential(void) {
-	int fcb, offset;
+	int fcb, offset, count, n = 0;
 	struct file_data *fdp = NULL;
 	static const char func[] = "read sequential";
 	FDOS_ENTRY(func, REGS_DE);
@@ -2293,6 +4384,11 @@ bdos_read_sequential(void) {
 	 */
 	fdp = file_fcb(fcb, func);
 	if (! fdp) goto premature_exit;
+	/*
+	 * get and check number of records
+	 */
+	count = get_record_count(func);
+	if (count == (-1)) goto premature_exit;
 	/*
 	 * get and check current file offset;
 	 */
@@ -2305,31 +4401,85 @@ bdos_read_sequential(void) {
 		goto premature_exit;
 	}
 	/*
-	 * set file position
+	 * read the records to the current DMA buffer and advance
+	 * offset in FCB
 	 */
-	if (seek(fcb, fdp, offset, func) == (-1)) goto premature_exit;
-	/*
-	 * read 128 bytes to the current DMA buffer
-	 */
-	if (read_record(fcb, fdp, func) == (-1)) goto premature_exit;
-	/*
-	 * advance offset in FCB
-	 */
-	set_offset(fcb, offset + 1);
+	n = read_records(fcb, fdp, offset, count, func);
+	set_offset(fcb, offset + n);
+	if (n < count) {
+		if (offset + n == 65536) reg_a = 0x06;
+		goto premature_exit;
+	}
 	/*
 	 * success
 	 */
 	reg_a = 0x00;
 premature_exit:
 	reg_l = reg_a;
-	reg_h = reg_b = 0;
+	/*
+	 * on errors, H contains the number of records read
+	 */
+	reg_h = reg_b = reg_a ? n : 0;
 	FDOS_EXIT(func, REGS_A);
 	return;
 }
 
 
 /*
- * check if disk or file are writeable
+ * copy a file of a lower layer of an overlay drive to the top layer,
+ * and reopen all FCBs open on the file for writing
+ */
+static int
+copy_up(int fcb, struct file_data *fdp, const char *caller) {
+	int rc = (-1), fd;
+	struct file_data *tp;
+	if (ovl_copy_up(fdp->drive, fdp->name) == (-1)) {
+		plog("%s (FCB 0x%04x): cannot copy %s/%s to the top layer: %s",
+		    caller, fcb, conf_drives[fdp->drive], fdp->name,
+		    strerror(errno));
+		terminate = 1;
+		term_reason = ERR_HOST;
+		goto premature_exit;
+	}
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (! (tp->flags & FILE_LOWER) || ! same_file(tp, fdp)) {
+			continue;
+		}
+		/*
+		 * parked files are reopened for writing on their next
+		 * access anyway
+		 */
+		if (tp->flags & FILE_PARKED) {
+			tp->flags &= ~FILE_LOWER;
+			if (tp->map) map_file(tp, tp->map_size, caller);
+			continue;
+		}
+		fd = open_drive_file(tp->drive, tp->name, O_RDWR);
+		if (fd == (-1)) {
+			plog("%s (FCB 0x%04x): could not open %s/%s: %s",
+			    caller, fcb, conf_drives[tp->drive], tp->name,
+			    strerror(errno));
+			terminate = 1;
+			term_reason = ERR_HOST;
+			goto premature_exit;
+		}
+		HOST_CALL(close(tp->fd));
+		tp->fd = fd;
+		tp->flags &= ~FILE_LOWER;
+		/*
+		 * replace the private read only mapping of the lower file
+		 */
+		if (tp->map) map_file(tp, tp->map_size, caller);
+	}
+	rc = 0;
+premature_exit:
+	return rc;
+}
+
+
+/*
+ * check if disk or file are writeable; files of lower layers of overlay
+ * drives are copied to the top layer
  */
 static int
 check_writeable(int fcb, struct file_data *fdp, const char *caller) {
@@ -2338,8 +4488,8 @@ check_writeable(int fcb, struct file_data *fdp, const char *caller) {
 	 * disk read only?
 	 */
 	if (fdp->flags & FILE_RODISK) {
-		plog("%s (FCB 0x%04x): %s: write protected disk", caller, fcb,
-		    fdp->path);
+		plog("%s (FCB 0x%04x): %s/%s: write protected disk", caller,
+		    fcb, conf_drives[fdp->drive], fdp->name);
 		terminate = 1;
 		term_reason = ERR_RODISK;
 		goto premature_exit;
@@ -2348,12 +4498,15 @@ check_writeable(int fcb, struct file_data *fdp, const char *caller) {
 	 * file read only?
 	 */
 	if (fdp->flags & FILE_ROFILE) {
-		plog("%s (FCB 0x%04x): %s is write protected", caller, fcb,
-		    fdp->path);
+		plog("%s (FCB 0x%04x): %s/%s is write protected", caller,
+		    fcb, conf_drives[fdp->drive], fdp->name);
 		terminate = 1;
 		term_reason = ERR_ROFILE;
 		goto premature_exit;
 	}
+	if ((fdp->flags & FILE_LOWER) && copy_up(fcb, fdp, caller)) {
+		goto premature_exit;
+	}
 	rc = 0;
 premature_exit:
 	return rc;
@@ -2365,7 +4518,7 @@ premature_exit:
  */
 static void
 bdos_write_sequential(void) {
-	int fcb, offset;
+	int fcb, offset, count, n = 0;
 	struct file_data *fdp;
 	static const char func[] = "write sequential";
 	FDOS_ENTRY(func, REGS_DE);
@@ -2388,6 +4541,11 @@ bdos_write_sequential(void) {
 	 * check for write protection
 	 */
 	if (check_writeable(fcb, fdp, func) == (-1)) goto premature_exit;
+	/*
+	 * get and check number of records
+	 */
+	count = get_record_count(func);
+	if (count == (-1)) goto premature_exit;
 	/*
 	 * get and check current file offset;
 	 */
@@ -2400,24 +4558,25 @@ bdos_write_sequential(void) {
 		goto premature_exit;
 	}
 	/*
-	 * set file position
-	 */
-	if (seek(fcb, fdp, offset, func) == (-1)) goto premature_exit;
-	/*
-	 * write 128 bytes from the current DMA buffer
+	 * write the records from the current DMA buffer and advance
+	 * offset in FCB
 	 */
-	if (write_record(fcb, fdp, func) == (-1)) goto premature_exit;
-	/*
-	 * advance offset in FCB
-	 */
-	set_offset(fcb, offset + 1);
+	n = write_records(fcb, fdp, offset, count, func);
+	set_offset(fcb, offset + n);
+	if (n < count) {
+		if (offset + n == 65536) reg_a = 0x06;
+		goto premature_exit;
+	}
 	/*
 	 * success
 	 */
 	reg_a = 0;
 premature_exit:
 	reg_l = reg_a;
-	reg_h = reg_b = 0;
+	/*
+	 * on errors, H contains the number of records written
+	 */
+	reg_h = reg_b = reg_a ? n : 0;
 	FDOS_EXIT(func, REGS_A);
 	return;
 }
@@ -2428,9 +4587,8 @@ premature_exit:
  */
 static void
 bdos_make_file(void) {
-	int fcb, drive, fd = (-1);
+	int fcb, drive, fd = (-1), stream;
 	char unix_name[L_UNIX_NAME];
-	char *path = NULL;
 	struct file_data *fdp;
 	static const char func[] = "make file";
 	FDOS_ENTRY(func, REGS_DE);
@@ -2478,30 +4636,55 @@ bdos_make_file(void) {
 		goto premature_exit;
 	}
 	/*
-	 * allocate and assemble file path
+	 * streams are opened for writing
 	 */
-	path = alloc(strlen(conf_drives[drive]) + strlen(unix_name) + 2);
-	sprintf(path, "%s/%s", conf_drives[drive], unix_name);
+	stream = stm_find(drive, unix_name);
+	if (stream != (-1)) {
+		if (open_stream(fcb, drive, unix_name, stream, 1, func)) {
+			goto premature_exit;
+		}
+		reg_a = 0x00;
+		goto premature_exit;
+	}
 	/*
 	 * create new file
 	 */
-	fd = open(path, O_CREAT|O_EXCL|O_RDWR, 0666);
+	settle_search(drive, func);
+	if (conf_drive_type[drive] == DT_DIRECTORY ||
+	    conf_drive_type[drive] == DT_OVERLAY) reserve_fd();
+	fd = open_drive_file(drive, unix_name, O_CREAT|O_EXCL|O_RDWR);
 	if (fd == (-1)) {
-		plog("%s (FCB 0x%04x): could not create %s: %s", func, fcb,
-		    path, strerror(errno));
-		terminate = 1;
-		term_reason = ERR_HOST;
+		plog("%s (FCB 0x%04x): could not create %s/%s: %s", func,
+		    fcb, conf_drives[drive], unix_name, strerror(errno));
+		/*
+		 * a full directory is reported to the program
+		 */
+		if (errno != ENOSPC) {
+			terminate = 1;
+			term_reason = ERR_HOST;
+		}
 		goto premature_exit;
 	}
+	add_dir_entry(drive, unix_name);
+	note_dir_change(drive);
+	pf_drop(drive, unix_name);
+	record_file(DK_CREATED, drive, unix_name, NULL);
 	/*
 	 * create file structure
 	 */
 	fdp = create_filedata(fcb, func);
-	fdp->path = path;
-	path = NULL;
+	if (! fdp) goto premature_exit;
+	fdp->drive = drive;
+	strcpy(fdp->name, unix_name);
 	fdp->fd = fd;
 	fd = (-1);
 	fdp->flags = 0;
+	if (is_pooled(fdp)) lru_add(fdp);
+	check_shared(fdp);
+	if (conf_map_files && (conf_drive_type[drive] == DT_DIRECTORY ||
+	    conf_drive_type[drive] == DT_OVERLAY)) {
+		map_file(fdp, 0, func);
+	}
 	/*
 	 * success: always return directory code 0
 	 */
@@ -2510,8 +4693,7 @@ premature_exit:
 	/*
 	 * clean up
 	 */
-	if (fd != (-1)) close(fd);
-	free(path);
+	if (fd != (-1)) close_drive_file(drive, fd);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -2524,10 +4706,9 @@ premature_exit:
 static void
 bdos_rename_file(void) {
 	int fcb, drive;
-	char unix_name_old[L_UNIX_NAME], unix_name_new[L_UNIX_NAME],
-	    *path_old = NULL, *path_new = NULL;
+	char unix_name_old[L_UNIX_NAME], unix_name_new[L_UNIX_NAME];
+	struct file_data *tp;
 	static const char func[] = "rename file";
-	size_t l;
 	FDOS_ENTRY(func, REGS_DE);
 	/*
 	 * assume the operation fails
@@ -2575,19 +4756,18 @@ bdos_rename_file(void) {
 		goto premature_exit;
 	}
 	/*
-	 * allocate and assemble old and new file paths
+	 * the result depends on the presence or absence of both files
 	 */
-	l = strlen(conf_drives[drive]);
-	path_old = alloc(l + strlen(unix_name_old) + 2);
-	sprintf(path_old, "%s/%s", conf_drives[drive], unix_name_old);
-	path_new = alloc(l + strlen(unix_name_new) + 2);
-	sprintf(path_new, "%s/%s", conf_drives[drive], unix_name_new);
+	record_file(DK_EXAMINED, drive, unix_name_old, NULL);
+	record_file(DK_EXAMINED, drive, unix_name_new, NULL);
 	/*
 	 * create new link
 	 */
-	if (link(path_old, path_new) == (-1)) {
-		plog("%s (FCB 0x%04x): link(%s, %s) failed: %s", func,
-		    fcb, path_old, path_new, strerror(errno));
+	settle_search(drive, func);
+	if (link_drive_file(drive, unix_name_old, unix_name_new) == (-1)) {
+		plog("%s (FCB 0x%04x): link(%s/%s, %s) failed: %s", func,
+		    fcb, conf_drives[drive], unix_name_old, unix_name_new,
+		    strerror(errno));
 		switch (errno) {
 		case ENOENT:
 		case EEXIST:
@@ -2606,24 +4786,35 @@ bdos_rename_file(void) {
 	/*
 	 * delete old link
 	 */
-	if (unlink(path_old) == (-1)) {
-		plog("%s (FCB 0x%04x): unlink(%s) failed: %s", func,
-		    fcb, path_old, strerror(errno));
+	if (unlink_drive_file(drive, unix_name_old) == (-1)) {
+		plog("%s (FCB 0x%04x): unlink(%s/%s) failed: %s", func,
+		    fcb, conf_drives[drive], unix_name_old, strerror(errno));
 		terminate = 1;
 		term_reason = ERR_HOST;
-		unlink(path_new);
+		unlink_drive_file(drive, unix_name_new);
+		note_dir_change(drive);
 		goto premature_exit;
 	}
+	remove_dir_entry(drive, unix_name_old);
+	add_dir_entry(drive, unix_name_new);
+	note_dir_change(drive);
+	pf_drop(drive, unix_name_old);
+	pf_drop(drive, unix_name_new);
+	record_file(DK_RENAMED, drive, unix_name_old, unix_name_new);
+	/*
+	 * files still open under the old name are reopened under the new
+	 * one by the descriptor pool
+	 */
+	for (tp = first_file_p; tp; tp = tp->next_p) {
+		if (tp->drive == drive && ! strcmp(tp->name, unix_name_old)) {
+			strcpy(tp->name, unix_name_new);
+		}
+	}
 	/*
 	 * success: always return directory code 0
 	 */
 	reg_a = 0x00;
 premature_exit:
-	/*
-	 * clean up
-	 */
-	free(path_old);
-	free(path_new);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -2683,13 +4874,15 @@ bdos_set_dma_address(void) {
 
 
 /*
- * the allocation vector is a dummy in this implementation; all drives
- * share the same allocation vector to save memory space
+ * the allocation vector is a dummy in this implementation (except for
+ * disk image drives); all drives share the same allocation vector to
+ * save memory space, so it is set up for the current drive
  */
 static void
 bdos_get_addr_alloc(void) {
 	static const char func[] = "get addr alloc";
 	FDOS_ENTRY(func, 0);
+	set_disk_params(current_drive);
 	reg_l = reg_a = (ALV & 0xff);
 	reg_h = reg_b = ((ALV >> 8) & 0xff);
 	FDOS_EXIT(func, REGS_HL);
@@ -2735,7 +4928,7 @@ bdos_get_read_only_vector(void) {
 static void
 bdos_set_file_attributes(void) {
 	int fcb, drive;
-	char unix_name[L_UNIX_NAME], *path = NULL;
+	char unix_name[L_UNIX_NAME];
 	static const char func[] = "set file attributes";
 	FDOS_ENTRY(func, REGS_DE);
 	/*
@@ -2773,12 +4966,8 @@ bdos_set_file_attributes(void) {
 	/*
 	 * success: always return directory code 0
 	 */
-	reg_a = 0x00;
-premature_exit:
-	/*
-	 * clean up
-	 */
-	free(path);
+	reg_a = 0x00;
+premature_exit:
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -2787,12 +4976,15 @@ premature_exit:
 
 /*
  * the disk parameters are dummy values (but consistent with the size
- * of the allocation vector); all drives share the same disk parameter block
+ * of the allocation vector) except for disk image drives; all drives
+ * share the same disk parameter block, so it is set up for the current
+ * drive
  */
 static void
 bdos_get_addr_diskparams(void) {
 	static const char func[] = "get addr diskparams";
 	FDOS_ENTRY(func, 0);
+	set_disk_params(current_drive);
 	reg_l = reg_a = (DPB & 0xff);
 	reg_h = reg_b = ((DPB >> 8) & 0xff);
 	FDOS_EXIT(func, REGS_HL);
@@ -2855,7 +5047,7 @@ get_random(int fcb, const char *caller) {
  */
 static void
 bdos_read_random(void) {
-	int fcb, offset;
+	int fcb, offset, count, n = 0;
 	struct file_data *fdp;
 	static const char func[] = "read random";
 	FDOS_ENTRY(func, REGS_DE);
@@ -2873,6 +5065,11 @@ bdos_read_random(void) {
 	 */
 	fdp = file_fcb(fcb, func);
 	if (! fdp) goto premature_exit;
+	/*
+	 * get and check number of records
+	 */
+	count = get_record_count(func);
+	if (count == (-1)) goto premature_exit;
 	/*
 	 * get and check current random record number;
 	 */
@@ -2885,24 +5082,26 @@ bdos_read_random(void) {
 		goto premature_exit;
 	}
 	/*
-	 * set file position
-	 */
-	if (seek(fcb, fdp, offset, func) == (-1)) goto premature_exit;
-	/*
-	 * read 128 bytes to the current DMA buffer
-	 */
-	if (read_record(fcb, fdp, func) == (-1)) goto premature_exit;
-	/*
-	 * set sequential offset in FCB
+	 * read the records to the current DMA buffer and set
+	 * sequential offset in FCB to the last record read (the
+	 * random record number remains unchanged)
 	 */
-	set_offset(fcb, offset);
+	n = read_records(fcb, fdp, offset, count, func);
+	if (n) set_offset(fcb, offset + n - 1);
+	if (n < count) {
+		if (offset + n == 65536) reg_a = 0x06;
+		goto premature_exit;
+	}
 	/*
 	 * report success
 	 */
 	reg_a = 0x00;
 premature_exit:
 	reg_l = reg_a;
-	reg_h = reg_b = 0;
+	/*
+	 * on errors, H contains the number of records read
+	 */
+	reg_h = reg_b = reg_a ? n : 0;
 	FDOS_EXIT(func, REGS_A);
 	return;
 }
@@ -2916,7 +5115,7 @@ premature_exit:
  */
 static void
 write_random(const char *caller) {
-	int fcb, offset;
+	int fcb, offset, count, n = 0;
 	struct file_data *fdp;
 	/*
 	 * assume the operation fails (0x05 means "no available directory
@@ -2939,6 +5138,11 @@ write_random(const char *caller) {
 	 * check for write protection
 	 */
 	if (check_writeable(fcb, fdp, caller) == (-1)) goto premature_exit;
+	/*
+	 * get and check number of records
+	 */
+	count = get_record_count(caller);
+	if (count == (-1)) goto premature_exit;
 	/*
 	 * get and check current random record number;
 	 */
@@ -2951,22 +5155,26 @@ write_random(const char *caller) {
 		goto premature_exit;
 	}
 	/*
-	 * set file position
-	 */
-	if (seek(fcb, fdp, offset, caller) == (-1)) goto premature_exit;
-	/*
-	 * write 128 bytes from the current DMA buffer
-	 */
-	if (write_record(fcb, fdp, caller) == (-1)) goto premature_exit;
-	/*
-	 * set sequential offset in FCB
+	 * write the records from the current DMA buffer and set
+	 * sequential offset in FCB to the last record written (the
+	 * random record number remains unchanged)
 	 */
-	set_offset(fcb, offset);
+	n = write_records(fcb, fdp, offset, count, caller);
+	if (n) set_offset(fcb, offset + n - 1);
+	if (n < count) {
+		if (offset + n == 65536) reg_a = 0x06;
+		goto premature_exit;
+	}
 	/*
 	 * report success
 	 */
 	reg_a = 0;
 premature_exit:
+	reg_l = reg_a;
+	/*
+	 * on errors, H contains the number of records written
+	 */
+	reg_h = reg_b = reg_a ? n : 0;
 	return;
 }
 
@@ -2979,8 +5187,6 @@ bdos_write_random(void) {
 	static const char func[] = "write random";
 	FDOS_ENTRY(func, REGS_DE);
 	write_random(func);
-	reg_l = reg_a;
-	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
 }
 
@@ -2994,7 +5200,6 @@ bdos_compute_file_size(void) {
 	int fcb, drive, t;
 	off_t size;
 	char unix_name[L_UNIX_NAME];
-	char *path = NULL;
 	struct stat s;
 	static const char func[] = "compute file size";
 	FDOS_ENTRY(func, REGS_DE);
@@ -3025,27 +5230,24 @@ bdos_compute_file_size(void) {
 		goto premature_exit;
 	}
 	/*
-	 * allocate and assemble file path
+	 * get size of file (including data still in write buffers)
 	 */
-	path = alloc(strlen(conf_drives[drive]) + strlen(unix_name) + 2);
-	sprintf(path, "%s/%s", conf_drives[drive], unix_name);
-	/*
-	 * get size of file
-	 */
-	t = lstat(path, &s);
+	flush_all(func);
+	t = stat_drive_file(drive, unix_name, &s);
+	record_file(DK_EXAMINED, drive, unix_name, NULL);
 	if (t == (-1)) {
-		plog("%s (FCB 0x%04x): lstat(%s) failed: %s", func, fcb,
-		    path, strerror(errno));
+		plog("%s (FCB 0x%04x): lstat(%s/%s) failed: %s", func, fcb,
+		    conf_drives[drive], unix_name, strerror(errno));
 		goto premature_exit;
 	}
 	if (! S_ISREG(s.st_mode)) {
-		plog("%s (FCB 0x%04x): %s is no regular file", func, fcb,
-		    path);
+		plog("%s (FCB 0x%04x): %s/%s is no regular file", func, fcb,
+		    conf_drives[drive], unix_name);
 		goto premature_exit;
 	}
 	if (s.st_size > 8 * 1024 * 1024) {
-		plog("%s (FCB 0x%04x): %s is larger than 8 MB", func, fcb,
-		    path);
+		plog("%s (FCB 0x%04x): %s/%s is larger than 8 MB", func, fcb,
+		    conf_drives[drive], unix_name);
 		goto premature_exit;
 	}
 	size = (s.st_size + 127) / 128;
@@ -3060,7 +5262,6 @@ bdos_compute_file_size(void) {
 	 */
 	reg_a = 0x00;
 premature_exit:
-	free(path);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
@@ -3154,8 +5355,6 @@ bdos_write_random_with_zero_fill(void) {
 	static const char func[] = "write random with zero fill";
 	FDOS_ENTRY(func, REGS_DE);
 	write_random(func);
-	reg_l = reg_a;
-	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
 }
 
@@ -3179,6 +5378,27 @@ bdos_write_random_with_zero_fill(void) {
  */
 
 
+/*
+ * set the number of records (1...128) transferred by the read and write
+ * functions (20, 21, 33, 34, and 40)
+ */
+static void
+bdosx_set_multi_sector_count(void) {
+	static const char func[] = "set multi-sector count";
+	SYS_ENTRY(func, REGS_E);
+	if (reg_e < 1 || reg_e > 128) {
+		plog("%s: invalid count %d", func, reg_e);
+		reg_a = 0xff;
+	} else {
+		multi_sector_count = reg_e;
+		reg_a = 0x00;
+	}
+	reg_l = reg_a;
+	reg_h = reg_b = 0;
+	SYS_EXIT(func, REGS_A);
+}
+
+
 /*
  * get a byte from the simulated SCB
  */
@@ -3219,7 +5439,7 @@ read_scb(int offset) {
 	case 0x44: /* current user number, 0..15 */
 		return current_user;
 	case 0x4A: /* current multi sector count */
-		return 1;
+		return multi_sector_count;
 	default:
 		return 0x00;
 	}
@@ -3401,9 +5621,15 @@ bdosx_read_file_date_stamps_and_password_mode(void) {
 	unsigned char temp_fcb[12];
 	char unix_name[L_UNIX_NAME];
 	struct file_list *flp = NULL;
+	struct arena arena;
 	struct cpm_time ct;
 	static const char func[] = "read file date stamps and password mode";
 	FDOS_ENTRY(func, REGS_DE);
+	cch_uncacheable("file date stamps read");
+	/*
+	 * the file list is allocated from a local arena
+	 */
+	init_arena(&arena);
 	/*
 	 * assume the operation fails
 	 */
@@ -3426,7 +5652,7 @@ bdosx_read_file_date_stamps_and_password_mode(void) {
 	 * get a list of regular files matching the name in the FCB
 	 * (usually, this will be a one-element list)
 	 */
-	flp = get_filelist(conf_drives[drive], unix_name, func);
+	flp = get_filelist(drive, unix_name, &arena, func);
 	if (! flp) goto premature_exit;
 	/*
 	 * if the file name in the FCB was ambigous, update it
@@ -3440,8 +5666,10 @@ bdosx_read_file_date_stamps_and_password_mode(void) {
 	 */
 	memory[fcb + 12] = 0;
 	/*
-	 * copy access and modify time stamps to the FCB
+	 * copy access and modify time stamps to the FCB; in
+	 * deterministic mode, all files are stamped with the epoch
 	 */
+	if (conf_epoch >= 0) flp->access = flp->modify = (time_t) conf_epoch;
 	unix_to_cpm_time(&flp->access, &ct);
 	store_cpm_time(&ct, fcb + 24);
 	unix_to_cpm_time(&flp->modify, &ct);
@@ -3454,13 +5682,27 @@ premature_exit:
 	/*
 	 * clean up
 	 */
-	free_filelist(flp);
+	free_arena(&arena);
 	reg_l = reg_a;
 	reg_h = reg_b = 0;
 	FDOS_EXIT(func, REGS_A);
 }
 
 
+/*
+ * get the current Unix time, which is virtual in deterministic mode
+ */
+static time_t
+current_time(void) {
+	if (conf_epoch < 0) {
+		cch_uncacheable("clock read");
+		return time(NULL);
+	}
+	return (time_t) (conf_epoch + instruction_count / VIRTUAL_IPS +
+	    virtual_delay / 1000);
+}
+
+
 /*
  * return the current date and time
  */
@@ -3485,7 +5727,7 @@ bdosx_get_date_and_time(void) {
 	/*
 	 * get current Unix time
 	 */
-	time(&t);
+	t = current_time();
 	/*
 	 * convert it to the CP/M format
 	 */
@@ -3535,6 +5777,13 @@ bdosx_get_set_program_return_code(void) {
 static void
 pause_execution(int delay) {
 	struct timeval end, t;
+	/*
+	 * in deterministic mode, the delay just advances the clock
+	 */
+	if (conf_epoch >= 0) {
+		virtual_delay += delay;
+		return;
+	}
 	/*
 	 * calculate absolute end time
 	 */
@@ -3602,6 +5851,341 @@ bdosx_delay(void) {
 }
 
 
+/*
+ * tnylpo-specific BDOS functions: these are meant for programs written
+ * for tnylpo, which may move data between files and memory in large
+ * chunks instead of 128 byte records. They are numbered from 224 on,
+ * out of the way of the functions of CP/M 3 and MP/M; function 224
+ * allows programs to detect tnylpo. The file functions take the address
+ * of a transfer block in DE:
+ *
+ *	+0	address of the FCB of an open file
+ *	+2	buffer address
+ *	+4	byte count (replaced by the number of bytes transferred)
+ *	+6	byte offset in the file (32 bits)
+ *
+ * Like the CP/M 2.2 functions, they return 0x00 on success and 0xff on
+ * errors in A and L.
+ */
+#define BDOST_FIRST 224
+#define TRANSFER_SIZE 10
+#define MAX_FILE_SIZE (8L * 1024 * 1024)
+
+
+/*
+ * helper function: get a word from memory
+ */
+static int
+peek_word(int address) {
+	return memory[address] | (memory[address + 1] << 8);
+}
+
+
+/*
+ * get and check the transfer block addressed by DE and the file data
+ * structure of its FCB; returns NULL on errors
+ */
+static struct file_data *
+get_transfer(int *block_p, int *fcb_p, const char *caller) {
+	int block = get_de(), fcb, buffer, count;
+	struct file_data *fdp = NULL;
+	if (MEMORY_SIZE - block < TRANSFER_SIZE) {
+		plog("%s (block 0x%04x): invalid address", caller, block);
+		terminate = 1;
+		term_reason = ERR_BDOSARG;
+		goto premature_exit;
+	}
+	if (log_level >= LL_FCBS) {
+		plog("dump of transfer block(0x%04x):", block);
+		plog_dump(block, TRANSFER_SIZE);
+	}
+	fcb = peek_word(block);
+	buffer = peek_word(block + 2);
+	count = peek_word(block + 4);
+	if (MEMORY_SIZE - fcb < 36 || MEMORY_SIZE - buffer < count) {
+		plog("%s (block 0x%04x): invalid FCB or buffer address",
+		    caller, block);
+		terminate = 1;
+		term_reason = ERR_BDOSARG;
+		goto premature_exit;
+	}
+	fdp = get_filedata(fcb, caller);
+	if (fdp && (fdp->flags & FILE_STREAM)) {
+		plog("%s (FCB 0x%04x): %s/%s is a stream", caller, fcb,
+		    conf_drives[fdp->drive], fdp->name);
+		fdp = NULL;
+		goto premature_exit;
+	}
+	*block_p = block;
+	*fcb_p = fcb;
+premature_exit:
+	return fdp;
+}
+
+
+/*
+ * return the tnylpo signature 0x544e ("TN") in HL
+ */
+static void
+bdost_get_signature(void) {
+	static const char func[] = "get tnylpo signature";
+	SYS_ENTRY(func, 0);
+	reg_a = reg_l = 0x4e;
+	reg_b = reg_h = 0x54;
+	SYS_EXIT(func, REGS_HL);
+}
+
+
+/*
+ * read bytes from a file at a byte offset (data still in the write
+ * buffers is written first); fewer bytes than requested are read at the
+ * end of file
+ */
+static void
+bdost_read_bytes(void) {
+	int block, fcb, buffer;
+	size_t count, n = 0;
+	off_t offset;
+	ssize_t t;
+	struct file_data *fdp;
+	static const char func[] = "read bytes";
+	FDOS_ENTRY(func, REGS_DE);
+	/*
+	 * assume the operation fails
+	 */
+	reg_a = 0xff;
+	/*
+	 * get and check the transfer block
+	 */
+	fdp = get_transfer(&block, &fcb, func);
+	if (! fdp) goto premature_exit;
+	buffer = peek_word(block + 2);
+	count = peek_word(block + 4);
+	offset = ((off_t) peek_word(block + 8) << 16) | peek_word(block + 6);
+	/*
+	 * data still in write buffers must be read from the file
+	 */
+	if (fdp->dirty_length && flush_file(fdp, func)) goto premature_exit;
+	if ((fdp->flags & FILE_SHARED) && flush_shared(fdp, func)) {
+		goto premature_exit;
+	}
+	/*
+	 * mapped file: copy the data directly from the mapping (which is
+	 * extended if the file has grown)
+	 */
+	if (fdp->map && offset + (off_t) count > fdp->map_size &&
+	    update_map(fcb, fdp, func)) goto premature_exit;
+	if (fdp->map) {
+		if (offset < fdp->map_size) {
+			n = fdp->map_size - offset;
+			if (n > count) n = count;
+			memcpy(memory + buffer, fdp->map + offset, n);
+		}
+	} else {
+		if (host_fd(fdp, func) == (-1)) goto premature_exit;
+		while (n < count) {
+			t = read_drive_file(fdp->drive, fdp->fd,
+			    memory + buffer + n, count - n, offset + n);
+			if (! t) break;
+			if (t == (-1)) {
+				plog("%s (FCB 0x%04x): pread(%s/%s) failed: "
+				    "%s",
+				    func, fcb, conf_drives[fdp->drive],
+				    fdp->name, strerror(errno));
+				terminate = 1;
+				term_reason = ERR_HOST;
+				goto premature_exit;
+			}
+			n += t;
+		}
+	}
+	memory[block + 4] = (n & 0xff);
+	memory[block + 5] = ((n >> 8) & 0xff);
+	record_count += (n + 127) / 128;
+	reg_a = 0x00;
+premature_exit:
+	reg_l = reg_a;
+	reg_h = reg_b = 0;
+	FDOS_EXIT(func, REGS_A);
+}
+
+
+/*
+ * write bytes to a file at a byte offset (after the data in the write
+ * buffers); files cannot grow beyond the CP/M maximum of 8 MB
+ */
+static void
+bdost_write_bytes(void) {
+	int block, fcb, buffer;
+	size_t count, n = 0;
+	off_t offset;
+	ssize_t t;
+	struct file_data *fdp;
+	static const char func[] = "write bytes";
+	FDOS_ENTRY(func, REGS_DE);
+	/*
+	 * assume the operation fails
+	 */
+	reg_a = 0xff;
+	/*
+	 * get and check the transfer block
+	 */
+	fdp = get_transfer(&block, &fcb, func);
+	if (! fdp) goto premature_exit;
+	buffer = peek_word(block + 2);
+	count = peek_word(block + 4);
+	offset = ((off_t) peek_word(block + 8) << 16) | peek_word(block + 6);
+	if (offset + (off_t) count > MAX_FILE_SIZE) {
+		plog("%s (FCB 0x%04x): %s/%s would exceed 8 MB", func, fcb,
+		    conf_drives[fdp->drive], fdp->name);
+		goto premature_exit;
+	}
+	if (check_writeable(fcb, fdp, func)) goto premature_exit;
+	if (limit_output((int) count)) goto premature_exit;
+	/*
+	 * buffered data goes to the file first, since it may overlap the
+	 * data written now
+	 */
+	if (fdp->dirty_length && flush_file(fdp, func)) goto premature_exit;
+	if ((fdp->flags & FILE_SHARED) && flush_shared(fdp, func)) {
+		goto premature_exit;
+	}
+	if (host_fd(fdp, func) == (-1)) goto premature_exit;
+	while (n < count) {
+		t = write_drive_file(fdp->drive, fdp->fd, memory + buffer + n,
+		    count - n, offset + n);
+		if (t == (-1)) {
+			plog("%s (FCB 0x%04x): pwrite(%s/%s) failed: %s", func,
+			    fcb, conf_drives[fdp->drive], fdp->name,
+			    strerror(errno));
+			terminate = 1;
+			term_reason = ERR_HOST;
+			goto premature_exit;
+		}
+		n += t;
+	}
+	/*
+	 * the read cache windows of the file are now outdated (a mapping
+	 * shows the new data, and is extended when the file is read)
+	 */
+	fdp->flags |= FILE_WRITTEN;
+	fdp->cache_valid = 0;
+	fdp->cache_eof = 0;
+	if (fdp->flags & FILE_SHARED) invalidate_shared(fdp);
+	memory[block + 4] = (n & 0xff);
+	memory[block + 5] = ((n >> 8) & 0xff);
+	record_count += (n + 127) / 128;
+	reg_a = 0x00;
+premature_exit:
+	reg_l = reg_a;
+	reg_h = reg_b = 0;
+	FDOS_EXIT(func, REGS_A);
+}
+
+
+/*
+ * store the size of a file in bytes (including data still in the write
+ * buffers) in the offset field of the transfer block
+ */
+static void
+bdost_get_file_size(void) {
+	int block, fcb;
+	off_t size;
+	struct stat s;
+	struct file_data *fdp;
+	static const char func[] = "get file size";
+	FDOS_ENTRY(func, REGS_DE);
+	/*
+	 * assume the operation fails
+	 */
+	reg_a = 0xff;
+	/*
+	 * get and check the transfer block
+	 */
+	fdp = get_transfer(&block, &fcb, func);
+	if (! fdp) goto premature_exit;
+	if (fdp->dirty_length && flush_file(fdp, func)) goto premature_exit;
+	if ((fdp->flags & FILE_SHARED) && flush_shared(fdp, func)) {
+		goto premature_exit;
+	}
+	if (stat_drive_file(fdp->drive, fdp->name, &s) == (-1)) {
+		plog("%s (FCB 0x%04x): lstat(%s/%s) failed: %s", func, fcb,
+		    conf_drives[fdp->drive], fdp->name, strerror(errno));
+		goto premature_exit;
+	}
+	size = s.st_size;
+	memory[block + 6] = (size & 0xff);
+	memory[block + 7] = ((size >> 8) & 0xff);
+	memory[block + 8] = ((size >> 16) & 0xff);
+	memory[block + 9] = ((size >> 24) & 0xff);
+	reg_a = 0x00;
+premature_exit:
+	reg_l = reg_a;
+	reg_h = reg_b = 0;
+	FDOS_EXIT(func, REGS_A);
+}
+
+
+/*
+ * copy a block of memory; DE points to destination address, source
+ * address, and byte count (the areas may overlap)
+ */
+static void
+bdost_move_memory(void) {
+	int block, destination, source, count;
+	static const char func[] = "move memory";
+	SYS_ENTRY(func, REGS_DE);
+	reg_a = 0xff;
+	block = get_de();
+	if (MEMORY_SIZE - block < 6) goto bad_argument;
+	destination = peek_word(block);
+	source = peek_word(block + 2);
+	count = peek_word(block + 4);
+	if (MEMORY_SIZE - destination < count ||
+	    MEMORY_SIZE - source < count) goto bad_argument;
+	memmove(memory + destination, memory + source, count);
+	reg_a = 0x00;
+	goto premature_exit;
+bad_argument:
+	plog("%s (block 0x%04x): invalid address", func, block);
+	terminate = 1;
+	term_reason = ERR_BDOSARG;
+premature_exit:
+	reg_l = reg_a;
+	reg_h = reg_b = 0;
+	SYS_EXIT(func, REGS_A);
+}
+
+
+/*
+ * fill a block of memory; DE points to destination address, byte
+ * count, and fill byte
+ */
+static void
+bdost_fill_memory(void) {
+	int block, destination, count;
+	static const char func[] = "fill memory";
+	SYS_ENTRY(func, REGS_DE);
+	reg_a = 0xff;
+	block = get_de();
+	if (MEMORY_SIZE - block < 5) goto bad_argument;
+	destination = peek_word(block);
+	count = peek_word(block + 2);
+	if (MEMORY_SIZE - destination < count) goto bad_argument;
+	memset(memory + destination, memory[block + 4], count);
+	reg_a = 0x00;
+	goto premature_exit;
+bad_argument:
+	plog("%s (block 0x%04x): invalid address", func, block);
+	terminate = 1;
+	term_reason = ERR_BDOSARG;
+premature_exit:
+	reg_l = reg_a;
+	reg_h = reg_b = 0;
+	SYS_EXIT(func, REGS_A);
+}
+
+
 /*
  * function dispatcher table for the BDOS functions
  */
@@ -3650,7 +6234,7 @@ static void (*bdos_functions_p[])(void) = {
 /*41*/	bdos_unsupported,
 /*42*/	bdos_unsupported,
 /*43*/	bdos_unsupported,
-/*44*/	bdos_unsupported,
+/*44*/	bdosx_set_multi_sector_count,
 /*45*/	bdos_unsupported,
 /*46*/	bdos_unsupported,
 /*47*/	bdos_unsupported,
@@ -3753,6 +6337,22 @@ static void (*bdos_functions_p[])(void) = {
 #define BDOS_COUNT (sizeof bdos_functions_p / sizeof bdos_functions_p[0])
 
 
+/*
+ * function dispatcher table for the tnylpo-specific BDOS functions
+ */
+static void (*bdost_functions_p[])(void) = {
+/*224*/	bdost_get_signature,
+/*225*/	bdost_read_bytes,
+/*226*/	bdost_write_bytes,
+/*227*/	bdost_get_file_size,
+/*228*/	bdost_move_memory,
+/*229*/	bdost_fill_memory
+};
+
+#define BDOST_COUNT \
+    (sizeof bdost_functions_p / sizeof bdost_functions_p[0])
+
+
 /*
  * BDOS call
  */
@@ -3760,6 +6360,8 @@ static void
 magic_bdos(void) {
 	if (reg_c < BDOS_COUNT) {
 		(*bdos_functions_p[reg_c])();
+	} else if (reg_c >= BDOST_FIRST && reg_c - BDOST_FIRST < BDOST_COUNT) {
+		(*bdost_functions_p[reg_c - BDOST_FIRST])();
 	} else {
 		bdos_unsupported();
 	}
@@ -4037,7 +6639,7 @@ os_call(int magic) { (*magic_functions_p[magic])(); }
  */
 int
 os_exit(void) {
-	int rc = 0;
+	int rc = 0, i;
 	struct file_data *fdp;
 	/*
 	 * return error if the application program set a program return
@@ -4054,13 +6656,77 @@ os_exit(void) {
 	 * reset disk subsystem
 	 */
 	disk_reset();
+	/*
+	 * stop prefetching
+	 */
+	pf_exit();
 	/*
 	 * tear down file list
 	 */
 	while (first_file_p) {
 		fdp = first_file_p;
-		first_file_p = fdp->next_p;
+		remove_filedata(fdp);
 		free_filedata(fdp);
 	}
+	free(file_table);
+	file_table = NULL;
+	file_table_size = 0;
+	free_pool(&file_pool);
+	/*
+	 * save the files of RAM drives which are to be kept, and discard
+	 * the RAM drives
+	 */
+	for (i = 0; i < 16; i++) {
+		if (conf_drive_type[i] != DT_RAM || ! conf_persist_dir[i]) {
+			continue;
+		}
+		if (ram_persist(i, conf_persist_dir[i],
+		    conf_persist_files[i])) rc = (-1);
+	}
+	ram_exit();
+	/*
+	 * close the layers of the overlay drives
+	 */
+	ovl_exit();
+	/*
+	 * close the streams
+	 */
+	if (stm_exit()) rc = (-1);
+	/*
+	 * release the archives of the tar drives
+	 */
+	tar_exit();
+	/*
+	 * write back and release the disk image drives
+	 */
+	if (dsk_exit()) rc = (-1);
+	/*
+	 * store the result of a successful run in the result cache, and
+	 * write the dependency file
+	 */
+	cch_exit(! rc && term_reason == OK_TERM);
+	if (dep_exit()) rc = (-1);
+	/*
+	 * release the search list
+	 */
+	close_search_stream();
+	free_arena(&search_arena);
+	search_list_p = NULL;
+	/*
+	 * discard the directory indexes
+	 */
+	for (i = 0; i < 16; i++) free_dir_index(i);
+	free_pool(&dir_pool);
+#ifdef __linux__
+	if (inotify_fd != (-1)) close(inotify_fd);
+	inotify_fd = (-1);
+#endif
+	/*
+	 * close the directories of the drives
+	 */
+	for (i = 0; i < 16; i++) {
+		if (drive_fd[i] != (-1)) close(drive_fd[i]);
+		drive_fd[i] = (-1);
+	}
 	return rc;
 }
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * Overlay drives merge the files of several host directories (layers):
+ * a file name is resolved against the topmost layer containing it. New
+ * files are created in the top layer, and files of the lower layers are
+ * copied to the top layer before they are written or renamed. Deleting
+ * a file of a lower layer creates a whiteout (an empty file named
+ * ".wh.<name>") in the top layer, which hides the file in the lower
+ * layers. The merged directory is read once, on first use, and
+ * maintained by the changes made through the overlay drive.
+ */
+
+
+/*
+ * merged directory entry: the name of a file and the layer containing
+ * it (0 is the top layer; WHITED_OUT for hidden names)
+ */
+#define WHITED_OUT (-1)
+struct ovl_entry {
+	struct ovl_entry *next_p; /* next entry in the same hash chain */
+	int layer;
+	char name[1]; /* extended by the allocation */
+};
+
+
+/*
+ * state of an overlay drive: the directory file descriptors of the
+ * layers, and the merged directory hashed by name (entries are added,
+ * but never removed, so the list of all entries is kept in creation
+ * order for listings)
+ */
+#define OVL_HASH_SIZE 1024
+static struct ovl_drive {
+	int *fds;
+	int layers;
+	struct ovl_entry **table;
+	struct ovl_entry **entries;
+	int count;
+	int size;
+} ovl_drives[16];
+
+
+/*
+ * find a name in the merged directory; returns NULL if it is unknown
+ */
+static struct ovl_entry *
+find_entry(struct ovl_drive *dp, const char *name) {
+	struct ovl_entry *ep = dp->table[hash_name(name, OVL_HASH_SIZE)];
+	while (ep && strcmp(ep->name, name)) ep = ep->next_p;
+	return ep;
+}
+
+
+/*
+ * enter a name into the merged directory (unless it is already known)
+ */
+static struct ovl_entry *
+add_entry(struct ovl_drive *dp, const char *name, int layer) {
+	struct ovl_entry *ep = find_entry(dp, name);
+	unsigned h;
+	if (ep) return ep;
+	ep = alloc(sizeof (struct ovl_entry) + strlen(name));
+	strcpy(ep->name, name);
+	ep->layer = layer;
+	h = hash_name(name, OVL_HASH_SIZE);
+	ep->next_p = dp->table[h];
+	dp->table[h] = ep;
+	if (dp->count == dp->size) {
+		dp->size = dp->size ? dp->size * 2 : 64;
+		dp->entries = resize(dp->entries,
+		    dp->size * sizeof (struct ovl_entry *));
+	}
+	dp->entries[dp->count++] = ep;
+	return ep;
+}
+
+
+/*
+ * get the merged directory of a drive, reading the layers from top to
+ * bottom if this has not been done yet; names found in an upper layer
+ * (or whited out there) hide the same names in lower layers
+ */
+static struct ovl_drive *
+get_drive(int drive) {
+	struct ovl_drive *dp = ovl_drives + drive;
+	DIR *dirp;
+	struct dirent *dep;
+	int i, fd;
+	if (dp->table) return dp;
+	dp->table = alloc(OVL_HASH_SIZE * sizeof (struct ovl_entry *));
+	memset(dp->table, 0, OVL_HASH_SIZE * sizeof (struct ovl_entry *));
+	for (i = 0; i < dp->layers; i++) {
+		fd = HOST_CALL(openat(dp->fds[i], ".", O_RDONLY | O_CLOEXEC));
+		dirp = (fd == (-1)) ? NULL : fdopendir(fd);
+		if (! dirp) {
+			plog("cannot read layer %d of drive %c: %s", i,
+			    'A' + drive, strerror(errno));
+			if (fd != (-1)) close(fd);
+			continue;
+		}
+		for (;;) {
+			dep = HOST_CALL(readdir(dirp));
+			if (! dep) break;
+			if (! strncmp(dep->d_name, OVL_WHITEOUT,
+			    sizeof OVL_WHITEOUT - 1)) {
+				if (! i) add_entry(dp, dep->d_name +
+				    sizeof OVL_WHITEOUT - 1, WHITED_OUT);
+				continue;
+			}
+			add_entry(dp, dep->d_name, i);
+		}
+		HOST_CALL(closedir(dirp));
+	}
+	return dp;
+}
+
+
+/*
+ * get the entry of an existing file; sets errno to ENOENT and returns
+ * NULL if there is no such file
+ */
+static struct ovl_entry *
+get_file(int drive, const char *name) {
+	struct ovl_entry *ep = find_entry(get_drive(drive), name);
+	if (! ep || ep->layer == WHITED_OUT) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return ep;
+}
+
+
+/*
+ * record the creation or removal of a whiteout in the dependency list
+ * (which also feeds the result cache)
+ */
+static void
+record_whiteout(struct ovl_drive *dp, const char *wh,
+    enum dep_kind kind) {
+	const char *dir = conf_drives[dp - ovl_drives];
+	char *path;
+	if (! conf_dep_file && ! conf_cache_dir) return;
+	path = alloc(strlen(dir) + strlen(wh) + 2);
+	sprintf(path, "%s/%s", dir, wh);
+	dep_record(kind, path, NULL);
+	free(path);
+}
+
+
+/*
+ * create or remove the whiteout of a name in the top layer
+ */
+static int
+set_whiteout(struct ovl_drive *dp, const char *name, int set) {
+	char *wh = alloc(sizeof OVL_WHITEOUT + strlen(name));
+	int fd, rc = 0, e;
+	sprintf(wh, "%s%s", OVL_WHITEOUT, name);
+	if (set) {
+		fd = HOST_CALL(openat(dp->fds[0], wh,
+		    O_WRONLY | O_CREAT | O_CLOEXEC, 0666));
+		if (fd == (-1)) {
+			rc = (-1);
+		} else {
+			HOST_CALL(close(fd));
+			record_whiteout(dp, wh, DK_CREATED);
+		}
+	} else {
+		if (HOST_CALL(unlinkat(dp->fds[0], wh, 0)) == (-1)) {
+			if (errno != ENOENT) rc = (-1);
+		} else {
+			record_whiteout(dp, wh, DK_DELETED);
+		}
+	}
+	e = errno;
+	free(wh);
+	errno = e;
+	return rc;
+}
+
+
+/*
+ * copy a file of a lower layer to a new name in the top layer
+ */
+static int
+copy_file(struct ovl_drive *dp, const struct ovl_entry *ep,
+    const char *new_name) {
+	int in_fd, out_fd = (-1), rc = (-1), e;
+	unsigned char buffer[16 * 1024];
+	ssize_t n, t, k;
+	in_fd = HOST_CALL(openat(dp->fds[ep->layer], ep->name,
+	    O_RDONLY | O_CLOEXEC));
+	if (in_fd == (-1)) goto premature_exit;
+	out_fd = HOST_CALL(openat(dp->fds[0], new_name,
+	    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+	if (out_fd == (-1)) goto premature_exit;
+	for (;;) {
+		n = HOST_CALL(read(in_fd, buffer, sizeof buffer));
+		if (n == (-1)) goto premature_exit;
+		if (! n) break;
+		for (t = 0; t < n; t += k) {
+			k = HOST_CALL(write(out_fd, buffer + t, n - t));
+			if (k == (-1)) goto premature_exit;
+		}
+	}
+	rc = 0;
+premature_exit:
+	e = errno;
+	if (in_fd != (-1)) close(in_fd);
+	if (out_fd != (-1)) {
+		close(out_fd);
+		if (rc) unlinkat(dp->fds[0], new_name, 0);
+	}
+	errno = e;
+	return rc;
+}
+
+
+/*
+ * open the directories of the layers of an overlay drive
+ */
+int
+ovl_init(int drive) {
+	struct ovl_drive *dp = ovl_drives + drive;
+	int i;
+	for (i = 0; conf_layers[drive][i]; i++);
+	dp->layers = i + 1;
+	dp->fds = alloc(dp->layers * sizeof (int));
+	for (i = 0; i < dp->layers; i++) dp->fds[i] = (-1);
+	for (i = 0; i < dp->layers; i++) {
+		dp->fds[i] = open(i ? conf_layers[drive][i - 1] :
+		    conf_drives[drive], O_RDONLY | O_CLOEXEC);
+		if (dp->fds[i] == (-1)) {
+			perr("cannot open directory %s of drive %c: %s",
+			    i ? conf_layers[drive][i - 1] : conf_drives[drive],
+			    'A' + drive, strerror(errno));
+			return (-1);
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * open a file of an overlay drive; new files (O_CREAT) are created in
+ * the top layer, files of lower layers are always opened read only
+ */
+static int
+ovl_open(int drive, const char *name, int flags) {
+	struct ovl_drive *dp = get_drive(drive);
+	struct ovl_entry *ep = find_entry(dp, name);
+	int fd;
+	if (flags & O_CREAT) {
+		if (ep && ep->layer != WHITED_OUT) {
+			errno = EEXIST;
+			return (-1);
+		}
+		fd = HOST_CALL(openat(dp->fds[0], name, flags | O_CLOEXEC,
+		    0666));
+		if (fd == (-1)) return fd;
+		if (ep) {
+			set_whiteout(dp, name, 0);
+			ep->layer = 0;
+		} else {
+			add_entry(dp, name, 0);
+		}
+		return fd;
+	}
+	ep = get_file(drive, name);
+	if (! ep) return (-1);
+	return HOST_CALL(openat(dp->fds[ep->layer], name,
+	    (ep->layer ? O_RDONLY : flags) | O_CLOEXEC));
+}
+
+
+/*
+ * get the layer containing a file (0 for the top layer), or (-1) if
+ * there is no such file
+ */
+int
+ovl_layer(int drive, const char *name) {
+	struct ovl_entry *ep = get_file(drive, name);
+	return ep ? ep->layer : (-1);
+}
+
+
+/*
+ * get the path of the layer directory containing a file (or of the top
+ * layer, if there is no such file)
+ */
+const char *
+ovl_dir(int drive, const char *name) {
+	int layer = ovl_layer(drive, name);
+	return layer > 0 ? conf_layers[drive][layer - 1] : conf_drives[drive];
+}
+
+
+/*
+ * get information about a file
+ */
+static int
+ovl_stat(int drive, const char *name, struct stat *sp) {
+	struct ovl_entry *ep = get_file(drive, name);
+	if (! ep) return (-1);
+	return HOST_CALL(fstatat(ovl_drives[drive].fds[ep->layer], name, sp,
+	    AT_SYMLINK_NOFOLLOW));
+}
+
+
+/*
+ * delete a file: the file is removed from the top layer, and if a file
+ * of this name exists in a lower layer, it is whited out
+ */
+static int
+ovl_unlink(int drive, const char *name) {
+	struct ovl_drive *dp = get_drive(drive);
+	struct ovl_entry *ep = get_file(drive, name);
+	struct stat s;
+	int i;
+	if (! ep) return (-1);
+	if (! ep->layer &&
+	    HOST_CALL(unlinkat(dp->fds[0], name, 0)) == (-1)) {
+		return (-1);
+	}
+	for (i = 1; i < dp->layers; i++) {
+		if (! HOST_CALL(fstatat(dp->fds[i], name, &s,
+		    AT_SYMLINK_NOFOLLOW))) {
+			break;
+		}
+	}
+	if (i < dp->layers && set_whiteout(dp, name, 1) == (-1)) {
+		return (-1);
+	}
+	ep->layer = WHITED_OUT;
+	return 0;
+}
+
+
+/*
+ * add a new name for a file; files of lower layers are copied to the
+ * new name in the top layer
+ */
+static int
+ovl_link(int drive, const char *old_name, const char *new_name) {
+	struct ovl_drive *dp = get_drive(drive);
+	struct ovl_entry *ep = get_file(drive, old_name), *new_ep;
+	int rc;
+	if (! ep) return (-1);
+	new_ep = find_entry(dp, new_name);
+	if (new_ep && new_ep->layer != WHITED_OUT) {
+		errno = EEXIST;
+		return (-1);
+	}
+	if (ep->layer) {
+		rc = copy_file(dp, ep, new_name);
+	} else {
+		rc = HOST_CALL(linkat(dp->fds[0], old_name, dp->fds[0],
+		    new_name, 0));
+	}
+	if (rc == (-1)) return rc;
+	if (new_ep) {
+		set_whiteout(dp, new_name, 0);
+		new_ep->layer = 0;
+	} else {
+		add_entry(dp, new_name, 0);
+	}
+	return 0;
+}
+
+
+/*
+ * copy a file of a lower layer to the top layer (before it is changed)
+ */
+int
+ovl_copy_up(int drive, const char *name) {
+	struct ovl_drive *dp = get_drive(drive);
+	struct ovl_entry *ep = get_file(drive, name);
+	if (! ep) return (-1);
+	if (! ep->layer) return 0;
+	if (copy_file(dp, ep, name) == (-1)) return (-1);
+	ep->layer = 0;
+	return 0;
+}
+
+
+/*
+ * list the files of a drive (whited out files are skipped)
+ */
+static const char *
+ovl_next_name(int drive, int *pos_p) {
+	struct ovl_drive *dp = get_drive(drive);
+	while (*pos_p < dp->count) {
+		if (dp->entries[*pos_p]->layer != WHITED_OUT) {
+			return dp->entries[(*pos_p)++]->name;
+		}
+		(*pos_p)++;
+	}
+	return NULL;
+}
+
+
+/*
+ * operations on the files of overlay drives (open files are host files)
+ */
+const struct drive_ops ovl_ops = {
+	ovl_open, ovl_stat, ovl_unlink, ovl_link, ovl_next_name,
+	host_pread, host_pwrite, host_close
+};
+
+
+/*
+ * release the state of the overlay drives
+ */
+void
+ovl_exit(void) {
+	int i, j;
+	struct ovl_drive *dp;
+	for (i = 0; i < 16; i++) {
+		dp = ovl_drives + i;
+		for (j = 0; j < dp->layers; j++) {
+			if (dp->fds[j] != (-1)) close(dp->fds[j]);
+		}
+		for (j = 0; j < dp->count; j++) free(dp->entries[j]);
+		free(dp->fds);
+		free(dp->table);
+		free(dp->entries);
+		memset(dp, 0, sizeof (struct ovl_drive));
+	}
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * Prefetching reads the beginning of the files a program is expected to
+ * open (those named in the default FCBs and their companions with the
+ * configured extensions) in a background thread while the program
+ * starts up. When the program opens such a file for the first time, the
+ * data is taken over as the read cache window of the file, provided the
+ * file has not changed in the meantime (same inode, size, and
+ * modification time); files created, deleted, or renamed by the program
+ * before opening them are dropped. Only files of directory drives are
+ * prefetched, since the other drive emulations are not thread safe.
+ */
+#define PF_SLOTS 32
+
+
+/*
+ * states of a prefetched file
+ */
+enum pf_state {
+	PF_QUEUED /* not yet read */,
+	PF_BUSY /* being read by the prefetch thread */,
+	PF_READY /* data available */,
+	PF_DONE /* taken, dropped, or not readable */
+};
+
+
+/*
+ * prefetched file
+ */
+static struct pf_slot {
+	int drive;
+	int dir_fd;
+	char *name;
+	enum pf_state state;
+	unsigned char *data;
+	size_t valid;
+	int eof;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t modify;
+} slots[PF_SLOTS];
+static int slot_count = 0;
+
+
+/*
+ * the prefetch thread reads up to pf_size bytes of each file; the slots
+ * are protected by the mutex, and the condition is signalled whenever
+ * a file has been read
+ */
+static size_t pf_size = 0;
+static pthread_t thread;
+static int running = 0, stop = 0;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * find the slot of a file, or NULL
+ */
+static struct pf_slot *
+find_slot(int drive, const char *name) {
+	int i;
+	for (i = 0; i < slot_count; i++) {
+		if (slots[i].drive == drive && ! strcmp(slots[i].name, name)) {
+			return slots + i;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * read the beginning of a file into a slot (called by the prefetch
+ * thread without holding the mutex, so it works on a copy of the slot);
+ * returns (-1) if the file cannot be read. Only regular files are
+ * read: they are checked before opening (opening a FIFO would block
+ * the thread), and opened without blocking in case the file has been
+ * replaced in the meantime.
+ */
+static int
+read_slot(struct pf_slot *sp) {
+	int rc = 0, fd = (-1);
+	struct stat s;
+	ssize_t t;
+#ifdef AT_FDCWD
+	if (! fstatat(sp->dir_fd, sp->name, &s, 0) && S_ISREG(s.st_mode)) {
+		fd = openat(sp->dir_fd, sp->name,
+		    O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	}
+#else
+	char *path = malloc(strlen(conf_drives[sp->drive]) +
+	    strlen(sp->name) + 2);
+	if (path) {
+		sprintf(path, "%s/%s", conf_drives[sp->drive], sp->name);
+		if (! stat(path, &s) && S_ISREG(s.st_mode)) {
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		}
+		free(path);
+	}
+#endif
+	if (fd == (-1) || fstat(fd, &s) == (-1) || ! S_ISREG(s.st_mode)) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	sp->dev = s.st_dev;
+	sp->ino = s.st_ino;
+	sp->size = s.st_size;
+	sp->modify = s.st_mtime;
+	sp->data = malloc(pf_size);
+	if (! sp->data) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	sp->valid = 0;
+	sp->eof = 0;
+	while (sp->valid < pf_size) {
+		t = read(fd, sp->data + sp->valid, pf_size - sp->valid);
+		if (! t) {
+			sp->eof = 1;
+			break;
+		}
+		if (t == (-1)) {
+			rc = (-1);
+			goto premature_exit;
+		}
+		sp->valid += t;
+	}
+premature_exit:
+	if (rc) {
+		free(sp->data);
+		sp->data = NULL;
+	}
+	if (fd != (-1)) close(fd);
+	return rc;
+}
+
+
+/*
+ * the prefetch thread: read the queued files in turn
+ */
+static void *
+pf_thread(void *arg) {
+	int i;
+	struct pf_slot temp;
+	for (i = 0; ; i++) {
+		pthread_mutex_lock(&mutex);
+		/*
+		 * skip files already dropped or taken by the program
+		 */
+		while (i < slot_count && slots[i].state != PF_QUEUED) i++;
+		if (stop || i == slot_count) {
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		slots[i].state = PF_BUSY;
+		temp = slots[i];
+		pthread_mutex_unlock(&mutex);
+		if (read_slot(&temp)) temp.data = NULL;
+		pthread_mutex_lock(&mutex);
+		/*
+		 * the file may have been dropped in the meantime
+		 */
+		if (slots[i].state == PF_BUSY && temp.data) {
+			temp.state = PF_READY;
+			slots[i] = temp;
+		} else {
+			slots[i].state = PF_DONE;
+			free(temp.data);
+		}
+		pthread_cond_broadcast(&ready);
+		pthread_mutex_unlock(&mutex);
+	}
+	return arg;
+}
+
+
+/*
+ * queue a file of a drive for prefetching (before pf_start() is called);
+ * dir_fd is the directory file descriptor of the drive
+ */
+void
+pf_add(int drive, int dir_fd, const char *name) {
+	struct pf_slot *sp;
+	if (slot_count == PF_SLOTS || find_slot(drive, name)) return;
+	sp = slots + slot_count++;
+	memset(sp, 0, sizeof (struct pf_slot));
+	sp->drive = drive;
+	sp->dir_fd = dir_fd;
+	sp->name = alloc(strlen(name) + 1);
+	strcpy(sp->name, name);
+	sp->state = PF_QUEUED;
+}
+
+
+/*
+ * start reading the queued files (up to size bytes of each); if the
+ * thread cannot be started, the files are simply not prefetched
+ */
+void
+pf_start(size_t size) {
+	int i, rc;
+	sigset_t all, old;
+	if (! slot_count) return;
+	pf_size = size;
+	/*
+	 * signals are handled by the main thread only
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&thread, NULL, pf_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		plog("cannot start prefetch thread: %s", strerror(rc));
+		for (i = 0; i < slot_count; i++) slots[i].state = PF_DONE;
+		return;
+	}
+	running = 1;
+}
+
+
+/*
+ * take the prefetched data of a file just opened (as fd) by the
+ * program: returns a buffer of the size passed to pf_start() containing
+ * *valid_p bytes from the beginning of the file (*eof_p is set if this
+ * is the whole file), or NULL if the file has not been prefetched or
+ * has been changed since. A file being read by the thread is waited
+ * for (the thread reads at most the size of a cache window of each
+ * file); a file still queued is dropped from the queue and read by the
+ * caller itself, since the thread would read all files queued before
+ * it first.
+ */
+unsigned char *
+pf_take(int drive, const char *name, int fd, size_t *valid_p, int *eof_p) {
+	struct pf_slot *sp;
+	struct stat s;
+	unsigned char *data = NULL;
+	if (! slot_count) return NULL;
+	pthread_mutex_lock(&mutex);
+	sp = find_slot(drive, name);
+	if (! sp) goto premature_exit;
+	while (sp->state == PF_BUSY) pthread_cond_wait(&ready, &mutex);
+	if (sp->state == PF_READY) {
+		if (HOST_CALL(fstat(fd, &s)) == 0 && s.st_dev == sp->dev &&
+		    s.st_ino == sp->ino && s.st_size == sp->size &&
+		    s.st_mtime == sp->modify) {
+			data = sp->data;
+			*valid_p = sp->valid;
+			*eof_p = sp->eof;
+		} else {
+			free(sp->data);
+		}
+		sp->data = NULL;
+	}
+	sp->state = PF_DONE;
+premature_exit:
+	pthread_mutex_unlock(&mutex);
+	return data;
+}
+
+
+/*
+ * drop the prefetched data of a file which is created, deleted, or
+ * renamed by the program
+ */
+void
+pf_drop(int drive, const char *name) {
+	struct pf_slot *sp;
+	if (! slot_count) return;
+	pthread_mutex_lock(&mutex);
+	sp = find_slot(drive, name);
+	if (sp) {
+		free(sp->data);
+		sp->data = NULL;
+		sp->state = PF_DONE;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ * stop the prefetch thread (after the file it is reading) and release
+ * the data not taken by the program
+ */
+void
+pf_exit(void) {
+	int i;
+	if (running) {
+		pthread_mutex_lock(&mutex);
+		stop = 1;
+		pthread_mutex_unlock(&mutex);
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+	for (i = 0; i < slot_count; i++) {
+		free(slots[i].data);
+		free(slots[i].name);
+	}
+	slot_count = 0;
+	stop = 0;
+}
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * RAM drives keep their files in memory; the OS emulation accesses them
+ * through file handles which mimic Unix file descriptors. As on a Unix
+ * file system, the data of a file (its "inode") is separate from its
+ * names, so that a file may be renamed by linking and unlinking it, and
+ * an open file stays accessible after its name has been deleted.
+ */
+
+
+/*
+ * contents of a file, shared by its names and open handles
+ */
+struct ram_data {
+	unsigned char *bytes;
+	size_t size;
+	size_t allocated;
+	time_t access;
+	time_t modify;
+	int links;
+	int opens;
+};
+
+
+/*
+ * name of a file in the directory of a RAM drive
+ */
+struct ram_file {
+	struct ram_file *next_p; /* next file in the same hash chain */
+	struct ram_data *data_p;
+	int slot; /* position in the file array of the drive */
+	char name[1]; /* extended by the allocation */
+};
+
+
+/*
+ * directory of a RAM drive: the files are hashed by name for lookups
+ * and kept in an array for listings
+ */
+#define RAM_HASH_SIZE 256
+static struct ram_dir {
+	struct ram_file **table;
+	struct ram_file **files;
+	int count;
+	int size;
+} ram_dirs[16];
+
+
+/*
+ * open files (the handles refer to the data of the files)
+ */
+static struct handle_table handles = HANDLE_TABLE_INITIALIZER;
+
+
+/*
+ * find the entry of a file name; returns the address of the pointer
+ * to the entry (which is NULL if there is no such file)
+ */
+static struct ram_file **
+find_file(int drive, const char *name) {
+	struct ram_dir *dp = ram_dirs + drive;
+	struct ram_file **fpp;
+	if (! dp->table) {
+		dp->table = alloc(RAM_HASH_SIZE * sizeof (struct ram_file *));
+		memset(dp->table, 0,
+		    RAM_HASH_SIZE * sizeof (struct ram_file *));
+	}
+	fpp = dp->table + hash_name(name, RAM_HASH_SIZE);
+	while (*fpp && strcmp((*fpp)->name, name)) fpp = &(*fpp)->next_p;
+	return fpp;
+}
+
+
+/*
+ * release the data of a file if it has neither names nor open handles
+ */
+static void
+release_data(struct ram_data *rdp) {
+	if (rdp->links || rdp->opens) return;
+	free(rdp->bytes);
+	free(rdp);
+}
+
+
+/*
+ * enter a new name for the data of a file into the directory of a drive;
+ * fpp is the result of find_file() for the name
+ */
+static void
+add_file(int drive, struct ram_file **fpp, const char *name,
+    struct ram_data *rdp) {
+	struct ram_dir *dp = ram_dirs + drive;
+	struct ram_file *fp;
+	fp = alloc(sizeof (struct ram_file) + strlen(name));
+	strcpy(fp->name, name);
+	fp->next_p = NULL;
+	fp->data_p = rdp;
+	rdp->links++;
+	*fpp = fp;
+	if (dp->count == dp->size) {
+		dp->size = dp->size ? dp->size * 2 : 64;
+		dp->files = resize(dp->files,
+		    dp->size * sizeof (struct ram_file *));
+	}
+	fp->slot = dp->count;
+	dp->files[dp->count++] = fp;
+}
+
+
+/*
+ * remove a name from the directory of a drive; fpp is the result of
+ * find_file() for the name
+ */
+static void
+remove_file(int drive, struct ram_file **fpp) {
+	struct ram_dir *dp = ram_dirs + drive;
+	struct ram_file *fp = *fpp;
+	*fpp = fp->next_p;
+	/*
+	 * the last file of the array takes the place of the removed one
+	 */
+	dp->files[fp->slot] = dp->files[--dp->count];
+	dp->files[fp->slot]->slot = fp->slot;
+	fp->data_p->links--;
+	release_data(fp->data_p);
+	free(fp);
+}
+
+
+/*
+ * open a file of a RAM drive; flags are O_RDONLY or O_RDWR, optionally
+ * combined with O_CREAT and O_EXCL to create a new file. Returns a
+ * handle or (-1) with errno set like open(2).
+ */
+static int
+ram_open(int drive, const char *name, int flags) {
+	struct ram_file **fpp;
+	struct ram_data *rdp;
+	fpp = find_file(drive, name);
+	if (*fpp) {
+		if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+			errno = EEXIST;
+			return (-1);
+		}
+		rdp = (*fpp)->data_p;
+	} else {
+		if (! (flags & O_CREAT)) {
+			errno = ENOENT;
+			return (-1);
+		}
+		rdp = alloc(sizeof (struct ram_data));
+		rdp->bytes = NULL;
+		rdp->size = rdp->allocated = 0;
+		rdp->modify = time(NULL);
+		rdp->links = rdp->opens = 0;
+		add_file(drive, fpp, name, rdp);
+	}
+	rdp->access = time(NULL);
+	rdp->opens++;
+	return handle_add(&handles, rdp);
+}
+
+
+/*
+ * close a file handle
+ */
+static int
+ram_close(int handle) {
+	struct ram_data *rdp = handle_get(&handles, handle);
+	if (! rdp) return (-1);
+	handle_remove(&handles, handle);
+	rdp->opens--;
+	release_data(rdp);
+	return 0;
+}
+
+
+/*
+ * read from a handle at an offset (relative to the start of the file)
+ */
+static ssize_t
+ram_pread(int handle, void *buffer, size_t n, off_t offset) {
+	struct ram_data *rdp = handle_get(&handles, handle);
+	if (! rdp) return (-1);
+	if (offset < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((size_t) offset >= rdp->size) return 0;
+	if (n > rdp->size - offset) n = rdp->size - offset;
+	memcpy(buffer, rdp->bytes + offset, n);
+	return n;
+}
+
+
+/*
+ * write to a handle at an offset; a gap between the end of file and the
+ * offset reads as zeros
+ */
+static ssize_t
+ram_pwrite(int handle, const void *buffer, size_t n, off_t offset) {
+	struct ram_data *rdp = handle_get(&handles, handle);
+	size_t end, t;
+	if (! rdp) return (-1);
+	if (offset < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	end = offset + n;
+	if (end > rdp->allocated) {
+		t = rdp->allocated ? rdp->allocated : 16 * 1024;
+		while (t < end) t *= 2;
+		rdp->bytes = resize(rdp->bytes, t);
+		rdp->allocated = t;
+	}
+	if ((size_t) offset > rdp->size) {
+		memset(rdp->bytes + rdp->size, 0, offset - rdp->size);
+	}
+	memcpy(rdp->bytes + offset, buffer, n);
+	if (end > rdp->size) rdp->size = end;
+	rdp->modify = time(NULL);
+	return n;
+}
+
+
+/*
+ * get the attributes of a file: files of RAM drives are regular files,
+ * with a size and time stamps, but no further attributes
+ */
+static int
+ram_stat(int drive, const char *name, struct stat *sp) {
+	struct ram_file *fp = *find_file(drive, name);
+	if (! fp) {
+		errno = ENOENT;
+		return (-1);
+	}
+	memset(sp, 0, sizeof (struct stat));
+	sp->st_mode = S_IFREG | 0666;
+	sp->st_size = fp->data_p->size;
+	sp->st_atime = fp->data_p->access;
+	sp->st_mtime = fp->data_p->modify;
+	return 0;
+}
+
+
+/*
+ * delete a file name
+ */
+static int
+ram_unlink(int drive, const char *name) {
+	struct ram_file **fpp = find_file(drive, name);
+	if (! *fpp) {
+		errno = ENOENT;
+		return (-1);
+	}
+	remove_file(drive, fpp);
+	return 0;
+}
+
+
+/*
+ * add a new name for an existing file
+ */
+static int
+ram_link(int drive, const char *old_name, const char *new_name) {
+	struct ram_file *fp = *find_file(drive, old_name), **fpp;
+	if (! fp) {
+		errno = ENOENT;
+		return (-1);
+	}
+	fpp = find_file(drive, new_name);
+	if (*fpp) {
+		errno = EEXIST;
+		return (-1);
+	}
+	add_file(drive, fpp, new_name, fp->data_p);
+	return 0;
+}
+
+
+/*
+ * list the files of a drive
+ */
+static const char *
+ram_next_name(int drive, int *pos_p) {
+	struct ram_dir *dp = ram_dirs + drive;
+	if (*pos_p >= dp->count) return NULL;
+	return dp->files[(*pos_p)++]->name;
+}
+
+
+/*
+ * operations on the files of RAM drives
+ */
+const struct drive_ops ram_ops = {
+	ram_open, ram_stat, ram_unlink, ram_link, ram_next_name,
+	ram_pread, ram_pwrite, ram_close
+};
+
+
+/*
+ * check if a file name matches one of the blank separated shell
+ * patterns in a string
+ */
+static int
+match_patterns(const char *name, const char *patterns) {
+	char pattern[64];
+	size_t l;
+	for (;;) {
+		patterns += strspn(patterns, " ");
+		l = strcspn(patterns, " ");
+		if (! l) return 0;
+		if (l < sizeof pattern) {
+			memcpy(pattern, patterns, l);
+			pattern[l] = '\0';
+			if (! fnmatch(pattern, name, 0)) return 1;
+		}
+		patterns += l;
+	}
+}
+
+
+/*
+ * copy the files of a RAM drive matching the patterns (all files if
+ * patterns is NULL) to a host directory; the copies are the only host
+ * files written through a RAM drive, and are recorded as outputs in the
+ * dependency list. Returns (-1) on errors.
+ */
+int
+ram_persist(int drive, const char *dir, const char *patterns) {
+	struct ram_dir *dp = ram_dirs + drive;
+	struct ram_data *rdp;
+	char *path = NULL;
+	int i, fd = (-1), rc = 0;
+	size_t n;
+	ssize_t t;
+	for (i = 0; i < dp->count; i++) {
+		if (patterns && ! match_patterns(dp->files[i]->name,
+		    patterns)) continue;
+		rdp = dp->files[i]->data_p;
+		free(path);
+		path = alloc(strlen(dir) + strlen(dp->files[i]->name) + 2);
+		sprintf(path, "%s/%s", dir, dp->files[i]->name);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0666);
+		if (fd == (-1)) {
+			perr("cannot create %s: %s", path, strerror(errno));
+			rc = (-1);
+			continue;
+		}
+		for (n = 0; n < rdp->size; n += t) {
+			t = write(fd, rdp->bytes + n, rdp->size - n);
+			if (t == (-1)) {
+				perr("write error on %s: %s", path,
+				    strerror(errno));
+				rc = (-1);
+				break;
+			}
+		}
+		if (close(fd) == (-1)) {
+			perr("cannot close %s: %s", path, strerror(errno));
+			rc = (-1);
+			continue;
+		}
+		if (n == rdp->size && (conf_dep_file || conf_cache_dir)) {
+			dep_record(DK_WRITTEN, path, NULL);
+		}
+	}
+	free(path);
+	return rc;
+}
+
+
+/*
+ * release all files of the RAM drives (open handles must have been
+ * closed before)
+ */
+void
+ram_exit(void) {
+	int i;
+	struct ram_dir *dp;
+	for (i = 0; i < 16; i++) {
+		dp = ram_dirs + i;
+		while (dp->count) {
+			remove_file(i, find_file(i,
+			    dp->files[dp->count - 1]->name));
+		}
+		free(dp->table);
+		free(dp->files);
+		dp->table = dp->files = NULL;
+		dp->size = 0;
+	}
+	free_handles(&handles);
+}
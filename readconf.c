@@ -87,6 +87,25 @@ wchar_t *conf_unprintable = NULL;
  */
 char *conf_drives[16];
 int conf_readonly[16];
+/*
+ * kind of the CP/M drives A...P; for RAM drives, the directory to which
+ * the files matching the blank separated patterns (all files if there
+ * are none) are saved on exit; for overlay drives, the NULL terminated
+ * list of the lower layers (the top layer is in conf_drives); for tar
+ * drives, conf_drives is the path of the archive, for disk image drives
+ * the path of the image, whose format is in conf_disk_format
+ */
+enum drive_type conf_drive_type[16];
+char *conf_persist_dir[16];
+char *conf_persist_files[16];
+char **conf_layers[16];
+struct disk_format conf_disk_format[16];
+/*
+ * pseudo files of the drives which are connected to host file
+ * descriptors, files (e.g. FIFOs), or commands
+ */
+struct stream *conf_streams = NULL;
+int conf_stream_count = 0;
 /*
  * name of the command file to execute
  */
@@ -134,6 +153,65 @@ enum dump conf_dump = 0;
  */
 int delay_count = (-1);
 int delay_nanoseconds = (-1);
+/*
+ * lockstep checker: compare memory of the primary and the reference
+ * CPU core every conf_lockstep instructions (default: checker disabled)
+ */
+int conf_lockstep = (-1);
+/*
+ * resource limits for the program run: instructions executed, seconds
+ * of wall-clock time, bytes written to disk files and the console,
+ * and files open at the same time (default: no limits)
+ */
+long long conf_limit_instructions = (-1);
+int conf_limit_time = (-1);
+long long conf_limit_output = (-1);
+int conf_limit_files = (-1);
+/*
+ * maximum number of host file descriptors held by the open files of
+ * the program; less recently used files are closed and reopened when
+ * needed (default: derived from the descriptor limit of the process)
+ */
+int conf_limit_descriptors = (-1);
+/*
+ * deterministic execution: if not negative, the clock of the emulated
+ * system starts at this Unix time and is advanced by the emulation only
+ * (default: deterministic execution disabled)
+ */
+long long conf_epoch = (-1);
+/*
+ * durability of data written to disk files (default: written at the
+ * latest when the file is closed)
+ */
+enum durability conf_durability = DUR_UNSET;
+/*
+ * directory index of the drives (default: updated by inotify if
+ * available, otherwise revalidated by directory modification time)
+ */
+enum dircache conf_dircache = DC_UNSET;
+/*
+ * file receiving the list of host files accessed by the program, and
+ * its format (default: no list is written)
+ */
+char *conf_dep_file = NULL;
+enum dep_format conf_dep_format = DF_MAKE;
+/*
+ * directory of the result cache (default: no result cache)
+ */
+char *conf_cache_dir = NULL;
+/*
+ * flag controlling whether disk files are accessed through memory
+ * mappings instead of read/write system calls (default: no mappings)
+ */
+int conf_map_files = (-1);
+/*
+ * flag controlling whether the files named in the default FCBs are read
+ * in advance by a background thread, together with the files of the
+ * same name and the extensions in the NULL terminated list
+ * conf_prefetch_ext (default: no prefetching)
+ */
+int conf_prefetch = (-1);
+char **conf_prefetch_ext = NULL;
 /*
  * save configuration: default is no saving done
  */
@@ -1216,6 +1294,60 @@ premature_exit:
 }
 
 
+/*
+ * parse the interval of the lockstep checker
+ */
+static int
+parse_lockstep(int *lockstep_p) {
+	int rc = 0;
+	if (*lockstep_p != (-1)) {
+		predefined("cpu lockstep");
+		rc = (-1);
+		goto premature_exit;
+	}
+	get_token();
+	if (! check_equal(&rc)) goto premature_exit;
+	get_token();
+	if (! check_number(&rc)) goto premature_exit;
+	if (token_ul < 1 || token_ul > INT_MAX) {
+		perr("%s(%d): cpu lockstep interval out of range", cfn, ln);
+		rc = (-1);
+		goto premature_exit;
+	}
+	*lockstep_p = (int) token_ul;
+	get_token();
+premature_exit:
+	return rc;
+}
+
+
+/*
+ * parse a resource limit from the configuration file
+ */
+static int
+parse_limit(const char *name, long long *limit_p, long long max) {
+	int rc = 0;
+	if (*limit_p != (-1)) {
+		perr("%s(%d): limit %s redefined", cfn, ln, name);
+		rc = (-1);
+		goto premature_exit;
+	}
+	get_token();
+	if (! check_equal(&rc)) goto premature_exit;
+	get_token();
+	if (! check_number(&rc)) goto premature_exit;
+	if (token_ul < 1 || token_ul > max) {
+		perr("%s(%d): limit %s out of range", cfn, ln, name);
+		rc = (-1);
+		goto premature_exit;
+	}
+	*limit_p = (long long) token_ul;
+	get_token();
+premature_exit:
+	return rc;
+}
+
+
 /*
  * read parameters from the configuration file; parameters already
  * defined on the command line take precedence
@@ -1227,13 +1359,24 @@ parse_config(void) {
 	    temp_screen_delay = (-1), temp_default_drive = (-1),
 	    temp_reverse_bs_del = (-1), temp_delay_count = (-1),
 	    temp_delay_nanoseconds = (-1), temp_color = (-1),
-	    temp_foreground = (-1), temp_background = (-1);
+	    temp_foreground = (-1), temp_background = (-1),
+	    temp_lockstep = (-1), temp_map_files = (-1),
+	    temp_prefetch = (-1);
+	long long temp_limit_instructions = (-1), temp_limit_time = (-1),
+	    temp_limit_output = (-1), temp_limit_files = (-1),
+	    temp_limit_descriptors = (-1), temp_epoch = (-1);
 	enum dump temp_dump = 0;
+	enum durability temp_durability = DUR_UNSET;
+	enum dircache temp_dircache = DC_UNSET;
 	wchar_t line[L_LINE];
 	size_t l;
 	enum charset default_cs[2] = { CS_NONE, CS_NONE };
 	wchar_t **cs;
 	enum log_level temp_log_level = LL_UNSET;
+	int format[6];
+	struct stream *sp;
+	struct disk_format *dfp;
+	static const struct disk_format ibm_3740 = { 26, 1024, 242, 63, 2, 6 };
 	/*
 	 * get wctype("blank") once
 	 */
@@ -1350,47 +1493,251 @@ parse_config(void) {
 			continue;
 		} else if (! wcscmp(token_ident, L"cpu")) {
 			/*
-			 * specify CPU delay: an instruction count
+			 * specify CPU delay (an instruction count
 			 * and a number of nanoseconds, separated by a
-			 * comma
+			 * comma) or the lockstep checker interval
 			 */
 			get_token();
-			if (token != 'i' || wcscmp(token_ident, L"delay")) {
-				pexpected("delay");
+			if (token == 'i' && ! wcscmp(token_ident,
+			    L"lockstep")) {
+				if (parse_lockstep(&temp_lockstep)) {
+					rc = (-1);
+					continue;
+				}
+			} else {
+				if (token != 'i' ||
+				    wcscmp(token_ident, L"delay")) {
+					pexpected("delay");
+					rc = (-1);
+					continue;
+				}
+				if (temp_delay_count != (-1)) {
+					predefined("cpu delay");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+				if (! check_equal(&rc)) continue;
+				get_token();
+				if (! check_number(&rc)) continue;
+				if (token_ul < 1 || token_ul > INT_MAX) {
+					perr("%s(%d): cpu delay count out "
+					    "of range", cfn, ln);
+					rc = (-1);
+					continue;
+				}
+				temp_delay_count = (int) token_ul;
+				get_token();
+				if (token != ',') {
+					pexpected(",");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+				if (! check_number(&rc)) continue;
+				if (token_ul < 1 || token_ul > INT_MAX) {
+					perr("%s(%d): cpu delay nanoseconds "
+					    "out of range", cfn, ln);
+					rc = (-1);
+					continue;
+				}
+				temp_delay_nanoseconds = (int) token_ul;
+				get_token();
+			}
+		} else if (! wcscmp(token_ident, L"limit")) {
+			/*
+			 * resource limits: number of instructions,
+			 * wall-clock seconds, bytes of output, number
+			 * of open files, and number of host file
+			 * descriptors held by open files
+			 */
+			get_token();
+			if (! check_keyword(&rc)) continue;
+			if (! wcscmp(token_ident, L"instructions")) {
+				if (parse_limit("instructions",
+				    &temp_limit_instructions, LLONG_MAX)) {
+					rc = (-1);
+					continue;
+				}
+			} else if (! wcscmp(token_ident, L"time")) {
+				if (parse_limit("time", &temp_limit_time,
+				    INT_MAX)) {
+					rc = (-1);
+					continue;
+				}
+			} else if (! wcscmp(token_ident, L"output")) {
+				if (parse_limit("output", &temp_limit_output,
+				    LLONG_MAX)) {
+					rc = (-1);
+					continue;
+				}
+			} else if (! wcscmp(token_ident, L"files")) {
+				if (parse_limit("files", &temp_limit_files,
+				    INT_MAX)) {
+					rc = (-1);
+					continue;
+				}
+			} else if (! wcscmp(token_ident, L"descriptors")) {
+				if (parse_limit("descriptors",
+				    &temp_limit_descriptors, INT_MAX)) {
+					rc = (-1);
+					continue;
+				}
+			} else {
+				pexpected("instructions, time, output, "
+				    "files, or descriptors");
 				rc = (-1);
 				continue;
 			}
-			if (temp_delay_count != (-1)) {
-				predefined("cpu delay");
+		} else if (! wcscmp(token_ident, L"durability")) {
+			/*
+			 * when data written to disk files is passed to
+			 * the host system: none (when the write buffer is
+			 * full), close (on BDOS close), or sync (on close,
+			 * and synced to stable storage)
+			 */
+			if (temp_durability != DUR_UNSET) {
+				predefined("durability");
 				rc = (-1);
 				continue;
 			}
 			get_token();
 			if (! check_equal(&rc)) continue;
 			get_token();
-			if (! check_number(&rc)) continue;
-			if (token_ul < 1 || token_ul > INT_MAX) {
-				perr("%s(%d): cpu delay count out of range",
-				    cfn, ln);
+			if (! check_keyword(&rc)) continue;
+			if (! wcscmp(token_ident, L"none")) {
+				temp_durability = DUR_NONE;
+			} else if (! wcscmp(token_ident, L"close")) {
+				temp_durability = DUR_CLOSE;
+			} else if (! wcscmp(token_ident, L"sync")) {
+				temp_durability = DUR_SYNC;
+			} else {
+				pexpected("none, close, or sync");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+		} else if (! wcscmp(token_ident, L"directory")) {
+			/*
+			 * how the cached directory index of the drives
+			 * is kept up to date: none (no index), mtime
+			 * (directory modification time), or inotify
+			 */
+			get_token();
+			if (token != 'i' || wcscmp(token_ident, L"cache")) {
+				pexpected("cache");
+				rc = (-1);
+				continue;
+			}
+			if (temp_dircache != DC_UNSET) {
+				predefined("directory cache");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+			if (! check_equal(&rc)) continue;
+			get_token();
+			if (! check_keyword(&rc)) continue;
+			if (! wcscmp(token_ident, L"none")) {
+				temp_dircache = DC_NONE;
+			} else if (! wcscmp(token_ident, L"mtime")) {
+				temp_dircache = DC_MTIME;
+			} else if (! wcscmp(token_ident, L"inotify")) {
+				temp_dircache = DC_INOTIFY;
+			} else {
+				pexpected("none, mtime, or inotify");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+		} else if (! wcscmp(token_ident, L"dependency")) {
+			/*
+			 * dependency file: string containing a Unix path,
+			 * optionally followed by a comma and the format
+			 * (make or json)
+			 */
+			get_token();
+			if (token != 'i' || wcscmp(token_ident, L"file")) {
+				pexpected("file");
+				rc = (-1);
+				continue;
+			}
+			if (conf_dep_file) {
+				predefined("dependency file");
 				rc = (-1);
 				continue;
 			}
-			temp_delay_count = (int) token_ul;
 			get_token();
-			if (token != ',') {
-				pexpected(",");
+			if (! check_equal(&rc)) continue;
+			get_token();
+			if (! check_string(&rc)) continue;
+			if (unix_path(token_string, &conf_dep_file)) {
+				pinvalid("file name");
 				rc = (-1);
 				continue;
 			}
 			get_token();
+			if (token == ',') {
+				get_token();
+				if (! check_keyword(&rc)) continue;
+				if (! wcscmp(token_ident, L"make")) {
+					conf_dep_format = DF_MAKE;
+				} else if (! wcscmp(token_ident, L"json")) {
+					conf_dep_format = DF_JSON;
+				} else {
+					pexpected("make or json");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+			}
+		} else if (! wcscmp(token_ident, L"result")) {
+			/*
+			 * result cache: string containing the path of
+			 * the cache directory
+			 */
+			get_token();
+			if (token != 'i' || wcscmp(token_ident, L"cache")) {
+				pexpected("cache");
+				rc = (-1);
+				continue;
+			}
+			if (conf_cache_dir) {
+				predefined("result cache");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+			if (! check_equal(&rc)) continue;
+			get_token();
+			if (! check_string(&rc)) continue;
+			if (unix_path(token_string, &conf_cache_dir)) {
+				pinvalid("file name");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+		} else if (! wcscmp(token_ident, L"deterministic")) {
+			/*
+			 * deterministic execution, the clock starting
+			 * at the given Unix time
+			 */
+			if (temp_epoch != (-1)) {
+				predefined("deterministic");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+			if (! check_equal(&rc)) continue;
+			get_token();
 			if (! check_number(&rc)) continue;
-			if (token_ul < 1 || token_ul > INT_MAX) {
-				perr("%s(%d): cpu delay nanoseconds out "
-				    "of range", cfn, ln);
+			if (token_ul > LLONG_MAX) {
+				perr("%s(%d): deterministic epoch out of "
+				    "range", cfn, ln);
 				rc = (-1);
 				continue;
 			}
-			temp_delay_nanoseconds = (int) token_ul;
+			temp_epoch = (long long) token_ul;
 			get_token();
 		} else if (! wcscmp(token_ident, L"console")) {
 			/*
@@ -1456,6 +1803,85 @@ parse_config(void) {
 			}
 			temp_dont_close = ! temp_dont_close;
 
+		} else if (! wcscmp(token_ident, L"map")) {
+			/*
+			 * map files determines whether disk files are
+			 * accessed through memory mappings
+			 */
+			get_token();
+			if (token != 'i' || wcscmp(token_ident, L"files")) {
+				pexpected("files");
+				rc = (-1);
+				continue;
+			}
+			if (temp_map_files != (-1)) {
+				predefined("map files");
+				rc = (-1);
+				continue;
+			}
+			if (parse_boolean(&temp_map_files) == (-1)) {
+				rc = (-1);
+				continue;
+			}
+		} else if (! wcscmp(token_ident, L"prefetch")) {
+			/*
+			 * prefetch files determines whether the files named
+			 * on the command line are read in advance,
+			 * prefetch extensions lists the extensions of
+			 * companion files to be read as well
+			 */
+			get_token();
+			if (token == 'i' && ! wcscmp(token_ident, L"files")) {
+				if (temp_prefetch != (-1)) {
+					predefined("prefetch files");
+					rc = (-1);
+					continue;
+				}
+				if (parse_boolean(&temp_prefetch) == (-1)) {
+					rc = (-1);
+					continue;
+				}
+			} else if (token == 'i' &&
+			    ! wcscmp(token_ident, L"extensions")) {
+				if (conf_prefetch_ext) {
+					predefined("prefetch extensions");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+				if (! check_equal(&rc)) continue;
+				n = 0;
+				conf_prefetch_ext = alloc(sizeof (char *));
+				conf_prefetch_ext[0] = NULL;
+				do {
+					get_token();
+					if (! check_string(&rc)) {
+						n = (-1);
+						break;
+					}
+					l = wcslen(token_string);
+					conf_prefetch_ext = resize(
+					    conf_prefetch_ext,
+					    (n + 2) * sizeof (char *));
+					conf_prefetch_ext[n] =
+					    conf_prefetch_ext[n + 1] = NULL;
+					if (l < 1 || l > 3 || unix_path(
+					    token_string,
+					    conf_prefetch_ext + n)) {
+						pinvalid("extension");
+						rc = (-1);
+						n = (-1);
+						break;
+					}
+					n++;
+					get_token();
+				} while (token == ',');
+				if (n == (-1)) continue;
+			} else {
+				pexpected("files or extensions");
+				rc = (-1);
+				continue;
+			}
 		} else if (! wcscmp(token_ident, L"screen")) {
 			/*
 			 * define a delay in seconds between program
@@ -1569,7 +1995,20 @@ parse_config(void) {
 			 * the drive name is a identifier a, b, c, ..., p;
 			 * the parameter value is a string containing a
 			 * Unix path, optionally preceded by the
-			 * identifier readonly and a comma
+			 * identifier readonly and a comma, or the
+			 * identifier ram, optionally followed by a comma,
+			 * a string containing the Unix path of a directory,
+			 * and optionally another comma and a string
+			 * containing the file name patterns to be saved
+			 * there, or the identifier overlay followed by
+			 * two or more strings (separated by commas)
+			 * containing the Unix paths of the layers, top
+			 * layer first, or the identifier tar, a comma,
+			 * and a string containing the Unix path of a tar
+			 * archive, or the identifier image, a comma, a
+			 * string containing the Unix path of a CP/M disk
+			 * image, and optionally six numbers (separated by
+			 * commas) describing its format
 			 */
 			get_token();
 			if (token != 'i' || wcslen(token_ident) != 1) {
@@ -1590,16 +2029,70 @@ parse_config(void) {
 			get_token();
 			if (! check_equal(&rc)) continue;
 			get_token();
-			if (token == 'i') {
+			if (token == 'i' && ! wcscmp(token_ident, L"ram")) {
+				/*
+				 * RAM drive (named ram:<drive letter> in
+				 * messages)
+				 */
+				conf_drive_type[drive_no] = DT_RAM;
+				conf_drives[drive_no] = alloc(6);
+				sprintf(conf_drives[drive_no], "ram:%c",
+				    'a' + drive_no);
+				get_token();
+				if (token == ',') {
+					get_token();
+					if (! check_string(&rc)) continue;
+					if (unix_path(token_string,
+					    conf_persist_dir + drive_no)) {
+						pinvalid("file name");
+						rc = (-1);
+						continue;
+					}
+					get_token();
+				}
+				if (token == ',' &&
+				    conf_persist_dir[drive_no]) {
+					get_token();
+					if (! check_string(&rc)) continue;
+					if (unix_path(token_string,
+					    conf_persist_files + drive_no)) {
+						pinvalid("file name pattern");
+						rc = (-1);
+						continue;
+					}
+					get_token();
+				}
+			} else if (token == 'i' &&
+			    ! wcscmp(token_ident, L"tar")) {
 				/*
-				 * read only?
+				 * tar drives are always read only
 				 */
-				if (wcscmp(token_ident, L"readonly")) {
-					pexpected("string");
+				conf_drive_type[drive_no] = DT_TAR;
+				conf_readonly[drive_no] = 1;
+				get_token();
+				if (token != ',') {
+					pexpected(",");
 					rc = (-1);
 					continue;
 				}
-				conf_readonly[drive_no] = 1;
+				get_token();
+				if (! check_string(&rc)) continue;
+				if (unix_path(token_string,
+				    conf_drives + drive_no)) {
+					pinvalid("file name");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+			} else if (token == 'i' &&
+			    ! wcscmp(token_ident, L"image")) {
+				/*
+				 * disk image drive: the format defaults to
+				 * an 8" single sided single density disk
+				 * (IBM 3740)
+				 */
+				conf_drive_type[drive_no] = DT_IMAGE;
+				conf_disk_format[drive_no] = ibm_3740;
 				get_token();
 				if (token != ',') {
 					pexpected(",");
@@ -1607,14 +2100,122 @@ parse_config(void) {
 					continue;
 				}
 				get_token();
+				if (! check_string(&rc)) continue;
+				if (unix_path(token_string,
+				    conf_drives + drive_no)) {
+					pinvalid("file name");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+				if (token == ',') {
+					for (n = 0; n < 6; n++) {
+						if (n) get_token();
+						if (n && token != ',') {
+							pexpected(",");
+							break;
+						}
+						get_token();
+						if (! check_number(&rc)) break;
+						if (token_ul > 65535) {
+							pinvalid(
+							    "disk parameter");
+							break;
+						}
+						format[n] = (int) token_ul;
+					}
+					if (n < 6) {
+						rc = (-1);
+						continue;
+					}
+					dfp = conf_disk_format + drive_no;
+					dfp->spt = format[0];
+					dfp->bls = format[1];
+					dfp->dsm = format[2];
+					dfp->drm = format[3];
+					dfp->off = format[4];
+					dfp->skew = format[5];
+					get_token();
+				}
+			} else if (token == 'i' &&
+			    ! wcscmp(token_ident, L"overlay")) {
+				/*
+				 * overlay drive: top layer, at least one
+				 * lower layer
+				 */
+				conf_drive_type[drive_no] = DT_OVERLAY;
+				get_token();
+				if (token != ',') {
+					pexpected(",");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+				if (! check_string(&rc)) continue;
+				if (unix_path(token_string,
+				    conf_drives + drive_no)) {
+					pinvalid("file name");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+				n = 0;
+				conf_layers[drive_no] = alloc(sizeof (char *));
+				conf_layers[drive_no][0] = NULL;
+				while (token == ',') {
+					get_token();
+					if (! check_string(&rc)) {
+						n = (-1);
+						break;
+					}
+					conf_layers[drive_no] = resize(
+					    conf_layers[drive_no],
+					    (n + 2) * sizeof (char *));
+					conf_layers[drive_no][n + 1] = NULL;
+					if (unix_path(token_string,
+					    conf_layers[drive_no] + n)) {
+						pinvalid("file name");
+						rc = (-1);
+						n = (-1);
+						break;
+					}
+					n++;
+					get_token();
+				}
+				if (n == (-1)) continue;
+				if (! n) {
+					pexpected(",");
+					rc = (-1);
+					continue;
+				}
+			} else {
+				if (token == 'i') {
+					/*
+					 * read only?
+					 */
+					if (wcscmp(token_ident, L"readonly")) {
+						pexpected("string");
+						rc = (-1);
+						continue;
+					}
+					conf_readonly[drive_no] = 1;
+					get_token();
+					if (token != ',') {
+						pexpected(",");
+						rc = (-1);
+						continue;
+					}
+					get_token();
+				}
+				if (! check_string(&rc)) continue;
+				if (unix_path(token_string,
+				    conf_drives + drive_no)) {
+					pinvalid("file name");
+					rc = (-1);
+					continue;
+				}
+				get_token();
 			}
-			if (! check_string(&rc)) continue;
-			if (unix_path(token_string, conf_drives + drive_no)) {
-				pinvalid("file name");
-				rc = (-1);
-				continue;
-			}
-			get_token();
 		} else if (! wcscmp(token_ident, L"logfile")) {
 			/*
 			 * the parameter of logfile is a string
@@ -1669,6 +2270,99 @@ parse_config(void) {
 				continue;
 			}
 			if (! cols) cols = n;
+		} else if (! wcscmp(token_ident, L"stream")) {
+			/*
+			 * pseudo file: drive letter, string containing
+			 * the file name, equal sign, and either the
+			 * identifier fd and a file descriptor number, or
+			 * the identifier file or command and a string
+			 * containing a Unix path resp. a shell command,
+			 * optionally followed by a comma and the mode
+			 * (text or raw)
+			 */
+			get_token();
+			if (token != 'i' || wcslen(token_ident) != 1) {
+				drive_no = (-1);
+			} else {
+				drive_no = cpm_drive(token_ident[0]);
+			}
+			if (drive_no == (-1)) {
+				pinvalid("drive name");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+			if (! check_string(&rc)) continue;
+			conf_streams = resize(conf_streams,
+			    (conf_stream_count + 1) * sizeof (struct stream));
+			sp = conf_streams + conf_stream_count++;
+			memset(sp, 0, sizeof (struct stream));
+			sp->drive = drive_no;
+			sp->fd = (-1);
+			for (n = 0; token_string[n]; n++) {
+				token_string[n] = towlower(token_string[n]);
+			}
+			if (unix_path(token_string, &sp->name)) {
+				pinvalid("file name");
+				rc = (-1);
+				continue;
+			}
+			for (n = 0; n < conf_stream_count - 1; n++) {
+				if (conf_streams[n].drive == drive_no &&
+				    ! strcmp(conf_streams[n].name, sp->name)) {
+					break;
+				}
+			}
+			if (n < conf_stream_count - 1) {
+				predefined("stream");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+			if (! check_equal(&rc)) continue;
+			get_token();
+			if (! check_keyword(&rc)) continue;
+			if (! wcscmp(token_ident, L"fd")) {
+				sp->kind = SK_FD;
+				get_token();
+				if (! check_number(&rc)) continue;
+				if (token_ul > INT_MAX) {
+					perr("%s(%d): file descriptor out of "
+					    "range", cfn, ln);
+					rc = (-1);
+					continue;
+				}
+				sp->fd = (int) token_ul;
+			} else if (! wcscmp(token_ident, L"file") ||
+			    ! wcscmp(token_ident, L"command")) {
+				sp->kind = wcscmp(token_ident, L"file") ?
+				    SK_COMMAND : SK_FILE;
+				get_token();
+				if (! check_string(&rc)) continue;
+				if (unix_path(token_string, &sp->path)) {
+					pinvalid(sp->kind == SK_FILE ?
+					    "file name" : "command");
+					rc = (-1);
+					continue;
+				}
+			} else {
+				pexpected("fd, file, or command");
+				rc = (-1);
+				continue;
+			}
+			get_token();
+			if (token == ',') {
+				get_token();
+				if (! check_keyword(&rc)) continue;
+				if (! wcscmp(token_ident, L"text")) {
+					sp->text = 1;
+				} else if (wcscmp(token_ident, L"raw")) {
+					pexpected("text or raw");
+					rc = (-1);
+					continue;
+				}
+				get_token();
+			}
 		} else if (! wcscmp(token_ident, L"printer")) {
 			/*
 			 * printer file definition
@@ -1733,6 +2427,8 @@ parse_config(void) {
 	 */
 	if (log_level == LL_UNSET) log_level = temp_log_level;
 	if (dont_close == (-1)) dont_close = temp_dont_close;
+	if (conf_map_files == (-1)) conf_map_files = temp_map_files;
+	if (conf_prefetch == (-1)) conf_prefetch = temp_prefetch;
 	if (altkeys == (-1)) altkeys = temp_altkeys;
 	if (reverse_bs_del == (-1)) reverse_bs_del = temp_reverse_bs_del;
 	if (screen_delay == (-1)) screen_delay = temp_screen_delay;
@@ -1742,6 +2438,21 @@ parse_config(void) {
 	if (conf_color == (-1)) conf_color = temp_color;
 	if (conf_foreground == (-1)) conf_foreground = temp_foreground;
 	if (conf_background == (-1)) conf_background = temp_background;
+	if (conf_lockstep == (-1)) conf_lockstep = temp_lockstep;
+	if (conf_limit_instructions == (-1)) {
+		conf_limit_instructions = temp_limit_instructions;
+	}
+	if (conf_limit_time == (-1)) conf_limit_time = (int) temp_limit_time;
+	if (conf_limit_output == (-1)) conf_limit_output = temp_limit_output;
+	if (conf_epoch == (-1)) conf_epoch = temp_epoch;
+	if (conf_durability == DUR_UNSET) conf_durability = temp_durability;
+	if (conf_dircache == DC_UNSET) conf_dircache = temp_dircache;
+	if (conf_limit_files == (-1)) {
+		conf_limit_files = (int) temp_limit_files;
+	}
+	if (conf_limit_descriptors == (-1)) {
+		conf_limit_descriptors = (int) temp_limit_descriptors;
+	}
 	if (delay_count == (-1)) {
 		delay_count = temp_delay_count;
 		delay_nanoseconds = temp_delay_nanoseconds;
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <wchar.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * Streams are pseudo files of the drives whose records are transferred
+ * sequentially to or from a host file descriptor, a host file (e.g. a
+ * FIFO), or a shell command, without seeking or storing a file. A
+ * stream opened by BDOS function 15 (open file) is read, a stream
+ * opened by function 22 (make file) is written; in text mode, the
+ * characters are converted like those of the printer, punch, and reader
+ * devices (CR/LF to LF and back, SUB ends the output). Since pipes
+ * opened by popen() cannot be wide oriented on all systems, text is
+ * converted from and to multibyte characters explicitly.
+ */
+
+
+/*
+ * state of a stream; at most one FCB may use a stream at a time
+ */
+static struct stream_state {
+	FILE *fp;
+	int output;
+	int cr; /* text output: the last character was a CR */
+	int lf; /* text input: a LF is to be returned after the CR */
+	int ended; /* text output: SUB written, input: end of file */
+	mbstate_t mbs; /* text: multibyte conversion state */
+} *states = NULL;
+
+
+/*
+ * SIGPIPE is ignored while output streams are open (a reader going
+ * away is reported as a write error); the previous action is restored
+ * when the last output stream is closed
+ */
+static struct sigaction saved_sigpipe;
+static int output_streams = 0;
+
+
+/*
+ * find the stream of a drive with the given name; returns its handle or
+ * (-1) if there is no such stream
+ */
+int
+stm_find(int drive, const char *name) {
+	int i;
+	for (i = 0; i < conf_stream_count; i++) {
+		if (conf_streams[i].drive == drive &&
+		    ! strcmp(conf_streams[i].name, name)) return i;
+	}
+	return (-1);
+}
+
+
+/*
+ * open a stream for reading or writing; returns (-1) and sets errno on
+ * failure
+ */
+int
+stm_open(int handle, int output) {
+	int rc = 0, fd;
+	struct stream *sp = conf_streams + handle;
+	struct stream_state *ssp;
+	struct sigaction sa;
+	const char *mode = output ? "w" : "r";
+	if (! states) {
+		states = alloc(conf_stream_count *
+		    sizeof (struct stream_state));
+		memset(states, 0, conf_stream_count *
+		    sizeof (struct stream_state));
+	}
+	ssp = states + handle;
+	if (ssp->fp) {
+		errno = EBUSY;
+		rc = (-1);
+		goto premature_exit;
+	}
+	switch (sp->kind) {
+	case SK_FD:
+		/*
+		 * the descriptor is duplicated to keep it open after the
+		 * stream is closed
+		 */
+		fd = fcntl(sp->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd == (-1)) {
+			rc = (-1);
+			goto premature_exit;
+		}
+		ssp->fp = fdopen(fd, mode);
+		if (! ssp->fp) {
+			rc = (-1);
+			close(fd);
+			goto premature_exit;
+		}
+		break;
+	case SK_FILE:
+		ssp->fp = fopen(sp->path, mode);
+		/*
+		 * commands of other streams must not inherit the file
+		 */
+		if (ssp->fp) fcntl(fileno(ssp->fp), F_SETFD, FD_CLOEXEC);
+		break;
+	case SK_COMMAND:
+		fflush(NULL);
+		ssp->fp = popen(sp->path, mode);
+		break;
+	}
+	if (! ssp->fp) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	if (output && ! output_streams++) {
+		sa.sa_handler = SIG_IGN;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sigaction(SIGPIPE, &sa, &saved_sigpipe);
+	}
+	ssp->output = output;
+	ssp->cr = ssp->lf = ssp->ended = 0;
+	memset(&ssp->mbs, 0, sizeof ssp->mbs);
+premature_exit:
+	return rc;
+}
+
+
+/*
+ * helper function for stm_read(): read a character from a text stream;
+ * invalid multibyte sequences are skipped. Returns WEOF at the end of
+ * the stream or on errors.
+ */
+static wint_t
+get_wchar(struct stream_state *ssp) {
+	int c;
+	char b;
+	wchar_t wc;
+	size_t t;
+	for (;;) {
+		c = getc(ssp->fp);
+		if (c == EOF) return WEOF;
+		b = (char) c;
+		t = mbrtowc(&wc, &b, 1, &ssp->mbs);
+		if (t == (size_t) (-2)) continue;
+		if (t == (size_t) (-1)) {
+			memset(&ssp->mbs, 0, sizeof ssp->mbs);
+			continue;
+		}
+		return (wint_t) wc;
+	}
+}
+
+
+/*
+ * read the next record from a stream to record; returns the number of
+ * bytes read (the rest of the record is filled with SUB characters), 0
+ * at the end of the stream, or (-1) on errors (errno is set)
+ */
+int
+stm_read(int handle, unsigned char *record) {
+	int n = 0, t;
+	wint_t wc;
+	struct stream_state *ssp = states + handle;
+	if (ssp->output) {
+		errno = EBADF;
+		return (-1);
+	}
+	if (! conf_streams[handle].text) {
+		/*
+		 * raw bytes
+		 */
+		while (n < 128 && ! ssp->ended) {
+			t = fread(record + n, 1, 128 - n, ssp->fp);
+			n += t;
+			if (n == 128) break;
+			if (feof(ssp->fp)) {
+				ssp->ended = 1;
+			} else if (errno != EINTR && errno != EAGAIN) {
+				return (-1);
+			}
+			clearerr(ssp->fp);
+		}
+	} else {
+		/*
+		 * text: convert to the CP/M character set (skipping
+		 * characters which cannot be converted), LF to CR/LF
+		 */
+		while (n < 128) {
+			if (ssp->lf) {
+				ssp->lf = 0;
+				record[n++] = 0x0a /* LF */;
+				continue;
+			}
+			if (ssp->ended) break;
+			wc = get_wchar(ssp);
+			if (wc == WEOF) {
+				if (feof(ssp->fp)) {
+					ssp->ended = 1;
+				} else if (errno != EINTR && errno != EAGAIN) {
+					return (-1);
+				}
+				clearerr(ssp->fp);
+				continue;
+			}
+			t = to_cpm(wc);
+			if (t == (-1)) continue;
+			if (t == 0x0a /* LF */) {
+				ssp->lf = 1;
+				t = 0x0d /* CR */;
+			}
+			record[n++] = t;
+		}
+	}
+	if (n) memset(record + n, 0x1a /* SUB */, 128 - n);
+	return n;
+}
+
+
+/*
+ * helper function for stm_write(): write a character to a text stream;
+ * characters which cannot be converted are skipped
+ */
+static int
+put_wchar(struct stream_state *ssp, wchar_t wc) {
+	char b[MB_LEN_MAX];
+	size_t n = 0, t;
+	t = wcrtomb(b, wc, &ssp->mbs);
+	if (t == (size_t) (-1)) {
+		memset(&ssp->mbs, 0, sizeof ssp->mbs);
+		return 0;
+	}
+	while (n < t) {
+		n += fwrite(b + n, 1, t - n, ssp->fp);
+		if (n == t) break;
+		if (errno != EINTR && errno != EAGAIN) return (-1);
+		clearerr(ssp->fp);
+	}
+	return 0;
+}
+
+
+/*
+ * write a record to a stream; returns (-1) on errors (errno is set)
+ */
+int
+stm_write(int handle, const unsigned char *record) {
+	int i;
+	size_t n = 0;
+	unsigned char c;
+	wint_t wc;
+	struct stream_state *ssp = states + handle;
+	if (! ssp->output) {
+		errno = EBADF;
+		return (-1);
+	}
+	if (! conf_streams[handle].text) {
+		/*
+		 * raw bytes
+		 */
+		while (n < 128) {
+			n += fwrite(record + n, 1, 128 - n, ssp->fp);
+			if (n == 128) break;
+			if (errno != EINTR && errno != EAGAIN) return (-1);
+			clearerr(ssp->fp);
+		}
+		return 0;
+	}
+	/*
+	 * text: convert from the CP/M character set (skipping characters
+	 * which cannot be converted), CR/LF to LF; a SUB character ends
+	 * the text
+	 */
+	for (i = 0; i < 128 && ! ssp->ended; i++) {
+		c = record[i];
+		if (c == 0x1a /* SUB */) {
+			ssp->ended = 1;
+			break;
+		}
+		if (c != 0x0a /* LF */ && ssp->cr &&
+		    put_wchar(ssp, L'\r')) return (-1);
+		if (c != 0x0d /* CR */) {
+			wc = from_cpm(c);
+			if (wc != (-1) && put_wchar(ssp, wc)) return (-1);
+		}
+		ssp->cr = (c == 0x0d /* CR */);
+	}
+	return 0;
+}
+
+
+/*
+ * close a stream; returns (-1) on errors (errno is set), and 1 if the
+ * command of the stream returned a nonzero exit status (which is
+ * logged)
+ */
+int
+stm_close(int handle) {
+	int rc = 0, t, e = 0;
+	struct stream *sp = conf_streams + handle;
+	struct stream_state *ssp = states + handle;
+	if (ssp->output && ssp->cr && ! ssp->ended) {
+		if (put_wchar(ssp, L'\r')) {
+			e = errno;
+			rc = (-1);
+		}
+	}
+	if (sp->kind == SK_COMMAND) {
+		t = pclose(ssp->fp);
+		if (t == (-1)) {
+			e = errno;
+			rc = (-1);
+		} else if (t) {
+			plog("command \"%s\" of stream %c:%s returned "
+			    "status 0x%x", sp->path, 'a' + sp->drive,
+			    sp->name, t);
+			if (! rc) rc = 1;
+		}
+	} else if (fclose(ssp->fp)) {
+		e = errno;
+		rc = (-1);
+	}
+	ssp->fp = NULL;
+	if (ssp->output && ! --output_streams) {
+		sigaction(SIGPIPE, &saved_sigpipe, NULL);
+	}
+	if (rc == (-1)) errno = e;
+	return rc;
+}
+
+
+/*
+ * close the streams still open (i.e. not closed by the program);
+ * returns (-1) if errors occurred
+ */
+int
+stm_exit(void) {
+	int rc = 0, i;
+	if (! states) goto premature_exit;
+	for (i = 0; i < conf_stream_count; i++) {
+		if (! states[i].fp) continue;
+		if (stm_close(i) == (-1)) {
+			perr("cannot close stream %c:%s: %s",
+			    'a' + conf_streams[i].drive,
+			    conf_streams[i].name, strerror(errno));
+			rc = (-1);
+		}
+	}
+	free(states);
+	states = NULL;
+premature_exit:
+	return rc;
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * Tar drives present the regular files of an uncompressed tar archive
+ * as a read only drive. The member headers are read once, when the
+ * drive is set up, into an index hashed by file name; file data is
+ * then copied directly from the archive, which is mapped into memory
+ * if possible and read by pread(2) otherwise. Only members in the top
+ * directory of the archive are visible; their names are converted to
+ * lower case (as CP/M distributions usually are in upper case).
+ */
+#define TAR_BLOCK 512
+
+
+/*
+ * maximum length of a GNU long name (longer names are taken as a sign
+ * of a corrupt archive)
+ */
+#define TAR_LONG_NAME 4096
+
+
+/*
+ * member of an archive
+ */
+struct tar_member {
+	struct tar_member *next_p; /* next member in the same hash chain */
+	off_t offset; /* offset of the member data in the archive */
+	off_t size;
+	time_t modify;
+	char name[1]; /* extended by the allocation */
+};
+
+
+/*
+ * archive of a tar drive: the members are hashed by name for lookups
+ * and kept in an array for listings
+ */
+#define TAR_HASH_SIZE 1024
+static struct tar_archive {
+	int fd;
+	unsigned char *map; /* NULL if the archive could not be mapped */
+	size_t map_length;
+	struct tar_member **table;
+	struct tar_member **members;
+	int count;
+	int size;
+} tar_archives[16];
+
+
+/*
+ * open files
+ */
+struct tar_handle {
+	struct tar_archive *ap;
+	struct tar_member *mp;
+};
+static struct handle_table handles = HANDLE_TABLE_INITIALIZER;
+static struct pool handle_pool = POOL_INITIALIZER(struct tar_handle);
+
+
+/*
+ * find a member by name; returns NULL if there is no such member
+ */
+static struct tar_member *
+find_member(struct tar_archive *ap, const char *name) {
+	struct tar_member *mp;
+	mp = ap->table[hash_name(name, TAR_HASH_SIZE)];
+	while (mp && strcmp(mp->name, name)) mp = mp->next_p;
+	return mp;
+}
+
+
+/*
+ * enter a member into the index; a later member of the same name
+ * replaces an earlier one (as when the archive is extracted)
+ */
+static void
+add_member(struct tar_archive *ap, const char *name, off_t offset,
+    off_t size, time_t modify) {
+	struct tar_member *mp = find_member(ap, name);
+	unsigned h;
+	if (! mp) {
+		mp = alloc(sizeof (struct tar_member) + strlen(name));
+		strcpy(mp->name, name);
+		h = hash_name(name, TAR_HASH_SIZE);
+		mp->next_p = ap->table[h];
+		ap->table[h] = mp;
+		if (ap->count == ap->size) {
+			ap->size = ap->size ? ap->size * 2 : 64;
+			ap->members = resize(ap->members,
+			    ap->size * sizeof (struct tar_member *));
+		}
+		ap->members[ap->count++] = mp;
+	}
+	mp->offset = offset;
+	mp->size = size;
+	mp->modify = modify;
+}
+
+
+/*
+ * read from the archive at a given offset; returns the number of bytes
+ * read or (-1)
+ */
+static ssize_t
+read_archive(struct tar_archive *ap, off_t offset, void *buffer, size_t n) {
+	if (ap->map) {
+		if ((size_t) offset >= ap->map_length) return 0;
+		if (n > ap->map_length - offset) n = ap->map_length - offset;
+		memcpy(buffer, ap->map + offset, n);
+		return n;
+	}
+	return HOST_CALL(pread(ap->fd, buffer, n, offset));
+}
+
+
+/*
+ * get a numeric field of a member header: octal digits (optionally
+ * surrounded by blanks and terminated by NUL), or a big endian binary
+ * number if the first byte has its top bit set (GNU extension); returns
+ * (-1) for negative binary numbers and for binary numbers too large
+ * for a long long
+ */
+static long long
+get_number(const unsigned char *field, int length) {
+	long long n = 0;
+	int i = 0;
+	if (field[0] & 0x80) {
+		if (field[0] & 0x40) return (-1);
+		n = field[0] & 0x3f;
+		for (i = 1; i < length; i++) {
+			if (n > (LLONG_MAX >> 8)) return (-1);
+			n = (n << 8) | field[i];
+		}
+		return n;
+	}
+	while (i < length && field[i] == ' ') i++;
+	while (i < length && field[i] >= '0' && field[i] <= '7') {
+		n = n * 8 + (field[i++] - '0');
+	}
+	return n;
+}
+
+
+/*
+ * check the checksum of a member header (the sum of all header bytes,
+ * with the checksum field counted as blanks)
+ */
+static int
+check_header(const unsigned char *header) {
+	long long sum = 0;
+	int i;
+	for (i = 0; i < TAR_BLOCK; i++) {
+		sum += (i >= 148 && i < 156) ? ' ' : header[i];
+	}
+	return sum == get_number(header + 148, 8);
+}
+
+
+/*
+ * get the name of a member in lower case and without leading "./": the
+ * GNU long name preceding the member, if there is one, or the name in
+ * the member header (prefixed by the ustar prefix field)
+ */
+#define L_TAR_NAME 257
+static void
+get_name(const unsigned char *header, const char *long_name, char *name) {
+	size_t skip = 0;
+	char *cp;
+	if (long_name) {
+		snprintf(name, L_TAR_NAME, "%s", long_name);
+	} else if (! memcmp(header + 257, "ustar", 5) && header[345]) {
+		snprintf(name, L_TAR_NAME, "%.155s/%.100s",
+		    (const char *) header + 345, (const char *) header);
+	} else {
+		snprintf(name, L_TAR_NAME, "%.100s", (const char *) header);
+	}
+	while (name[skip] == '.' && name[skip + 1] == '/') skip += 2;
+	memmove(name, name + skip, strlen(name + skip) + 1);
+	for (cp = name; *cp; cp++) *cp = tolower((unsigned char) *cp);
+}
+
+
+/*
+ * set up a tar drive: open (and map) the archive, and index its members
+ */
+int
+tar_init(int drive) {
+	struct tar_archive *ap = tar_archives + drive;
+	unsigned char header[TAR_BLOCK];
+	char name[L_TAR_NAME], *long_name = NULL;
+	struct stat s;
+	off_t offset = 0, size;
+	ssize_t n;
+	void *p;
+	int rc = (-1), type;
+	ap->table = alloc(TAR_HASH_SIZE * sizeof (struct tar_member *));
+	memset(ap->table, 0, TAR_HASH_SIZE * sizeof (struct tar_member *));
+	ap->fd = open(conf_drives[drive], O_RDONLY | O_CLOEXEC);
+	if (ap->fd == (-1)) {
+		perr("cannot open archive %s of drive %c: %s",
+		    conf_drives[drive], 'A' + drive, strerror(errno));
+		goto premature_exit;
+	}
+	if (fstat(ap->fd, &s) == (-1)) {
+		perr("cannot stat archive %s of drive %c: %s",
+		    conf_drives[drive], 'A' + drive, strerror(errno));
+		goto premature_exit;
+	}
+	/*
+	 * map the archive (files are read by pread(2) if this fails)
+	 */
+	if (s.st_size > 0) {
+		p = mmap(NULL, (size_t) s.st_size, PROT_READ, MAP_PRIVATE,
+		    ap->fd, 0);
+		if (p != MAP_FAILED) {
+			ap->map = p;
+			ap->map_length = (size_t) s.st_size;
+		}
+	}
+	/*
+	 * walk the member headers up to the first all zero block (or the
+	 * end of the archive)
+	 */
+	for (;;) {
+		n = read_archive(ap, offset, header, TAR_BLOCK);
+		if (n == (-1)) {
+			perr("cannot read archive %s of drive %c: %s",
+			    conf_drives[drive], 'A' + drive, strerror(errno));
+			goto premature_exit;
+		}
+		if (n < TAR_BLOCK || ! header[0]) break;
+		if (! check_header(header)) {
+			perr("bad header in archive %s of drive %c "
+			    "at offset %lld", conf_drives[drive], 'A' + drive,
+			    (long long) offset);
+			goto premature_exit;
+		}
+		offset += TAR_BLOCK;
+		size = (off_t) get_number(header + 124, 12);
+		type = header[156];
+		if (size < 0 || size > s.st_size - offset ||
+		    (type == 'L' && size > TAR_LONG_NAME)) {
+			perr("bad member size in archive %s of drive %c "
+			    "at offset %lld", conf_drives[drive], 'A' + drive,
+			    (long long) (offset - TAR_BLOCK));
+			goto premature_exit;
+		}
+		if (type == 'L') {
+			/*
+			 * GNU long name of the next member
+			 */
+			free(long_name);
+			long_name = alloc((size_t) size + 1);
+			n = read_archive(ap, offset, long_name, (size_t) size);
+			long_name[n > 0 ? n : 0] = '\0';
+		} else if (type == '0' || type == '\0' || type == '7') {
+			/*
+			 * regular file: only members in the top directory
+			 * are visible
+			 */
+			get_name(header, long_name, name);
+			free(long_name);
+			long_name = NULL;
+			if (name[0] && ! strchr(name, '/')) {
+				add_member(ap, name, offset, size,
+				    (time_t) get_number(header + 136, 12));
+			}
+		} else {
+			free(long_name);
+			long_name = NULL;
+		}
+		offset += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+	rc = 0;
+premature_exit:
+	free(long_name);
+	return rc;
+}
+
+
+/*
+ * open a member of the archive of a tar drive; opening for writing
+ * fails with EACCES, creating files with EROFS. Returns a handle or
+ * (-1) with errno set like open(2).
+ */
+static int
+tar_open(int drive, const char *name, int flags) {
+	struct tar_archive *ap = tar_archives + drive;
+	struct tar_member *mp;
+	struct tar_handle *hp;
+	if (flags & O_CREAT) {
+		errno = EROFS;
+		return (-1);
+	}
+	mp = find_member(ap, name);
+	if (! mp) {
+		errno = ENOENT;
+		return (-1);
+	}
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		errno = EACCES;
+		return (-1);
+	}
+	hp = pool_get(&handle_pool);
+	hp->ap = ap;
+	hp->mp = mp;
+	return handle_add(&handles, hp);
+}
+
+
+/*
+ * close a file handle
+ */
+static int
+tar_close(int handle) {
+	struct tar_handle *hp = handle_get(&handles, handle);
+	if (! hp) return (-1);
+	handle_remove(&handles, handle);
+	pool_put(&handle_pool, hp);
+	return 0;
+}
+
+
+/*
+ * read from a handle at an offset (relative to the start of the member)
+ */
+static ssize_t
+tar_pread(int handle, void *buffer, size_t n, off_t offset) {
+	struct tar_handle *hp = handle_get(&handles, handle);
+	if (! hp) return (-1);
+	if (offset < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (offset >= hp->mp->size) return 0;
+	if ((off_t) n > hp->mp->size - offset) {
+		n = (size_t) (hp->mp->size - offset);
+	}
+	return read_archive(hp->ap, hp->mp->offset + offset, buffer, n);
+}
+
+
+/*
+ * members are opened read only and cannot be written to
+ */
+static ssize_t
+tar_pwrite(int handle, const void *buffer, size_t n, off_t offset) {
+	errno = EBADF;
+	return (-1);
+}
+
+
+/*
+ * get the attributes of a member: archive members are read only regular
+ * files
+ */
+static int
+tar_stat(int drive, const char *name, struct stat *sp) {
+	struct tar_member *mp = find_member(tar_archives + drive, name);
+	if (! mp) {
+		errno = ENOENT;
+		return (-1);
+	}
+	memset(sp, 0, sizeof (struct stat));
+	sp->st_mode = S_IFREG | 0444;
+	sp->st_size = mp->size;
+	sp->st_atime = sp->st_mtime = mp->modify;
+	return 0;
+}
+
+
+/*
+ * members cannot be deleted or renamed
+ */
+static int
+tar_unlink(int drive, const char *name) {
+	errno = EROFS;
+	return (-1);
+}
+
+
+static int
+tar_link(int drive, const char *old_name, const char *new_name) {
+	errno = EROFS;
+	return (-1);
+}
+
+
+/*
+ * list the members of an archive
+ */
+static const char *
+tar_next_name(int drive, int *pos_p) {
+	struct tar_archive *ap = tar_archives + drive;
+	if (*pos_p >= ap->count) return NULL;
+	return ap->members[(*pos_p)++]->name;
+}
+
+
+/*
+ * operations on the members of the archives of tar drives
+ */
+const struct drive_ops tar_ops = {
+	tar_open, tar_stat, tar_unlink, tar_link, tar_next_name,
+	tar_pread, tar_pwrite, tar_close
+};
+
+
+/*
+ * release the archives of the tar drives (open handles must have been
+ * closed before)
+ */
+void
+tar_exit(void) {
+	int i, j;
+	struct tar_archive *ap;
+	for (i = 0; i < 16; i++) {
+		ap = tar_archives + i;
+		if (! ap->table) continue;
+		if (ap->map) munmap(ap->map, ap->map_length);
+		if (ap->fd != (-1)) close(ap->fd);
+		for (j = 0; j < ap->count; j++) free(ap->members[j]);
+		free(ap->table);
+		free(ap->members);
+		memset(ap, 0, sizeof (struct tar_archive));
+	}
+	free_handles(&handles);
+	free_pool(&handle_pool);
+}
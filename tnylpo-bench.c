@@ -0,0 +1,1335 @@
+/*
+ * Copyright (c) 2019 Georg Brein. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * tnylpo-bench runs a set of built-in Z80 workloads on the emulator
+ * and reports the emulation speed and the file I/O throughput as CSV
+ * on stdout; it links the emulator proper (everything but main.c) and
+ * needs no CP/M software. Optionally, the results are compared to a
+ * baseline (the CSV output of an earlier run), and slowdowns beyond a
+ * threshold are reported as errors.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+#include <errno.h>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "tnylpo.h"
+
+
+/*
+ * the workloads store their 16-bit result at this address (in the
+ * zero page area reserved for the CBIOS, which is unused by tnylpo)
+ */
+#define RESULT_ADDRESS 0x0040
+
+
+/*
+ * Common start of all workloads: the subroutine "work" (which
+ * immediately follows this code) is called "count" times, and its
+ * result (in HL) is stored at RESULT_ADDRESS. The word at 0x0103 is
+ * patched by tnylpo-bench before the program is written to disk.
+ */
+#define COUNT_OFFSET 3
+static const unsigned char prologue[] = {
+	0xc3, 0x05, 0x01,                   /* 0100 jp start */
+	0x01, 0x00,                         /* 0103 count: dw 1 */
+	0x2a, 0x03, 0x01,                   /* 0105 start: ld hl,(count) */
+	0x22, 0x1d, 0x01,                   /* 0108 ld (left),hl */
+	0xcd, 0x1f, 0x01,                   /* 010b again: call work */
+	0x22, 0x40, 0x00,                   /* 010e ld ($40),hl */
+	0x2a, 0x1d, 0x01,                   /* 0111 ld hl,(left) */
+	0x2b,                               /* 0114 dec hl */
+	0x22, 0x1d, 0x01,                   /* 0115 ld (left),hl */
+	0x7c,                               /* 0118 ld a,h */
+	0xb5,                               /* 0119 or l */
+	0x20, 0xef,                         /* 011a jr nz,again */
+	0xc9,                               /* 011c ret */
+	0x00, 0x00,                         /* 011d left: dw 0 */
+};
+
+
+/*
+ * integer loop: sum of 1...1000 (modulo 0x10000)
+ */
+static const unsigned char loop_code[] = {
+	0x21, 0x00, 0x00,                   /* 011f work: ld hl,0 */
+	0x01, 0xe8, 0x03,                   /* 0122 ld bc,1000 */
+	0x09,                               /* 0125 l1: add hl,bc */
+	0x0b,                               /* 0126 dec bc */
+	0x78,                               /* 0127 ld a,b */
+	0xb1,                               /* 0128 or c */
+	0x20, 0xfa,                         /* 0129 jr nz,l1 */
+	0xc9,                               /* 012b ret */
+};
+
+
+/*
+ * sieve of Eratosthenes as in the BYTE benchmark: number of primes
+ * found in 8190 flags
+ */
+static const unsigned char sieve_code[] = {
+	0x21, 0x63, 0x01,                   /* 011f work: ld hl,flags */
+	0x36, 0x01,                         /* 0122 ld (hl),1 */
+	0x11, 0x64, 0x01,                   /* 0124 ld de,flags+1 */
+	0x01, 0xfd, 0x1f,                   /* 0127 ld bc,size-1 */
+	0xed, 0xb0,                         /* 012a ldir */
+	0xfd, 0x21, 0x00, 0x00,             /* 012c ld iy,0 */
+	0x01, 0x00, 0x00,                   /* 0130 ld bc,0 */
+	0x21, 0x63, 0x01,                   /* 0133 s1: ld hl,flags */
+	0x09,                               /* 0136 add hl,bc */
+	0x7e,                               /* 0137 ld a,(hl) */
+	0xb7,                               /* 0138 or a */
+	0x28, 0x1b,                         /* 0139 jr z,s3 */
+	0x60,                               /* 013b ld h,b */
+	0x69,                               /* 013c ld l,c */
+	0x29,                               /* 013d add hl,hl */
+	0x23,                               /* 013e inc hl */
+	0x23,                               /* 013f inc hl */
+	0x23,                               /* 0140 inc hl */
+	0xeb,                               /* 0141 ex de,hl */
+	0x21, 0x63, 0x01,                   /* 0142 ld hl,flags */
+	0x09,                               /* 0145 add hl,bc */
+	0x19,                               /* 0146 add hl,de */
+	0x7d,                               /* 0147 s2: ld a,l */
+	0xd6, 0x61,                         /* 0148 sub (flags+size) & 255 */
+	0x7c,                               /* 014a ld a,h */
+	0xde, 0x21,                         /* 014b sbc a,(flags+size) >> 8 */
+	0x30, 0x05,                         /* 014d jr nc,s4 */
+	0x36, 0x00,                         /* 014f ld (hl),0 */
+	0x19,                               /* 0151 add hl,de */
+	0x18, 0xf3,                         /* 0152 jr s2 */
+	0xfd, 0x23,                         /* 0154 s4: inc iy */
+	0x03,                               /* 0156 s3: inc bc */
+	0x79,                               /* 0157 ld a,c */
+	0xd6, 0xfe,                         /* 0158 sub size & 255 */
+	0x78,                               /* 015a ld a,b */
+	0xde, 0x1f,                         /* 015b sbc a,size >> 8 */
+	0x38, 0xd4,                         /* 015d jr c,s1 */
+	0xfd, 0xe5,                         /* 015f push iy */
+	0xe1,                               /* 0161 pop hl */
+	0xc9,                               /* 0162 ret */
+};
+
+
+/*
+ * 16-bit multiplication and division by shifting: sum of quotients and
+ * remainders of (i * 12345) / (i + 7) for i = 1...300
+ */
+static const unsigned char muldiv_code[] = {
+	0x21, 0x00, 0x00,                   /* 011f work: ld hl,0 */
+	0x22, 0x86, 0x01,                   /* 0122 ld (sum),hl */
+	0x01, 0x01, 0x00,                   /* 0125 ld bc,1 */
+	0xed, 0x43, 0x84, 0x01,             /* 0128 w1: ld (i),bc */
+	0x11, 0x39, 0x30,                   /* 012c ld de,12345 */
+	0xcd, 0x5c, 0x01,                   /* 012f call mul */
+	0x44,                               /* 0132 ld b,h */
+	0x4d,                               /* 0133 ld c,l */
+	0xed, 0x5b, 0x84, 0x01,             /* 0134 ld de,(i) */
+	0x21, 0x07, 0x00,                   /* 0138 ld hl,7 */
+	0x19,                               /* 013b add hl,de */
+	0xeb,                               /* 013c ex de,hl */
+	0xcd, 0x6d, 0x01,                   /* 013d call div */
+	0x09,                               /* 0140 add hl,bc */
+	0xed, 0x5b, 0x86, 0x01,             /* 0141 ld de,(sum) */
+	0x19,                               /* 0145 add hl,de */
+	0x22, 0x86, 0x01,                   /* 0146 ld (sum),hl */
+	0xed, 0x4b, 0x84, 0x01,             /* 0149 ld bc,(i) */
+	0x03,                               /* 014d inc bc */
+	0x79,                               /* 014e ld a,c */
+	0xfe, 0x2d,                         /* 014f cp 301 & 255 */
+	0x20, 0xd5,                         /* 0151 jr nz,w1 */
+	0x78,                               /* 0153 ld a,b */
+	0xfe, 0x01,                         /* 0154 cp 301 >> 8 */
+	0x20, 0xd0,                         /* 0156 jr nz,w1 */
+	0x2a, 0x86, 0x01,                   /* 0158 ld hl,(sum) */
+	0xc9,                               /* 015b ret */
+	0x21, 0x00, 0x00,                   /* 015c mul: ld hl,0 */
+	0x3e, 0x10,                         /* 015f ld a,16 */
+	0x29,                               /* 0161 m1: add hl,hl */
+	0xcb, 0x13,                         /* 0162 rl e */
+	0xcb, 0x12,                         /* 0164 rl d */
+	0x30, 0x01,                         /* 0166 jr nc,m2 */
+	0x09,                               /* 0168 add hl,bc */
+	0x3d,                               /* 0169 m2: dec a */
+	0x20, 0xf5,                         /* 016a jr nz,m1 */
+	0xc9,                               /* 016c ret */
+	0x21, 0x00, 0x00,                   /* 016d div: ld hl,0 */
+	0x3e, 0x10,                         /* 0170 ld a,16 */
+	0xcb, 0x21,                         /* 0172 d1: sla c */
+	0xcb, 0x10,                         /* 0174 rl b */
+	0xed, 0x6a,                         /* 0176 adc hl,hl */
+	0xed, 0x52,                         /* 0178 sbc hl,de */
+	0x30, 0x03,                         /* 017a jr nc,d2 */
+	0x19,                               /* 017c add hl,de */
+	0x18, 0x01,                         /* 017d jr d3 */
+	0x0c,                               /* 017f d2: inc c */
+	0x3d,                               /* 0180 d3: dec a */
+	0x20, 0xef,                         /* 0181 jr nz,d1 */
+	0xc9,                               /* 0183 ret */
+	0x00, 0x00,                         /* 0184 i: dw 0 */
+	0x00, 0x00,                         /* 0186 sum: dw 0 */
+};
+
+
+/*
+ * indexed array code using IX and IY: dst[i] = (src[i] + src[i + 1]) ^
+ * src[i + 2], result is the sum of dst
+ */
+static const unsigned char index_code[] = {
+	0xdd, 0x21, 0x60, 0x01,             /* 011f work: ld ix,src */
+	0x06, 0x00,                         /* 0123 ld b,0 */
+	0x3e, 0x03,                         /* 0125 ld a,3 */
+	0xdd, 0x77, 0x00,                   /* 0127 i0: ld (ix+0),a */
+	0xc6, 0x07,                         /* 012a add a,7 */
+	0xdd, 0x23,                         /* 012c inc ix */
+	0x10, 0xf7,                         /* 012e djnz i0 */
+	0xdd, 0x21, 0x60, 0x01,             /* 0130 ld ix,src */
+	0xfd, 0x21, 0x60, 0x02,             /* 0134 ld iy,dst */
+	0x06, 0xfe,                         /* 0138 ld b,254 */
+	0xdd, 0x7e, 0x00,                   /* 013a i1: ld a,(ix+0) */
+	0xdd, 0x86, 0x01,                   /* 013d add a,(ix+1) */
+	0xdd, 0xae, 0x02,                   /* 0140 xor (ix+2) */
+	0xfd, 0x77, 0x00,                   /* 0143 ld (iy+0),a */
+	0xdd, 0x23,                         /* 0146 inc ix */
+	0xfd, 0x23,                         /* 0148 inc iy */
+	0x10, 0xee,                         /* 014a djnz i1 */
+	0xfd, 0x21, 0x60, 0x02,             /* 014c ld iy,dst */
+	0x21, 0x00, 0x00,                   /* 0150 ld hl,0 */
+	0x16, 0x00,                         /* 0153 ld d,0 */
+	0x06, 0xfe,                         /* 0155 ld b,254 */
+	0xfd, 0x5e, 0x00,                   /* 0157 i2: ld e,(iy+0) */
+	0x19,                               /* 015a add hl,de */
+	0xfd, 0x23,                         /* 015b inc iy */
+	0x10, 0xf8,                         /* 015d djnz i2 */
+	0xc9,                               /* 015f ret */
+	/* 0160 src: ds 256 (not part of the file) */
+	/* 0260 dst: ds 256 (not part of the file) */
+};
+
+
+/*
+ * block moves and compares (LDIR, LDDR, CPIR, CPI) on two 2KB areas
+ */
+static const unsigned char block_code[] = {
+	0x21, 0x00, 0x10,                   /* 011f work: ld hl,blk1 */
+	0x01, 0x00, 0x08,                   /* 0122 ld bc,2048 */
+	0x1e, 0x00,                         /* 0125 ld e,0 */
+	0x73,                               /* 0127 b0: ld (hl),e */
+	0x1c,                               /* 0128 inc e */
+	0x23,                               /* 0129 inc hl */
+	0x0b,                               /* 012a dec bc */
+	0x78,                               /* 012b ld a,b */
+	0xb1,                               /* 012c or c */
+	0x20, 0xf8,                         /* 012d jr nz,b0 */
+	0x21, 0x00, 0x10,                   /* 012f ld hl,blk1 */
+	0x11, 0x00, 0x18,                   /* 0132 ld de,blk2 */
+	0x01, 0x00, 0x08,                   /* 0135 ld bc,2048 */
+	0xed, 0xb0,                         /* 0138 ldir */
+	0x21, 0xfe, 0x1f,                   /* 013a ld hl,blk2+2046 */
+	0x11, 0xff, 0x1f,                   /* 013d ld de,blk2+2047 */
+	0x01, 0xff, 0x07,                   /* 0140 ld bc,2047 */
+	0xed, 0xb8,                         /* 0143 lddr */
+	0x21, 0x00, 0x18,                   /* 0145 ld hl,blk2 */
+	0x01, 0x00, 0x08,                   /* 0148 ld bc,2048 */
+	0x3e, 0xff,                         /* 014b ld a,255 */
+	0xed, 0xb1,                         /* 014d cpir */
+	0xc5,                               /* 014f push bc */
+	0x21, 0x00, 0x10,                   /* 0150 ld hl,blk1 */
+	0x11, 0x01, 0x18,                   /* 0153 ld de,blk2+1 */
+	0x01, 0xff, 0x07,                   /* 0156 ld bc,2047 */
+	0xdd, 0x21, 0x00, 0x00,             /* 0159 ld ix,0 */
+	0x1a,                               /* 015d b1: ld a,(de) */
+	0xed, 0xa1,                         /* 015e cpi */
+	0x20, 0x02,                         /* 0160 jr nz,b2 */
+	0xdd, 0x23,                         /* 0162 inc ix */
+	0x13,                               /* 0164 b2: inc de */
+	0xea, 0x5d, 0x01,                   /* 0165 jp pe,b1 */
+	0xe1,                               /* 0168 pop hl */
+	0xdd, 0xe5,                         /* 0169 push ix */
+	0xd1,                               /* 016b pop de */
+	0x19,                               /* 016c add hl,de */
+	0xc9,                               /* 016d ret */
+};
+
+
+/*
+ * bit operations of the 0xcb plane: population count of all bytes plus
+ * a series of rotate, shift, set, and reset operations on memory
+ */
+static const unsigned char bitops_code[] = {
+	0x21, 0x00, 0x00,                   /* 011f work: ld hl,0 */
+	0x0e, 0x00,                         /* 0122 ld c,0 */
+	0x79,                               /* 0124 t0: ld a,c */
+	0x06, 0x08,                         /* 0125 ld b,8 */
+	0x16, 0x00,                         /* 0127 ld d,0 */
+	0xcb, 0x47,                         /* 0129 t1: bit 0,a */
+	0x28, 0x01,                         /* 012b jr z,t2 */
+	0x14,                               /* 012d inc d */
+	0x0f,                               /* 012e t2: rrca */
+	0x10, 0xf8,                         /* 012f djnz t1 */
+	0x5a,                               /* 0131 ld e,d */
+	0x16, 0x00,                         /* 0132 ld d,0 */
+	0x19,                               /* 0134 add hl,de */
+	0xe5,                               /* 0135 push hl */
+	0x21, 0x50, 0x01,                   /* 0136 ld hl,tmp */
+	0x71,                               /* 0139 ld (hl),c */
+	0xcb, 0x06,                         /* 013a rlc (hl) */
+	0xcb, 0x2e,                         /* 013c sra (hl) */
+	0xcb, 0xc6,                         /* 013e set 0,(hl) */
+	0xcb, 0xbe,                         /* 0140 res 7,(hl) */
+	0xcb, 0x3e,                         /* 0142 srl (hl) */
+	0xcb, 0x16,                         /* 0144 rl (hl) */
+	0xcb, 0x5e,                         /* 0146 bit 3,(hl) */
+	0xe1,                               /* 0148 pop hl */
+	0x28, 0x01,                         /* 0149 jr z,t3 */
+	0x23,                               /* 014b inc hl */
+	0x0c,                               /* 014c t3: inc c */
+	0x20, 0xd5,                         /* 014d jr nz,t0 */
+	0xc9,                               /* 014f ret */
+	0x00,                               /* 0150 tmp: db 0 */
+};
+
+
+/*
+ * BCD arithmetic: add 37 4321 times to a six digit BCD number
+ */
+static const unsigned char bcd_code[] = {
+	0x21, 0x00, 0x00,                   /* 011f work: ld hl,0 */
+	0x22, 0x48, 0x01,                   /* 0122 ld (bcd),hl */
+	0x22, 0x4a, 0x01,                   /* 0125 ld (bcd+2),hl */
+	0x01, 0xe1, 0x10,                   /* 0128 ld bc,4321 */
+	0x21, 0x48, 0x01,                   /* 012b d0: ld hl,bcd */
+	0x7e,                               /* 012e ld a,(hl) */
+	0xc6, 0x37,                         /* 012f add a,$37 */
+	0x27,                               /* 0131 daa */
+	0x77,                               /* 0132 ld (hl),a */
+	0x23,                               /* 0133 inc hl */
+	0x7e,                               /* 0134 ld a,(hl) */
+	0xce, 0x00,                         /* 0135 adc a,0 */
+	0x27,                               /* 0137 daa */
+	0x77,                               /* 0138 ld (hl),a */
+	0x23,                               /* 0139 inc hl */
+	0x7e,                               /* 013a ld a,(hl) */
+	0xce, 0x00,                         /* 013b adc a,0 */
+	0x27,                               /* 013d daa */
+	0x77,                               /* 013e ld (hl),a */
+	0x0b,                               /* 013f dec bc */
+	0x78,                               /* 0140 ld a,b */
+	0xb1,                               /* 0141 or c */
+	0x20, 0xe7,                         /* 0142 jr nz,d0 */
+	0x2a, 0x48, 0x01,                   /* 0144 ld hl,(bcd) */
+	0xc9,                               /* 0147 ret */
+	/* 0148 bcd: ds 4 (not part of the file) */
+};
+
+
+/*
+ * console output through BDOS functions 2 and 9 (output is discarded)
+ */
+static const unsigned char console_code[] = {
+	0x06, 0x32,                         /* 011f work: ld b,50 */
+	0xc5,                               /* 0121 c0: push bc */
+	0x0e, 0x09,                         /* 0122 ld c,9 */
+	0x11, 0x50, 0x01,                   /* 0124 ld de,line */
+	0xcd, 0x05, 0x00,                   /* 0127 call 5 */
+	0xc1,                               /* 012a pop bc */
+	0x10, 0xf4,                         /* 012b djnz c0 */
+	0x06, 0xc8,                         /* 012d ld b,200 */
+	0xc5,                               /* 012f c1: push bc */
+	0x78,                               /* 0130 ld a,b */
+	0xe6, 0x1f,                         /* 0131 and 31 */
+	0xc6, 0x41,                         /* 0133 add a,'A' */
+	0x5f,                               /* 0135 ld e,a */
+	0x0e, 0x02,                         /* 0136 ld c,2 */
+	0xcd, 0x05, 0x00,                   /* 0138 call 5 */
+	0xc1,                               /* 013b pop bc */
+	0x10, 0xf1,                         /* 013c djnz c1 */
+	0x1e, 0x0d,                         /* 013e ld e,13 */
+	0x0e, 0x02,                         /* 0140 ld c,2 */
+	0xcd, 0x05, 0x00,                   /* 0142 call 5 */
+	0x1e, 0x0a,                         /* 0145 ld e,10 */
+	0x0e, 0x02,                         /* 0147 ld c,2 */
+	0xcd, 0x05, 0x00,                   /* 0149 call 5 */
+	0x21, 0x32, 0x00,                   /* 014c ld hl,50 */
+	0xc9,                               /* 014f ret */
+	/* 0150 line: db "The quick brown fox jumps over " */
+	0x54, 0x68, 0x65, 0x20, 0x71, 0x75, 0x69, 0x63,
+	0x6b, 0x20, 0x62, 0x72, 0x6f, 0x77, 0x6e, 0x20,
+	0x66, 0x6f, 0x78, 0x20, 0x6a, 0x75, 0x6d, 0x70,
+	0x73, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x20,
+	/* 016f db "the lazy dog 0123456789", 13, 10, "$" */
+	0x74, 0x68, 0x65, 0x20, 0x6c, 0x61, 0x7a, 0x79,
+	0x20, 0x64, 0x6f, 0x67, 0x20, 0x30, 0x31, 0x32,
+	0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x0d,
+	0x0a, 0x24,
+};
+
+
+/*
+ * sequential write: delete, create, and write a file of 512 records
+ */
+static const unsigned char seqwrite_code[] = {
+	0xcd, 0x6c, 0x01,                   /* 011f work: call fcbinit */
+	0x0e, 0x13,                         /* 0122 ld c,19 */
+	0x11, 0x79, 0x01,                   /* 0124 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0127 call 5 */
+	0xcd, 0x6c, 0x01,                   /* 012a call fcbinit */
+	0x0e, 0x16,                         /* 012d ld c,22 */
+	0x11, 0x79, 0x01,                   /* 012f ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0132 call 5 */
+	0x21, 0x00, 0x00,                   /* 0135 ld hl,0 */
+	0x22, 0x77, 0x01,                   /* 0138 ld (n),hl */
+	0x21, 0x80, 0x00,                   /* 013b ld hl,$80 */
+	0x06, 0x80,                         /* 013e ld b,128 */
+	0x70,                               /* 0140 f0: ld (hl),b */
+	0x23,                               /* 0141 inc hl */
+	0x10, 0xfc,                         /* 0142 djnz f0 */
+	0x01, 0x00, 0x02,                   /* 0144 ld bc,512 */
+	0xc5,                               /* 0147 w0: push bc */
+	0x0e, 0x15,                         /* 0148 ld c,21 */
+	0x11, 0x79, 0x01,                   /* 014a ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 014d call 5 */
+	0xb7,                               /* 0150 or a */
+	0x20, 0x07,                         /* 0151 jr nz,w1 */
+	0x2a, 0x77, 0x01,                   /* 0153 ld hl,(n) */
+	0x23,                               /* 0156 inc hl */
+	0x22, 0x77, 0x01,                   /* 0157 ld (n),hl */
+	0xc1,                               /* 015a w1: pop bc */
+	0x0b,                               /* 015b dec bc */
+	0x78,                               /* 015c ld a,b */
+	0xb1,                               /* 015d or c */
+	0x20, 0xe7,                         /* 015e jr nz,w0 */
+	0x0e, 0x10,                         /* 0160 ld c,16 */
+	0x11, 0x79, 0x01,                   /* 0162 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0165 call 5 */
+	0x2a, 0x77, 0x01,                   /* 0168 ld hl,(n) */
+	0xc9,                               /* 016b ret */
+	0x21, 0x85, 0x01,                   /* 016c fcbinit: ld hl,fcb+12 */
+	0x06, 0x18,                         /* 016f ld b,24 */
+	0xaf,                               /* 0171 xor a */
+	0x77,                               /* 0172 i0: ld (hl),a */
+	0x23,                               /* 0173 inc hl */
+	0x10, 0xfc,                         /* 0174 djnz i0 */
+	0xc9,                               /* 0176 ret */
+	0x00, 0x00,                         /* 0177 n: dw 0 */
+	/* 0179 fcb: db 0, "BENCH DAT" */
+	0x00, 0x42, 0x45, 0x4e, 0x43, 0x48, 0x20, 0x20,
+	0x20, 0x44, 0x41, 0x54,
+	/* 0185 ds 24 (not part of the file) */
+};
+
+
+/*
+ * sequential read: read a file of 512 records (READ.DAT)
+ */
+static const unsigned char seqread_code[] = {
+	0xcd, 0x50, 0x01,                   /* 011f work: call fcbinit */
+	0x0e, 0x0f,                         /* 0122 ld c,15 */
+	0x11, 0x5d, 0x01,                   /* 0124 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0127 call 5 */
+	0x21, 0x00, 0x00,                   /* 012a ld hl,0 */
+	0x22, 0x5b, 0x01,                   /* 012d ld (n),hl */
+	0x0e, 0x14,                         /* 0130 r0: ld c,20 */
+	0x11, 0x5d, 0x01,                   /* 0132 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0135 call 5 */
+	0xb7,                               /* 0138 or a */
+	0x20, 0x09,                         /* 0139 jr nz,r1 */
+	0x2a, 0x5b, 0x01,                   /* 013b ld hl,(n) */
+	0x23,                               /* 013e inc hl */
+	0x22, 0x5b, 0x01,                   /* 013f ld (n),hl */
+	0x18, 0xec,                         /* 0142 jr r0 */
+	0x0e, 0x10,                         /* 0144 r1: ld c,16 */
+	0x11, 0x5d, 0x01,                   /* 0146 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0149 call 5 */
+	0x2a, 0x5b, 0x01,                   /* 014c ld hl,(n) */
+	0xc9,                               /* 014f ret */
+	0x21, 0x69, 0x01,                   /* 0150 fcbinit: ld hl,fcb+12 */
+	0x06, 0x18,                         /* 0153 ld b,24 */
+	0xaf,                               /* 0155 xor a */
+	0x77,                               /* 0156 i0: ld (hl),a */
+	0x23,                               /* 0157 inc hl */
+	0x10, 0xfc,                         /* 0158 djnz i0 */
+	0xc9,                               /* 015a ret */
+	0x00, 0x00,                         /* 015b n: dw 0 */
+	/* 015d fcb: db 0, "READ DAT" */
+	0x00, 0x52, 0x45, 0x41, 0x44, 0x20, 0x20, 0x20,
+	0x20, 0x44, 0x41, 0x54,
+	/* 0169 ds 24 (not part of the file) */
+};
+
+
+/*
+ * multi-sector read: read a file of 512 records (READ.DAT) in
+ * transfers of 16 records (BDOS 44, CP/M 3)
+ */
+static const unsigned char multiread_code[] = {
+	0xcd, 0x7b, 0x01,                   /* 011f work: call fcbinit */
+	0x0e, 0x0f,                         /* 0122 ld c,15 */
+	0x11, 0x88, 0x01,                   /* 0124 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0127 call 5 */
+	0x0e, 0x2c,                         /* 012a ld c,44 */
+	0x1e, 0x10,                         /* 012c ld e,16 */
+	0xcd, 0x05, 0x00,                   /* 012e call 5 */
+	0x0e, 0x1a,                         /* 0131 ld c,26 */
+	0x11, 0x00, 0x10,                   /* 0133 ld de,$1000 */
+	0xcd, 0x05, 0x00,                   /* 0136 call 5 */
+	0x21, 0x00, 0x00,                   /* 0139 ld hl,0 */
+	0x22, 0x86, 0x01,                   /* 013c ld (n),hl */
+	0x0e, 0x14,                         /* 013f r0: ld c,20 */
+	0x11, 0x88, 0x01,                   /* 0141 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0144 call 5 */
+	0xb7,                               /* 0147 or a */
+	0x20, 0x0c,                         /* 0148 jr nz,r1 */
+	0x2a, 0x86, 0x01,                   /* 014a ld hl,(n) */
+	0x11, 0x10, 0x00,                   /* 014d ld de,16 */
+	0x19,                               /* 0150 add hl,de */
+	0x22, 0x86, 0x01,                   /* 0151 ld (n),hl */
+	0x18, 0xe9,                         /* 0154 jr r0 */
+	0x5c,                               /* 0156 r1: ld e,h */
+	0x16, 0x00,                         /* 0157 ld d,0 */
+	0x2a, 0x86, 0x01,                   /* 0159 ld hl,(n) */
+	0x19,                               /* 015c add hl,de */
+	0x22, 0x86, 0x01,                   /* 015d ld (n),hl */
+	0x0e, 0x2c,                         /* 0160 ld c,44 */
+	0x1e, 0x01,                         /* 0162 ld e,1 */
+	0xcd, 0x05, 0x00,                   /* 0164 call 5 */
+	0x0e, 0x1a,                         /* 0167 ld c,26 */
+	0x11, 0x80, 0x00,                   /* 0169 ld de,$80 */
+	0xcd, 0x05, 0x00,                   /* 016c call 5 */
+	0x0e, 0x10,                         /* 016f ld c,16 */
+	0x11, 0x88, 0x01,                   /* 0171 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0174 call 5 */
+	0x2a, 0x86, 0x01,                   /* 0177 ld hl,(n) */
+	0xc9,                               /* 017a ret */
+	0x21, 0x94, 0x01,                   /* 017b fcbinit: ld hl,fcb+12 */
+	0x06, 0x18,                         /* 017e ld b,24 */
+	0xaf,                               /* 0180 xor a */
+	0x77,                               /* 0181 i0: ld (hl),a */
+	0x23,                               /* 0182 inc hl */
+	0x10, 0xfc,                         /* 0183 djnz i0 */
+	0xc9,                               /* 0185 ret */
+	0x00, 0x00,                         /* 0186 n: dw 0 */
+	/* 0188 fcb: db 0, "READ DAT" */
+	0x00, 0x52, 0x45, 0x41, 0x44, 0x20, 0x20, 0x20,
+	0x20, 0x44, 0x41, 0x54,
+	/* 0194 ds 24 (not part of the file) */
+};
+
+
+/*
+ * random access to a file of 512 records (RANDOM.DAT): 256 times a
+ * BDOS 33 read and a BDOS 34 write of the same record, followed by a
+ * BDOS 40 write of a neighbouring record
+ */
+static const unsigned char random_code[] = {
+	0xcd, 0x9c, 0x01,                   /* 011f work: call fcbinit */
+	0x0e, 0x0f,                         /* 0122 ld c,15 */
+	0x11, 0xab, 0x01,                   /* 0124 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0127 call 5 */
+	0x21, 0x00, 0x00,                   /* 012a ld hl,0 */
+	0x22, 0xa9, 0x01,                   /* 012d ld (n),hl */
+	0x22, 0xa7, 0x01,                   /* 0130 ld (i),hl */
+	0x2a, 0xa7, 0x01,                   /* 0133 x0: ld hl,(i) */
+	0x54,                               /* 0136 ld d,h */
+	0x5d,                               /* 0137 ld e,l */
+	0x29,                               /* 0138 add hl,hl */
+	0x29,                               /* 0139 add hl,hl */
+	0x44,                               /* 013a ld b,h */
+	0x4d,                               /* 013b ld c,l */
+	0x29,                               /* 013c add hl,hl */
+	0x29,                               /* 013d add hl,hl */
+	0x29,                               /* 013e add hl,hl */
+	0x09,                               /* 013f add hl,bc */
+	0x19,                               /* 0140 add hl,de */
+	0x11, 0x0b, 0x00,                   /* 0141 ld de,11 */
+	0x19,                               /* 0144 add hl,de */
+	0x7c,                               /* 0145 ld a,h */
+	0xe6, 0x01,                         /* 0146 and 1 */
+	0x67,                               /* 0148 ld h,a */
+	0x22, 0xcc, 0x01,                   /* 0149 ld (fcb+33),hl */
+	0xaf,                               /* 014c xor a */
+	0x32, 0xce, 0x01,                   /* 014d ld (fcb+35),a */
+	0x0e, 0x21,                         /* 0150 ld c,33 */
+	0x11, 0xab, 0x01,                   /* 0152 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0155 call 5 */
+	0xcd, 0x92, 0x01,                   /* 0158 call tally */
+	0x0e, 0x22,                         /* 015b ld c,34 */
+	0x11, 0xab, 0x01,                   /* 015d ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0160 call 5 */
+	0xcd, 0x92, 0x01,                   /* 0163 call tally */
+	0x2a, 0xcc, 0x01,                   /* 0166 ld hl,(fcb+33) */
+	0x7d,                               /* 0169 ld a,l */
+	0xee, 0x01,                         /* 016a xor 1 */
+	0x6f,                               /* 016c ld l,a */
+	0x22, 0xcc, 0x01,                   /* 016d ld (fcb+33),hl */
+	0x0e, 0x28,                         /* 0170 ld c,40 */
+	0x11, 0xab, 0x01,                   /* 0172 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 0175 call 5 */
+	0xcd, 0x92, 0x01,                   /* 0178 call tally */
+	0x2a, 0xa7, 0x01,                   /* 017b ld hl,(i) */
+	0x23,                               /* 017e inc hl */
+	0x22, 0xa7, 0x01,                   /* 017f ld (i),hl */
+	0x7c,                               /* 0182 ld a,h */
+	0x3d,                               /* 0183 dec a */
+	0x20, 0xad,                         /* 0184 jr nz,x0 */
+	0x0e, 0x10,                         /* 0186 ld c,16 */
+	0x11, 0xab, 0x01,                   /* 0188 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 018b call 5 */
+	0x2a, 0xa9, 0x01,                   /* 018e ld hl,(n) */
+	0xc9,                               /* 0191 ret */
+	0xb7,                               /* 0192 tally: or a */
+	0xc0,                               /* 0193 ret nz */
+	0x2a, 0xa9, 0x01,                   /* 0194 ld hl,(n) */
+	0x23,                               /* 0197 inc hl */
+	0x22, 0xa9, 0x01,                   /* 0198 ld (n),hl */
+	0xc9,                               /* 019b ret */
+	0x21, 0xb7, 0x01,                   /* 019c fcbinit: ld hl,fcb+12 */
+	0x06, 0x18,                         /* 019f ld b,24 */
+	0xaf,                               /* 01a1 xor a */
+	0x77,                               /* 01a2 i0: ld (hl),a */
+	0x23,                               /* 01a3 inc hl */
+	0x10, 0xfc,                         /* 01a4 djnz i0 */
+	0xc9,                               /* 01a6 ret */
+	0x00, 0x00,                         /* 01a7 i: dw 0 */
+	0x00, 0x00,                         /* 01a9 n: dw 0 */
+	/* 01ab fcb: db 0, "RANDOM DAT" */
+	0x00, 0x52, 0x41, 0x4e, 0x44, 0x4f, 0x4d, 0x20,
+	0x20, 0x44, 0x41, 0x54,
+	/* 01b7 ds 24 (not part of the file) */
+};
+
+
+/*
+ * directory search (BDOS 17 and 18) for *.DAT in a directory of
+ * 2000 files
+ */
+static const unsigned char search_code[] = {
+	0x21, 0x00, 0x00,                   /* 011f work: ld hl,0 */
+	0x22, 0x46, 0x01,                   /* 0122 ld (n),hl */
+	0x0e, 0x11,                         /* 0125 ld c,17 */
+	0x11, 0x48, 0x01,                   /* 0127 ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 012a call 5 */
+	0xfe, 0xff,                         /* 012d s0: cp 255 */
+	0x28, 0x11,                         /* 012f jr z,s1 */
+	0x2a, 0x46, 0x01,                   /* 0131 ld hl,(n) */
+	0x23,                               /* 0134 inc hl */
+	0x22, 0x46, 0x01,                   /* 0135 ld (n),hl */
+	0x0e, 0x12,                         /* 0138 ld c,18 */
+	0x11, 0x48, 0x01,                   /* 013a ld de,fcb */
+	0xcd, 0x05, 0x00,                   /* 013d call 5 */
+	0x18, 0xeb,                         /* 0140 jr s0 */
+	0x2a, 0x46, 0x01,                   /* 0142 s1: ld hl,(n) */
+	0xc9,                               /* 0145 ret */
+	0x00, 0x00,                         /* 0146 n: dw 0 */
+	/* 0148 fcb: db 0, "????????DAT", 0, 0, 0, 0 */
+	0x00, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+	0x3f, 0x44, 0x41, 0x54, 0x00, 0x00, 0x00, 0x00,
+};
+
+
+/*
+ * number of records of the data files and number of files in the
+ * directory for the search workload
+ */
+#define DATA_RECORDS 512
+#define SEARCH_FILES 2000
+
+
+/*
+ * program name for error messages
+ */
+static const char *prog_name = NULL;
+/*
+ * repeat counts of the workloads are multiplied by this factor
+ * divided by 100
+ */
+static int scale = 100;
+/*
+ * number of runs of each workload; the fastest run is reported
+ */
+static int runs = 1;
+/*
+ * scratch directory for the workload programs (CP/M drive A)
+ */
+static char *work_dir = NULL;
+/*
+ * CSV output; stdout itself is redirected to /dev/null, since it
+ * receives the console output of the workloads
+ */
+static FILE *csv_fp = NULL;
+/*
+ * baseline for the regression check and the tolerated slowdown
+ * in percent
+ */
+static struct baseline {
+	struct baseline *next_p;
+	char *name;
+	double mips;
+	double records_per_second;
+	double host_calls_per_record;
+} *baseline_p = NULL;
+static int threshold = 10;
+/*
+ * number of workloads slower than the baseline
+ */
+static int regressions = 0;
+
+
+/*
+ * return the path of a file in the scratch directory
+ */
+static char *
+work_path(const char *name) {
+	char *path;
+	path = alloc(strlen(work_dir) + strlen(name) + 2);
+	sprintf(path, "%s/%s", work_dir, name);
+	return path;
+}
+
+
+/*
+ * create a file in the scratch directory containing a number of
+ * 128 byte records
+ */
+static int
+create_file(const char *name, int records) {
+	int rc = 0, i;
+	char *path;
+	unsigned char record[128];
+	FILE *fp;
+	path = work_path(name);
+	fp = fopen(path, "wb");
+	if (! fp) {
+		perr("cannot create %s: %s", path, strerror(errno));
+		rc = (-1);
+		goto premature_exit;
+	}
+	for (i = 0; i < records; i++) {
+		memset(record, i & 0xff, sizeof record);
+		fwrite(record, 1, sizeof record, fp);
+	}
+	if (ferror(fp)) {
+		perr("write error on %s: %s", path, strerror(errno));
+		rc = (-1);
+	}
+	if (fclose(fp)) {
+		perr("cannot close %s: %s", path, strerror(errno));
+		rc = (-1);
+	}
+premature_exit:
+	free(path);
+	return rc;
+}
+
+
+/*
+ * set up the files used by the I/O workloads
+ */
+static int
+setup_seqread(void) { return create_file("read.dat", DATA_RECORDS); }
+
+static int
+setup_random(void) { return create_file("random.dat", DATA_RECORDS); }
+
+static int
+setup_search(void) {
+	int i;
+	char name[16];
+	for (i = 0; i < SEARCH_FILES; i++) {
+		sprintf(name, "f%04d.dat", i);
+		if (create_file(name, 0)) return (-1);
+	}
+	return 0;
+}
+
+
+/*
+ * table of workloads
+ */
+static const struct workload {
+	const char *name;
+	const unsigned char *code;
+	size_t size;
+	int count;
+	int expected;
+	int (*setup)(void);
+} workloads[] = {
+	{ "loop", loop_code, sizeof loop_code, 5000, 0xa314, NULL },
+	{ "sieve", sieve_code, sizeof sieve_code, 100, 1899, NULL },
+	{ "muldiv", muldiv_code, sizeof muldiv_code, 300, 0x2a5e,
+	    NULL },
+	{ "index", index_code, sizeof index_code, 6500, 0x7d99,
+	    NULL },
+	{ "block", block_code, sizeof block_code, 800, 0x0efe,
+	    NULL },
+	{ "bitops", bitops_code, sizeof bitops_code, 1700, 0x0480,
+	    NULL },
+	{ "bcd", bcd_code, sizeof bcd_code, 300, 0x9877, NULL },
+	{ "console", console_code, sizeof console_code, 2000, 50,
+	    NULL },
+	{ "seqwrite", seqwrite_code, sizeof seqwrite_code, 500,
+	    DATA_RECORDS, NULL },
+	{ "seqread", seqread_code, sizeof seqread_code, 800,
+	    DATA_RECORDS, setup_seqread },
+	{ "multiread", multiread_code, sizeof multiread_code, 800,
+	    DATA_RECORDS, setup_seqread },
+	{ "random", random_code, sizeof random_code, 400, 768,
+	    setup_random },
+	{ "search", search_code, sizeof search_code, 80,
+	    SEARCH_FILES, setup_search }
+};
+#define WORKLOADS (sizeof workloads / sizeof workloads[0])
+
+
+/*
+ * measurements of a workload run
+ */
+struct measurement {
+	unsigned long long instructions;
+	unsigned long long records;
+	unsigned long long host_calls;
+	double seconds;
+	int result;
+};
+
+
+/*
+ * write a message to stderr
+ */
+void
+perr(const char *format, ...) {
+	va_list params;
+	va_start(params, format);
+	fprintf(stderr, "%s: ", prog_name);
+	vfprintf(stderr, format, params);
+	fprintf(stderr, "\n");
+	va_end(params);
+}
+
+
+/*
+ * there is no log file
+ */
+void
+plog(const char *format, ...) { }
+
+void
+plog_dump(int addr, int length) { }
+
+
+/*
+ * display a short usage summary
+ */
+void
+usage(void) {
+	int i;
+	perr("usage: %s [ <options> ] [ <workload> ... ]", prog_name);
+	perr("valid <options> are");
+	perr("    -b <fn>         compare results to baseline CSV file <fn>");
+	perr("    -f <fn>         read configuration file");
+	perr("    -r <n>          run each workload <n> times, report "
+	    "fastest run");
+	perr("    -s <percent>    scale repeat counts of the workloads");
+	perr("    -t <percent>    tolerated slowdown against the baseline");
+	perr("valid <workload>s are");
+	for (i = 0; i < WORKLOADS; i++) {
+		perr("    %s", workloads[i].name);
+	}
+}
+
+
+/*
+ * seconds elapsed since a point in time
+ */
+static double
+elapsed(const struct timeval *start_p) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start_p->tv_sec) +
+	    (now.tv_usec - start_p->tv_usec) / 1e6;
+}
+
+
+/*
+ * remove all files from the scratch directory
+ */
+static void
+clean_work_dir(void) {
+	DIR *dp;
+	struct dirent *dep;
+	char *path;
+	dp = opendir(work_dir);
+	if (! dp) return;
+	while ((dep = readdir(dp))) {
+		if (! strcmp(dep->d_name, ".") || ! strcmp(dep->d_name, ".."))
+		    continue;
+		path = work_path(dep->d_name);
+		unlink(path);
+		free(path);
+	}
+	closedir(dp);
+}
+
+
+/*
+ * write a workload program to the scratch directory and return its path
+ */
+static char *
+write_workload(const struct workload *wp) {
+	char *path, name[16];
+	unsigned char buffer[sizeof prologue];
+	long count;
+	FILE *fp;
+	sprintf(name, "%.8s.com", wp->name);
+	path = work_path(name);
+	/*
+	 * patch the repeat count into the prologue
+	 */
+	count = (long) wp->count * scale / 100;
+	if (count < 1) count = 1;
+	if (count > 0xffff) count = 0xffff;
+	memcpy(buffer, prologue, sizeof prologue);
+	buffer[COUNT_OFFSET] = count & 0xff;
+	buffer[COUNT_OFFSET + 1] = (count >> 8) & 0xff;
+	fp = fopen(path, "wb");
+	if (! fp) {
+		perr("cannot create %s: %s", path, strerror(errno));
+		goto premature_exit;
+	}
+	fwrite(buffer, 1, sizeof buffer, fp);
+	fwrite(wp->code, 1, wp->size, fp);
+	if (ferror(fp)) {
+		perr("write error on %s: %s", path, strerror(errno));
+		fclose(fp);
+		goto premature_exit;
+	}
+	if (fclose(fp)) {
+		perr("cannot close %s: %s", path, strerror(errno));
+		goto premature_exit;
+	}
+	return path;
+premature_exit:
+	unlink(path);
+	free(path);
+	return NULL;
+}
+
+
+/*
+ * run a workload program once, like tnylpo would; only the emulation
+ * proper is timed
+ */
+static int
+measure(struct measurement *mp) {
+	int rc = 0;
+	struct timeval start;
+	terminate = 0;
+	term_reason = OK_NOTRUN;
+	instruction_count = 0;
+	record_count = 0;
+	host_call_count = 0;
+	mp->seconds = 0.0;
+	mp->result = (-1);
+	rc = cpu_init();
+	if (rc) goto premature_exit;
+	rc = console_init();
+	if (! rc) {
+		gettimeofday(&start, NULL);
+		cpu_run();
+		mp->seconds = elapsed(&start);
+		if (console_exit()) rc = (-1);
+		mp->result = memory[RESULT_ADDRESS] |
+		    (memory[RESULT_ADDRESS + 1] << 8);
+	}
+	mp->instructions = instruction_count;
+	mp->records = record_count;
+	mp->host_calls = host_call_count;
+	if (mp->seconds <= 0.0) mp->seconds = 1e-6;
+	if (cpu_exit()) rc = (-1);
+premature_exit:
+	return rc;
+}
+
+
+/*
+ * compare the measurements of a workload to the baseline
+ */
+static void
+check_baseline(const char *name, double mips, double records_per_second,
+    double host_calls_per_record) {
+	struct baseline *bp;
+	double tolerance = threshold / 100.0;
+	for (bp = baseline_p; bp && strcmp(bp->name, name); bp = bp->next_p);
+	if (! bp) {
+		perr("%s: not in baseline", name);
+		return;
+	}
+	if (records_per_second > 0.0) {
+		if (records_per_second < bp->records_per_second *
+		    (1.0 - tolerance)) {
+			perr("%s: %.0f records/s, baseline %.0f records/s",
+			    name, records_per_second, bp->records_per_second);
+			regressions++;
+		}
+	} else if (mips < bp->mips * (1.0 - tolerance)) {
+		perr("%s: %.2f MIPS, baseline %.2f MIPS", name, mips,
+		    bp->mips);
+		regressions++;
+	}
+	/*
+	 * host calls per record do not depend on the host's speed,
+	 * so any increase is reported
+	 */
+	if (host_calls_per_record > bp->host_calls_per_record + 0.005) {
+		perr("%s: %.2f host calls per record, baseline %.2f", name,
+		    host_calls_per_record, bp->host_calls_per_record);
+		regressions++;
+	}
+}
+
+
+/*
+ * run a single workload and write its CSV line
+ */
+static int
+run_workload(const struct workload *wp) {
+	int rc = 0, i;
+	char *path = NULL;
+	struct measurement best, m;
+	double mips, records_per_second, host_calls_per_record;
+	/*
+	 * create the program file and the files needed by the workload
+	 */
+	path = write_workload(wp);
+	if (! path) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	conf_command = path;
+	if (wp->setup && (*wp->setup)()) {
+		rc = (-1);
+		goto premature_exit;
+	}
+	/*
+	 * run the workload, keep the fastest run
+	 */
+	rc = measure(&best);
+	if (rc) goto premature_exit;
+	for (i = 1; i < runs; i++) {
+		rc = measure(&m);
+		if (rc) goto premature_exit;
+		if (m.seconds < best.seconds) best = m;
+	}
+	mips = best.instructions / best.seconds / 1e6;
+	records_per_second = best.records / best.seconds;
+	host_calls_per_record = best.records ?
+	    (double) best.host_calls / best.records : 0.0;
+	fprintf(csv_fp, "%s,%llu,%.3f,%.2f,%.2f,%llu,%.0f,%.2f,"
+	    "0x%04x,0x%04x,%s\n", wp->name, best.instructions, best.seconds,
+	    mips, best.instructions ?
+	    best.seconds * 1e9 / best.instructions : 0.0, best.records,
+	    records_per_second, host_calls_per_record, best.result,
+	    wp->expected, best.result == wp->expected ? "ok" : "FAILED");
+	fflush(csv_fp);
+	if (best.result != wp->expected) rc = (-1);
+	if (baseline_p) {
+		check_baseline(wp->name, mips, records_per_second,
+		    host_calls_per_record);
+	}
+premature_exit:
+	clean_work_dir();
+	free(path);
+	return rc;
+}
+
+
+/*
+ * find a column in the header line of a CSV file
+ */
+static int
+find_column(char **fields, int n, const char *name) {
+	int i;
+	for (i = 0; i < n && strcmp(fields[i], name); i++);
+	return (i < n) ? i : (-1);
+}
+
+
+/*
+ * split a CSV line into fields (no quoting is used by tnylpo-bench)
+ */
+#define MAX_FIELDS 16
+
+static int
+split_line(char *line, char **fields) {
+	int n = 0;
+	char *cp;
+	cp = strchr(line, '\n');
+	if (cp) *cp = '\0';
+	fields[n++] = line;
+	for (cp = line; *cp && n < MAX_FIELDS; cp++) {
+		if (*cp == ',') {
+			*cp = '\0';
+			fields[n++] = cp + 1;
+		}
+	}
+	return n;
+}
+
+
+/*
+ * read the baseline for the regression check from the CSV output of
+ * an earlier run
+ */
+static int
+read_baseline(const char *fn) {
+	int rc = 0, n, name_col, mips_col, rps_col, hpr_col;
+	char line[1024], *fields[MAX_FIELDS];
+	struct baseline *bp;
+	FILE *fp;
+	fp = fopen(fn, "r");
+	if (! fp) {
+		perr("cannot open %s: %s", fn, strerror(errno));
+		rc = (-1);
+		goto premature_exit;
+	}
+	if (! fgets(line, sizeof line, fp)) {
+		perr("%s is empty", fn);
+		rc = (-1);
+		goto premature_exit;
+	}
+	n = split_line(line, fields);
+	name_col = find_column(fields, n, "workload");
+	mips_col = find_column(fields, n, "mips");
+	rps_col = find_column(fields, n, "records_per_second");
+	hpr_col = find_column(fields, n, "host_calls_per_record");
+	if (name_col == (-1) || mips_col == (-1) || rps_col == (-1) ||
+	    hpr_col == (-1)) {
+		perr("%s is no tnylpo-bench output", fn);
+		rc = (-1);
+		goto premature_exit;
+	}
+	while (fgets(line, sizeof line, fp)) {
+		n = split_line(line, fields);
+		if (n <= name_col || n <= mips_col || n <= rps_col ||
+		    n <= hpr_col) continue;
+		bp = alloc(sizeof (struct baseline));
+		bp->name = alloc(strlen(fields[name_col]) + 1);
+		strcpy(bp->name, fields[name_col]);
+		bp->mips = strtod(fields[mips_col], NULL);
+		bp->records_per_second = strtod(fields[rps_col], NULL);
+		bp->host_calls_per_record = strtod(fields[hpr_col], NULL);
+		bp->next_p = baseline_p;
+		baseline_p = bp;
+	}
+premature_exit:
+	if (fp) fclose(fp);
+	return rc;
+}
+
+
+/*
+ * create the scratch directory
+ */
+static int
+make_work_dir(void) {
+	const char *tmp;
+	tmp = getenv("TMPDIR");
+	if (! tmp || ! *tmp) tmp = "/tmp";
+	work_dir = alloc(strlen(tmp) + 32);
+	sprintf(work_dir, "%s/tnylpo-bench.%ld", tmp, (long) getpid());
+	if (mkdir(work_dir, 0700)) {
+		perr("cannot create %s: %s", work_dir, strerror(errno));
+		free(work_dir);
+		work_dir = NULL;
+		return (-1);
+	}
+	return 0;
+}
+
+
+/*
+ * parse a numeric command line argument
+ */
+static int
+parse_number(const char *arg, int min, int max, int *value_p) {
+	unsigned long ul;
+	char *cp;
+	ul = strtoul(arg, &cp, 10);
+	if (*cp || ul < min || ul > max) {
+		perr("argument %s out of range (%d...%d)", arg, min, max);
+		return (-1);
+	}
+	*value_p = (int) ul;
+	return 0;
+}
+
+
+/*
+ * For once, no comment.
+ */
+int
+main(int argc, char **argv) {
+	int rc = 0, opt, i, j, fd;
+	char *cfn = NULL, *bfn = NULL;
+	prog_name = base_name(argv[0]);
+	if (! setlocale(LC_CTYPE, "")) {
+		perr("setlocale(LC_CTYPE) failed");
+		rc = (-1);
+		goto premature_exit;
+	}
+	/*
+	 * parse command line
+	 */
+	opterr = 0;
+	while ((opt = getopt(argc, argv, "b:f:hr:s:t:")) != EOF) {
+		switch (opt) {
+		case 'b':
+			bfn = optarg;
+			break;
+		case 'f':
+			cfn = optarg;
+			break;
+		case 'r':
+			if (parse_number(optarg, 1, 100, &runs)) rc = (-1);
+			break;
+		case 's':
+			if (parse_number(optarg, 1, 100000, &scale)) rc = (-1);
+			break;
+		case 't':
+			if (parse_number(optarg, 0, 100, &threshold)) {
+				rc = (-1);
+			}
+			break;
+		default:
+			rc = (-1);
+			break;
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < WORKLOADS &&
+		    strcmp(argv[i], workloads[j].name); j++);
+		if (j == WORKLOADS) {
+			perr("unknown workload %s", argv[i]);
+			rc = (-1);
+		}
+	}
+	if (rc) {
+		usage();
+		goto premature_exit;
+	}
+	if (bfn) {
+		rc = read_baseline(bfn);
+		if (rc) goto premature_exit;
+	}
+	/*
+	 * the configuration file is optional; without one, the
+	 * user's .tnylpo.conf is not used either, since it might
+	 * e. g. contain a CPU delay
+	 */
+	rc = read_config(cfn ? cfn : "/dev/null");
+	if (rc) goto premature_exit;
+	/*
+	 * same defaults as in tnylpo, with drive A as the scratch directory
+	 */
+	rc = make_work_dir();
+	if (rc) goto premature_exit;
+	conf_drives[0] = work_dir;
+	conf_readonly[0] = 0;
+	default_drive = 0;
+	conf_interactive = 0;
+	conf_argc = 0;
+	conf_argv = argv + argc;
+	if (log_level == LL_UNSET) log_level = LL_ERRORS;
+	if (conf_printer_raw == (-1)) conf_printer_raw = 0;
+	if (conf_punch_raw == (-1)) conf_punch_raw = 0;
+	if (conf_reader_raw == (-1)) conf_reader_raw = 0;
+	if (dont_close == (-1)) dont_close = 0;
+	if (conf_map_files == (-1)) conf_map_files = 0;
+	if (conf_prefetch == (-1)) conf_prefetch = 0;
+	if (conf_durability == DUR_UNSET) conf_durability = DUR_CLOSE;
+	if (conf_dircache == DC_UNSET) conf_dircache = DC_INOTIFY;
+	/*
+	 * benchmarks must always run, and write no dependency files
+	 */
+	conf_cache_dir = NULL;
+	conf_dep_file = NULL;
+	/*
+	 * move stdout out of the way of the CSV output
+	 */
+	fflush(stdout);
+	fd = dup(fileno(stdout));
+	if (fd != (-1)) csv_fp = fdopen(fd, "w");
+	if (! csv_fp || ! freopen("/dev/null", "w", stdout)) {
+		perr("cannot redirect stdout: %s", strerror(errno));
+		rc = (-1);
+		goto premature_exit;
+	}
+	fprintf(csv_fp, "workload,instructions,seconds,mips,"
+	    "ns_per_instruction,records,records_per_second,"
+	    "host_calls_per_record,result,expected,status\n");
+	/*
+	 * run all or the selected workloads
+	 */
+	for (i = 0; i < WORKLOADS; i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc &&
+			    strcmp(argv[j], workloads[i].name); j++);
+			if (j == argc) continue;
+		}
+		if (run_workload(workloads + i)) rc = (-1);
+	}
+	if (finalize_chario()) rc = (-1);
+	/*
+	 * regressions against the baseline are errors
+	 */
+	if (regressions) {
+		perr("%d regression(s) against baseline %s (threshold %d%%)",
+		    regressions, bfn, threshold);
+		rc = (-1);
+	}
+premature_exit:
+	if (work_dir) rmdir(work_dir);
+	if (csv_fp && fclose(csv_fp)) rc = (-1);
+	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+	return 0;
+}
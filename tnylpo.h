@@ -34,6 +34,9 @@
 
 #include <stdlib.h>
 #include <wchar.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 /*
@@ -109,7 +112,12 @@ enum reason {
 	ERR_HOST /* host system call failed */,
 	ERR_LOGIC  /* error in guest program logic */,
 	ERR_SIGNAL /* caught a signal */,
-	ERR_HALT /* HALT instruction executed */
+	ERR_HALT /* HALT instruction executed */,
+	ERR_LOCKSTEP /* CPU cores diverged in lockstep mode */,
+	ERR_INSTRLIMIT /* instruction limit exceeded */,
+	ERR_TIMELIMIT /* wall-clock time limit exceeded */,
+	ERR_OUTPUTLIMIT /* output limit exceeded */,
+	ERR_FILELIMIT /* open file limit exceeded */
 };
 extern enum reason term_reason;
 
@@ -120,6 +128,32 @@ extern enum reason term_reason;
 extern int cpu_init(void);
 extern void cpu_run(void);
 extern int cpu_exit(void);
+extern unsigned long long instruction_count;
+
+
+/*
+ * complete CPU state as seen by the lockstep checker; the flags
+ * are packed into f and alt_f in the order SZYHXPNC (bit 7...0)
+ */
+struct cpu_state {
+	int pc, sp;
+	unsigned char a, f, b, c, d, e, h, l;
+	unsigned char alt_a, alt_f, alt_b, alt_c, alt_d, alt_e, alt_h, alt_l;
+	unsigned char ixh, ixl, iyh, iyl, r, i, iff;
+};
+extern void cpu_step(void);
+extern void cpu_get_state(struct cpu_state *state_p);
+extern void cpu_set_state(const struct cpu_state *state_p);
+/*
+ * reference CPU core (cpu.c compiled with REFERENCE_CORE defined)
+ */
+extern unsigned char *ref_memory;
+extern int ref_terminate;
+extern enum reason ref_term_reason;
+extern void ref_cpu_step(void);
+extern void ref_cpu_get_state(struct cpu_state *state_p);
+extern void ref_cpu_set_state(const struct cpu_state *state_p);
+extern void ref_os_call(int magic);
 
 
 /*
@@ -130,6 +164,134 @@ extern int os_init(void);
 extern void os_call(int magic);
 extern int os_exit(void);
 extern int get_tpa_end(void);
+extern unsigned long long record_count;
+extern unsigned long long host_call_count;
+#define HOST_CALL(call) (host_call_count++, (call))
+extern ssize_t host_pread(int fd, void *buffer, size_t n, off_t offset);
+extern ssize_t host_pwrite(int fd, const void *buffer, size_t n,
+    off_t offset);
+extern int host_close(int fd);
+extern unsigned long long output_count;
+extern int limit_output(int n);
+
+
+/*
+ * access to the files of a drive, one set of operations per kind of
+ * drive: names are relative to the drive, open returns a handle for the
+ * other operations, and all functions fail like their Unix counterparts.
+ * next_name lists the files of a drive from memory: it returns the name
+ * of the next file from position *pos_p on and advances the position,
+ * or NULL at the end of the directory (*pos_p is 0 for the first call);
+ * it is NULL for drives which are listed by reading a host directory.
+ */
+struct drive_ops {
+	int (*open)(int drive, const char *name, int flags);
+	int (*stat)(int drive, const char *name, struct stat *sp);
+	int (*unlink)(int drive, const char *name);
+	int (*link)(int drive, const char *old_name, const char *new_name);
+	const char *(*next_name)(int drive, int *pos_p);
+	ssize_t (*pread)(int handle, void *buffer, size_t n, off_t offset);
+	ssize_t (*pwrite)(int handle, const void *buffer, size_t n,
+	    off_t offset);
+	int (*close)(int handle);
+};
+
+
+/*
+ * RAM drive emulation (part of the OS emulation, but separated to keep
+ * source file sizes managable)
+ */
+extern const struct drive_ops ram_ops;
+extern int ram_persist(int drive, const char *dir, const char *patterns);
+extern void ram_exit(void);
+
+
+/*
+ * overlay drive emulation (part of the OS emulation, but separated to
+ * keep source file sizes managable)
+ */
+#define OVL_WHITEOUT ".wh." /* prefix of the names of whiteouts */
+extern const struct drive_ops ovl_ops;
+extern int ovl_init(int drive);
+extern int ovl_layer(int drive, const char *name);
+extern const char *ovl_dir(int drive, const char *name);
+extern int ovl_copy_up(int drive, const char *name);
+extern void ovl_exit(void);
+
+
+/*
+ * tar archive drive emulation (part of the OS emulation, but separated
+ * to keep source file sizes managable)
+ */
+extern const struct drive_ops tar_ops;
+extern int tar_init(int drive);
+extern void tar_exit(void);
+
+
+/*
+ * disk image drive emulation (part of the OS emulation, but separated
+ * to keep source file sizes managable)
+ */
+extern const struct drive_ops dsk_ops;
+extern int dsk_init(int drive);
+extern void dsk_dpb(int drive, unsigned char *dpb);
+extern void dsk_alv(int drive, unsigned char *alv, size_t size);
+extern int dsk_exit(void);
+
+
+/*
+ * prefetching of the files named on the command line (part of the OS
+ * emulation, but separated to keep source file sizes managable)
+ */
+extern void pf_add(int drive, int dir_fd, const char *name);
+extern void pf_start(size_t size);
+extern unsigned char *pf_take(int drive, const char *name, int fd,
+    size_t *valid_p, int *eof_p);
+extern void pf_drop(int drive, const char *name);
+extern void pf_exit(void);
+
+
+/*
+ * streams, i.e. pseudo files connected to host files or commands (part
+ * of the OS emulation, but separated to keep source file sizes
+ * managable)
+ */
+extern int stm_find(int drive, const char *name);
+extern int stm_open(int handle, int output);
+extern int stm_read(int handle, unsigned char *record);
+extern int stm_write(int handle, const unsigned char *record);
+extern int stm_close(int handle);
+extern int stm_exit(void);
+
+
+/*
+ * dependency list of the host files accessed by the program (part of
+ * the OS emulation, but separated to keep source file sizes managable)
+ */
+enum dep_kind {
+	DK_READ /* opened for reading */,
+	DK_CREATED /* created */,
+	DK_WRITTEN /* written to */,
+	DK_DELETED /* deleted */,
+	DK_RENAMED /* renamed */,
+	DK_EXAMINED /* looked for without opening it */
+};
+extern void dep_record(enum dep_kind kind, const char *path,
+    const char *new_path);
+extern const char *dep_next(enum dep_kind kind, int *pos_p);
+extern int dep_exit(void);
+
+
+/*
+ * result cache (part of the OS emulation, but separated to keep source
+ * file sizes managable)
+ */
+extern int cch_init(size_t image_size, int drive);
+extern void cch_uncacheable(const char *reason);
+extern void cch_input(const char *path);
+extern void cch_console(unsigned char c);
+extern void cch_replay(void);
+extern void cch_exit(int success);
 
 
 /*
@@ -145,6 +307,9 @@ extern wchar_t *conf_alt_charset[256];
 extern wchar_t *conf_unprintable;
 extern char *conf_drives[16];
 extern int conf_readonly[16];
+extern char *conf_persist_dir[16];
+extern char *conf_persist_files[16];
+extern char **conf_layers[16];
 extern char *conf_command;
 extern int conf_argc;
 extern char **conf_argv;
@@ -158,14 +323,111 @@ extern int charset;
 extern char *conf_log;
 extern int default_drive;
 extern int dont_close;
+extern int conf_map_files;
+extern int conf_prefetch;
+extern char **conf_prefetch_ext;
 extern int reverse_bs_del;
 extern int delay_count;
 extern int delay_nanoseconds;
+extern int conf_lockstep;
+extern long long conf_limit_instructions;
+extern int conf_limit_time;
+extern long long conf_limit_output;
+extern int conf_limit_files;
+extern int conf_limit_descriptors;
+extern long long conf_epoch;
 extern int conf_color;
 extern int conf_foreground;
 extern int conf_background;
 
 
+/*
+ * durability of data written to disk files
+ */
+enum durability {
+	DUR_UNSET = (-1) /* initial state */,
+	DUR_NONE = 0 /* written when the write buffer is full or on exit */,
+	DUR_CLOSE /* written at the latest by BDOS function 16 (close) */,
+	DUR_SYNC /* additionally synced to stable storage on close */
+};
+extern enum durability conf_durability;
+
+
+/*
+ * format of the dependency file
+ */
+enum dep_format {
+	DF_MAKE /* make rule */,
+	DF_JSON /* JSON object */
+};
+extern char *conf_dep_file;
+extern enum dep_format conf_dep_format;
+extern char *conf_cache_dir;
+
+
+/*
+ * kinds of CP/M drives
+ */
+enum drive_type {
+	DT_DIRECTORY = 0 /* files in a host directory */,
+	DT_RAM /* files in memory, optionally saved to a directory on exit */,
+	DT_OVERLAY /* files in a stack of host directories */,
+	DT_TAR /* members of a tar archive (read only) */,
+	DT_IMAGE /* files in a raw CP/M disk image */
+};
+extern enum drive_type conf_drive_type[16];
+
+
+/*
+ * format of a CP/M disk image: sectors (of 128 bytes) per track, block
+ * size, highest block number, highest directory entry number, reserved
+ * tracks, and skew factor of the sectors
+ */
+struct disk_format {
+	int spt;
+	int bls;
+	int dsm;
+	int drm;
+	int off;
+	int skew;
+};
+extern struct disk_format conf_disk_format[16];
+
+
+/*
+ * pseudo file of a drive, whose records are read from or written to a
+ * host file descriptor, a file (e.g. a FIFO), or a shell command,
+ * optionally converting text
+ */
+enum stream_kind {
+	SK_FD /* inherited file descriptor */,
+	SK_FILE /* host file */,
+	SK_COMMAND /* shell command (through popen(3)) */
+};
+struct stream {
+	int drive;
+	char *name; /* Unix file name of the pseudo file */
+	enum stream_kind kind;
+	int fd;
+	char *path; /* path of the file resp. shell command */
+	int text;
+};
+extern struct stream *conf_streams;
+extern int conf_stream_count;
+
+
+/*
+ * revalidation of the cached directory index of the drives
+ */
+enum dircache {
+	DC_UNSET = (-1) /* initial state */,
+	DC_NONE = 0 /* no index, directories are read for every search */,
+	DC_MTIME /* index revalidated by the modification time of the drive */,
+	DC_INOTIFY /* index updated by inotify events (Linux) */
+};
+extern enum dircache conf_dircache;
+
+
 /*
  * dump configuration
  */
@@ -203,6 +465,49 @@ extern void *alloc(size_t s);
 extern void *resize(void *vp, size_t s);
 
 
+/*
+ * arenas: memory allocated piecemeal and released all at once
+ */
+struct arena {
+	struct arena_chunk *chunk_p;
+	size_t next_size;
+};
+#define ARENA_INITIALIZER { NULL, 0 }
+extern void init_arena(struct arena *ap);
+extern void *arena_alloc(struct arena *ap, size_t s);
+extern char *arena_strdup(struct arena *ap, const char *s);
+extern void free_arena(struct arena *ap);
+
+
+/*
+ * pools: objects of a fixed size allocated in slabs and recycled
+ */
+struct pool {
+	size_t size;
+	void *free_p;
+	struct pool_slab *slab_p;
+};
+#define POOL_INITIALIZER(type) { sizeof (type), NULL, NULL }
+extern void *pool_get(struct pool *pp);
+extern void pool_put(struct pool *pp, void *vp);
+extern void free_pool(struct pool *pp);
+
+
+/*
+ * hash tables and handle tables of the drive emulations
+ */
+extern unsigned hash_name(const char *name, unsigned size);
+struct handle_table {
+	void **slots; /* NULL if the handle is unused */
+	int count;
+};
+#define HANDLE_TABLE_INITIALIZER { NULL, 0 }
+extern int handle_add(struct handle_table *tp, void *vp);
+extern void *handle_get(const struct handle_table *tp, int handle);
+extern void handle_remove(struct handle_table *tp, int handle);
+extern void free_handles(struct handle_table *tp);
+
+
 /*
  * character conversion
  */
@@ -29,6 +29,7 @@
  */
 
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <wchar.h>
@@ -75,6 +76,221 @@ void *resize(void *vp, size_t s) {
 }
 
 
+/*
+ * alignment of memory handed out by arenas and pools
+ */
+union arena_align {
+	long long ll;
+	long double ld;
+	void *vp;
+	void (*fp)(void);
+};
+#define ALIGNED(s) (((s) + sizeof (union arena_align) - 1) / \
+    sizeof (union arena_align) * sizeof (union arena_align))
+
+
+/*
+ * chunk of memory of an arena (the data follows the header)
+ */
+struct arena_chunk {
+	struct arena_chunk *next_p;
+	size_t size;
+	size_t used;
+};
+#define CHUNK_HEADER ALIGNED(sizeof (struct arena_chunk))
+#define ARENA_MIN_CHUNK 4096
+
+
+/*
+ * initialize an empty arena
+ */
+void
+init_arena(struct arena *ap) {
+	ap->chunk_p = NULL;
+	ap->next_size = ARENA_MIN_CHUNK;
+}
+
+
+/*
+ * allocate memory from an arena; the memory is released all at once
+ * by free_arena(). Chunks double in size, so an arena of n bytes needs
+ * O(log n) calls to malloc().
+ */
+void *
+arena_alloc(struct arena *ap, size_t s) {
+	struct arena_chunk *cp = ap->chunk_p;
+	void *vp;
+	s = ALIGNED(s);
+	if (! cp || cp->size - cp->used < s) {
+		if (ap->next_size < ARENA_MIN_CHUNK) {
+			ap->next_size = ARENA_MIN_CHUNK;
+		}
+		while (ap->next_size < s) ap->next_size *= 2;
+		cp = alloc(CHUNK_HEADER + ap->next_size);
+		cp->next_p = ap->chunk_p;
+		cp->size = ap->next_size;
+		cp->used = 0;
+		ap->chunk_p = cp;
+		ap->next_size *= 2;
+	}
+	vp = (char *) cp + CHUNK_HEADER + cp->used;
+	cp->used += s;
+	return vp;
+}
+
+
+/*
+ * copy a string to an arena
+ */
+char *
+arena_strdup(struct arena *ap, const char *s) {
+	char *cp = arena_alloc(ap, strlen(s) + 1);
+	strcpy(cp, s);
+	return cp;
+}
+
+
+/*
+ * release all memory of an arena, leaving it empty
+ */
+void
+free_arena(struct arena *ap) {
+	struct arena_chunk *cp;
+	while (ap->chunk_p) {
+		cp = ap->chunk_p;
+		ap->chunk_p = cp->next_p;
+		free(cp);
+	}
+	ap->next_size = ARENA_MIN_CHUNK;
+}
+
+
+/*
+ * slab of a pool (the objects follow the header)
+ */
+struct pool_slab {
+	struct pool_slab *next_p;
+};
+#define SLAB_HEADER ALIGNED(sizeof (struct pool_slab))
+#define SLAB_OBJECTS 64
+
+
+/*
+ * get an object from a pool; objects are allocated in slabs of
+ * SLAB_OBJECTS and kept on a free list when they are returned
+ */
+void *
+pool_get(struct pool *pp) {
+	struct pool_slab *sp;
+	size_t s = ALIGNED(pp->size < sizeof (void *) ?
+	    sizeof (void *) : pp->size);
+	char *cp;
+	void *vp;
+	int i;
+	if (! pp->free_p) {
+		sp = alloc(SLAB_HEADER + SLAB_OBJECTS * s);
+		sp->next_p = pp->slab_p;
+		pp->slab_p = sp;
+		cp = (char *) sp + SLAB_HEADER;
+		for (i = 0; i < SLAB_OBJECTS; i++) {
+			*(void **) (cp + i * s) = pp->free_p;
+			pp->free_p = cp + i * s;
+		}
+	}
+	vp = pp->free_p;
+	pp->free_p = *(void **) vp;
+	return vp;
+}
+
+
+/*
+ * return an object to its pool
+ */
+void
+pool_put(struct pool *pp, void *vp) {
+	*(void **) vp = pp->free_p;
+	pp->free_p = vp;
+}
+
+
+/*
+ * release all slabs of a pool (all objects must have been returned)
+ */
+void
+free_pool(struct pool *pp) {
+	struct pool_slab *sp;
+	while (pp->slab_p) {
+		sp = pp->slab_p;
+		pp->slab_p = sp->next_p;
+		free(sp);
+	}
+	pp->free_p = NULL;
+}
+
+
+/*
+ * hash a file name into a table of size entries
+ */
+unsigned
+hash_name(const char *name, unsigned size) {
+	unsigned h = 0;
+	while (*name) h = h * 31 + (unsigned char) *name++;
+	return h % size;
+}
+
+
+/*
+ * enter an object into a handle table; returns the first unused handle,
+ * growing the table if necessary
+ */
+int
+handle_add(struct handle_table *tp, void *vp) {
+	int h;
+	for (h = 0; h < tp->count && tp->slots[h]; h++);
+	if (h == tp->count) {
+		tp->count = tp->count ? tp->count * 2 : 16;
+		tp->slots = resize(tp->slots, tp->count * sizeof (void *));
+		memset(tp->slots + h, 0, (tp->count - h) * sizeof (void *));
+	}
+	tp->slots[h] = vp;
+	return h;
+}
+
+
+/*
+ * get the object of a handle; returns NULL with errno set to EBADF if
+ * the handle is not in use
+ */
+void *
+handle_get(const struct handle_table *tp, int handle) {
+	if (handle < 0 || handle >= tp->count || ! tp->slots[handle]) {
+		errno = EBADF;
+		return NULL;
+	}
+	return tp->slots[handle];
+}
+
+
+/*
+ * release a handle (the object itself is left to the caller)
+ */
+void
+handle_remove(struct handle_table *tp, int handle) {
+	tp->slots[handle] = NULL;
+}
+
+
+/*
+ * release a handle table (all handles must have been removed)
+ */
+void
+free_handles(struct handle_table *tp) {
+	free(tp->slots);
+	tp->slots = NULL;
+	tp->count = 0;
+}
+
+
 /*
  * convert a Unix character to the CP/M character set
  * returns (-1) if the character cannot converted, and the 8-bit